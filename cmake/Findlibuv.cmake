@@ -18,6 +18,7 @@
 #  LIBUV_FOUND, if false, do not try to link to libuv
 #  LIBUV_LIBRARIES
 #  LIBUV_INCLUDE_DIR, where to find uv.h
+#  LIBUV_VERSION, the version of libuv found
 
 FIND_PATH(LIBUV_INCLUDE_DIR NAMES uv.h)
 FIND_LIBRARY(LIBUV_LIBRARIES NAMES uv libuv)
@@ -29,5 +30,24 @@ if(WIN32)
   list(APPEND LIBUV_LIBRARIES ws2_32)
 endif()
 
+# libuv 1.23 moved the version macros out of uv-version.h
+if(LIBUV_INCLUDE_DIR)
+  if(EXISTS "${LIBUV_INCLUDE_DIR}/uv/version.h")
+    set(_LIBUV_VERSION_HEADER "${LIBUV_INCLUDE_DIR}/uv/version.h")
+  else()
+    set(_LIBUV_VERSION_HEADER "${LIBUV_INCLUDE_DIR}/uv-version.h")
+  endif()
+  if(EXISTS "${_LIBUV_VERSION_HEADER}")
+    file(STRINGS "${_LIBUV_VERSION_HEADER}" _LIBUV_VERSION_DEFINES REGEX "#define UV_VERSION_(MAJOR|MINOR|PATCH) ")
+    foreach(_LIBUV_PART MAJOR MINOR PATCH)
+      string(REGEX REPLACE ".*#define UV_VERSION_${_LIBUV_PART} +([0-9]+).*" "\\1"
+             LIBUV_VERSION_${_LIBUV_PART} "${_LIBUV_VERSION_DEFINES}")
+    endforeach()
+    set(LIBUV_VERSION "${LIBUV_VERSION_MAJOR}.${LIBUV_VERSION_MINOR}.${LIBUV_VERSION_PATCH}")
+  endif()
+endif()
+
 INCLUDE(FindPackageHandleStandardArgs)
-FIND_PACKAGE_HANDLE_STANDARD_ARGS(LIBUV DEFAULT_MSG LIBUV_LIBRARIES LIBUV_INCLUDE_DIR)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(libuv
+  REQUIRED_VARS LIBUV_LIBRARIES LIBUV_INCLUDE_DIR
+  VERSION_VAR LIBUV_VERSION)
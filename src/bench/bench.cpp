@@ -0,0 +1,233 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include "bench.h"
+#include "core/build_info.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <gflags/gflags.h>
+#include "io/io.h"
+#include <map>
+#include <string_theory/st_format.h>
+#include <string_theory/st_stringstream.h>
+#include <vector>
+
+// =================================================================================
+
+DEFINE_string(filter, "", "Only run benchmarks whose names contain this");
+DEFINE_bool(list, false, "List the benchmarks instead of running them");
+DEFINE_double(min_time, 0.25, "Minimum number of seconds each repetition of a benchmark runs for");
+DEFINE_uint32(repetitions, 3, "Number of times each benchmark is repeated; the median is reported");
+DEFINE_string(format, "text", "Output format: text, csv, or json");
+DEFINE_string(output, "", "File to write the results to (default: standard output)");
+DEFINE_string(baseline, "", "Results of an earlier run in csv format to compare against");
+
+// =================================================================================
+
+struct bench_t
+{
+    ST::string m_name;
+    fus::bench_proc m_proc;
+    size_t m_bytes;
+};
+
+struct bench_result_t
+{
+    const bench_t* m_bench;
+    uint64_t m_iterations;
+    double m_nsPerOp;
+    double m_nsPerOpMin;
+    double m_nsPerOpMax;
+};
+
+static std::vector<bench_t> s_benches;
+const void* volatile fus::bench_sink = nullptr;
+
+void fus::bench_add(const ST::string& name, fus::bench_proc proc, size_t bytes)
+{
+    s_benches.push_back({ name, std::move(proc), bytes });
+}
+
+// =================================================================================
+
+static void print(const ST::string& str)
+{
+    fputs(str.c_str(), stdout);
+    fflush(stdout);
+}
+
+static uint64_t time_bench(const bench_t& bench, uint64_t iterations)
+{
+    uint64_t start = uv_hrtime();
+    bench.m_proc(iterations);
+    return uv_hrtime() - start;
+}
+
+static bench_result_t run_bench(const bench_t& bench)
+{
+    // Grow the iteration count until a run fills the minimum time. This doubles as the warm up.
+    uint64_t target = (uint64_t)(FLAGS_min_time * 1000000000.0);
+    uint64_t iterations = 1;
+    uint64_t elapsed = time_bench(bench, iterations);
+    while (elapsed < target) {
+        uint64_t predicted = elapsed ? (uint64_t)((double)iterations * (double)target * 1.2 / (double)elapsed)
+                                     : iterations * 100;
+        iterations = std::clamp(predicted, iterations + 1, iterations * 100);
+        elapsed = time_bench(bench, iterations);
+    }
+
+    std::vector<double> samples;
+    samples.push_back((double)elapsed / (double)iterations);
+    for (uint32_t i = 1; i < FLAGS_repetitions; ++i)
+        samples.push_back((double)time_bench(bench, iterations) / (double)iterations);
+    std::sort(samples.begin(), samples.end());
+    return { &bench, iterations, samples[samples.size() / 2], samples.front(), samples.back() };
+}
+
+static inline double bytes_per_second(const bench_result_t& result)
+{
+    if (!result.m_bench->m_bytes || result.m_nsPerOp <= 0.0)
+        return 0.0;
+    return (double)result.m_bench->m_bytes * 1000000000.0 / result.m_nsPerOp;
+}
+
+// =================================================================================
+
+static std::map<ST::string, double> load_baseline(const char* path)
+{
+    // Only the name and time columns matter, and names never contain commas.
+    std::map<ST::string, double> baseline;
+    std::ifstream stream(path);
+    std::string line;
+    while (std::getline(stream, line)) {
+        std::vector<ST::string> columns = ST::string(line).split(',');
+        if (columns.size() < 3 || columns[0] == "name")
+            continue;
+        baseline[columns[0]] = strtod(columns[2].c_str(), nullptr);
+    }
+    return baseline;
+}
+
+static ST::string format_text(const bench_result_t& result, const std::map<ST::string, double>& baseline)
+{
+    ST::string_stream ss;
+    ss << ST::format("{<48} {>12.1f} ns/op {>12} runs", result.m_bench->m_name, result.m_nsPerOp,
+                     result.m_iterations);
+    double bps = bytes_per_second(result);
+    if (bps > 0.0)
+        ss << ST::format(" {>10.1f} MiB/s", bps / (1024.0 * 1024.0));
+    auto it = baseline.find(result.m_bench->m_name);
+    if (it != baseline.end() && it->second > 0.0)
+        ss << ST::format(" {>+8.1f}%", (result.m_nsPerOp - it->second) * 100.0 / it->second);
+    ss << "\n";
+    return ss.to_string();
+}
+
+static ST::string format_csv(const std::vector<bench_result_t>& results)
+{
+    ST::string_stream ss;
+    ss << "name,iterations,ns_per_op,ns_per_op_min,ns_per_op_max,bytes_per_second\n";
+    for (const bench_result_t& result : results) {
+        ss << ST::format("{},{},{.3f},{.3f},{.3f},{.0f}\n", result.m_bench->m_name, result.m_iterations,
+                         result.m_nsPerOp, result.m_nsPerOpMin, result.m_nsPerOpMax, bytes_per_second(result));
+    }
+    return ss.to_string();
+}
+
+static ST::string format_json(const std::vector<bench_result_t>& results)
+{
+    ST::string_stream ss;
+    ss << ST::format("{{\n  \"version\": \"{}\",\n  \"benchmarks\": [\n", fus::build_version());
+    for (size_t i = 0; i < results.size(); ++i) {
+        const bench_result_t& result = results[i];
+        ss << ST::format("    {{\"name\": \"{}\", \"iterations\": {}, \"ns_per_op\": {.3f}, "
+                         "\"ns_per_op_min\": {.3f}, \"ns_per_op_max\": {.3f}, \"bytes_per_second\": {.0f}}}{}\n",
+                         result.m_bench->m_name, result.m_iterations, result.m_nsPerOp, result.m_nsPerOpMin,
+                         result.m_nsPerOpMax, bytes_per_second(result), (i + 1 < results.size()) ? "," : "");
+    }
+    ss << "  ]\n}\n";
+    return ss.to_string();
+}
+
+// =================================================================================
+
+int main(int argc, char* argv[])
+{
+    gflags::SetVersionString(fus::build_version());
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_format != "text" && FLAGS_format != "csv" && FLAGS_format != "json") {
+        print(ST::format("Unknown output format '{}'\n", FLAGS_format));
+        return 1;
+    }
+    FLAGS_repetitions = std::max(1U, FLAGS_repetitions);
+
+    fus::io_init();
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    fus::bench_add_core();
+    fus::bench_add_io(&loop);
+    fus::bench_add_protocol(&loop);
+
+    if (FLAGS_list) {
+        for (const bench_t& bench : s_benches)
+            print(ST::format("{}\n", bench.m_name));
+        return 0;
+    }
+
+    std::map<ST::string, double> baseline;
+    if (!FLAGS_baseline.empty())
+        baseline = load_baseline(FLAGS_baseline.c_str());
+
+    // Text goes out as it comes in; everything else waits for the whole run.
+    bool text = FLAGS_format == "text";
+    FILE* output = FLAGS_output.empty() ? stdout : fopen(FLAGS_output.c_str(), "w");
+    if (!output) {
+        print(ST::format("Unable to open '{}' for writing\n", FLAGS_output));
+        return 1;
+    }
+
+    std::vector<bench_result_t> results;
+    for (const bench_t& bench : s_benches) {
+        if (!FLAGS_filter.empty() && !strstr(bench.m_name.c_str(), FLAGS_filter.c_str()))
+            continue;
+        results.push_back(run_bench(bench));
+        if (text) {
+            fputs(format_text(results.back(), baseline).c_str(), output);
+            fflush(output);
+        }
+    }
+
+    if (FLAGS_format == "csv")
+        fputs(format_csv(results).c_str(), output);
+    else if (FLAGS_format == "json")
+        fputs(format_json(results).c_str(), output);
+    if (output != stdout)
+        fclose(output);
+
+    // Anything the benchmarks left open gets closed so the loop can be torn down cleanly.
+    uv_walk(&loop, [](uv_handle_t* handle, void*) {
+        if (!uv_is_closing(handle))
+            uv_close(handle, nullptr);
+    }, nullptr);
+    uv_run(&loop, UV_RUN_DEFAULT);
+    uv_loop_close(&loop);
+    fus::io_close();
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_BENCH_H
+#define __FUS_BENCH_H
+
+#include <cstdint>
+#include <functional>
+#include <string_theory/string>
+#include <uv.h>
+
+namespace fus
+{
+    /** Runs the operation being measured the given number of times. */
+    typedef std::function<void(uint64_t)> bench_proc;
+
+    /**
+     * Adds a benchmark. Names are slash separated and start with the library being measured. If
+     * each run of the operation processes a buffer, give its size to get throughput reported.
+     */
+    void bench_add(const ST::string& name, bench_proc proc, size_t bytes=0);
+
+    extern const void* volatile bench_sink;
+
+    /** Keeps the compiler from optimizing away a result that nobody looks at. */
+    template<typename T>
+    inline void bench_keep(const T& value)
+    {
+#if defined(__GNUC__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        bench_sink = &value;
+#endif
+    }
+
+    void bench_add_core();
+    void bench_add_io(uv_loop_t*);
+    void bench_add_protocol(uv_loop_t*);
+};
+
+#endif
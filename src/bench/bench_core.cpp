@@ -0,0 +1,160 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bench.h"
+#include "core/list.h"
+#include "core/metrics.h"
+#include "core/uuid.h"
+#include "daemon/daemon_config.h"
+#include <memory>
+#include <vector>
+
+// =================================================================================
+
+static void bench_uuid()
+{
+    fus::bench_add("core/uuid/generate", [](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(fus::uuid::generate());
+    });
+
+    fus::uuid a = fus::uuid::generate();
+    fus::uuid b = fus::uuid::generate();
+    fus::bench_add("core/uuid/equals", [a, b](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(a == b);
+    });
+    fus::bench_add("core/uuid/less", [a, b](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(a < b);
+    });
+    fus::bench_add("core/uuid/as_string", [a](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(a.as_string());
+    });
+
+    ST::string str = a.as_string();
+    fus::bench_add("core/uuid/from_string", [str](uint64_t iterations) {
+        fus::uuid result;
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(result.from_string(str));
+    });
+}
+
+// =================================================================================
+
+struct bench_node_t
+{
+    uint64_t m_value;
+    FUS_LIST_LINK(bench_node_t) m_link;
+};
+
+typedef FUS_LIST_DECL(bench_node_t, m_link) bench_list_t;
+
+static void bench_list()
+{
+    // The same nodes are reused by every run, so these measure the list, not the allocator.
+    constexpr size_t k_numNodes = 1024;
+    auto nodes = std::make_shared<std::vector<bench_node_t>>(k_numNodes);
+
+    fus::bench_add("core/list/push_unlink", [nodes](uint64_t iterations) {
+        bench_list_t list;
+        for (uint64_t i = 0; i < iterations; ++i) {
+            bench_node_t& node = (*nodes)[i % k_numNodes];
+            list.push_back(&node);
+            node.m_link.unlink();
+        }
+    });
+
+    fus::bench_add("core/list/fill_clear", [nodes](uint64_t iterations) {
+        bench_list_t list;
+        for (uint64_t i = 0; i < iterations; ++i) {
+            for (bench_node_t& node : *nodes)
+                list.push_back(&node);
+            list.clear();
+        }
+    });
+
+    fus::bench_add("core/list/iterate", [nodes](uint64_t iterations) {
+        bench_list_t list;
+        for (bench_node_t& node : *nodes)
+            list.push_back(&node);
+        for (uint64_t i = 0; i < iterations; ++i) {
+            uint64_t sum = 0;
+            for (bench_node_t* it = list.front(); it; it = list.next(it))
+                sum += it->m_value;
+            fus::bench_keep(sum);
+        }
+        list.clear();
+    });
+}
+
+// =================================================================================
+
+static void bench_config()
+{
+    auto config = std::make_shared<fus::config_parser>(fus::daemon_config);
+
+    fus::bench_add("core/config/get_int", [config](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(config->get<unsigned int>("lobby", "port"));
+    });
+    fus::bench_add("core/config/get_bool", [config](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(config->get<bool>("log", "binary"));
+    });
+    fus::bench_add("core/config/get_string", [config](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            fus::bench_keep(config->get<const ST::string&>("crypt", "auth_n"));
+    });
+}
+
+// =================================================================================
+
+static fus::metric_counter s_benchCounter("fus_bench_counter_total", "Counter bumped by fus_bench");
+static fus::metric_counter_set s_benchCounterSet("fus_bench_counter_set_total", "Counter set bumped by fus_bench",
+                                                 "index", 8);
+static fus::metric_histogram s_benchHistogram("fus_bench_histogram", "Histogram filled by fus_bench");
+
+static void bench_metrics()
+{
+    // These are the costs paid on every hot path that records anything, so they need to stay
+    // down in the single digit nanoseconds.
+    fus::bench_add("core/metrics/counter_add", [](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            s_benchCounter.add();
+    });
+    fus::bench_add("core/metrics/counter_set_add", [](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            s_benchCounterSet.add((uint32_t)(i & 7));
+    });
+    fus::bench_add("core/metrics/histogram_record", [](uint64_t iterations) {
+        // Spread the values out so every bucket lookup isn't the same one.
+        for (uint64_t i = 0; i < iterations; ++i)
+            s_benchHistogram.record((i * 2654435761ULL) & 0xFFFFF);
+    });
+}
+
+// =================================================================================
+
+void fus::bench_add_core()
+{
+    bench_uuid();
+    bench_list();
+    bench_config();
+    bench_metrics();
+}
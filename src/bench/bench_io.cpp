@@ -0,0 +1,195 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bench.h"
+#include "core/errors.h"
+#include "io/crypt_stream.h"
+#include "io/hash.h"
+#include "io/io.h"
+#include <memory>
+#include <openssl/bn.h>
+#include <string_theory/st_codecs.h>
+#include <string_theory/st_format.h>
+#include <vector>
+
+// =================================================================================
+
+static void bench_hash()
+{
+    auto hash = std::make_shared<fus::hash>(fus::hash_type::e_sha1);
+
+    fus::bench_add("io/hash/hash_account", [hash](uint64_t iterations) {
+        uint8_t buf[20];
+        for (uint64_t i = 0; i < iterations; ++i) {
+            hash->hash_account(ST_LITERAL("benchmark"), ST_LITERAL("password"), buf, sizeof(buf));
+            fus::bench_keep(buf);
+        }
+    });
+
+    fus::bench_add("io/hash/hash_login", [hash](uint64_t iterations) {
+        uint8_t acctHash[20];
+        uint8_t buf[20];
+        hash->hash_account(ST_LITERAL("benchmark"), ST_LITERAL("password"), acctHash, sizeof(acctHash));
+        for (uint64_t i = 0; i < iterations; ++i) {
+            hash->hash_login(acctHash, sizeof(acctHash), (uint32_t)i, 0xDEADBEEF, buf, sizeof(buf));
+            fus::bench_keep(buf);
+        }
+    });
+}
+
+// =================================================================================
+
+/** Both ends of an encrypted connection over the loopback interface. */
+struct bench_crypt_pair_t
+{
+    uv_tcp_t m_listener;
+    uv_connect_t m_connect;
+    fus::crypt_stream_t* m_client;
+    fus::crypt_stream_t* m_server;
+    size_t m_established;
+
+    uint32_t m_g;
+    BIGNUM* m_k;
+    BIGNUM* m_n;
+    BIGNUM* m_x;
+};
+
+static BIGNUM* load_key(const ST::string& key)
+{
+    uint8_t buf[64];
+    FUS_ASSERTR(ST::base64_decode(key, buf, sizeof(buf)) == sizeof(buf));
+    return BN_bin2bn(buf, sizeof(buf), nullptr);
+}
+
+static void pair_established(fus::crypt_stream_t* stream, ssize_t status)
+{
+    FUS_ASSERTR(status >= 0);
+    auto pair = (bench_crypt_pair_t*)uv_handle_get_data((uv_handle_t*)stream);
+    if (++pair->m_established == 2)
+        uv_close((uv_handle_t*)&pair->m_listener, nullptr);
+}
+
+static fus::crypt_stream_t* pair_stream(bench_crypt_pair_t* pair)
+{
+    auto stream = (fus::crypt_stream_t*)malloc(sizeof(fus::crypt_stream_t));
+    fus::tcp_stream_init(stream, uv_handle_get_loop((uv_handle_t*)&pair->m_listener));
+    fus::crypt_stream_init(stream);
+    uv_handle_set_data((uv_handle_t*)stream, pair);
+    return stream;
+}
+
+static void pair_accepted(uv_stream_t* listener, int status)
+{
+    FUS_ASSERTR(status >= 0);
+    auto pair = (bench_crypt_pair_t*)uv_handle_get_data((uv_handle_t*)listener);
+    pair->m_server = pair_stream(pair);
+    FUS_ASSERTR(uv_accept(listener, (uv_stream_t*)pair->m_server) == 0);
+    fus::tcp_stream_set_connected(pair->m_server);
+    fus::crypt_stream_set_keys_server(pair->m_server, pair->m_k, pair->m_n);
+    fus::crypt_stream_establish_server(pair->m_server, pair_established);
+}
+
+static void pair_connected(uv_connect_t* req, int status)
+{
+    FUS_ASSERTR(status >= 0);
+    auto pair = (bench_crypt_pair_t*)req->data;
+    fus::tcp_stream_set_connected(pair->m_client);
+    fus::crypt_stream_set_keys_client(pair->m_client, pair->m_g, pair->m_n, pair->m_x);
+    fus::crypt_stream_establish_client(pair->m_client, pair_established);
+}
+
+static bench_crypt_pair_t* make_crypt_pair(uv_loop_t* loop)
+{
+    // A real pair of keys is needed for the math to mean anything. These take a moment.
+    auto pair = new bench_crypt_pair_t;
+    pair->m_g = 41;
+    auto [k, n, x] = fus::io_generate_keys(pair->m_g);
+    pair->m_k = load_key(k);
+    pair->m_n = load_key(n);
+    pair->m_x = load_key(x);
+    pair->m_established = 0;
+
+    sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_tcp_init(loop, &pair->m_listener);
+    uv_handle_set_data((uv_handle_t*)&pair->m_listener, pair);
+    FUS_ASSERTR(uv_tcp_bind(&pair->m_listener, (const sockaddr*)&addr, 0) == 0);
+    FUS_ASSERTR(uv_listen((uv_stream_t*)&pair->m_listener, 1, pair_accepted) == 0);
+
+    sockaddr_storage bound;
+    int boundsz = sizeof(bound);
+    uv_tcp_getsockname(&pair->m_listener, (sockaddr*)&bound, &boundsz);
+    pair->m_client = pair_stream(pair);
+    pair->m_connect.data = pair;
+    uv_tcp_connect(&pair->m_connect, (uv_tcp_t*)pair->m_client, (const sockaddr*)&bound, pair_connected);
+
+    uv_run(loop, UV_RUN_DEFAULT);
+    FUS_ASSERTR(pair->m_established == 2);
+    return pair;
+}
+
+static void bench_crypt(uv_loop_t* loop)
+{
+    bench_crypt_pair_t* pair = make_crypt_pair(loop);
+
+    fus::bench_add("io/crypt/handshake_client", [pair](uint64_t iterations) {
+        BIGNUM* seed = BN_new();
+        uint8_t ydata[64];
+        for (uint64_t i = 0; i < iterations; ++i) {
+            fus::crypt_handshake_client(pair->m_g, pair->m_n, pair->m_x, seed, ydata, sizeof(ydata));
+            fus::bench_keep(ydata);
+        }
+        BN_free(seed);
+    });
+
+    fus::bench_add("io/crypt/handshake_server", [pair](uint64_t iterations) {
+        BIGNUM* seed = BN_new();
+        uint8_t ydata[64];
+        uint8_t srvSeed[64];
+        fus::crypt_handshake_client(pair->m_g, pair->m_n, pair->m_x, seed, ydata, sizeof(ydata));
+        for (uint64_t i = 0; i < iterations; ++i) {
+            fus::crypt_handshake_server(pair->m_k, pair->m_n, ydata, sizeof(ydata), srvSeed, sizeof(srvSeed));
+            fus::bench_keep(srvSeed);
+        }
+        BN_free(seed);
+    });
+
+    // Most messages are small, but file and vault transfers can be quite large.
+    for (size_t size : { 16, 64, 256, 1024, 4096, 65536 }) {
+        auto buf = std::make_shared<std::vector<uint8_t>>(size * 2);
+        fus::bench_add(ST::format("io/crypt/encipher/{}", size), [pair, buf, size](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                fus::crypt_stream_encipher(pair->m_client, buf->data(), buf->data() + size, size);
+                fus::bench_keep(buf->data());
+            }
+        }, size);
+        fus::bench_add(ST::format("io/crypt/decipher/{}", size), [pair, buf, size](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                fus::crypt_stream_decipher(pair->m_server, buf->data(), size);
+                fus::bench_keep(buf->data());
+            }
+        }, size);
+    }
+}
+
+// =================================================================================
+
+void fus::bench_add_io(uv_loop_t* loop)
+{
+    bench_hash();
+    bench_crypt(loop);
+}
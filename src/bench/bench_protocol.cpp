@@ -0,0 +1,209 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include "bench.h"
+#include "io/net_struct.h"
+#include "io/tcp_stream.h"
+#include <memory>
+#include "protocol/admin.h"
+#include "protocol/auth.h"
+#include "protocol/common.h"
+#include "protocol/db.h"
+#include <string_theory/st_format.h>
+#include <vector>
+
+// =================================================================================
+
+// Every protocol message, gathered up by including the definitions once more.
+#define FUS_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name) &fus::protocol::protocol_name##_##msg_name::net_struct,
+#define FUS_NET_STRUCT_BEGIN(protocol_name, msg_name) FUS_NET_STRUCT_BEGIN_COMMON(protocol_name, msg_name)
+#define FUS_NET_FIELD_BLOB(name, size)
+#define FUS_NET_FIELD_BUFFER(name)
+#define FUS_NET_FIELD_BUFFER_TINY(name)
+#define FUS_NET_FIELD_BUFFER_HUGE(name)
+#define FUS_NET_FIELD_BUFFER_REDUNDANT(name)
+#define FUS_NET_FIELD_BUFFER_REDUNDANT_TINY(name)
+#define FUS_NET_FIELD_BUFFER_REDUNDANT_HUGE(name)
+#define FUS_NET_FIELD_UINT8(name)
+#define FUS_NET_FIELD_UINT16(name)
+#define FUS_NET_FIELD_UINT32(name)
+#define FUS_NET_FIELD_STRING_UTF8(name, size)
+#define FUS_NET_FIELD_STRING_UTF16(name, size)
+#define FUS_NET_FIELD_UUID(name)
+#define FUS_NET_STRUCT_END(protocol_name, msg_name)
+
+static const fus::net_struct_t* const* s_structs[] = {
+#include "protocol/admin.inl"
+#include "protocol/auth.inl"
+#include "protocol/common.inl"
+#include "protocol/db.inl"
+};
+
+#include "protocol/protocol_objects_end.inl"
+
+// =================================================================================
+
+/** A message as the daemons hold it in memory and as it looks on the wire. */
+struct bench_msg_t
+{
+    const fus::net_struct_t* m_struct;
+    std::vector<uint8_t> m_memory;
+    std::vector<uint8_t> m_append;
+    std::vector<uint8_t> m_wire;
+};
+
+static inline bool is_buffer(const fus::net_field_t& field)
+{
+    switch (field.m_type) {
+    case fus::net_field_t::data_type::e_buffer:
+    case fus::net_field_t::data_type::e_buffer_tiny:
+    case fus::net_field_t::data_type::e_buffer_huge:
+    case fus::net_field_t::data_type::e_buffer_redundant:
+    case fus::net_field_t::data_type::e_buffer_redundant_tiny:
+    case fus::net_field_t::data_type::e_buffer_redundant_huge:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline bool is_redundant(const fus::net_field_t& field)
+{
+    return field.m_type == fus::net_field_t::data_type::e_buffer_redundant ||
+           field.m_type == fus::net_field_t::data_type::e_buffer_redundant_tiny ||
+           field.m_type == fus::net_field_t::data_type::e_buffer_redundant_huge;
+}
+
+static inline void set_size(uint8_t* ptr, size_t sizesz, uint32_t value)
+{
+    for (size_t i = 0; i < sizesz; ++i)
+        ptr[i] = i < sizeof(value) ? (uint8_t)(value >> (i * 8)) : 0;
+}
+
+static inline uint32_t string_chars(const fus::net_field_t& field)
+{
+    // A short name's worth of characters, which is what most strings on the wire look like.
+    return (uint32_t)std::min<size_t>(8, field.m_datasz / sizeof(char16_t));
+}
+
+static bool make_msg(const fus::net_struct_t* ns, bench_msg_t& msg)
+{
+    constexpr uint32_t k_bufferBytes = 32;
+
+    msg.m_struct = ns;
+    msg.m_memory.assign(fus::net_struct_calcsz(ns), 0);
+    size_t offset = 0;
+    for (size_t i = 0; i < ns->m_size; ++i) {
+        const fus::net_field_t& field = ns->m_fields[i];
+        if (field.m_type == fus::net_field_t::data_type::e_string_utf16) {
+            size_t sizesz = ns->m_fields[i - 1].m_datasz;
+            set_size(&msg.m_memory[offset - sizesz], sizesz, string_chars(field));
+            for (size_t j = 0; j < string_chars(field); ++j)
+                msg.m_memory[offset + j * sizeof(char16_t)] = 'a' + (uint8_t)j;
+        } else if (is_buffer(field)) {
+            // Only a trailing buffer can be handed over separately from the message.
+            if (i + 1 != ns->m_size)
+                return false;
+            size_t sizesz = ns->m_fields[i - 1].m_datasz;
+            uint32_t value = k_bufferBytes + (is_redundant(field) ? (uint32_t)sizesz : 0);
+            set_size(&msg.m_memory[offset - sizesz], sizesz, value);
+            msg.m_append.assign(k_bufferBytes, 0xAA);
+        }
+        offset += field.m_datasz;
+    }
+
+    offset = 0;
+    for (size_t i = 0; i < ns->m_size; ++i) {
+        const fus::net_field_t& field = ns->m_fields[i];
+        const uint8_t* ptr = msg.m_memory.data() + offset;
+        if (field.m_type == fus::net_field_t::data_type::e_string_utf16)
+            msg.m_wire.insert(msg.m_wire.end(), ptr, ptr + string_chars(field) * sizeof(char16_t));
+        else if (is_buffer(field))
+            msg.m_wire.insert(msg.m_wire.end(), msg.m_append.begin(), msg.m_append.end());
+        else
+            msg.m_wire.insert(msg.m_wire.end(), ptr, ptr + field.m_datasz);
+        offset += field.m_datasz;
+    }
+    return true;
+}
+
+// =================================================================================
+
+static void bench_read_done(fus::tcp_stream_t* stream, ssize_t nread, void*)
+{
+    *(ssize_t*)uv_handle_get_data((uv_handle_t*)stream) = nread;
+}
+
+static fus::tcp_stream_t* make_stream(uv_loop_t* loop, ssize_t* result)
+{
+    // Never connected: reads are fed by hand and writes are serialized, then dropped.
+    auto stream = (fus::tcp_stream_t*)malloc(sizeof(fus::tcp_stream_t));
+    fus::tcp_stream_init(stream, loop);
+    uv_handle_set_data((uv_handle_t*)stream, result);
+    return stream;
+}
+
+static void bench_msg(uv_loop_t* loop, const std::shared_ptr<bench_msg_t>& msg)
+{
+    auto result = std::make_shared<ssize_t>(0);
+    fus::tcp_stream_t* stream = make_stream(loop, result.get());
+
+    // Make sure the message actually parses before timing it.
+    fus::tcp_stream_read_struct(stream, msg->m_struct, bench_read_done);
+    fus::tcp_stream_feed(stream, msg->m_wire.data(), msg->m_wire.size());
+    if (*result <= 0) {
+        fputs(ST::format("Skipping {}: the synthesized message does not parse\n", msg->m_struct->m_name).c_str(),
+              stderr);
+        return;
+    }
+
+    fus::bench_add(ST::format("protocol/read/{}", msg->m_struct->m_name), [stream, msg](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            fus::tcp_stream_read_struct(stream, msg->m_struct, bench_read_done);
+            fus::tcp_stream_feed(stream, msg->m_wire.data(), msg->m_wire.size());
+        }
+    }, msg->m_wire.size());
+
+    fus::bench_add(ST::format("protocol/write/{}", msg->m_struct->m_name), [stream, msg](uint64_t iterations) {
+        const void* append = msg->m_append.empty() ? nullptr : msg->m_append.data();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            fus::tcp_stream_write_struct(stream, msg->m_struct, msg->m_memory.data(), msg->m_memory.size(),
+                                         append, msg->m_append.size());
+        }
+    }, msg->m_wire.size());
+}
+
+// =================================================================================
+
+void fus::bench_add_protocol(uv_loop_t* loop)
+{
+    fus::bench_add("protocol/net_struct_calcsz", [](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            for (const fus::net_struct_t* const* ns : s_structs)
+                fus::bench_keep(fus::net_struct_calcsz(*ns, (*ns)->m_size / 2));
+        }
+    });
+
+    for (const fus::net_struct_t* const* ns : s_structs) {
+        auto msg = std::make_shared<bench_msg_t>();
+        if (make_msg(*ns, *msg))
+            bench_msg(loop, msg);
+        else
+            fputs(ST::format("Skipping {}: it has a buffer in the middle\n", (*ns)->m_name).c_str(), stderr);
+    }
+}
@@ -141,6 +141,12 @@ static void admin_client_pump(fus::admin_client_t* client, ssize_t nread, fus::p
     case fus::protocol::admin_acctCreateReply::id():
         admin_read<fus::protocol::admin_acctCreateReply>(client, admin_trans);
         break;
+    case fus::protocol::admin_acctCreateBatchReply::id():
+        admin_read<fus::protocol::admin_acctCreateBatchReply>(client, admin_trans);
+        break;
+    case fus::protocol::admin_statsReply::id():
+        admin_read<fus::protocol::admin_statsReply>(client, admin_trans);
+        break;
     default:
         fus::tcp_stream_shutdown(client);
         break;
@@ -0,0 +1,159 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "auth_client.h"
+#include "core/errors.h"
+#include "io/io.h"
+#include "protocol/auth.h"
+
+// =================================================================================
+
+int fus::auth_client_init(fus::auth_client_t* client, uv_loop_t* loop)
+{
+    int result = client_init(client, loop);
+    if (result < 0)
+        return result;
+    tcp_stream_free_cb(client, (tcp_free_cb)auth_client_free);
+
+    ((client_t*)client)->m_proc = (client_pump_proc)auth_client_read;
+    client->m_registercb = nullptr;
+    client->m_srvChallenge = 0;
+
+    return 0;
+}
+
+void fus::auth_client_free(fus::auth_client_t* client)
+{
+    client_free(client);
+}
+
+// =================================================================================
+
+void fus::auth_client_connect(fus::auth_client_t* client, const sockaddr* addr, void* buf, size_t bufsz, fus::client_connect_cb cb)
+{
+    FUS_ASSERTD(buf);
+    FUS_ASSERTD(bufsz);
+
+    auto header = (protocol::common_connection_header*)buf;
+    header->set_connType(protocol::e_protocolCli2Auth);
+    fus::client_crypt_connect(client, addr, buf, bufsz, cb);
+}
+
+void fus::auth_client_connect(fus::auth_client_t* client, const sockaddr* addr, void* buf, size_t bufsz,
+                              uint32_t g, const ST::string& n, const ST::string& x, fus::client_connect_cb cb)
+{
+    FUS_ASSERTD(buf);
+    FUS_ASSERTD(bufsz);
+
+    auto header = (protocol::common_connection_header*)buf;
+    header->set_connType(protocol::e_protocolCli2Auth);
+    fus::client_crypt_connect(client, addr, buf, bufsz, g, n, x, cb);
+}
+
+size_t fus::auth_client_header_size()
+{
+    return sizeof(protocol::common_connection_header);
+}
+
+// =================================================================================
+
+void fus::auth_client_register_handler(fus::auth_client_t* client, fus::auth_client_register_cb cb)
+{
+    client->m_registercb = cb;
+}
+
+// =================================================================================
+
+template<typename _Msg>
+using _auth_cb = void(fus::auth_client_t*, ssize_t, _Msg*);
+
+template<typename _Msg, typename _Cb = _auth_cb<_Msg>>
+static inline void auth_read(fus::auth_client_t* client, _Cb cb)
+{
+    fus::tcp_stream_read_msg<_Msg>(client, (fus::tcp_read_cb)cb);
+}
+
+template<typename _Msg>
+static void auth_trans(fus::auth_client_t* client, ssize_t nread, _Msg* reply)
+{
+    if (nread < 0) {
+        fus::tcp_stream_shutdown(client);
+        return;
+    }
+
+    fus::client_fire_trans(client, reply->get_transId(), (fus::net_error)reply->get_result(), nread, reply);
+    fus::auth_client_read(client);
+}
+
+template<typename _Msg>
+static void auth_trans_noresult(fus::auth_client_t* client, ssize_t nread, _Msg* reply)
+{
+    if (nread < 0) {
+        fus::tcp_stream_shutdown(client);
+        return;
+    }
+
+    fus::client_fire_trans(client, reply->get_transId(), fus::net_error::e_success, nread, reply);
+    fus::auth_client_read(client);
+}
+
+// =================================================================================
+
+static void auth_registerReply(fus::auth_client_t* client, ssize_t nread, fus::protocol::auth_clientRegisterReply* reply)
+{
+    if (nread < 0) {
+        fus::tcp_stream_shutdown(client);
+        return;
+    }
+
+    client->m_srvChallenge = reply->get_loginSalt();
+    if (client->m_registercb)
+        client->m_registercb(client, client->m_srvChallenge);
+
+    fus::auth_client_read(client);
+}
+
+static void auth_client_pump(fus::auth_client_t* client, ssize_t nread, fus::protocol::common_msg_std_header* header)
+{
+    if (nread < 0) {
+        fus::tcp_stream_shutdown(client);
+        return;
+    }
+
+    switch (header->get_type()) {
+    case fus::protocol::auth_pingReply::id():
+        auth_read<fus::protocol::auth_pingReply>(client, auth_trans_noresult);
+        break;
+    case fus::protocol::auth_clientRegisterReply::id():
+        auth_read<fus::protocol::auth_clientRegisterReply>(client, auth_registerReply);
+        break;
+    case fus::protocol::auth_acctLoginReply::id():
+        auth_read<fus::protocol::auth_acctLoginReply>(client, auth_trans);
+        break;
+    case fus::protocol::auth_accountExistsReply::id():
+        auth_read<fus::protocol::auth_accountExistsReply>(client, auth_trans);
+        break;
+    default:
+        fus::tcp_stream_shutdown(client);
+        break;
+    }
+}
+
+void fus::auth_client_read(fus::auth_client_t* client)
+{
+    tcp_stream_peek_msg<protocol::common_msg_std_header>(client, (tcp_read_cb)auth_client_pump);
+}
@@ -0,0 +1,51 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_AUTH_CLIENT_H
+#define __FUS_AUTH_CLIENT_H
+
+#include "client_base.h"
+
+namespace fus
+{
+    struct auth_client_t;
+    typedef void (*auth_client_register_cb)(auth_client_t*, uint32_t);
+
+    /**
+     * A client of the auth daemon's public protocol. This speaks the same dialect as the game
+     * client, so it is mostly useful for testing the auth daemon.
+     */
+    struct auth_client_t : public client_t
+    {
+        auth_client_register_cb m_registercb;
+        uint32_t m_srvChallenge;
+    };
+
+    int auth_client_init(auth_client_t*, uv_loop_t*);
+    void auth_client_free(auth_client_t*);
+
+    void auth_client_connect(auth_client_t*, const sockaddr*, void*, size_t, client_connect_cb);
+    void auth_client_connect(auth_client_t*, const sockaddr*, void*, size_t, uint32_t, const ST::string&, const ST::string&, client_connect_cb);
+    size_t auth_client_header_size();
+
+    /** The callback is run with the server's login challenge once the client is registered. */
+    void auth_client_register_handler(auth_client_t*, auth_client_register_cb cb=nullptr);
+
+    void auth_client_read(auth_client_t*);
+};
+
+#endif
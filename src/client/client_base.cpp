@@ -16,6 +16,8 @@
 
 #include "client_base.h"
 #include "core/errors.h"
+#include "core/flight_recorder.h"
+#include "core/metrics.h"
 #include <cstring>
 #include <new>
 #include <openssl/bn.h>
@@ -41,6 +43,12 @@ struct connect_req_t
     uint8_t m_buf[];
 };
 
+static fus::metric_counter s_transStarted("fus_client_trans_total", "Transactions sent to remote daemons");
+static fus::metric_counter s_transKilled("fus_client_trans_killed_total", "Transactions abandoned before a reply arrived");
+static fus::metric_histogram s_transLatency("fus_client_trans_latency_us", "Time from sending a transaction to its reply (us)");
+
+static fus::client_connector_f s_connector = nullptr;
+
 // =================================================================================
 
 int fus::client_init(fus::client_t* client, uv_loop_t* loop)
@@ -58,6 +66,8 @@ int fus::client_init(fus::client_t* client, uv_loop_t* loop)
     client->m_connectcb = nullptr;
     client->m_transId = 0;
     new(&client->m_trans) std::map<uint32_t, transaction_t>;
+    client->m_transRtt = nullptr;
+    client->m_transRttsz = 0;
 
     return result;
 }
@@ -68,6 +78,7 @@ void fus::client_free(fus::client_t* client)
         BN_free(client->m_connectReq->m_nKey);
         BN_free(client->m_connectReq->m_xKey);
     }
+    free(client->m_connectReq);
     uv_timer_stop(&client->m_reconnect);
     uv_close((uv_handle_t*)&client->m_reconnect, tcp_stream_unref);
     client_kill_trans(client, net_error::e_remoteShutdown, UV_ECANCELED);
@@ -103,7 +114,7 @@ static void _client_connected(connect_req_t* req, int status)
         if (client->m_connectcb)
             client->m_connectcb(client, status);
     } else {
-        client->m_flags |= fus::tcp_stream_t::e_connected;
+        fus::tcp_stream_set_connected(client);
         fus::tcp_stream_write(client, req->m_buf, req->m_bufsz);
         if (req->m_flags & connect_req_t::e_encrypt) {
             if (req->m_flags & connect_req_t::e_ownsKeys)
@@ -117,6 +128,33 @@ static void _client_connected(connect_req_t* req, int status)
     }
 }
 
+static void _client_connect_now(fus::client_t* client)
+{
+    connect_req_t* req = client->m_connectReq;
+    if (s_connector) {
+        req->m_req.handle = (uv_stream_t*)client;
+        _client_connected(req, s_connector(client, (const sockaddr*)&req->m_sockaddr));
+    } else {
+        uv_tcp_connect((uv_connect_t*)req, (uv_tcp_t*)client, (const sockaddr*)&req->m_sockaddr,
+                       (uv_connect_cb)_client_connected);
+    }
+}
+
+static void _client_connect_deferred(uv_timer_t* timer)
+{
+    _client_connect_now((fus::client_t*)uv_handle_get_data((uv_handle_t*)timer));
+}
+
+static void _client_connect(fus::client_t* client)
+{
+    // A connector finishes right away, but callers expect the callback to come from the loop, as
+    // it would for a real connection.
+    if (s_connector)
+        uv_timer_start(&client->m_reconnect, _client_connect_deferred, 0, 0);
+    else
+        _client_connect_now(client);
+}
+
 static inline void _load_key(BIGNUM*& bn, const ST::string& key)
 {
     bn = BN_new();
@@ -137,7 +175,7 @@ void fus::client_crypt_connect(fus::client_t* client, const sockaddr* addr, cons
     client->m_connectReq->m_bufsz = bufsz;
     memcpy(client->m_connectReq->m_buf, buf, bufsz);
 
-    uv_tcp_connect((uv_connect_t*)client->m_connectReq, (uv_tcp_t*)client, addr, (uv_connect_cb)_client_connected);
+    _client_connect(client);
 }
 
 void fus::client_crypt_connect(fus::client_t* client, const sockaddr* addr, const void* buf, size_t bufsz,
@@ -158,7 +196,7 @@ void fus::client_crypt_connect(fus::client_t* client, const sockaddr* addr, cons
     client->m_connectReq->m_bufsz = bufsz;
     memcpy(client->m_connectReq->m_buf, buf, bufsz);
 
-    uv_tcp_connect((uv_connect_t*)client->m_connectReq, (uv_tcp_t*)client, addr, (uv_connect_cb)_client_connected);
+    _client_connect(client);
 }
 
 void fus::client_connect(fus::client_t* client, const sockaddr* addr, const void* buf, size_t bufsz, client_connect_cb cb)
@@ -173,17 +211,11 @@ void fus::client_connect(fus::client_t* client, const sockaddr* addr, const void
     client->m_connectReq->m_bufsz = bufsz;
     memcpy(client->m_connectReq->m_buf, buf, bufsz);
 
-    uv_tcp_connect((uv_connect_t*)client->m_connectReq, (uv_tcp_t*)client, addr, (uv_connect_cb)_client_connected);
+    _client_connect(client);
 }
 
 // =================================================================================
 
-static void reconnect_client(uv_timer_t* timer)
-{
-    fus::client_t* client = (fus::client_t*)uv_handle_get_data((uv_handle_t*)timer);
-    uv_tcp_connect((uv_connect_t*)client->m_connectReq, (uv_tcp_t*)client, (sockaddr*)&client->m_connectReq->m_sockaddr, (uv_connect_cb)_client_connected);
-}
-
 void fus::client_reconnect(fus::client_t* client, uint64_t reconnectTimeMs)
 {
     FUS_ASSERTD(client);
@@ -196,7 +228,12 @@ void fus::client_reconnect(fus::client_t* client, uint64_t reconnectTimeMs)
     client_kill_trans(client, fus::net_error::e_disconnected, UV_ECONNRESET);
 
     FUS_ASSERTD(client->m_connectReq);
-    uv_timer_start(&client->m_reconnect, reconnect_client, reconnectTimeMs, 0);
+    uv_timer_start(&client->m_reconnect, _client_connect_deferred, reconnectTimeMs, 0);
+}
+
+void fus::client_set_connector(fus::client_connector_f connector)
+{
+    s_connector = connector;
 }
 
 // =================================================================================
@@ -206,12 +243,16 @@ uint32_t fus::client_next_transId(fus::client_t* client)
     return client->m_transId++;
 }
 
-uint32_t fus::client_gen_trans(fus::client_t* client, void* instance, uint32_t wrapTransId, fus::client_trans_cb cb)
+uint32_t fus::client_gen_trans(fus::client_t* client, void* instance, uint32_t wrapTransId, fus::client_trans_cb cb,
+                               const net_struct_t* ns, uint16_t type, uint32_t traceId)
 {
     uint32_t transId = client->m_transId++;
     if (cb) {
         client->m_trans.emplace(std::piecewise_construct, std::forward_as_tuple(transId),
-                                std::forward_as_tuple(instance, wrapTransId, cb));
+                                std::forward_as_tuple(instance, wrapTransId, cb, uv_hrtime(),
+                                                      ns ? ns->m_name : "transaction", traceId, type));
+        s_transStarted.add();
+        flight_record(flight_event::e_transStart, tcp_stream_connid(client), type, transId);
     }
     return transId;
 }
@@ -220,6 +261,14 @@ void fus::client_fire_trans(fus::client_t* client, uint32_t transId, net_error r
 {
     auto it = client->m_trans.find(transId);
     if (it != client->m_trans.end()) {
+        uint64_t now = uv_hrtime();
+        uint64_t rtt = (now - it->second.m_start) / 1000;
+        s_transLatency.record(rtt);
+        if (it->second.m_type < client->m_transRttsz)
+            client->m_transRtt[it->second.m_type].record(rtt);
+        trace_span(it->second.m_traceId, it->second.m_name, it->second.m_start, now);
+        flight_record(flight_event::e_transFinish, tcp_stream_connid(client), it->second.m_type, (uint32_t)rtt);
+
         it->second.m_cb(it->second.m_instance, client, it->second.m_transId,
                         result, nread, msg);
         client->m_trans.erase(it);
@@ -232,6 +281,7 @@ void fus::client_kill_trans(fus::client_t* client, net_error result, ssize_t nre
         for (auto& it : client->m_trans)
             it.second.m_cb(it.second.m_instance, client, it.second.m_transId, result, nread, nullptr);
     }
+    s_transKilled.add(client->m_trans.size());
     client->m_trans.clear();
     client->m_transId = 0;
 }
@@ -240,9 +290,10 @@ void fus::client_kill_trans(fus::client_t* client, void* instance, net_error res
 {
     for (auto it = client->m_trans.cbegin(); it != client->m_trans.cend();) {
         if (it->second.m_instance == instance) {
+            s_transKilled.add();
             if (!quiet)
                 it->second.m_cb(instance, client, it->second.m_transId, result, nread, nullptr);
-            client->m_trans.erase(it);
+            it = client->m_trans.erase(it);
         } else {
             ++it;
         }
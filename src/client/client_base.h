@@ -19,14 +19,19 @@
 
 #include "io/crypt_stream.h"
 #include "io/net_error.h"
+#include "io/net_struct.h"
+#include "io/trace.h"
 #include <map>
+#include <type_traits>
 
 struct connect_req_t;
 
 namespace fus
 {
     struct client_t;
+    class metric_histogram;
     typedef void (*client_connect_cb)(client_t*, ssize_t status);
+    typedef int (*client_connector_f)(client_t*, const sockaddr*);
     typedef void (*client_pump_proc)(client_t*);
     typedef void (*client_trans_cb)(void*, client_t*, uint32_t, net_error, ssize_t, const void*);
     typedef std::map<uint32_t, struct transaction_t> trans_map_t;
@@ -36,9 +41,15 @@ namespace fus
         void* m_instance;
         uint32_t m_transId;
         client_trans_cb m_cb;
+        uint64_t m_start;
+        const char* m_name;
+        uint32_t m_traceId;
+        uint16_t m_type;
 
-        transaction_t(void* instance, uint32_t transId, client_trans_cb cb)
-            : m_instance(instance), m_transId(transId), m_cb(cb)
+        transaction_t(void* instance, uint32_t transId, client_trans_cb cb, uint64_t start,
+                      const char* name, uint32_t traceId, uint16_t type)
+            : m_instance(instance), m_transId(transId), m_cb(cb), m_start(start), m_name(name),
+              m_traceId(traceId), m_type(type)
         { }
     };
 
@@ -52,6 +63,10 @@ namespace fus
 
         uint32_t m_transId;
         trans_map_t m_trans;
+
+        /** Round trip time histograms for each request type, indexed by message ID. Optional. */
+        const metric_histogram* m_transRtt;
+        size_t m_transRttsz;
     };
 
     int client_init(client_t*, uv_loop_t*);
@@ -62,17 +77,39 @@ namespace fus
     void client_connect(client_t*, const sockaddr*, const void*, size_t, client_connect_cb);
     void client_reconnect(client_t*, uint64_t reconnectTimeMs=30000);
 
+    /**
+     * Routes every outgoing connection in the process through the connector instead of the
+     * network. The connector must connect the client, eg with tcp_stream_pair(), or return an
+     * error. Pass nullptr to go back to the network.
+     */
+    void client_set_connector(client_connector_f);
+
     uint32_t client_next_transId(client_t*);
-    uint32_t client_gen_trans(client_t*, void*, uint32_t, client_trans_cb);
+    uint32_t client_gen_trans(client_t*, void*, uint32_t, client_trans_cb, const net_struct_t* ns=nullptr,
+                              uint16_t type=0, uint32_t traceId=0);
     void client_fire_trans(client_t*, uint32_t, net_error, ssize_t, const void*);
     void client_kill_trans(client_t*, net_error, ssize_t, bool quiet=false);
     void client_kill_trans(client_t*, void*, net_error, ssize_t, bool quiet=false);
 
+    template<typename _Msg, typename = void>
+    struct _msg_has_trace : std::false_type { };
+
+    template<typename _Msg>
+    struct _msg_has_trace<_Msg, std::void_t<decltype(std::declval<_Msg&>().set_traceId(0))>> : std::true_type { };
+
     template<typename _Msg>
     void client_prep_trans(client_t* client, _Msg& msg, void* instance, uint32_t wrapTransId,
                            client_trans_cb cb)
     {
-        msg.set_transId(client_gen_trans(client, instance, wrapTransId, cb));
+        // Requests that can carry a trace context pass it along so the remote daemon's spans
+        // can be matched up with ours.
+        uint32_t traceId = 0;
+        if constexpr (_msg_has_trace<_Msg>::value) {
+            traceId = trace_next_id();
+            msg.set_traceId(traceId);
+        }
+        msg.set_transId(client_gen_trans(client, instance, wrapTransId, cb, _Msg::net_struct,
+                                         _Msg::id(), traceId));
     }
 };
 
@@ -15,12 +15,26 @@
  */
 
 #include "core/errors.h"
+#include "core/metrics.h"
 #include <cstring>
 #include "db_client.h"
+#include <iterator>
 #include "protocol/db.h"
 
 // =================================================================================
 
+// Indexed by request message ID
+static const fus::metric_histogram s_transRtt[] = {
+    { "fus_db_trans_rtt_us", "Round trip time of requests to the db daemon (us)", "type=\"ping\"" },
+    { "fus_db_trans_rtt_us", "Round trip time of requests to the db daemon (us)", "type=\"acctCreate\"" },
+    { "fus_db_trans_rtt_us", "Round trip time of requests to the db daemon (us)", "type=\"acctAuth\"" },
+    { "fus_db_trans_rtt_us", "Round trip time of requests to the db daemon (us)", "type=\"acctExists\"" },
+    { "fus_db_trans_rtt_us", "Round trip time of requests to the db daemon (us)", "type=\"acctCreateBatch\"" },
+};
+static_assert(std::size(s_transRtt) == fus::protocol::db::e_acctCreateBatchRequest + 1);
+
+// =================================================================================
+
 int fus::db_client_init(fus::db_client_t* client, uv_loop_t* loop)
 {
     int result = client_init(client, loop);
@@ -29,6 +43,9 @@ int fus::db_client_init(fus::db_client_t* client, uv_loop_t* loop)
     tcp_stream_free_cb(client, (tcp_free_cb)db_client_free);
 
     client->m_proc = (client_pump_proc)db_client_read;
+    client->m_acctInvalidatecb = nullptr;
+    client->m_transRtt = s_transRtt;
+    client->m_transRttsz = std::size(s_transRtt);
 
     return 0;
 }
@@ -68,6 +85,13 @@ size_t fus::db_client_header_size()
 
 // =================================================================================
 
+void fus::db_client_acct_invalidate_handler(fus::db_client_t* client, fus::db_client_acct_invalidate_cb cb)
+{
+    client->m_acctInvalidatecb = cb;
+}
+
+// =================================================================================
+
 template<typename _Msg>
 using _db_cb = void(fus::db_client_t*, ssize_t, _Msg*);
 
@@ -103,6 +127,19 @@ static void db_trans_noresult(fus::db_client_t* client, ssize_t nread, _Msg* rep
 
 // =================================================================================
 
+static void db_acctInvalidateBCast(fus::db_client_t* client, ssize_t nread, fus::protocol::db_acctInvalidateBCast* bcast)
+{
+    if (nread < 0) {
+        fus::tcp_stream_shutdown(client);
+        return;
+    }
+
+    if (client->m_acctInvalidatecb)
+        client->m_acctInvalidatecb(client, bcast->get_name());
+
+    fus::db_client_read(client);
+}
+
 static void db_client_pump(fus::db_client_t* client, ssize_t nread, fus::protocol::common_msg_std_header* header)
 {
     if (nread < 0) {
@@ -120,6 +157,15 @@ static void db_client_pump(fus::db_client_t* client, ssize_t nread, fus::protoco
     case fus::protocol::db_acctAuthReply::id():
         db_read<fus::protocol::db_acctAuthReply>(client, db_trans);
         break;
+    case fus::protocol::db_acctExistsReply::id():
+        db_read<fus::protocol::db_acctExistsReply>(client, db_trans);
+        break;
+    case fus::protocol::db_acctCreateBatchReply::id():
+        db_read<fus::protocol::db_acctCreateBatchReply>(client, db_trans);
+        break;
+    case fus::protocol::db_acctInvalidateBCast::id():
+        db_read<fus::protocol::db_acctInvalidateBCast>(client, db_acctInvalidateBCast);
+        break;
     default:
         fus::tcp_stream_shutdown(client);
         break;
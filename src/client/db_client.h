@@ -25,9 +25,11 @@ namespace fus
     class uuid;
 
     struct db_client_t;
+    typedef void (*db_client_acct_invalidate_cb)(db_client_t*, std::string_view);
 
     struct db_client_t : public client_t
     {
+        db_client_acct_invalidate_cb m_acctInvalidatecb;
     };
 
     int db_client_init(db_client_t*, uv_loop_t*);
@@ -37,6 +39,8 @@ namespace fus
     void db_client_connect(db_client_t*, const sockaddr*, void*, size_t, uint32_t, const ST::string&, const ST::string&, client_connect_cb);
     size_t db_client_header_size();
 
+    void db_client_acct_invalidate_handler(db_client_t*, db_client_acct_invalidate_cb cb=nullptr);
+
     void db_client_read(db_client_t*);
 };
 
@@ -0,0 +1,363 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "alloc_profile.h"
+
+#ifdef FUS_ALLOC_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string_theory/format>
+
+#if defined(__GLIBC__)
+#   include <cxxabi.h>
+#   include <dlfcn.h>
+#   include <execinfo.h>
+#   define FUS_ALLOC_HOOK_MALLOC
+#endif
+
+// =================================================================================
+
+constexpr size_t k_maxTags = 256;
+constexpr size_t k_maxSites = 4096;
+constexpr size_t k_siteFrames = 4;
+
+namespace
+{
+    struct tag_slot_t
+    {
+        const char* m_tag;
+        uint32_t m_type;
+        std::atomic<uint64_t> m_messages;
+        std::atomic<uint64_t> m_allocs;
+        std::atomic<uint64_t> m_bytes;
+    };
+
+    struct site_slot_t
+    {
+        std::atomic<uint64_t> m_key;
+        uint16_t m_tag;
+        void* m_frames[k_siteFrames];
+        std::atomic<uint64_t> m_allocs;
+        std::atomic<uint64_t> m_bytes;
+    };
+};
+
+// malloc calls us, possibly before main(), so the tables are fixed size and need no constructors.
+static tag_slot_t s_tags[k_maxTags];
+static std::atomic<size_t> s_numTags{ 1 };
+static site_slot_t s_sites[k_maxSites];
+static std::mutex s_tagLock;
+
+static thread_local uint16_t t_slot = 0;
+static thread_local bool t_inHook = false;
+
+// =================================================================================
+
+static inline void bump(std::atomic<uint64_t>& value, uint64_t n)
+{
+    value.fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline uint64_t site_key(uint16_t tag, void* const* frames)
+{
+    // FNV-1a over the tag and frames. Zero marks an empty slot, so it's never a valid key.
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](uint64_t value) { hash = (hash ^ value) * 1099511628211ULL; };
+    mix(tag);
+    for (size_t i = 0; i < k_siteFrames; ++i)
+        mix((uint64_t)(uintptr_t)frames[i]);
+    return hash ? hash : 1;
+}
+
+/**
+ * Counts one allocation against the current thread's tag and call site. This never allocates
+ * or locks anything itself, and allocations it causes are not counted. Capturing the call site
+ * with backtrace() is another matter: unwinding may take the dynamic loader's lock, and the
+ * very first call loads libgcc_s, which allocates -- hence the warm up below.
+ */
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void record(size_t size)
+{
+    if (t_inHook)
+        return;
+    t_inHook = true;
+
+    uint16_t tag = t_slot;
+    bump(s_tags[tag].m_allocs, 1);
+    bump(s_tags[tag].m_bytes, size);
+
+#ifdef FUS_ALLOC_HOOK_MALLOC
+    // Frame 0 is us and frame 1 is the hooked allocator function, so skip them.
+    void* frames[k_siteFrames + 2] = {};
+    backtrace(frames, (int)std::size(frames));
+    void* const* site = frames + 2;
+#else
+    void* frames[k_siteFrames] = { __builtin_return_address(0) };
+    void* const* site = frames;
+#endif
+
+    uint64_t key = site_key(tag, site);
+    for (size_t i = 0; i < k_maxSites; ++i) {
+        site_slot_t& slot = s_sites[(key + i) % k_maxSites];
+        uint64_t expected = slot.m_key.load(std::memory_order_acquire);
+        if (expected == 0) {
+            // Claim the slot. If somebody beat us to it, it might have been for this same site.
+            if (slot.m_key.compare_exchange_strong(expected, key, std::memory_order_acq_rel)) {
+                slot.m_tag = tag;
+                memcpy(slot.m_frames, site, sizeof(slot.m_frames));
+                expected = key;
+            }
+        }
+        if (expected == key) {
+            bump(slot.m_allocs, 1);
+            bump(slot.m_bytes, size);
+            break;
+        }
+    }
+
+    t_inHook = false;
+}
+
+#ifdef FUS_ALLOC_HOOK_MALLOC
+// Get backtrace()'s one-time setup out of the way while the process is still single threaded,
+// rather than in whichever allocation happens to be profiled first.
+__attribute__((constructor))
+static void warm_up()
+{
+    t_inHook = true;
+    void* frames[k_siteFrames + 2];
+    backtrace(frames, (int)std::size(frames));
+    t_inHook = false;
+}
+#endif
+
+// =================================================================================
+
+#ifdef FUS_ALLOC_HOOK_MALLOC
+// glibc lets the executable interpose the allocator, which catches malloc() from C code and
+// operator new alike -- libstdc++'s operator new is built on malloc().
+extern "C"
+{
+    void* __libc_malloc(size_t);
+    void* __libc_calloc(size_t, size_t);
+    void* __libc_realloc(void*, size_t);
+
+    void* malloc(size_t size)
+    {
+        record(size);
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size)
+    {
+        record(count * size);
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* ptr, size_t size)
+    {
+        record(size);
+        return __libc_realloc(ptr, size);
+    }
+};
+#else
+// Elsewhere, settle for everything that goes through operator new.
+void* operator new(size_t size)
+{
+    record(size);
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+// =================================================================================
+
+fus::alloc_scope_t::alloc_scope_t(const char* tag, uint32_t type)
+    : m_prevSlot(t_slot)
+{
+    // Tags are string literals, so the same pointer always means the same tag.
+    size_t numTags = s_numTags.load(std::memory_order_acquire);
+    size_t slot = 0;
+    for (size_t i = 1; i < numTags; ++i) {
+        if (s_tags[i].m_tag == tag && s_tags[i].m_type == type) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == 0) {
+        std::lock_guard<std::mutex> lock(s_tagLock);
+        numTags = s_numTags.load(std::memory_order_relaxed);
+        for (size_t i = 1; i < numTags; ++i) {
+            if (s_tags[i].m_tag == tag && s_tags[i].m_type == type) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot == 0 && numTags < k_maxTags) {
+            slot = numTags;
+            s_tags[slot].m_tag = tag;
+            s_tags[slot].m_type = type;
+            s_numTags.store(numTags + 1, std::memory_order_release);
+        }
+    }
+
+    t_slot = (uint16_t)slot;
+    if (type != k_noType)
+        bump(s_tags[slot].m_messages, 1);
+}
+
+fus::alloc_scope_t::~alloc_scope_t()
+{
+    t_slot = m_prevSlot;
+}
+
+// =================================================================================
+
+std::vector<fus::alloc_tag_stats_t> fus::alloc_profile_tags()
+{
+    std::vector<alloc_tag_stats_t> result;
+    size_t numTags = s_numTags.load(std::memory_order_acquire);
+    for (size_t i = 0; i < numTags; ++i) {
+        alloc_tag_stats_t& stats = result.emplace_back();
+        stats.m_tag = i ? s_tags[i].m_tag : "(untagged)";
+        stats.m_type = i ? s_tags[i].m_type : alloc_scope_t::k_noType;
+        stats.m_messages = s_tags[i].m_messages.load(std::memory_order_relaxed);
+        stats.m_allocs = s_tags[i].m_allocs.load(std::memory_order_relaxed);
+        stats.m_bytes = s_tags[i].m_bytes.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+static ST::string symbolize(void* const* frames)
+{
+#ifdef FUS_ALLOC_HOOK_MALLOC
+    // Prefer the first frame in our own code over whatever library did the allocating for us.
+    Dl_info self;
+    dladdr((void*)&fus::alloc_profile_reset, &self);
+
+    void* pc = frames[0];
+    Dl_info info{};
+    for (size_t i = 0; i < k_siteFrames && frames[i]; ++i) {
+        Dl_info frame;
+        if (dladdr(frames[i], &frame) && frame.dli_fbase == self.dli_fbase) {
+            pc = frames[i];
+            info = frame;
+            break;
+        }
+    }
+    if (!info.dli_fname && !dladdr(pc, &info))
+        return ST::format("{#x}", (uintptr_t)pc);
+
+    if (info.dli_sname) {
+        int status;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        ST::string result = ST::format("{}+{#x}", status == 0 ? demangled : info.dli_sname,
+                                       (uintptr_t)pc - (uintptr_t)info.dli_saddr);
+        free(demangled);
+        return result;
+    }
+    return ST::format("{}+{#x}", info.dli_fname, (uintptr_t)pc - (uintptr_t)info.dli_fbase);
+#else
+    return ST::format("{#x}", (uintptr_t)frames[0]);
+#endif
+}
+
+std::vector<fus::alloc_site_stats_t> fus::alloc_profile_sites(size_t max)
+{
+    std::vector<const site_slot_t*> sites;
+    for (const site_slot_t& slot : s_sites) {
+        if (slot.m_key.load(std::memory_order_acquire) != 0)
+            sites.push_back(&slot);
+    }
+
+    max = std::min(max, sites.size());
+    std::partial_sort(sites.begin(), sites.begin() + max, sites.end(),
+                      [](const site_slot_t* lhs, const site_slot_t* rhs) {
+                          return lhs->m_allocs.load(std::memory_order_relaxed) >
+                                 rhs->m_allocs.load(std::memory_order_relaxed);
+                      });
+
+    std::vector<alloc_site_stats_t> result;
+    result.reserve(max);
+    for (size_t i = 0; i < max; ++i) {
+        const site_slot_t* slot = sites[i];
+        alloc_site_stats_t& stats = result.emplace_back();
+        stats.m_tag = slot->m_tag ? s_tags[slot->m_tag].m_tag : "(untagged)";
+        stats.m_type = slot->m_tag ? s_tags[slot->m_tag].m_type : alloc_scope_t::k_noType;
+        stats.m_site = symbolize(slot->m_frames);
+        stats.m_allocs = slot->m_allocs.load(std::memory_order_relaxed);
+        stats.m_bytes = slot->m_bytes.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+void fus::alloc_profile_reset()
+{
+    // Tags and sites stay where they are so that scopes already in flight remain valid.
+    size_t numTags = s_numTags.load(std::memory_order_acquire);
+    for (size_t i = 0; i < numTags; ++i) {
+        s_tags[i].m_messages.store(0, std::memory_order_relaxed);
+        s_tags[i].m_allocs.store(0, std::memory_order_relaxed);
+        s_tags[i].m_bytes.store(0, std::memory_order_relaxed);
+    }
+    for (site_slot_t& slot : s_sites) {
+        slot.m_allocs.store(0, std::memory_order_relaxed);
+        slot.m_bytes.store(0, std::memory_order_relaxed);
+    }
+}
+
+#else
+
+std::vector<fus::alloc_tag_stats_t> fus::alloc_profile_tags()
+{
+    return {};
+}
+
+std::vector<fus::alloc_site_stats_t> fus::alloc_profile_sites(size_t)
+{
+    return {};
+}
+
+void fus::alloc_profile_reset()
+{
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_ALLOC_PROFILE_H
+#define __FUS_ALLOC_PROFILE_H
+
+#include <cstdint>
+#include <string_theory/string>
+#include <vector>
+
+#include "fus_config.h"
+
+namespace fus
+{
+    /**
+     * Attributes the allocations made on this thread to a subsystem, and optionally to a message
+     * type, for as long as it is in scope. Scopes nest; the innermost one wins. Entering a scope
+     * with a message type counts one message handled for that tag.
+     * \remarks This compiles away to nothing unless fus is built with FUS_ALLOC_PROFILE.
+     */
+    class alloc_scope_t final
+    {
+#ifdef FUS_ALLOC_PROFILE
+        uint16_t m_prevSlot;
+#endif
+
+    public:
+        static constexpr uint32_t k_noType = UINT32_MAX;
+
+#ifdef FUS_ALLOC_PROFILE
+        alloc_scope_t(const char* tag, uint32_t type=k_noType);
+        ~alloc_scope_t();
+#else
+        alloc_scope_t(const char*, uint32_t=k_noType) { }
+#endif
+        alloc_scope_t(const alloc_scope_t&) = delete;
+        alloc_scope_t(alloc_scope_t&&) = delete;
+    };
+
+    struct alloc_tag_stats_t
+    {
+        const char* m_tag;
+        uint32_t m_type;
+        uint64_t m_messages;
+        uint64_t m_allocs;
+        uint64_t m_bytes;
+    };
+
+    struct alloc_site_stats_t
+    {
+        const char* m_tag;
+        uint32_t m_type;
+        ST::string m_site;
+        uint64_t m_allocs;
+        uint64_t m_bytes;
+    };
+
+    constexpr bool alloc_profile_enabled()
+    {
+#ifdef FUS_ALLOC_PROFILE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /** Totals for every tag seen so far, with untagged allocations listed under "(untagged)". */
+    std::vector<alloc_tag_stats_t> alloc_profile_tags();
+
+    /** The call sites responsible for the most allocations, symbolized where possible. */
+    std::vector<alloc_site_stats_t> alloc_profile_sites(size_t max);
+
+    void alloc_profile_reset();
+};
+
+#endif
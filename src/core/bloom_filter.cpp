@@ -0,0 +1,120 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bloom_filter.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// =================================================================================
+
+constexpr double s_ln2 = 0.69314718055994530942;
+
+static inline uint64_t fnv1a(const std::string_view& key)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (char c : key) {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t mix64(uint64_t x)
+{
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// =================================================================================
+
+template<typename _Fn>
+void fus::counting_bloom_filter::for_each_slot(const std::string_view& key, _Fn fn) const
+{
+    // Kirsch-Mitzenmacher: k indices derived from two independent hashes are as good as k hashes.
+    uint64_t h1 = fnv1a(key);
+    uint64_t h2 = mix64(h1) | 1;
+    size_t nslots = m_counters.size();
+    for (size_t i = 0; i < m_hashes; ++i)
+        fn((size_t)((h1 + i * h2) % nslots));
+}
+
+// =================================================================================
+
+void fus::counting_bloom_filter::reset(size_t expected, double fpRate)
+{
+    expected = std::max(expected, (size_t)1);
+    fpRate = std::clamp(fpRate, 0.0001, 0.5);
+
+    // m = -n ln(p) / ln(2)^2, k = (m / n) ln(2)
+    size_t nslots = (size_t)std::ceil(-(double)expected * std::log(fpRate) / (s_ln2 * s_ln2));
+    m_hashes = std::max((size_t)1, (size_t)std::round(((double)nslots / (double)expected) * s_ln2));
+    m_counters.assign(nslots, 0);
+    m_size = 0;
+}
+
+size_t fus::counting_bloom_filter::capacity() const
+{
+    if (m_hashes == 0)
+        return 0;
+    return (size_t)(((double)m_counters.size() / (double)m_hashes) * s_ln2);
+}
+
+// =================================================================================
+
+void fus::counting_bloom_filter::add(const std::string_view& key)
+{
+    if (m_counters.empty())
+        return;
+
+    // Saturated counters stick so that a remove can never introduce a false negative.
+    for_each_slot(key, [this](size_t idx) {
+        if (m_counters[idx] != std::numeric_limits<uint8_t>::max())
+            m_counters[idx]++;
+    });
+    m_size++;
+}
+
+void fus::counting_bloom_filter::remove(const std::string_view& key)
+{
+    if (!maybe_contains(key))
+        return;
+
+    for_each_slot(key, [this](size_t idx) {
+        if (m_counters[idx] != std::numeric_limits<uint8_t>::max())
+            m_counters[idx]--;
+    });
+    m_size--;
+}
+
+bool fus::counting_bloom_filter::maybe_contains(const std::string_view& key) const
+{
+    // An unsized filter knows nothing, so everything might be present.
+    if (m_counters.empty())
+        return true;
+
+    bool result = true;
+    for_each_slot(key, [this, &result](size_t idx) {
+        if (m_counters[idx] == 0)
+            result = false;
+    });
+    return result;
+}
@@ -0,0 +1,69 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FUS_BLOOM_FILTER_H
+#define __FUS_BLOOM_FILTER_H
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace fus
+{
+    /**
+     * \brief A counting bloom filter.
+     * Answers set membership queries with no false negatives and a tunable false positive rate.
+     * Each slot is a small saturating counter rather than a single bit so that keys may be removed
+     * again. Keys are hashed bytewise -- any normalization (such as case folding) is the caller's
+     * responsibility.
+     */
+    class counting_bloom_filter
+    {
+        std::vector<uint8_t> m_counters;
+        size_t m_hashes;
+        size_t m_size;
+
+        template<typename _Fn>
+        void for_each_slot(const std::string_view& key, _Fn fn) const;
+
+    public:
+        counting_bloom_filter() : m_hashes(), m_size() { }
+        counting_bloom_filter(size_t expected, double fpRate=0.01) { reset(expected, fpRate); }
+
+        /** Discards all keys and resizes the filter for the expected number of keys. */
+        void reset(size_t expected, double fpRate=0.01);
+
+        void add(const std::string_view& key);
+        void remove(const std::string_view& key);
+
+        /**
+         * Tests whether or not a key may be in the set.
+         * \returns false if the key is definitely not present, true if it might be.
+         */
+        bool maybe_contains(const std::string_view& key) const;
+
+        /** Number of keys currently in the filter. */
+        size_t size() const { return m_size; }
+
+        /** Number of keys the filter can hold before exceeding its target false positive rate. */
+        size_t capacity() const;
+
+        /** Memory used by the filter's counters in bytes. */
+        size_t memsz() const { return m_counters.size(); }
+    };
+};
+
+#endif
@@ -15,6 +15,7 @@
  */
 
 #include "errors.h"
+#include "flight_recorder.h"
 
 #ifdef _MSC_VER
 #   include <crtdbg.h>
@@ -60,6 +61,7 @@ static fus::assert::handler_t s_assertHandler = _default_assert_handler;
 
 void fus::assert::handle(const char* cond, const char* file, int line, const char* msg)
 {
+    flight_record_assert(cond, file, line, msg);
     if (s_assertHandler)
         s_assertHandler(cond, file, line, msg);
 }
@@ -0,0 +1,270 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "flight_recorder.h"
+#include <fstream>
+#include <iterator>
+#include <new>
+
+#ifdef _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+// The ring lives in a file shared by whoever maps it, so the atomics must not need a lock.
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+// =================================================================================
+
+static std::atomic<fus::flight_header_t*> s_header = nullptr;
+static fus::flight_event_t* s_events = nullptr;
+static uint64_t s_mask = 0;
+static size_t s_mapsz = 0;
+static std::chrono::steady_clock::time_point s_start;
+
+#ifdef _WIN32
+static HANDLE s_file = INVALID_HANDLE_VALUE;
+static HANDLE s_mapping = nullptr;
+#endif
+
+// =================================================================================
+
+static void* map_file(const std::filesystem::path& path, size_t size)
+{
+#ifdef _WIN32
+    s_file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                         CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (s_file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    s_mapping = CreateFileMappingW(s_file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+                                   (DWORD)size, nullptr);
+    void* ptr = s_mapping ? MapViewOfFile(s_mapping, FILE_MAP_WRITE, 0, 0, size) : nullptr;
+    if (!ptr) {
+        if (s_mapping)
+            CloseHandle(s_mapping);
+        CloseHandle(s_file);
+        s_mapping = nullptr;
+        s_file = INVALID_HANDLE_VALUE;
+    }
+    return ptr;
+#else
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return nullptr;
+    void* ptr = nullptr;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED)
+            ptr = nullptr;
+    }
+    // The mapping keeps the file alive on its own.
+    close(fd);
+    return ptr;
+#endif
+}
+
+static void unmap_file(void* ptr, size_t size)
+{
+#ifdef _WIN32
+    FlushViewOfFile(ptr, 0);
+    UnmapViewOfFile(ptr);
+    CloseHandle(s_mapping);
+    CloseHandle(s_file);
+    s_mapping = nullptr;
+    s_file = INVALID_HANDLE_VALUE;
+#else
+    munmap(ptr, size);
+#endif
+}
+
+// =================================================================================
+
+static void record(fus::flight_header_t* header, fus::flight_event kind, uint64_t connId, uint16_t type,
+                   uint32_t arg)
+{
+    uint64_t seq = header->m_head.fetch_add(1, std::memory_order_relaxed);
+    fus::flight_event_t& event = s_events[seq & s_mask];
+    event.m_seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.m_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - s_start).count();
+    event.m_connId = connId;
+    event.m_kind = (uint16_t)kind;
+    event.m_type = type;
+    event.m_arg = arg;
+    event.m_seq.store(seq + 1, std::memory_order_release);
+}
+
+// =================================================================================
+
+bool fus::flight_recorder_open(const std::filesystem::path& path, size_t events)
+{
+    if (s_header.load(std::memory_order_relaxed) || events == 0)
+        return false;
+
+    size_t capacity = 1;
+    while (capacity < events)
+        capacity <<= 1;
+
+    // Whatever the last run left behind is the most interesting thing after a crash, so don't
+    // clobber it.
+    std::error_code error;
+    if (std::filesystem::exists(path, error)) {
+        std::filesystem::path previous = path;
+        previous += ".1";
+        std::filesystem::rename(path, previous, error);
+    }
+
+    size_t mapsz = sizeof(flight_header_t) + capacity * sizeof(flight_event_t);
+    void* ptr = map_file(path, mapsz);
+    if (!ptr)
+        return false;
+
+    // Fresh from ftruncate, so everything is already zeroed.
+    auto header = new(ptr) flight_header_t;
+    memcpy(header->m_magic, flight_magic, sizeof(header->m_magic));
+    header->m_version = flight_version;
+    header->m_capacity = (uint32_t)capacity;
+    header->m_startTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+#ifdef _WIN32
+    header->m_pid = GetCurrentProcessId();
+#else
+    header->m_pid = (uint32_t)getpid();
+#endif
+    header->m_head.store(0, std::memory_order_relaxed);
+
+    s_start = std::chrono::steady_clock::now();
+    s_events = (flight_event_t*)(header + 1);
+    s_mask = capacity - 1;
+    s_mapsz = mapsz;
+    s_header.store(header, std::memory_order_release);
+
+    record(header, flight_event::e_start, 0, 0, 0);
+    return true;
+}
+
+void fus::flight_recorder_close()
+{
+    // Recording threads may still be around, so this is only safe at exit.
+    flight_header_t* header = s_header.exchange(nullptr, std::memory_order_acq_rel);
+    if (!header)
+        return;
+
+    unmap_file(header, s_mapsz);
+    s_events = nullptr;
+}
+
+// =================================================================================
+
+void fus::flight_record(flight_event kind, uint64_t connId, uint16_t type, uint32_t arg)
+{
+    // Loaded once, so the header can't change out from under the rest of the record.
+    flight_header_t* header = s_header.load(std::memory_order_acquire);
+    if (header)
+        record(header, kind, connId, type, arg);
+}
+
+void fus::flight_record_assert(const char* cond, const char* file, int line, const char* msg)
+{
+    flight_header_t* header = s_header.load(std::memory_order_acquire);
+    if (!header)
+        return;
+
+    // Only the first assert is kept; anything after it is probably fallout.
+    if (header->m_assert[0] == 0) {
+        snprintf(header->m_assert, sizeof(header->m_assert), "%s:%d: %s%s%s", file, line, cond,
+                 msg ? " -- " : "", msg ? msg : "");
+    }
+    record(header, flight_event::e_assert, 0, 0, (uint32_t)line);
+}
+
+// =================================================================================
+
+bool fus::flight_recorder_read(const std::filesystem::path& path, flight_dump_t& dump)
+{
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    if (!stream.is_open())
+        return false;
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    if (buf.size() < sizeof(flight_header_t))
+        return false;
+
+    auto header = (const flight_header_t*)buf.data();
+    if (memcmp(header->m_magic, flight_magic, sizeof(flight_magic)) != 0 || header->m_version != flight_version)
+        return false;
+    uint64_t capacity = header->m_capacity;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        buf.size() < sizeof(flight_header_t) + capacity * sizeof(flight_event_t))
+        return false;
+
+    dump.m_startTime = header->m_startTime;
+    dump.m_pid = header->m_pid;
+    dump.m_capacity = header->m_capacity;
+    dump.m_recorded = header->m_head.load(std::memory_order_relaxed);
+    dump.m_assert.assign(header->m_assert, strnlen(header->m_assert, sizeof(header->m_assert)));
+
+    // Walk the slots in sequence order, starting from the oldest one that can still be there.
+    auto events = (const flight_event_t*)(header + 1);
+    uint64_t first = dump.m_recorded > capacity ? dump.m_recorded - capacity : 0;
+    dump.m_events.clear();
+    dump.m_events.reserve(dump.m_recorded - first);
+    for (uint64_t seq = first; seq < dump.m_recorded; ++seq) {
+        const flight_event_t& event = events[seq & (capacity - 1)];
+        if (event.m_seq.load(std::memory_order_relaxed) != seq + 1)
+            continue;
+
+        flight_entry_t& entry = dump.m_events.emplace_back();
+        entry.m_seq = seq;
+        entry.m_time = event.m_time;
+        entry.m_connId = event.m_connId;
+        entry.m_kind = (flight_event)event.m_kind;
+        entry.m_type = event.m_type;
+        entry.m_arg = event.m_arg;
+    }
+    return true;
+}
+
+const char* fus::flight_event_name(flight_event kind)
+{
+    static const char* s_names[] = {
+        "none",
+        "start",
+        "accept",
+        "close",
+        "dispatch",
+        "trans_start",
+        "trans_finish",
+        "handshake",
+        "handshake_failed",
+        "loop_lag",
+        "slow_callback",
+        "assert",
+    };
+    static_assert(std::size(s_names) == (size_t)flight_event::e_numEvents);
+
+    if ((size_t)kind < std::size(s_names))
+        return s_names[(size_t)kind];
+    return "unknown";
+}
@@ -0,0 +1,122 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_FLIGHT_RECORDER_H
+#define __FUS_FLIGHT_RECORDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fus
+{
+    enum class flight_event : uint16_t
+    {
+        e_none,
+        e_start,
+        e_accept,
+        e_close,
+        e_dispatch,
+        e_transStart,
+        e_transFinish,
+        e_handshake,
+        e_handshakeFailed,
+        e_loopLag,
+        e_slowCallback,
+        e_assert,
+
+        e_numEvents,
+    };
+
+    /**
+     * One slot in the ring. The sequence number is written last, so a slot whose sequence doesn't
+     * match its position was torn by a crash mid-write (or overwritten) and must be ignored.
+     */
+    struct flight_event_t
+    {
+        std::atomic<uint64_t> m_seq;
+        uint64_t m_time;
+        uint64_t m_connId;
+        uint16_t m_kind;
+        uint16_t m_type;
+        uint32_t m_arg;
+    };
+    static_assert(sizeof(flight_event_t) == 32);
+
+    /** The recorder file is this header followed by a power of two number of events. */
+    struct flight_header_t
+    {
+        char m_magic[8];
+        uint32_t m_version;
+        uint32_t m_capacity;
+        uint64_t m_startTime;
+        uint32_t m_pid;
+        uint32_t m_reserved;
+        std::atomic<uint64_t> m_head;
+        char m_assert[472];
+    };
+    static_assert(sizeof(flight_header_t) == 512);
+
+    constexpr char flight_magic[8] = { 'F', 'U', 'S', 'F', 'L', 'I', 'T', 'E' };
+    constexpr uint32_t flight_version = 1;
+
+    /**
+     * Maps the recorder file and starts recording into it. The file is shared memory, so whatever
+     * was recorded survives the process dying on an assert or a crash.
+     * \param events Ring capacity, rounded up to a power of two.
+     */
+    bool flight_recorder_open(const std::filesystem::path& path, size_t events);
+    void flight_recorder_close();
+
+    /**
+     * Appends an event to the ring. This is a handful of stores and safe to call from any thread.
+     * Nothing happens if the recorder isn't open.
+     */
+    void flight_record(flight_event kind, uint64_t connId=0, uint16_t type=0, uint32_t arg=0);
+
+    /** Saves the reason for an assert in the header, where the decoder will find it. */
+    void flight_record_assert(const char* cond, const char* file, int line, const char* msg);
+
+    struct flight_entry_t
+    {
+        uint64_t m_seq;
+        uint64_t m_time;
+        uint64_t m_connId;
+        flight_event m_kind;
+        uint16_t m_type;
+        uint32_t m_arg;
+    };
+
+    struct flight_dump_t
+    {
+        uint64_t m_startTime;
+        uint32_t m_pid;
+        uint32_t m_capacity;
+        uint64_t m_recorded;
+        std::string m_assert;
+        std::vector<flight_entry_t> m_events;
+    };
+
+    /** Reads a recorder file, returning the events still in the ring, oldest first. */
+    bool flight_recorder_read(const std::filesystem::path& path, flight_dump_t& dump);
+
+    const char* flight_event_name(flight_event kind);
+};
+
+#endif
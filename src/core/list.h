@@ -221,6 +221,9 @@ namespace fus
         bool empty() const;
         void clear();
 
+        /** Number of nodes in the list. This walks the entire list. */
+        size_t count() const;
+
         T* front();
         T* back();
         const T* front() const;
@@ -270,6 +273,15 @@ namespace fus
         return m_link.next() == nullptr;
     }
 
+    template<class T>
+    size_t list<T>::count() const
+    {
+        size_t result = 0;
+        for (const T* node = front(); node; node = next(node))
+            result++;
+        return result;
+    }
+
     template<class T>
     void list<T>::clear()
     {
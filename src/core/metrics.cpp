@@ -0,0 +1,297 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "errors.h"
+#include "metrics.h"
+#include <memory>
+#include <mutex>
+#include <string_theory/st_format.h>
+#include <string_theory/st_stringstream.h>
+
+// =================================================================================
+
+thread_local fus::metrics::shard_t* fus::metrics::t_shard = nullptr;
+
+namespace
+{
+    struct metric_def_t
+    {
+        ST::string m_name;
+        ST::string m_labels;
+        ST::string m_help;
+        fus::metric_sample_t::metric_type m_type;
+        uint32_t m_id;
+        fus::metric_gauge::gauge_fn m_gauge;
+    };
+
+    class metrics_registry
+    {
+        std::mutex m_lock;
+        std::vector<metric_def_t> m_defs;
+        std::vector<fus::metrics::shard_t*> m_shards;
+        uint32_t m_nextCounter;
+        uint32_t m_nextHistogram;
+
+        /** Everything recorded by threads that have since exited. */
+        std::unique_ptr<fus::metrics::shard_t> m_retired;
+
+    public:
+        metrics_registry() : m_nextCounter(), m_nextHistogram(), m_retired(new fus::metrics::shard_t()) { }
+
+        uint32_t add(fus::metric_sample_t::metric_type type, const char* name, const char* help,
+                     const std::vector<ST::string>& labels);
+        void add_gauge(const char* name, const char* help, const char* labels, fus::metric_gauge::gauge_fn fn);
+        void attach(fus::metrics::shard_t* shard);
+        void detach(fus::metrics::shard_t* shard);
+        std::vector<fus::metric_sample_t> snapshot();
+    };
+
+    struct shard_owner_t
+    {
+        std::unique_ptr<fus::metrics::shard_t> m_shard;
+        ~shard_owner_t();
+    };
+};
+
+static metrics_registry& registry()
+{
+    static metrics_registry s_registry;
+    return s_registry;
+}
+
+static thread_local shard_owner_t s_shardOwner;
+
+// =================================================================================
+
+static inline void merge(std::atomic<uint64_t>& dst, const std::atomic<uint64_t>& src)
+{
+    dst.store(dst.load(std::memory_order_relaxed) + src.load(std::memory_order_relaxed),
+              std::memory_order_relaxed);
+}
+
+uint32_t metrics_registry::add(fus::metric_sample_t::metric_type type, const char* name, const char* help,
+                               const std::vector<ST::string>& labels)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // The same metric may be defined in more than one place, eg by each db engine. A metric's
+    // definitions are added together, so every one of them must line up (and no more) for it to
+    // be the same one.
+    auto continues = [type, name](const metric_def_t& def, uint32_t id) {
+        return def.m_type == type && def.m_name == name && !def.m_gauge && def.m_id == id;
+    };
+    for (size_t i = 0; i + labels.size() <= m_defs.size(); ++i) {
+        uint32_t id = m_defs[i].m_id;
+        if (!continues(m_defs[i], id) || (i > 0 && id > 0 && continues(m_defs[i - 1], id - 1)))
+            continue;
+        bool same = true;
+        for (size_t j = 0; j < labels.size() && same; ++j)
+            same = continues(m_defs[i + j], id + (uint32_t)j) && m_defs[i + j].m_labels == labels[j];
+        size_t end = i + labels.size();
+        if (same && (end == m_defs.size() || !continues(m_defs[end], id + (uint32_t)labels.size())))
+            return id;
+    }
+
+    bool counter = type == fus::metric_sample_t::metric_type::e_counter;
+    uint32_t& next = counter ? m_nextCounter : m_nextHistogram;
+    size_t max = counter ? fus::metrics::max_counters : fus::metrics::max_histograms;
+    FUS_ASSERTD(next + labels.size() <= max);
+    if (next + labels.size() > max)
+        return (uint32_t)max;
+
+    uint32_t id = next;
+    next += (uint32_t)labels.size();
+    for (size_t i = 0; i < labels.size(); ++i)
+        m_defs.push_back({ name, labels[i], help, type, id + (uint32_t)i, nullptr });
+    return id;
+}
+
+void metrics_registry::add_gauge(const char* name, const char* help, const char* labels,
+                                 fus::metric_gauge::gauge_fn fn)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_defs.push_back({ name, labels ? labels : "", help, fus::metric_sample_t::metric_type::e_gauge, 0,
+                       std::move(fn) });
+}
+
+void metrics_registry::attach(fus::metrics::shard_t* shard)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_shards.push_back(shard);
+}
+
+void metrics_registry::detach(fus::metrics::shard_t* shard)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_shards.erase(std::remove(m_shards.begin(), m_shards.end(), shard), m_shards.end());
+
+    for (size_t i = 0; i < fus::metrics::max_counters; ++i)
+        merge(m_retired->m_counters[i], shard->m_counters[i]);
+    for (size_t i = 0; i < fus::metrics::max_histograms; ++i) {
+        auto& dst = m_retired->m_histograms[i];
+        const auto& src = shard->m_histograms[i];
+        for (size_t j = 0; j < fus::metrics::histogram_buckets; ++j)
+            merge(dst.m_buckets[j], src.m_buckets[j]);
+        merge(dst.m_sum, src.m_sum);
+        dst.m_max.store(std::max(dst.m_max.load(std::memory_order_relaxed),
+                                 src.m_max.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+    }
+}
+
+std::vector<fus::metric_sample_t> metrics_registry::snapshot()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    std::vector<const fus::metrics::shard_t*> shards(m_shards.begin(), m_shards.end());
+    shards.push_back(m_retired.get());
+
+    std::vector<fus::metric_sample_t> result;
+    result.reserve(m_defs.size());
+    for (const metric_def_t& def : m_defs) {
+        fus::metric_sample_t& sample = result.emplace_back();
+        sample.m_name = def.m_name;
+        sample.m_labels = def.m_labels;
+        sample.m_help = def.m_help;
+        sample.m_type = def.m_type;
+        sample.m_value = 0;
+        sample.m_sum = 0;
+        sample.m_max = 0;
+
+        if (def.m_type == fus::metric_sample_t::metric_type::e_counter) {
+            for (const fus::metrics::shard_t* shard : shards)
+                sample.m_value += shard->m_counters[def.m_id].load(std::memory_order_relaxed);
+        } else if (def.m_type == fus::metric_sample_t::metric_type::e_gauge) {
+            sample.m_value = def.m_gauge();
+        } else {
+            sample.m_buckets.resize(fus::metrics::histogram_buckets);
+            for (const fus::metrics::shard_t* shard : shards) {
+                const auto& histogram = shard->m_histograms[def.m_id];
+                for (size_t i = 0; i < fus::metrics::histogram_buckets; ++i) {
+                    uint64_t count = histogram.m_buckets[i].load(std::memory_order_relaxed);
+                    sample.m_buckets[i] += count;
+                    sample.m_value += count;
+                }
+                sample.m_sum += histogram.m_sum.load(std::memory_order_relaxed);
+                sample.m_max = std::max(sample.m_max, histogram.m_max.load(std::memory_order_relaxed));
+            }
+        }
+    }
+    return result;
+}
+
+shard_owner_t::~shard_owner_t()
+{
+    if (m_shard) {
+        fus::metrics::t_shard = nullptr;
+        registry().detach(m_shard.get());
+    }
+}
+
+// =================================================================================
+
+fus::metrics::shard_t* fus::metrics::attach_thread()
+{
+    // Value-initialization zeroes all of the atomics.
+    s_shardOwner.m_shard.reset(new shard_t());
+    t_shard = s_shardOwner.m_shard.get();
+    registry().attach(t_shard);
+    return t_shard;
+}
+
+uint64_t fus::metrics::histogram_bucket_max(size_t bucket)
+{
+    if (bucket < histogram_sub_buckets)
+        return bucket;
+    size_t exp = (bucket >> histogram_sub_bits) + histogram_sub_bits - 1;
+    uint64_t sub = histogram_sub_buckets + (bucket & (histogram_sub_buckets - 1));
+    uint64_t width = uint64_t(1) << (exp - histogram_sub_bits);
+    if (bucket == histogram_buckets - 1)
+        return UINT64_MAX;
+    return (sub * width) + width - 1;
+}
+
+// =================================================================================
+
+fus::metric_counter::metric_counter(const char* name, const char* help, const char* labels)
+{
+    m_id = registry().add(metric_sample_t::metric_type::e_counter, name, help, { labels ? labels : "" });
+}
+
+fus::metric_counter_set::metric_counter_set(const char* name, const char* help, const char* label, uint32_t count)
+    : m_count(count)
+{
+    std::vector<ST::string> labels;
+    labels.reserve(count + 1);
+    for (uint32_t i = 0; i < count; ++i)
+        labels.push_back(ST::format("{}=\"{}\"", label, i));
+    labels.push_back(ST::format("{}=\"other\"", label));
+    m_id = registry().add(metric_sample_t::metric_type::e_counter, name, help, labels);
+}
+
+fus::metric_gauge::metric_gauge(const char* name, const char* help, const char* labels, gauge_fn fn)
+{
+    registry().add_gauge(name, help, labels, std::move(fn));
+}
+
+fus::metric_histogram::metric_histogram(const char* name, const char* help, const char* labels)
+{
+    m_id = registry().add(metric_sample_t::metric_type::e_histogram, name, help, { labels ? labels : "" });
+}
+
+// =================================================================================
+
+uint64_t fus::metric_sample_t::percentile(double fraction) const
+{
+    if (m_value == 0)
+        return 0;
+
+    uint64_t target = std::max((uint64_t)1, (uint64_t)(m_value * fraction));
+    uint64_t count = 0;
+    for (size_t i = 0; i < m_buckets.size(); ++i) {
+        count += m_buckets[i];
+        if (count >= target)
+            return std::min(metrics::histogram_bucket_max(i), m_max);
+    }
+    return m_max;
+}
+
+std::vector<fus::metric_sample_t> fus::metrics_snapshot()
+{
+    return registry().snapshot();
+}
+
+ST::string fus::metrics_format(const std::vector<metric_sample_t>& samples, const ST::string& filter)
+{
+    ST::string_stream stream;
+    for (const metric_sample_t& sample : samples) {
+        if (!filter.empty() && sample.m_name.find(filter.c_str()) < 0)
+            continue;
+
+        stream << sample.m_name;
+        if (!sample.m_labels.empty())
+            stream << "{" << sample.m_labels << "}";
+        if (sample.m_type != metric_sample_t::metric_type::e_histogram) {
+            stream << " " << sample.m_value << "\n";
+        } else {
+            stream << " count=" << sample.m_value << " sum=" << sample.m_sum
+                   << " p50=" << sample.percentile(0.50) << " p90=" << sample.percentile(0.90)
+                   << " p99=" << sample.percentile(0.99) << " p999=" << sample.percentile(0.999)
+                   << " max=" << sample.m_max << "\n";
+        }
+    }
+    return stream.to_string();
+}
@@ -0,0 +1,215 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FUS_METRICS_H
+#define __FUS_METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string_theory/st_string.h>
+#include <vector>
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+namespace fus
+{
+    namespace metrics
+    {
+        constexpr size_t max_counters = 1024;
+        constexpr size_t max_histograms = 64;
+
+        /**
+         * Histograms are log-linear: each power of two is split into eight equal buckets, so a
+         * recorded value is off by no more than 12.5%. Values of 2^36 or more share the last bucket.
+         */
+        constexpr unsigned histogram_sub_bits = 3;
+        constexpr size_t histogram_sub_buckets = 1 << histogram_sub_bits;
+        constexpr size_t histogram_buckets = histogram_sub_buckets * (36 - histogram_sub_bits + 1);
+
+        /**
+         * Each thread that records anything gets its own copy of every metric, so recording is a
+         * plain add to memory no other thread writes to. Readers sum up the shards.
+         */
+        struct shard_t
+        {
+            std::atomic<uint64_t> m_counters[max_counters];
+            struct
+            {
+                std::atomic<uint64_t> m_buckets[histogram_buckets];
+                std::atomic<uint64_t> m_sum;
+                std::atomic<uint64_t> m_max;
+            } m_histograms[max_histograms];
+        };
+
+        extern thread_local shard_t* t_shard;
+        shard_t* attach_thread();
+
+        inline shard_t* shard()
+        {
+            shard_t* shard = t_shard;
+            return shard ? shard : attach_thread();
+        }
+
+        /** Only the owning thread writes to a shard, so there's no need for a locked add. */
+        inline void bump(std::atomic<uint64_t>& value, uint64_t n)
+        {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        inline unsigned log2(uint64_t value)
+        {
+#ifdef _MSC_VER
+            unsigned long result;
+            _BitScanReverse64(&result, value);
+            return (unsigned)result;
+#else
+            return 63 - (unsigned)__builtin_clzll(value);
+#endif
+        }
+
+        inline size_t histogram_bucket(uint64_t value)
+        {
+            if (value < histogram_sub_buckets)
+                return (size_t)value;
+            unsigned exp = log2(value);
+            size_t bucket = ((exp - histogram_sub_bits + 1) << histogram_sub_bits) +
+                            ((value >> (exp - histogram_sub_bits)) & (histogram_sub_buckets - 1));
+            return bucket < histogram_buckets ? bucket : histogram_buckets - 1;
+        }
+
+        /** Largest value that is counted in a given bucket. */
+        uint64_t histogram_bucket_max(size_t bucket);
+    };
+
+    // =================================================================================
+
+    class metric_counter
+    {
+        uint32_t m_id;
+
+    public:
+        metric_counter(const char* name, const char* help, const char* labels=nullptr);
+        metric_counter(const metric_counter&) = delete;
+        metric_counter(metric_counter&&) = delete;
+
+        void add(uint64_t n=1) const
+        {
+            if (m_id < metrics::max_counters)
+                metrics::bump(metrics::shard()->m_counters[m_id], n);
+        }
+    };
+
+    /**
+     * A family of counters indexed by a small integer, such as a message type. Anything beyond
+     * the expected range is counted in a final "other" counter.
+     */
+    class metric_counter_set
+    {
+        uint32_t m_id;
+        uint32_t m_count;
+
+    public:
+        metric_counter_set(const char* name, const char* help, const char* label, uint32_t count);
+        metric_counter_set(const metric_counter_set&) = delete;
+        metric_counter_set(metric_counter_set&&) = delete;
+
+        void add(uint32_t index, uint64_t n=1) const
+        {
+            if (m_id < metrics::max_counters)
+                metrics::bump(metrics::shard()->m_counters[m_id + std::min(index, m_count)], n);
+        }
+    };
+
+    class metric_histogram
+    {
+        uint32_t m_id;
+
+    public:
+        metric_histogram(const char* name, const char* help, const char* labels=nullptr);
+        metric_histogram(const metric_histogram&) = delete;
+        metric_histogram(metric_histogram&&) = delete;
+
+        void record(uint64_t value) const
+        {
+            if (m_id < metrics::max_histograms) {
+                auto& histogram = metrics::shard()->m_histograms[m_id];
+                metrics::bump(histogram.m_buckets[metrics::histogram_bucket(value)], 1);
+                metrics::bump(histogram.m_sum, value);
+                if (value > histogram.m_max.load(std::memory_order_relaxed))
+                    histogram.m_max.store(value, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    /**
+     * A value that is computed when a snapshot is taken rather than recorded as it changes, such
+     * as the number of clients connected to a daemon. The function is called on whichever thread
+     * takes the snapshot, with the metrics lock held -- so keep it quick.
+     */
+    class metric_gauge
+    {
+    public:
+        typedef std::function<uint64_t()> gauge_fn;
+
+        metric_gauge(const char* name, const char* help, const char* labels, gauge_fn fn);
+        metric_gauge(const metric_gauge&) = delete;
+        metric_gauge(metric_gauge&&) = delete;
+    };
+
+    // =================================================================================
+
+    struct metric_sample_t
+    {
+        enum class metric_type
+        {
+            e_counter,
+            e_gauge,
+            e_histogram,
+        };
+
+        ST::string m_name;
+        ST::string m_labels;
+        ST::string m_help;
+        metric_type m_type;
+
+        /** Value of a counter or gauge, or number of values recorded by a histogram */
+        uint64_t m_value;
+
+        // Histograms only
+        uint64_t m_sum;
+        uint64_t m_max;
+        std::vector<uint64_t> m_buckets;
+
+        /** Upper bound of the bucket the given fraction of recorded values fall into. */
+        uint64_t percentile(double fraction) const;
+    };
+
+    /** Takes a consistent-enough copy of every metric. Safe to call from any thread. */
+    std::vector<metric_sample_t> metrics_snapshot();
+
+    /**
+     * Formats a snapshot as lines of "name{labels} value" text. Histograms are summarized by
+     * their count, sum, and a few percentiles.
+     * \param filter Only metrics whose name contains this are included.
+     */
+    ST::string metrics_format(const std::vector<metric_sample_t>&, const ST::string& filter={});
+};
+
+#endif
@@ -18,6 +18,7 @@
 #include "daemon/daemon_base.h"
 #include "daemon/server.h"
 #include "core/errors.h"
+#include "core/metrics.h"
 #include <new>
 #include "protocol/common.h"
 
@@ -25,6 +26,9 @@
 
 fus::admin_daemon_t* s_adminDaemon = nullptr;
 
+static fus::metric_gauge s_clients("fus_daemon_clients", "Clients connected to the daemon", "daemon=\"admin\"",
+                                   []() { return (uint64_t)(s_adminDaemon ? s_adminDaemon->m_clients.count() : 0); });
+
 // =================================================================================
 
 bool fus::admin_daemon_init()
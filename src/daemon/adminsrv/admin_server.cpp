@@ -17,9 +17,11 @@
 #include "admin_private.h"
 #include "client/db_client.h"
 #include "core/errors.h"
+#include "core/metrics.h"
 #include "daemon/daemon_base.h"
 #include <new>
 #include <openssl/evp.h>
+#include "protocol/acct_batch.h"
 #include "protocol/admin.h"
 #include "protocol/db.h"
 
@@ -45,9 +47,9 @@ void fus::admin_server_free(fus::admin_server_t* client)
 static inline bool admin_check_read(fus::admin_server_t* client, ssize_t nread)
 {
     if (nread < 0) {
-        s_adminDaemon->m_log.write_debug("[{}]: Read failed: {}",
-                                         fus::tcp_stream_peeraddr(client),
-                                         uv_strerror(nread));
+        FUS_LOG_DEBUG(s_adminDaemon->m_log, "[{}]: Read failed: {}",
+                                            client,
+                                            uv_strerror(nread));
         fus::tcp_stream_shutdown(client);
         return false;
     }
@@ -117,8 +119,8 @@ static void admin_acctCreate(fus::admin_server_t* client, ssize_t nread, fus::pr
         fwd.set_flags(msg->get_flags());
         fus::tcp_stream_write_msg(s_adminDaemon->m_db, fwd);
     } else {
-        s_adminDaemon->m_log.write_error("[{}] Tried to create an account '{}', but the DBSrv is unavailable",
-                                         fus::tcp_stream_peeraddr(client), msg->get_name());
+        FUS_LOG_ERROR(s_adminDaemon->m_log, "[{}] Tried to create an account '{}', but the DBSrv is unavailable",
+                                            client, msg->get_name());
         fus::protocol::admin_acctCreateReply reply;
         reply.set_type(reply.id());
         reply.set_transId(msg->get_transId());
@@ -130,13 +132,97 @@ static void admin_acctCreate(fus::admin_server_t* client, ssize_t nread, fus::pr
     fus::admin_server_read(client);
 }
 
+static void admin_acctBatchCreated(fus::admin_server_t* client, fus::db_client_t* db, uint32_t transId,
+                                   fus::net_error result, ssize_t nread,
+                                   const fus::protocol::db_acctCreateBatchReply* reply)
+{
+    fus::protocol::admin_acctCreateBatchReply msg;
+    msg.set_type(msg.id());
+    msg.set_transId(transId);
+    msg.set_result((uint32_t)result);
+    if (reply) {
+        // The per-account results are in the same format on both protocols, so pass them along as-is.
+        msg.set_count(reply->get_count());
+        msg.set_resultssz(reply->get_resultssz());
+        fus::tcp_stream_write_msg(client, msg, reply->get_results(), reply->get_resultssz());
+    } else {
+        msg.set_count(0);
+        msg.set_resultssz(0);
+        fus::tcp_stream_write_msg(client, msg);
+    }
+}
+
+static void admin_acctBatchCreate(fus::admin_server_t* client, ssize_t nread,
+                                  fus::protocol::admin_acctCreateBatchRequest* msg)
+{
+    if (!admin_check_read(client, nread))
+        return;
+
+    fus::net_error result = fus::net_error::e_pending;
+    if (msg->get_count() == 0 || msg->get_count() > fus::protocol::acct_batch_max) {
+        FUS_LOG_ERROR(s_adminDaemon->m_log, "[{}] Tried to create a batch of {} accounts",
+                                            client, msg->get_count());
+        result = fus::net_error::e_invalidParameter;
+    } else if (!(s_adminDaemon->m_flags & fus::daemon_t::e_dbConnected)) {
+        FUS_LOG_ERROR(s_adminDaemon->m_log, "[{}] Tried to create {} accounts, but the DBSrv is unavailable",
+                                            client, msg->get_count());
+        result = fus::net_error::e_internalError;
+    }
+
+    if (result == fus::net_error::e_pending) {
+        // The records go to the database daemon untouched -- it validates them anyway.
+        fus::protocol::db_acctCreateBatchRequest fwd;
+        fwd.set_type(fwd.id());
+        fus::client_prep_trans(s_adminDaemon->m_db, fwd, client, msg->get_transId(),
+                               (fus::client_trans_cb)admin_acctBatchCreated);
+        fwd.set_count(msg->get_count());
+        fwd.set_recordssz(msg->get_recordssz());
+        fus::tcp_stream_write_msg(s_adminDaemon->m_db, fwd, msg->get_records(), msg->get_recordssz());
+    } else {
+        fus::protocol::admin_acctCreateBatchReply reply;
+        reply.set_type(reply.id());
+        reply.set_transId(msg->get_transId());
+        reply.set_result((uint32_t)result);
+        reply.set_count(0);
+        reply.set_resultssz(0);
+        fus::tcp_stream_write_msg(client, reply);
+    }
+
+    // Continue reading
+    fus::admin_server_read(client);
+}
+
+// =================================================================================
+
+static void admin_stats(fus::admin_server_t* client, ssize_t nread, fus::protocol::admin_statsRequest* msg)
+{
+    if (!admin_check_read(client, nread))
+        return;
+
+    std::string_view filter = msg->get_filter();
+    ST::string stats = fus::metrics_format(fus::metrics_snapshot(),
+                                           ST::string::from_utf8(filter.data(), filter.size()));
+
+    fus::protocol::admin_statsReply reply;
+    reply.set_type(reply.id());
+    reply.set_transId(msg->get_transId());
+    reply.set_result((uint32_t)fus::net_error::e_success);
+    reply.set_statssz((uint32_t)stats.size());
+    fus::tcp_stream_write_msg(client, reply, stats.c_str(), stats.size());
+
+    fus::admin_server_read(client);
+}
+
 // =================================================================================
 
+static fus::metric_counter_set s_adminMessages("fus_admin_messages_total", "Messages received by the admin daemon", "type", 64);
+
 static void admin_msg_pump(fus::admin_server_t* client, ssize_t nread, fus::protocol::common_msg_std_header* msg)
 {
     if (!admin_check_read(client, nread))
         return;
 
+    s_adminMessages.add(msg->get_type());
     switch (msg->get_type()) {
     case fus::protocol::admin_pingRequest::id():
         admin_read<fus::protocol::admin_pingRequest>(client, admin_pingpong);
@@ -147,6 +233,12 @@ static void admin_msg_pump(fus::admin_server_t* client, ssize_t nread, fus::prot
     case fus::protocol::admin_acctCreateRequest::id():
         admin_read<fus::protocol::admin_acctCreateRequest>(client, admin_acctCreate);
         break;
+    case fus::protocol::admin_acctCreateBatchRequest::id():
+        admin_read<fus::protocol::admin_acctCreateBatchRequest>(client, admin_acctBatchCreate);
+        break;
+    case fus::protocol::admin_statsRequest::id():
+        admin_read<fus::protocol::admin_statsRequest>(client, admin_stats);
+        break;
     default:
         s_adminDaemon->m_log.write_error("Received unimplemented message type 0x{04X} -- kicking client", msg->get_type());
         fus::tcp_stream_shutdown(client);
@@ -45,6 +45,17 @@ namespace fus
     void auth_daemon_shutdown();
 
     void auth_daemon_accept(auth_server_t*, const void*);
+
+    struct auth_acct_cache_stats_t
+    {
+        size_t m_entries;
+        size_t m_capacity;
+        uint64_t m_hits;
+        uint64_t m_misses;
+        uint64_t m_evictions;
+    };
+
+    bool auth_daemon_acct_cache_stats(auth_acct_cache_stats_t*);
 };
 
 #endif
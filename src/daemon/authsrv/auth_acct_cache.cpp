@@ -0,0 +1,109 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "auth_private.h"
+#include "core/errors.h"
+#include <cstring>
+
+// =================================================================================
+
+fus::auth_acct_cache::auth_acct_cache(size_t maxEntries, uint64_t ttlMs)
+    : m_maxEntries(maxEntries), m_ttl(ttlMs), m_hits(), m_misses(), m_evictions()
+{
+    m_entries.reserve(maxEntries);
+}
+
+fus::auth_acct_cache::~auth_acct_cache()
+{
+    clear();
+}
+
+// =================================================================================
+
+void fus::auth_acct_cache::erase(entrymap_t::iterator it)
+{
+    auth_acct_cache_entry_t* entry = it->second;
+    m_entries.erase(it);
+    delete entry;
+}
+
+const fus::auth_acct_cache_entry_t* fus::auth_acct_cache::find(const ST::string& name, uint64_t now)
+{
+    auto it = m_entries.find(name);
+    if (it == m_entries.end()) {
+        m_misses++;
+        return nullptr;
+    }
+
+    if (it->second->m_expires <= now) {
+        erase(it);
+        m_misses++;
+        return nullptr;
+    }
+
+    // Most recently used entries live at the back of the list.
+    m_lru.push_back(it->second);
+    m_hits++;
+    return it->second;
+}
+
+void fus::auth_acct_cache::insert(const ST::string& name, const void* hash, size_t hashsz,
+                                  const fus::uuid& uuid, uint32_t flags, uint64_t now)
+{
+    if (!enabled() || hashsz == 0)
+        return;
+    FUS_ASSERTD(hashsz <= sizeof(auth_acct_cache_entry_t::m_hash));
+
+    auth_acct_cache_entry_t* entry;
+    auto it = m_entries.find(name);
+    if (it != m_entries.end()) {
+        entry = it->second;
+    } else {
+        // Make room by tossing the least recently used account.
+        if (m_entries.size() >= m_maxEntries) {
+            auth_acct_cache_entry_t* lru = m_lru.front();
+            FUS_ASSERTD(lru);
+            erase(m_entries.find(lru->m_name));
+            m_evictions++;
+        }
+
+        entry = new auth_acct_cache_entry_t;
+        entry->m_name = name;
+        m_entries.emplace(name, entry);
+    }
+
+    entry->m_expires = now + m_ttl;
+    entry->m_uuid = uuid;
+    entry->m_flags = flags;
+    entry->m_hashsz = hashsz;
+    memcpy(entry->m_hash, hash, hashsz);
+    m_lru.push_back(entry);
+}
+
+void fus::auth_acct_cache::invalidate(const ST::string& name)
+{
+    auto it = m_entries.find(name);
+    if (it != m_entries.end())
+        erase(it);
+}
+
+void fus::auth_acct_cache::clear()
+{
+    // Entries unlink themselves from the LRU list upon destruction.
+    for (auto& it : m_entries)
+        delete it.second;
+    m_entries.clear();
+}
@@ -15,7 +15,9 @@
  */
 
 #include "auth_private.h"
+#include "client/db_client.h"
 #include "core/errors.h"
+#include "core/metrics.h"
 #include "daemon/server.h"
 #include <new>
 #include "protocol/common.h"
@@ -24,6 +26,29 @@
 
 fus::auth_daemon_t* s_authDaemon = nullptr;
 
+static fus::metric_gauge s_clients("fus_daemon_clients", "Clients connected to the daemon", "daemon=\"auth\"",
+                                   []() { return (uint64_t)(s_authDaemon ? s_authDaemon->m_clients.count() : 0); });
+
+// =================================================================================
+
+static void auth_acct_invalidated(fus::db_client_t* db, std::string_view name)
+{
+    s_authDaemon->m_acctCache.invalidate(ST::string::from_utf8(name.data(), name.size()));
+}
+
+static void auth_db_connected(fus::db_trans_daemon_t*)
+{
+    // Invalidations broadcast while we were cut off from the db never reached us.
+    s_authDaemon->m_acctCache.clear();
+}
+
+static void auth_throttle_rotate(uv_timer_t* timer)
+{
+    uint64_t now = uv_now(uv_default_loop());
+    s_authDaemon->m_nameThrottle.rotate(now);
+    s_authDaemon->m_addrThrottle.rotate(now);
+}
+
 // =================================================================================
 
 bool fus::auth_daemon_init()
@@ -33,6 +58,27 @@ bool fus::auth_daemon_init()
     s_authDaemon = (auth_daemon_t*)malloc(sizeof(auth_daemon_t));
     db_trans_daemon_init(s_authDaemon, ST_LITERAL("auth"));
     new(&s_authDaemon->m_clients) FUS_LIST_DECL(auth_server_t, m_link);
+    new(&s_authDaemon->m_hash) fus::hash(fus::hash_type::e_sha1);
+
+    const fus::config_parser& config = server::get()->config();
+    new(&s_authDaemon->m_acctCache) auth_acct_cache(config.get<unsigned int>("auth", "acct_cache_size"),
+                                                    config.get<unsigned int>("auth", "acct_cache_ttl") * 1000);
+    db_client_acct_invalidate_handler(s_authDaemon->m_db, auth_acct_invalidated);
+    db_trans_daemon_connected_handler(s_authDaemon, auth_db_connected);
+
+    uv_loop_t* loop = uv_default_loop();
+    size_t throttleSlots = config.get<unsigned int>("auth", "login_fail_slots");
+    uint64_t throttleWindow = config.get<unsigned int>("auth", "login_fail_window") * 1000;
+    new(&s_authDaemon->m_nameThrottle) auth_login_throttle(throttleSlots, throttleWindow,
+                                                           config.get<unsigned int>("auth", "login_fail_name_limit"),
+                                                           uv_now(loop));
+    new(&s_authDaemon->m_addrThrottle) auth_login_throttle(throttleSlots, throttleWindow,
+                                                           config.get<unsigned int>("auth", "login_fail_addr_limit"),
+                                                           uv_now(loop));
+    uv_timer_init(loop, &s_authDaemon->m_throttleTimer);
+    uv_timer_start(&s_authDaemon->m_throttleTimer, auth_throttle_rotate, s_authDaemon->m_nameThrottle.window(),
+                   s_authDaemon->m_nameThrottle.window());
+    uv_unref((uv_handle_t*)&s_authDaemon->m_throttleTimer);
 
     return true;
 }
@@ -54,6 +100,10 @@ void fus::auth_daemon_free()
 {
     FUS_ASSERTD(s_authDaemon);
 
+    s_authDaemon->m_addrThrottle.~auth_login_throttle();
+    s_authDaemon->m_nameThrottle.~auth_login_throttle();
+    s_authDaemon->m_acctCache.~auth_acct_cache();
+    s_authDaemon->m_hash.~hash();
     s_authDaemon->m_clients.~list_declare();
     db_trans_daemon_free(s_authDaemon);
     free(s_authDaemon);
@@ -64,6 +114,8 @@ void fus::auth_daemon_shutdown()
 {
     FUS_ASSERTD(s_authDaemon);
     db_trans_daemon_shutdown(s_authDaemon);
+    uv_timer_stop(&s_authDaemon->m_throttleTimer);
+    uv_close((uv_handle_t*)&s_authDaemon->m_throttleTimer, nullptr);
 
     // Clients will be removed from the list by auth_server_free
     auto it = s_authDaemon->m_clients.front();
@@ -73,6 +125,20 @@ void fus::auth_daemon_shutdown()
     }
 }
 
+bool fus::auth_daemon_acct_cache_stats(fus::auth_acct_cache_stats_t* stats)
+{
+    if (!s_authDaemon)
+        return false;
+
+    const auth_acct_cache& cache = s_authDaemon->m_acctCache;
+    stats->m_entries = cache.size();
+    stats->m_capacity = cache.capacity();
+    stats->m_hits = cache.hits();
+    stats->m_misses = cache.misses();
+    stats->m_evictions = cache.evictions();
+    return true;
+}
+
 // =================================================================================
 
 static void auth_connection_encrypted(fus::auth_server_t* client, ssize_t result)
@@ -0,0 +1,83 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "auth_private.h"
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+// =================================================================================
+
+fus::auth_login_throttle::auth_login_throttle(size_t slots, uint64_t windowMs, uint32_t limit, uint64_t now)
+    : m_curr(limit ? slots : 0), m_prev(limit ? slots : 0), m_windowStart(now),
+      m_window(std::max(windowMs, (uint64_t)1)), m_limit(limit)
+{
+}
+
+// =================================================================================
+
+template<typename _Fn>
+void fus::auth_login_throttle::for_each_slot(const std::string_view& key, _Fn fn) const
+{
+    // Two independent slots per key -- an innocent key is only throttled if both of its slots
+    // collide with noisy keys.
+    uint64_t h1 = std::hash<std::string_view>()(key);
+    uint64_t h2 = h1 * 0x9E3779B97F4A7C15ULL;
+    h2 ^= h2 >> 32;
+    fn((size_t)(h1 % m_curr.size()));
+    fn((size_t)(h2 % m_curr.size()));
+}
+
+// =================================================================================
+
+void fus::auth_login_throttle::fail(const std::string_view& key)
+{
+    if (!enabled() || key.empty())
+        return;
+
+    for_each_slot(key, [this](size_t idx) {
+        if (m_curr[idx] != std::numeric_limits<uint16_t>::max())
+            m_curr[idx]++;
+    });
+}
+
+bool fus::auth_login_throttle::throttled(const std::string_view& key, uint64_t now) const
+{
+    if (!enabled() || key.empty())
+        return false;
+
+    // Sliding window approximation: the previous window's count is weighted by how much of it
+    // still overlaps a window ending now.
+    uint64_t elapsed = std::min(now - std::min(now, m_windowStart), m_window);
+    uint64_t remaining = m_window - elapsed;
+
+    uint64_t estimate = std::numeric_limits<uint64_t>::max();
+    for_each_slot(key, [&](size_t idx) {
+        uint64_t count = (uint64_t)m_curr[idx] + (((uint64_t)m_prev[idx] * remaining) / m_window);
+        estimate = std::min(estimate, count);
+    });
+    return estimate >= m_limit;
+}
+
+void fus::auth_login_throttle::rotate(uint64_t now)
+{
+    // If we somehow slept through an entire window, the current counts are stale, too.
+    if (now - std::min(now, m_windowStart) >= m_window * 2)
+        std::fill(m_curr.begin(), m_curr.end(), 0);
+    m_prev.swap(m_curr);
+    std::fill(m_curr.begin(), m_curr.end(), 0);
+    m_windowStart = now;
+}
@@ -18,13 +18,113 @@
 #define __FUS_AUTH_DAEMON_PRIVATE_H
 
 #include "auth.h"
+#include "core/uuid.h"
 #include "daemon/daemon_base.h"
+#include "io/hash.h"
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace fus
 {
+    struct auth_acct_cache_entry_t
+    {
+        FUS_LIST_LINK(auth_acct_cache_entry_t) m_link;
+
+        ST::string m_name;
+        uint64_t m_expires;
+        fus::uuid m_uuid;
+        uint32_t m_flags;
+        size_t m_hashsz;
+        uint8_t m_hash[64];
+    };
+
+    /**
+     * \brief LRU cache of account credentials that the auth daemon can verify logins against.
+     * Entries are populated from successful database authentications and are discarded when they
+     * expire, when the cache exceeds its size budget, or when the database tells us the account
+     * has changed.
+     */
+    class auth_acct_cache
+    {
+        typedef std::unordered_map<ST::string, auth_acct_cache_entry_t*,
+                                   ST::hash_i, ST::equal_i> entrymap_t;
+
+        FUS_LIST_DECL(auth_acct_cache_entry_t, m_link) m_lru;
+        entrymap_t m_entries;
+        size_t m_maxEntries;
+        uint64_t m_ttl;
+
+        uint64_t m_hits;
+        uint64_t m_misses;
+        uint64_t m_evictions;
+
+        void erase(entrymap_t::iterator it);
+
+    public:
+        auth_acct_cache(size_t maxEntries, uint64_t ttlMs);
+        auth_acct_cache(const auth_acct_cache&) = delete;
+        auth_acct_cache(auth_acct_cache&&) = delete;
+        ~auth_acct_cache();
+
+        const auth_acct_cache_entry_t* find(const ST::string& name, uint64_t now);
+        void insert(const ST::string& name, const void* hash, size_t hashsz, const fus::uuid& uuid,
+                    uint32_t flags, uint64_t now);
+        void invalidate(const ST::string& name);
+        void clear();
+
+        bool enabled() const { return m_maxEntries != 0; }
+        size_t size() const { return m_entries.size(); }
+        size_t capacity() const { return m_maxEntries; }
+        uint64_t hits() const { return m_hits; }
+        uint64_t misses() const { return m_misses; }
+        uint64_t evictions() const { return m_evictions; }
+    };
+
+    /**
+     * \brief Approximate sliding window counters of failed logins.
+     * Counts live in fixed-size tables indexed by hash (a count-min sketch), so memory use does not
+     * grow no matter how many distinct names or addresses an attacker throws at us. Each table
+     * covers one window, and rotating the tables expires every counter at once.
+     */
+    class auth_login_throttle
+    {
+        std::vector<uint16_t> m_curr;
+        std::vector<uint16_t> m_prev;
+        uint64_t m_windowStart;
+        uint64_t m_window;
+        uint32_t m_limit;
+
+        template<typename _Fn>
+        void for_each_slot(const std::string_view& key, _Fn fn) const;
+
+    public:
+        auth_login_throttle(size_t slots, uint64_t windowMs, uint32_t limit, uint64_t now);
+        auth_login_throttle(const auth_login_throttle&) = delete;
+        auth_login_throttle(auth_login_throttle&&) = delete;
+
+        /** Records a failed login attempt for this key. */
+        void fail(const std::string_view& key);
+
+        /** Tests whether or not the key has exceeded the failed login limit. */
+        bool throttled(const std::string_view& key, uint64_t now) const;
+
+        /** Starts a new window, forgetting everything older than the previous one. */
+        void rotate(uint64_t now);
+
+        bool enabled() const { return m_limit != 0 && !m_curr.empty(); }
+        uint64_t window() const { return m_window; }
+    };
+
     struct auth_daemon_t : public db_trans_daemon_t
     {
         FUS_LIST_DECL(auth_server_t, m_link) m_clients;
+        fus::hash m_hash;
+        auth_acct_cache m_acctCache;
+
+        auth_login_throttle m_nameThrottle;
+        auth_login_throttle m_addrThrottle;
+        uv_timer_t m_throttleTimer;
     };
 };
 
@@ -17,6 +17,8 @@
 #include "auth_private.h"
 #include "client/db_client.h"
 #include "core/errors.h"
+#include "core/metrics.h"
+#include <cstring>
 #include "daemon/daemon_base.h"
 #include <new>
 #include <openssl/rand.h>
@@ -46,9 +48,9 @@ void fus::auth_server_free(fus::auth_server_t* client)
 static inline bool auth_check_read(fus::auth_server_t* client, ssize_t nread)
 {
     if (nread < 0) {
-        s_authDaemon->m_log.write_debug("[{}] Read failed: {}",
-                                        fus::tcp_stream_peeraddr(client),
-                                        uv_strerror(nread));
+        FUS_LOG_DEBUG(s_authDaemon->m_log, "[{}] Read failed: {}",
+                                           client,
+                                           uv_strerror(nread));
         fus::tcp_stream_shutdown(client);
         return false;
     }
@@ -92,15 +94,64 @@ static void auth_registerClient(fus::auth_server_t* client, ssize_t nread, fus::
 
 // =================================================================================
 
+static fus::metric_counter s_loginsThrottled("fus_auth_logins_throttled_total", "Logins refused for too many recent failures");
+
+static inline std::string_view auth_peer_addr(const fus::auth_server_t* client)
+{
+    // Only the address itself matters -- the port changes with every connection.
+    const sockaddr* addr = fus::tcp_stream_peer(client);
+    if (addr->sa_family == AF_INET)
+        return std::string_view((const char*)&((const sockaddr_in*)addr)->sin_addr, sizeof(in_addr));
+    if (addr->sa_family == AF_INET6)
+        return std::string_view((const char*)&((const sockaddr_in6*)addr)->sin6_addr, sizeof(in6_addr));
+    return std::string_view();
+}
+
+static inline ST::string auth_throttle_name(const std::string_view& name)
+{
+    // Account names are case insensitive.
+    return ST::string::from_utf8(name.data(), name.size()).to_lower();
+}
+
+static void auth_login_failed(fus::auth_server_t* client, const std::string_view& name)
+{
+    ST::string nameKey = auth_throttle_name(name);
+    s_authDaemon->m_nameThrottle.fail(std::string_view(nameKey.c_str(), nameKey.size()));
+    s_authDaemon->m_addrThrottle.fail(auth_peer_addr(client));
+}
+
+static bool auth_login_throttled(fus::auth_server_t* client, const ST::string& name)
+{
+    uint64_t now = uv_now(uv_default_loop());
+    ST::string nameKey = name.to_lower();
+    if (s_authDaemon->m_nameThrottle.throttled(std::string_view(nameKey.c_str(), nameKey.size()), now))
+        return true;
+    return s_authDaemon->m_addrThrottle.throttled(auth_peer_addr(client), now);
+}
+
+// =================================================================================
+
 static void auth_acctLoginAuthed(fus::auth_server_t* client, fus::db_client_t* db, uint32_t transId,
                                  fus::net_error result, ssize_t nread, const fus::protocol::db_acctAuthReply* reply)
 {
+    // The transaction may have been killed, in which case there is no reply.
+    std::string_view name = reply ? reply->get_name() : std::string_view();
     if (result == fus::net_error::e_success)
-        s_authDaemon->m_log.write_debug("[{}] Account Login '{}': {}", fus::tcp_stream_peeraddr(client),
-                                        reply->get_name(), fus::net_error_string(result));
+        FUS_LOG_DEBUG(s_authDaemon->m_log, "[{}] Account Login '{}': {}", client,
+                                           name, fus::net_error_string(result));
     else
-        s_authDaemon->m_log.write_error("[{}] Account Login '{}': {}", fus::tcp_stream_peeraddr(client),
-                                        reply->get_name(), fus::net_error_string(result));
+        FUS_LOG_ERROR(s_authDaemon->m_log, "[{}] Account Login '{}': {}", client,
+                                           name, fus::net_error_string(result));
+
+    // Remember these credentials so a quick reconnect doesn't need to bother the database.
+    if (result == fus::net_error::e_success) {
+        s_authDaemon->m_acctCache.insert(ST::string::from_utf8(name.data(), name.size()),
+                                         reply->get_hash(), std::min(reply->get_hashlen(), reply->get_hashsz()),
+                                         *reply->get_uuid(), reply->get_flags(),
+                                         uv_now(uv_default_loop()));
+    } else if (result == fus::net_error::e_authenticationFailed || result == fus::net_error::e_accountNotFound) {
+        auth_login_failed(client, name);
+    }
 
     // TODO: this needs to request the account's players from the database
     fus::protocol::auth_acctLoginReply msg;
@@ -115,6 +166,43 @@ static void auth_acctLoginAuthed(fus::auth_server_t* client, fus::db_client_t* d
     fus::tcp_stream_write_msg(client, msg);
 }
 
+static bool auth_acctLoginCached(fus::auth_server_t* client, fus::protocol::auth_acctLoginRequest* msg)
+{
+    std::u16string_view name = msg->get_name();
+    ST::string acctName = ST::string::from_utf16(name.data(), name.size());
+    const fus::auth_acct_cache_entry_t* entry = s_authDaemon->m_acctCache.find(acctName, uv_now(uv_default_loop()));
+    if (!entry)
+        return false;
+
+    size_t hashbufsz = s_authDaemon->m_hash.digestsz();
+    if (hashbufsz != msg->get_hashsz() || entry->m_hashsz < hashbufsz)
+        return false;
+
+    void* hashbuf = alloca(hashbufsz);
+    s_authDaemon->m_hash.hash_login(entry->m_hash, entry->m_hashsz, msg->get_challenge(),
+                                    client->m_srvChallenge, hashbuf, hashbufsz);
+
+    // A mismatch might just mean that the password changed and we missed the memo. The database
+    // is the final authority, so let it decide.
+    if (memcmp(hashbuf, msg->get_hash(), hashbufsz) != 0) {
+        s_authDaemon->m_acctCache.invalidate(acctName);
+        return false;
+    }
+
+    FUS_LOG_DEBUG(s_authDaemon->m_log, "[{}] Account Login '{}': {} (cached)", client,
+                                       acctName, fus::net_error_string(fus::net_error::e_success));
+
+    fus::protocol::auth_acctLoginReply reply;
+    reply.set_type(reply.id());
+    reply.set_transId(msg->get_transId());
+    reply.set_result((uint32_t)fus::net_error::e_success);
+    *reply.get_uuid() = entry->m_uuid;
+    reply.set_flags(entry->m_flags);
+    // TOOD: billingtype, droidkey
+    fus::tcp_stream_write_msg(client, reply);
+    return true;
+}
+
 static void auth_acctLogin(fus::auth_server_t* client, ssize_t nread, fus::protocol::auth_acctLoginRequest* msg)
 {
     if (!auth_check_read(client, nread))
@@ -123,25 +211,35 @@ static void auth_acctLogin(fus::auth_server_t* client, ssize_t nread, fus::proto
     fus::net_error result = fus::net_error::e_pending;
     do {
         if (!(client->m_flags & e_clientRegistered)) {
-            s_authDaemon->m_log.write_debug("[{}] Account Login: wants to login as '{}' but has not registered",
-                                            fus::tcp_stream_peeraddr(client), msg->get_name());
+            FUS_LOG_DEBUG(s_authDaemon->m_log, "[{}] Account Login: wants to login as '{}' but has not registered",
+                                               client, msg->get_name());
             result = fus::net_error::e_disconnected;
             break;
         }
 
         if (client->m_flags & e_acctLoggedIn || client->m_flags & e_acctLoginInProgress) {
-            s_authDaemon->m_log.write_debug("[{}] Account Login: sent a dupe login request as '{}'",
-                                            fus::tcp_stream_peeraddr(client), msg->get_name());
+            FUS_LOG_DEBUG(s_authDaemon->m_log, "[{}] Account Login: sent a dupe login request as '{}'",
+                                               client, msg->get_name());
             result = fus::net_error::e_disconnected;
             break;
         }
 
         if (!(s_authDaemon->m_flags & fus::daemon_t::e_dbConnected)) {
-            s_authDaemon->m_log.write_error("[{}] Account Login: dbsrv unavailable for login request '{}'",
-                                            fus::tcp_stream_peeraddr(client), msg->get_name());
+            FUS_LOG_ERROR(s_authDaemon->m_log, "[{}] Account Login: dbsrv unavailable for login request '{}'",
+                                               client, msg->get_name());
             result = fus::net_error::e_internalError;
             break;
         }
+
+        // Refuse password guessers before they cost us a hash and a database round trip.
+        std::u16string_view name = msg->get_name();
+        if (auth_login_throttled(client, ST::string::from_utf16(name.data(), name.size()))) {
+            FUS_LOG_DEBUG(s_authDaemon->m_log, "[{}] Account Login: too many failed logins for '{}'",
+                                               client, msg->get_name());
+            s_loginsThrottled.add();
+            result = fus::net_error::e_tooManyFailedLogins;
+            break;
+        }
     } while(0);
 
 
@@ -153,7 +251,7 @@ static void auth_acctLogin(fus::auth_server_t* client, ssize_t nread, fus::proto
         fus::tcp_stream_write_msg(client, reply);
         if (result == fus::net_error::e_disconnected)
             fus::tcp_stream_shutdown(client);
-    } else {
+    } else if (!auth_acctLoginCached(client, msg)) {
         fus::protocol::db_acctAuthRequest fwd;
         fwd.set_type(fwd.id());
         fus::client_prep_trans(s_authDaemon->m_db, fwd, client, msg->get_transId(),
@@ -171,11 +269,55 @@ static void auth_acctLogin(fus::auth_server_t* client, ssize_t nread, fus::proto
 
 // =================================================================================
 
+static void auth_accountExistsReply(fus::auth_server_t* client, fus::db_client_t* db, uint32_t transId,
+                                    fus::net_error result, ssize_t nread, const fus::protocol::db_acctExistsReply* reply)
+{
+    fus::protocol::auth_accountExistsReply msg;
+    msg.set_type(msg.id());
+    msg.set_transId(transId);
+    msg.set_result((uint32_t)result);
+    msg.set_exists(reply ? reply->get_exists() : 0);
+    fus::tcp_stream_write_msg(client, msg);
+}
+
+static void auth_accountExists(fus::auth_server_t* client, ssize_t nread, fus::protocol::auth_accountExistsRequest* msg)
+{
+    if (!auth_check_read(client, nread))
+        return;
+
+    if (!(s_authDaemon->m_flags & fus::daemon_t::e_dbConnected)) {
+        FUS_LOG_ERROR(s_authDaemon->m_log, "[{}] Account Exists: dbsrv unavailable for request '{}'",
+                                           client, msg->get_name());
+
+        fus::protocol::auth_accountExistsReply reply;
+        reply.set_type(reply.id());
+        reply.set_transId(msg->get_transId());
+        reply.set_result((uint32_t)fus::net_error::e_internalError);
+        reply.set_exists(0);
+        fus::tcp_stream_write_msg(client, reply);
+    } else {
+        fus::protocol::db_acctExistsRequest fwd;
+        fwd.set_type(fwd.id());
+        fus::client_prep_trans(s_authDaemon->m_db, fwd, client, msg->get_transId(),
+                               (fus::client_trans_cb)auth_accountExistsReply);
+        fwd.set_name(msg->get_name());
+        fus::tcp_stream_write_msg(s_authDaemon->m_db, fwd);
+    }
+
+    // Continue reading
+    fus::auth_server_read(client);
+}
+
+// =================================================================================
+
+static fus::metric_counter_set s_authMessages("fus_auth_messages_total", "Messages received by the auth daemon", "type", 64);
+
 static void auth_msg_pump(fus::auth_server_t* client, ssize_t nread, fus::protocol::common_msg_std_header* msg)
 {
     if (!auth_check_read(client, nread))
         return;
 
+    s_authMessages.add(msg->get_type());
     switch (msg->get_type()) {
     case fus::protocol::auth_pingRequest::id():
         auth_read<fus::protocol::auth_pingRequest>(client, auth_pingpong);
@@ -186,9 +328,12 @@ static void auth_msg_pump(fus::auth_server_t* client, ssize_t nread, fus::protoc
     case fus::protocol::auth_acctLoginRequest::id():
         auth_read<fus::protocol::auth_acctLoginRequest>(client, auth_acctLogin);
         break;
+    case fus::protocol::auth_accountExistsRequest::id():
+        auth_read<fus::protocol::auth_accountExistsRequest>(client, auth_accountExists);
+        break;
     default:
-        s_authDaemon->m_log.write_error("[{}] Received unimplemented message type 0x{04X} -- kicking client",
-                                        fus::tcp_stream_peeraddr(client), msg->get_type());
+        FUS_LOG_ERROR(s_authDaemon->m_log, "[{}] Received unimplemented message type 0x{04X} -- kicking client",
+                                           client, msg->get_type());
         fus::tcp_stream_shutdown(client);
         break;
     }
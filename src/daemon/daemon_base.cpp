@@ -144,12 +144,14 @@ void fus::secure_daemon_encrypt_stream(fus::secure_daemon_t* daemon, fus::crypt_
 
 static void db_connected(fus::db_client_t* db, ssize_t status)
 {
-    ST::string addr = fus::tcp_stream_peeraddr(db);
-    fus::daemon_t* daemon = (fus::daemon_t*)uv_handle_get_data((uv_handle_t*)db);
+    const char* addr = fus::tcp_stream_peeraddr(db);
+    fus::db_trans_daemon_t* daemon = (fus::db_trans_daemon_t*)uv_handle_get_data((uv_handle_t*)db);
 
     if (status == 0) {
         daemon->m_log.write_error("DB '{}' connection established!", addr);
         daemon->m_flags |= fus::daemon_t::e_dbConnected;
+        if (daemon->m_dbConnectedcb)
+            daemon->m_dbConnectedcb(daemon);
     } else if (daemon->m_flags & fus::daemon_t::e_shuttingDown) {
         daemon->m_log.write_info("DB '{}' connection abandoned", addr);
     } else {
@@ -166,7 +168,6 @@ static void db_disconnected(fus::db_client_t* db)
         daemon->m_log.write_info("DB connection shutdown");
         daemon->m_db = nullptr;
     } else {
-        ST::string addr = fus::tcp_stream_peeraddr(db);
         daemon->m_log.write_error("DB '{}' connection lost, reconnecting in 5s...",
                                   fus::tcp_stream_peeraddr(db));
         fus::client_reconnect(db, 5000);
@@ -180,6 +181,7 @@ void fus::db_trans_daemon_init(fus::db_trans_daemon_t* daemon, const ST::string&
 {
     secure_daemon_init(daemon, srv);
 
+    daemon->m_dbConnectedcb = nullptr;
     daemon->m_db = (db_client_t*)malloc(sizeof(db_client_t));
     FUS_ASSERTD(db_client_init(daemon->m_db, uv_default_loop()) == 0);
     uv_handle_set_data((uv_handle_t*)daemon->m_db, daemon);
@@ -204,6 +206,11 @@ void fus::db_trans_daemon_init(fus::db_trans_daemon_t* daemon, const ST::string&
     }
 }
 
+void fus::db_trans_daemon_connected_handler(fus::db_trans_daemon_t* daemon, fus::db_trans_connected_cb cb)
+{
+    daemon->m_dbConnectedcb = cb;
+}
+
 void fus::db_trans_daemon_free(fus::db_trans_daemon_t* daemon)
 {
     secure_daemon_free(daemon);
@@ -69,12 +69,22 @@ namespace fus
     void secure_daemon_encrypt_stream(secure_daemon_t*, crypt_stream_t*, crypt_established_cb=nullptr);
     void secure_daemon_shutdown(secure_daemon_t*);
 
+    struct db_trans_daemon_t;
+    typedef void (*db_trans_connected_cb)(db_trans_daemon_t*);
+
     struct db_trans_daemon_t : public secure_daemon_t
     {
         db_client_t* m_db;
+        db_trans_connected_cb m_dbConnectedcb;
     };
 
     void db_trans_daemon_init(db_trans_daemon_t*, const ST::string&);
+
+    /**
+     * Sets a callback run each time the db connection is (re)established. Anything broadcast by
+     * the db daemon while the connection was down has been missed by then.
+     */
+    void db_trans_daemon_connected_handler(db_trans_daemon_t*, db_trans_connected_cb cb=nullptr);
     void db_trans_daemon_free(db_trans_daemon_t*);
     void db_trans_daemon_shutdown(db_trans_daemon_t*);
 };
@@ -43,6 +43,62 @@ namespace fus
                        "    - debug: Highest level of verbosity.\n"
                        "    - info: Normal level of verbosity.\n"
                        "    - error: Lowest level of verbosity.")
+        FUS_CONFIG_INT("log", "buffer_size", 1024,
+                       "Log Buffer Size\n"
+                       "Size, in KiB, of the buffer each thread queues log messages in. If the\n"
+                       "log writer falls this far behind, messages are dropped and counted.")
+        FUS_CONFIG_INT("log", "rotate_size", 64,
+                       "Log Rotation Size\n"
+                       "Size, in MiB, a log file may grow to before it is rotated. 0 disables this.")
+        FUS_CONFIG_INT("log", "rotate_interval", 24,
+                       "Log Rotation Interval\n"
+                       "Hours a log file may be written to before it is rotated. 0 disables this.")
+        FUS_CONFIG_INT("log", "rotate_keep", 5,
+                       "Log Rotation Count\n"
+                       "Number of old log files to keep around. The previous run's log is also\n"
+                       "rotated out when the server starts.")
+        FUS_CONFIG_BOOL("log", "binary", false,
+                        "Binary Logs\n"
+                        "Writes logs as compact binary .blog files instead of text. Hot path\n"
+                        "messages are stored unformatted; read the logs with fus_logdecode.")
+
+        FUS_CONFIG_INT("loop", "slow_callback_ms", 50,
+                       "Slow Callback Threshold\n"
+                       "Milliseconds a single network or database callback may block the event loop before it is\n"
+                       "logged as slow. Set this to 0 to disable these reports.")
+
+        FUS_CONFIG_INT("budget", "window", 10,
+                       "Connection Budget Window\n"
+                       "Seconds over which each client connection's resource use is measured against the budgets below")
+        FUS_CONFIG_INT("budget", "cpu_ms", 0,
+                       "Connection CPU Budget\n"
+                       "Milliseconds of read, decrypt and handler time a connection may use per window before it is kicked.\n"
+                       "Set this to 0 to disable this limit.")
+        FUS_CONFIG_INT("budget", "recv_kib", 0,
+                       "Connection Receive Budget\n"
+                       "KiB a connection may send us per window before it is kicked. Set this to 0 to disable this limit.")
+        FUS_CONFIG_INT("budget", "messages", 0,
+                       "Connection Message Budget\n"
+                       "Messages a connection may send us per window before it is kicked. Set this to 0 to disable this limit.")
+
+        FUS_CONFIG_INT("capture", "max_size", 256,
+                       "Traffic Capture Size Limit\n"
+                       "MiB of decrypted traffic the capture console command may record before it stops recording.\n"
+                       "Captures are replayed against a test server with fus_replay.")
+
+        FUS_CONFIG_INT("flight", "events", 65536,
+                       "Flight Recorder Size\n"
+                       "Number of recent events (connections, messages, db transactions, handshakes and loop stalls)\n"
+                       "kept in fus.flight in the log directory. The file survives crashes; read it with fus_flightdecode.\n"
+                       "Each event takes 32 bytes. Set this to 0 to disable the recorder.")
+
+        FUS_CONFIG_STR("metrics", "bindaddr", "127.0.0.1",
+                       "Metrics Bind Address\n"
+                       "IP Address that the Prometheus metrics endpoint listens on")
+        FUS_CONFIG_INT("metrics", "port", 0,
+                       "Metrics Bind Port\n"
+                       "Port that the Prometheus metrics endpoint listens on. Scrape http://<addr>:<port>/metrics\n"
+                       "Set this to 0 to disable the endpoint.")
 
         FUS_CONFIG_INT("client", "buildId", 918,
                        "Client Build ID\n"
@@ -64,15 +120,70 @@ namespace fus
                        "    - default: Default verification, any client can connect to file or gatekeeper but all others must match the expected values\n"
                        "    - strict: Strict verification, like default but the product uuid is verified for file and gatekeeper connections")
 
+        FUS_CONFIG_INT("auth", "acct_cache_size", 4096,
+                       "Account Cache Size\n"
+                       "Maximum number of account credentials the auth daemon will cache for verifying logins.\n"
+                       "Set this to 0 to disable the cache.")
+        FUS_CONFIG_INT("auth", "acct_cache_ttl", 300,
+                       "Account Cache Lifetime\n"
+                       "Number of seconds that a cached account credential remains valid")
+        FUS_CONFIG_INT("auth", "login_fail_window", 300,
+                       "Failed Login Window\n"
+                       "Number of seconds over which failed login attempts are counted")
+        FUS_CONFIG_INT("auth", "login_fail_name_limit", 10,
+                       "Failed Login Limit (Account)\n"
+                       "Number of failed logins to a single account allowed per window before further attempts are refused.\n"
+                       "Set this to 0 to disable throttling by account name.")
+        FUS_CONFIG_INT("auth", "login_fail_addr_limit", 30,
+                       "Failed Login Limit (Address)\n"
+                       "Number of failed logins from a single IP address allowed per window before further attempts are refused.\n"
+                       "Set this to 0 to disable throttling by address.")
+        FUS_CONFIG_INT("auth", "login_fail_slots", 65536,
+                       "Failed Login Table Size\n"
+                       "Number of counters used to track failed logins. Memory use is fixed at 4 bytes per slot\n"
+                       "for each of the account and address tables.")
+
         FUS_CONFIG_STR("db", "engine", "sqlite",
                        "Database Engine\n"
                        "This sets the engine to use for the database engine.\n"
                        "Possible Values:\n"
-                       "    - sqlite: A liteweight database solution completely self contained in fus for small shards")
+                       "    - sqlite: A liteweight database solution completely self contained in fus for small shards\n"
+                       "    - postgres: A PostgreSQL server, for shards that have outgrown SQLite")
+
+        FUS_CONFIG_STR("postgres", "conninfo", "dbname=fus",
+                       "PostgreSQL Connection String\n"
+                       "libpq connection string, eg \"host=localhost port=5432 dbname=fus user=fus\"")
+        FUS_CONFIG_INT("postgres", "pool_size", 4,
+                       "PostgreSQL Connection Pool Size\n"
+                       "Number of connections the db daemon keeps open to the PostgreSQL server")
+        FUS_CONFIG_INT("postgres", "pipeline_depth", 128,
+                       "PostgreSQL Pipeline Depth\n"
+                       "Maximum number of queries in flight on each connection. Further queries wait\n"
+                       "for room in the least busy connection.")
 
         FUS_CONFIG_STR("sqlite", "path", "db/fus.db",
                        "SQLite Database Path\n"
                        "Path to the database file used by the SQLite engine.")
+        FUS_CONFIG_INT("sqlite", "shards", 1,
+                       "SQLite Shard Count\n"
+                       "Number of database files accounts are spread across, each with its own writer thread.\n"
+                       "With more than one shard, the files are named after the database path, eg fus.shard0.db\n"
+                       "Run fus with --rebalance_db after changing this value.")
+        FUS_CONFIG_INT("sqlite", "acct_filter_size", 100000,
+                       "Account Name Filter Size\n"
+                       "Minimum number of account names the in-memory filter is sized for. The filter lets the\n"
+                       "database reject logins and existence checks for unknown accounts without a query.\n"
+                       "Set this to 0 to disable the filter.")
+        FUS_CONFIG_STR("sqlite", "backup_path", "db/backup/fus.db",
+                       "SQLite Backup Path\n"
+                       "Default destination of online database backups")
+        FUS_CONFIG_INT("sqlite", "backup_pages", 64,
+                       "SQLite Backup Pages per Step\n"
+                       "Number of database pages copied in each step of an online backup. Smaller values\n"
+                       "minimize the impact on server latency at the expense of a slower backup.")
+        FUS_CONFIG_INT("sqlite", "backup_interval", 5,
+                       "SQLite Backup Step Interval\n"
+                       "Number of milliseconds between each step of an online backup")
 
 #define FUS_CONFIG_CLIENT(type) \
     FUS_CONFIG_STR(type, "addr", "", \
@@ -15,16 +15,24 @@
  */
 
 #include "core/build_info.h"
+#include "fus_config.h"
 #include <gflags/gflags.h>
 #include "io/console.h"
 #include "io/io.h"
 #include "server.h"
 
+#ifdef FUS_HAVE_SQLITE
+#   include "sqlite3dbsrv/sqlite3db.h"
+#endif
+
 // =================================================================================
 
 DEFINE_string(config_path, "fus.ini", "Path to fus configuration file");
 DEFINE_string(generate_client_ini, "", "Generates a server.ini file for plClient");
 DEFINE_bool(generate_keys, false, "Generate a new set of encryption keys");
+#ifdef FUS_HAVE_SQLITE
+DEFINE_bool(rebalance_db, false, "Moves SQLite accounts into the correct shard after changing the number of shards");
+#endif
 DEFINE_bool(run_lobby, true, "Launch the server lobby");
 DEFINE_bool(save_config, false, "Saves the server configuration file");
 DEFINE_bool(use_console, true, "Use the interactive server console");
@@ -36,9 +44,11 @@ int main(int argc, char* argv[])
     gflags::SetVersionString(fus::build_version());
     gflags::ParseCommandLineFlags(&argc, &argv, false);
 
-    fus::console& console = fus::console::init(uv_default_loop());
+    // Without the interactive console, stdin and stdout may well not be a terminal.
+    fus::console& console = fus::console::init(uv_default_loop(), !FLAGS_use_console);
     console << fus::console::foreground_yellow << fus::console::weight_bold << fus::ro::dah() << fus::console::endl;
 
+    int result = 0;
     fus::io_init();
     {
         fus::server server(FLAGS_config_path);
@@ -52,6 +62,21 @@ int main(int argc, char* argv[])
         if (FLAGS_save_config)
             server.config().write(FLAGS_config_path);
 
+#ifdef FUS_HAVE_SQLITE
+        // Accounts can't be shuffled around underneath a running db daemon.
+        if (FLAGS_rebalance_db) {
+            if (!server.use_sqlite()) {
+                console << fus::console::weight_bold << fus::console::foreground_red
+                        << "Error: Rebalancing requires the SQLite3 db engine" << fus::console::endl;
+                result = 1;
+            } else if (!fus::sqlite3::db_rebalance()) {
+                result = 1;
+            }
+            FLAGS_run_lobby = false;
+            FLAGS_use_console = false;
+        }
+#endif
+
         // Start the lobby so anyone who wants to connect to the server can go ahead and enqueue that
         if (FLAGS_run_lobby) {
             if (!server.start_lobby()) {
@@ -68,5 +93,5 @@ int main(int argc, char* argv[])
         server.run_forever();
     }
     fus::io_close();
-    return 0;
+    return result;
 }
@@ -0,0 +1,334 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <string>
+#include <uv.h>
+#include <vector>
+
+#include "core/metrics.h"
+#include "metrics_http.h"
+
+// =================================================================================
+
+namespace fus
+{
+    struct metrics_http_client_t
+    {
+        uv_tcp_t m_tcp;
+        uv_timer_t m_timer;
+        uv_write_t m_write;
+        uv_shutdown_t m_shutdown;
+        unsigned int m_handles;
+
+        char m_request[2048];
+        size_t m_requestsz;
+
+        std::vector<metric_sample_t> m_samples;
+        size_t m_next;
+        std::string m_chunk;
+    };
+};
+
+// How many metrics are rendered between writes. Histograms expand to a few dozen lines each,
+// so this keeps any one chunk small enough to render without a noticeable stall.
+constexpr size_t k_samplesPerChunk = 32;
+
+// A scraper that stops reading or writing for this long (in ms) is assumed to be gone.
+constexpr uint64_t k_idleTimeout = 10000;
+
+static uv_tcp_t s_listener;
+static bool s_listening = false;
+
+// Every client that hasn't been freed yet, so shutdown can hang up on scrapes still in progress.
+static std::vector<fus::metrics_http_client_t*> s_clients;
+
+// =================================================================================
+
+static void client_closed(uv_handle_t* handle)
+{
+    auto client = (fus::metrics_http_client_t*)uv_handle_get_data(handle);
+    if (--client->m_handles != 0)
+        return;
+    s_clients.erase(std::find(s_clients.begin(), s_clients.end(), client));
+    client->~metrics_http_client_t();
+    free(client);
+}
+
+static void client_close(fus::metrics_http_client_t* client)
+{
+    if (!uv_is_closing((uv_handle_t*)&client->m_tcp))
+        uv_close((uv_handle_t*)&client->m_tcp, client_closed);
+    if (!uv_is_closing((uv_handle_t*)&client->m_timer))
+        uv_close((uv_handle_t*)&client->m_timer, client_closed);
+}
+
+static void client_idle(uv_timer_t* timer)
+{
+    client_close((fus::metrics_http_client_t*)uv_handle_get_data((uv_handle_t*)timer));
+}
+
+static inline void client_active(fus::metrics_http_client_t* client)
+{
+    uv_timer_start(&client->m_timer, client_idle, k_idleTimeout, 0);
+}
+
+static void client_shutdown_complete(uv_shutdown_t* req, int status)
+{
+    client_close((fus::metrics_http_client_t*)uv_handle_get_data((uv_handle_t*)req->handle));
+}
+
+// =================================================================================
+
+static const char* type_name(fus::metric_sample_t::metric_type type)
+{
+    switch (type) {
+    case fus::metric_sample_t::metric_type::e_counter:
+        return "counter";
+    case fus::metric_sample_t::metric_type::e_gauge:
+        return "gauge";
+    case fus::metric_sample_t::metric_type::e_histogram:
+        return "histogram";
+    }
+    return "untyped";
+}
+
+static void render_labels(std::string& out, const ST::string& labels, const char* le=nullptr)
+{
+    if (labels.empty() && !le)
+        return;
+    out += '{';
+    out += labels.c_str();
+    if (le) {
+        if (!labels.empty())
+            out += ',';
+        out += "le=\"";
+        out += le;
+        out += '"';
+    }
+    out += '}';
+}
+
+static void render_histogram(std::string& out, const fus::metric_sample_t& sample)
+{
+    // The registry's buckets are far finer than anyone wants to scrape, so they're rolled up
+    // into one cumulative Prometheus bucket per power of two. The last group ends at infinity.
+    uint64_t cumulative = 0;
+    size_t groups = sample.m_buckets.size() / fus::metrics::histogram_sub_buckets;
+    for (size_t group = 0; group + 1 < groups; ++group) {
+        for (size_t i = 0; i < fus::metrics::histogram_sub_buckets; ++i)
+            cumulative += sample.m_buckets[(group * fus::metrics::histogram_sub_buckets) + i];
+
+        size_t last = ((group + 1) * fus::metrics::histogram_sub_buckets) - 1;
+        std::string le = std::to_string(fus::metrics::histogram_bucket_max(last));
+        out += sample.m_name.c_str();
+        out += "_bucket";
+        render_labels(out, sample.m_labels, le.c_str());
+        out += ' ';
+        out += std::to_string(cumulative);
+        out += '\n';
+    }
+
+    out += sample.m_name.c_str();
+    out += "_bucket";
+    render_labels(out, sample.m_labels, "+Inf");
+    out += ' ';
+    out += std::to_string(sample.m_value);
+    out += '\n';
+
+    out += sample.m_name.c_str();
+    out += "_sum";
+    render_labels(out, sample.m_labels);
+    out += ' ';
+    out += std::to_string(sample.m_sum);
+    out += '\n';
+
+    out += sample.m_name.c_str();
+    out += "_count";
+    render_labels(out, sample.m_labels);
+    out += ' ';
+    out += std::to_string(sample.m_value);
+    out += '\n';
+}
+
+static void render_chunk(fus::metrics_http_client_t* client)
+{
+    client->m_chunk.clear();
+    size_t end = std::min(client->m_next + k_samplesPerChunk, client->m_samples.size());
+    for (; client->m_next < end; ++client->m_next) {
+        const fus::metric_sample_t& sample = client->m_samples[client->m_next];
+
+        // The snapshot is sorted by name, so each family's metadata is only written once.
+        if (client->m_next == 0 || client->m_samples[client->m_next - 1].m_name != sample.m_name) {
+            client->m_chunk += "# HELP ";
+            client->m_chunk += sample.m_name.c_str();
+            client->m_chunk += ' ';
+            client->m_chunk += sample.m_help.c_str();
+            client->m_chunk += "\n# TYPE ";
+            client->m_chunk += sample.m_name.c_str();
+            client->m_chunk += ' ';
+            client->m_chunk += type_name(sample.m_type);
+            client->m_chunk += '\n';
+        }
+
+        if (sample.m_type == fus::metric_sample_t::metric_type::e_histogram) {
+            render_histogram(client->m_chunk, sample);
+        } else {
+            client->m_chunk += sample.m_name.c_str();
+            render_labels(client->m_chunk, sample.m_labels);
+            client->m_chunk += ' ';
+            client->m_chunk += std::to_string(sample.m_value);
+            client->m_chunk += '\n';
+        }
+    }
+}
+
+static void write_chunk(fus::metrics_http_client_t* client);
+
+static void write_complete(uv_write_t* req, int status)
+{
+    auto client = (fus::metrics_http_client_t*)uv_handle_get_data((uv_handle_t*)req->handle);
+    if (status < 0) {
+        client_close(client);
+        return;
+    }
+
+    client_active(client);
+    if (client->m_next < client->m_samples.size()) {
+        render_chunk(client);
+        write_chunk(client);
+    } else if (uv_shutdown(&client->m_shutdown, (uv_stream_t*)&client->m_tcp, client_shutdown_complete) < 0) {
+        client_close(client);
+    }
+}
+
+static void write_chunk(fus::metrics_http_client_t* client)
+{
+    uv_buf_t buf = uv_buf_init(client->m_chunk.data(), (unsigned int)client->m_chunk.size());
+    if (uv_write(&client->m_write, (uv_stream_t*)&client->m_tcp, &buf, 1, write_complete) < 0)
+        client_close(client);
+}
+
+static void respond(fus::metrics_http_client_t* client)
+{
+    // Only the request line matters; anything that isn't a GET of the metrics page is refused.
+    bool found = strncmp(client->m_request, "GET /metrics ", 13) == 0 ||
+                 strncmp(client->m_request, "GET / ", 6) == 0;
+    if (!found) {
+        client->m_chunk = "HTTP/1.0 404 Not Found\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Connection: close\r\n\r\n";
+        write_chunk(client);
+        return;
+    }
+
+    client->m_samples = fus::metrics_snapshot();
+    std::stable_sort(client->m_samples.begin(), client->m_samples.end(),
+                     [](const auto& lhs, const auto& rhs) { return lhs.m_name < rhs.m_name; });
+
+    // HTTP/1.0 without a Content-Length lets the body be streamed as it's rendered.
+    client->m_chunk = "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Connection: close\r\n\r\n";
+    write_chunk(client);
+}
+
+// =================================================================================
+
+static void alloc_buffer(uv_handle_t* handle, size_t suggestedsz, uv_buf_t* buf)
+{
+    auto client = (fus::metrics_http_client_t*)uv_handle_get_data(handle);
+    size_t remsz = sizeof(client->m_request) - client->m_requestsz - 1;
+    *buf = uv_buf_init(client->m_request + client->m_requestsz, (unsigned int)remsz);
+}
+
+static void read_complete(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    auto client = (fus::metrics_http_client_t*)uv_handle_get_data((uv_handle_t*)stream);
+    if (nread < 0) {
+        client_close(client);
+        return;
+    }
+
+    client_active(client);
+    client->m_requestsz += nread;
+    client->m_request[client->m_requestsz] = 0;
+    if (strstr(client->m_request, "\r\n\r\n")) {
+        uv_read_stop(stream);
+        respond(client);
+    } else if (client->m_requestsz + 1 >= sizeof(client->m_request)) {
+        // Scrapers send tiny requests; this is someone doing something else entirely.
+        client_close(client);
+    }
+}
+
+static void on_connect(uv_stream_t* listener, int status)
+{
+    if (status < 0)
+        return;
+
+    auto client = (fus::metrics_http_client_t*)malloc(sizeof(fus::metrics_http_client_t));
+    new(client) fus::metrics_http_client_t();
+    client->m_requestsz = 0;
+    client->m_next = 0;
+    client->m_handles = 2;
+    s_clients.push_back(client);
+
+    uv_tcp_init(listener->loop, &client->m_tcp);
+    uv_handle_set_data((uv_handle_t*)&client->m_tcp, client);
+    uv_timer_init(listener->loop, &client->m_timer);
+    uv_handle_set_data((uv_handle_t*)&client->m_timer, client);
+
+    // Nobody gets to hold a connection open by trickling in a request, or by never reading the
+    // response, so the connection is dropped if it goes quiet for too long.
+    client_active(client);
+    if (uv_accept(listener, (uv_stream_t*)&client->m_tcp) < 0 ||
+        uv_read_start((uv_stream_t*)&client->m_tcp, alloc_buffer, read_complete) < 0) {
+        client_close(client);
+    }
+}
+
+// =================================================================================
+
+bool fus::metrics_http_init(uv_loop_t* loop, const sockaddr* addr)
+{
+    if (s_listening)
+        return true;
+
+    uv_tcp_init(loop, &s_listener);
+    if (uv_tcp_bind(&s_listener, addr, 0) < 0 || uv_listen((uv_stream_t*)&s_listener, 16, on_connect) < 0) {
+        uv_close((uv_handle_t*)&s_listener, nullptr);
+        return false;
+    }
+    s_listening = true;
+    return true;
+}
+
+void fus::metrics_http_shutdown()
+{
+    if (s_listening) {
+        uv_close((uv_handle_t*)&s_listener, nullptr);
+        s_listening = false;
+    }
+
+    // Clients only leave the list once both handles are closed, which can't happen until the
+    // loop runs again, so it's safe to walk it here.
+    for (fus::metrics_http_client_t* client : s_clients)
+        client_close(client);
+}
@@ -0,0 +1,37 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_DAEMON_METRICS_HTTP_H
+#define __FUS_DAEMON_METRICS_HTTP_H
+
+struct sockaddr;
+typedef struct uv_loop_s uv_loop_t;
+
+namespace fus
+{
+    /**
+     * Starts a minimal HTTP listener that serves every registered metric in the Prometheus
+     * text exposition format. Each scrape is rendered a few metrics at a time between writes
+     * so that a large registry never holds up the loop.
+     */
+    bool metrics_http_init(uv_loop_t*, const sockaddr*);
+
+    /** Stops accepting scrapes and hangs up on any that are still in flight. */
+    void metrics_http_shutdown();
+};
+
+#endif
@@ -0,0 +1,125 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core/errors.h"
+#include "core/metrics.h"
+#include "daemon/daemon_base.h"
+#include "daemon/server.h"
+#include <new>
+#include "pgdb_private.h"
+#include "protocol/common.h"
+
+// =================================================================================
+
+fus::pgsql::db_daemon_t* fus::pgsql::s_dbDaemon = nullptr;
+
+static fus::metric_gauge s_clients("fus_daemon_clients", "Clients connected to the daemon", "daemon=\"db\",engine=\"pgsql\"",
+                                   []() { return (uint64_t)(fus::pgsql::s_dbDaemon ? fus::pgsql::s_dbDaemon->m_clients.count() : 0); });
+
+// =================================================================================
+
+bool fus::pgsql::db_daemon_init()
+{
+    FUS_ASSERTD(s_dbDaemon == nullptr);
+
+    s_dbDaemon = (db_daemon_t*)calloc(sizeof(db_daemon_t), 1);
+    secure_daemon_init(s_dbDaemon, ST_LITERAL("db"));
+    new(&s_dbDaemon->m_clients) FUS_LIST_DECL(db_server_t, m_link);
+    new(&s_dbDaemon->m_hash) fus::hash(fus::hash_type::e_sha1);
+    new(&s_dbDaemon->m_pool) std::vector<pg_conn_t*>();
+    new(&s_dbDaemon->m_backlog) std::deque<pg_query_t>();
+
+    if (!pg_init_schema())
+        return false;
+
+    // Requests that arrive before the pool is up are simply held in the backlog.
+    pg_pool_open();
+
+    s_dbDaemon->m_log.write_info("PostgreSQL Database Initialized: {} connection(s), {} queries per pipeline",
+                                 s_dbDaemon->m_pool.size(), s_dbDaemon->m_pipelineDepth);
+    return true;
+}
+
+bool fus::pgsql::db_daemon_running()
+{
+    return s_dbDaemon != nullptr;
+}
+
+bool fus::pgsql::db_daemon_shutting_down()
+{
+    if (s_dbDaemon)
+        return s_dbDaemon->m_flags & daemon_t::e_shuttingDown;
+    return false;
+}
+
+void fus::pgsql::db_daemon_free()
+{
+    FUS_ASSERTD(s_dbDaemon);
+
+    // Connections that were never closed (eg the loop never ran) must still be released.
+    for (pg_conn_t* conn : s_dbDaemon->m_pool) {
+        PQfinish(conn->m_conn);
+        delete conn;
+    }
+
+    s_dbDaemon->m_backlog.~deque();
+    s_dbDaemon->m_pool.~vector();
+    s_dbDaemon->m_hash.~hash();
+    s_dbDaemon->m_clients.~list_declare();
+    secure_daemon_free(s_dbDaemon);
+    free(s_dbDaemon);
+    s_dbDaemon = nullptr;
+}
+
+void fus::pgsql::db_daemon_shutdown()
+{
+    FUS_ASSERTD(s_dbDaemon);
+    secure_daemon_shutdown(s_dbDaemon);
+    pg_pool_close();
+
+    // Clients will be removed from the list by db_server_free
+    auto it = s_dbDaemon->m_clients.front();
+    while (it) {
+        tcp_stream_shutdown(it);
+        it = s_dbDaemon->m_clients.next(it);
+    }
+}
+
+// =================================================================================
+
+static void db_connection_encrypted(fus::pgsql::db_server_t* client, ssize_t result)
+{
+    if (result < 0 || (fus::pgsql::s_dbDaemon->m_flags & fus::daemon_t::e_shuttingDown)) {
+        fus::tcp_stream_shutdown(client);
+        return;
+    }
+
+    fus::pgsql::s_dbDaemon->m_clients.push_back(client);
+    fus::pgsql::db_server_read(client);
+}
+
+void fus::pgsql::db_daemon_accept(db_server_t* client, const void* msgbuf)
+{
+    // Validate connection
+    if (!s_dbDaemon || (s_dbDaemon->m_flags & daemon_t::e_shuttingDown) || !daemon_verify_connection(s_dbDaemon, msgbuf, false)) {
+        tcp_stream_shutdown(client);
+        return;
+    }
+
+    // Init
+    db_server_init(client);
+    fus::secure_daemon_encrypt_stream(s_dbDaemon, client, (crypt_established_cb)db_connection_encrypted);
+}
@@ -0,0 +1,461 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "core/errors.h"
+#include "daemon/server.h"
+#include "io/loop_monitor.h"
+#include "io/trace.h"
+#include <iterator>
+#include "pgdb_private.h"
+
+// =================================================================================
+
+static const char* s_schema =
+    "CREATE TABLE IF NOT EXISTS accounts ("
+    "idx BIGSERIAL PRIMARY KEY, "
+    "name VARCHAR (64) NOT NULL, hash BYTEA NOT NULL, "
+    "uuid UUID NOT NULL, flags INTEGER NOT NULL); "
+
+    "CREATE UNIQUE INDEX IF NOT EXISTS index_account_name ON accounts (lower(name));";
+
+struct stmt_def_t
+{
+    const char* m_name;
+    const char* m_sql;
+    int m_numParams;
+};
+
+static const stmt_def_t s_stmtDefs[] = {
+    { "createAcct",
+      "INSERT INTO accounts (name, hash, uuid, flags) VALUES ($1, $2, $3, $4)",
+      4 },
+
+    { "authAcct",
+      "SELECT hash, uuid, flags FROM accounts WHERE lower(name) = lower($1)",
+      1 },
+
+    { "acctExists",
+      "SELECT 1 FROM accounts WHERE lower(name) = lower($1)",
+      1 },
+};
+
+static_assert(std::size(s_stmtDefs) == (size_t)fus::pgsql::stmt_id::e_numStmts,
+              "A definition must be provided for each statement ID");
+
+/** Milliseconds to wait before trying to reestablish a lost connection. */
+constexpr uint64_t s_reconnectDelay = 5000;
+
+// =================================================================================
+
+void fus::pgsql::pg_query_t::add_int(uint32_t value)
+{
+    // Binary integers are in network byte order.
+    uint8_t buf[4];
+    buf[0] = (uint8_t)(value >> 24);
+    buf[1] = (uint8_t)(value >> 16);
+    buf[2] = (uint8_t)(value >> 8);
+    buf[3] = (uint8_t)(value);
+    add_binary(buf, sizeof(buf));
+}
+
+bool fus::pgsql::pg_init_schema()
+{
+    // This only happens once at startup, so there's no harm in blocking.
+    const char* conninfo = server::get()->config().get<const char*>("postgres", "conninfo");
+    PGconn* conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        s_dbDaemon->m_log.write_error("PostgreSQL Connect Failed: {}", PQerrorMessage(conn));
+        PQfinish(conn);
+        return false;
+    }
+
+    PGresult* result = PQexec(conn, s_schema);
+    bool success = PQresultStatus(result) == PGRES_COMMAND_OK;
+    if (!success)
+        s_dbDaemon->m_log.write_error("PostgreSQL Schema Init Failed: {}", PQresultErrorMessage(result));
+    PQclear(result);
+    PQfinish(conn);
+    return success;
+}
+
+// =================================================================================
+
+static void conn_connect(fus::pgsql::pg_conn_t* conn);
+static void conn_poll(uv_poll_t* poll, int status, int events);
+
+static inline bool pg_shutting_down()
+{
+    return fus::pgsql::s_dbDaemon->m_flags & fus::daemon_t::e_shuttingDown;
+}
+
+static void conn_watch(fus::pgsql::pg_conn_t* conn, int events)
+{
+    if (conn->m_events != events) {
+        conn->m_events = events;
+        uv_poll_start(&conn->m_poll, events, conn_poll);
+    }
+}
+
+static void conn_reconnect(uv_timer_t* timer)
+{
+    conn_connect((fus::pgsql::pg_conn_t*)uv_handle_get_data((uv_handle_t*)timer));
+}
+
+static void conn_closed(uv_poll_t* poll)
+{
+    fus::pgsql::pg_conn_t* conn = (fus::pgsql::pg_conn_t*)uv_handle_get_data((uv_handle_t*)poll);
+
+    // The socket belongs to libpq, so it must outlive the poll handle.
+    PQfinish(conn->m_conn);
+    conn->m_conn = nullptr;
+    conn->m_flags = 0;
+
+    if (!pg_shutting_down())
+        uv_timer_start(&conn->m_reconnect, conn_reconnect, s_reconnectDelay, 0);
+}
+
+static void conn_abandon(fus::pgsql::pg_conn_t* conn)
+{
+    // Anyone still waiting on this connection is out of luck. Swap first because the callbacks
+    // are free to submit more work.
+    std::deque<fus::pgsql::pg_conn_t::pending_t> pipeline;
+    pipeline.swap(conn->m_pipeline);
+    conn->m_inflight = 0;
+    for (auto& pending : pipeline) {
+        if (!pending.m_sync && !pending.m_answered && pending.m_cb)
+            pending.m_cb(nullptr);
+    }
+}
+
+static void conn_close(fus::pgsql::pg_conn_t* conn)
+{
+    conn->m_flags &= ~(fus::pgsql::pg_conn_t::e_connecting | fus::pgsql::pg_conn_t::e_ready);
+    if (!(conn->m_flags & fus::pgsql::pg_conn_t::e_closing)) {
+        conn->m_flags |= fus::pgsql::pg_conn_t::e_closing;
+        uv_poll_stop(&conn->m_poll);
+        uv_close((uv_handle_t*)&conn->m_poll, (uv_close_cb)conn_closed);
+    }
+    conn_abandon(conn);
+}
+
+static void conn_failed(fus::pgsql::pg_conn_t* conn)
+{
+    fus::pgsql::s_dbDaemon->m_log.write_error("PostgreSQL Connection {} Failed: {}", conn->m_idx,
+                                              PQerrorMessage(conn->m_conn));
+    conn_close(conn);
+}
+
+static void conn_flush(fus::pgsql::pg_conn_t* conn)
+{
+    if (!(conn->m_flags & fus::pgsql::pg_conn_t::e_ready))
+        return;
+
+    switch (PQflush(conn->m_conn)) {
+    case 0:
+        conn->m_flags &= ~fus::pgsql::pg_conn_t::e_flushing;
+        conn_watch(conn, UV_READABLE);
+        break;
+    case 1:
+        // The socket is full, so finish writing when it drains.
+        conn->m_flags |= fus::pgsql::pg_conn_t::e_flushing;
+        conn_watch(conn, UV_READABLE | UV_WRITABLE);
+        break;
+    default:
+        conn_failed(conn);
+        break;
+    }
+}
+
+// =================================================================================
+
+/**
+ * Appends a query to the connection's pipeline.
+ * \returns false if the query could not be sent, in which case the caller still owns it.
+ */
+static bool conn_send(fus::pgsql::pg_conn_t* conn, fus::pgsql::pg_query_t& query)
+{
+    size_t numParams = query.m_params.size();
+    const char** values = (const char**)alloca(sizeof(const char*) * numParams);
+    int* lengths = (int*)alloca(sizeof(int) * numParams);
+    for (size_t i = 0; i < numParams; ++i) {
+        values[i] = query.m_params[i].data();
+        lengths[i] = (int)query.m_params[i].size();
+    }
+
+    // All results come back in binary so we never have to parse text from the server.
+    const stmt_def_t& def = s_stmtDefs[(size_t)query.m_stmt];
+    if (PQsendQueryPrepared(conn->m_conn, def.m_name, (int)numParams, values, lengths,
+                            query.m_formats.data(), 1) == 0) {
+        return false;
+    }
+    uint64_t sent = query.m_traceId ? uv_hrtime() : 0;
+    fus::trace_span(query.m_traceId, "pgsql queue", query.m_queued, sent);
+    conn->m_pipeline.push_back({ std::move(query.m_cb), false, false, query.m_traceId, sent });
+    conn->m_inflight++;
+
+    // A sync after every query keeps a failed query (eg a duplicate account name) from aborting
+    // everything queued behind it. Syncs don't wait on anything, so the pipeline stays full.
+    if (PQpipelineSync(conn->m_conn) == 0) {
+        // The query now belongs to the pipeline, which will be failed along with the connection.
+        conn_failed(conn);
+        return true;
+    }
+    conn->m_pipeline.push_back({ nullptr, true, false, 0, 0 });
+    return true;
+}
+
+static bool conn_available(const fus::pgsql::pg_conn_t* conn)
+{
+    return (conn->m_flags & fus::pgsql::pg_conn_t::e_ready) &&
+           conn->m_inflight < fus::pgsql::s_dbDaemon->m_pipelineDepth;
+}
+
+static void conn_drain_backlog(fus::pgsql::pg_conn_t* conn)
+{
+    auto& backlog = fus::pgsql::s_dbDaemon->m_backlog;
+    bool sent = false;
+    while (!backlog.empty() && conn_available(conn)) {
+        fus::pgsql::pg_query_t query = std::move(backlog.front());
+        backlog.pop_front();
+        if (!conn_send(conn, query)) {
+            backlog.push_front(std::move(query));
+            conn_failed(conn);
+            return;
+        }
+        sent = true;
+    }
+    if (sent)
+        conn_flush(conn);
+}
+
+static void conn_read_results(fus::pgsql::pg_conn_t* conn)
+{
+    while (!conn->m_pipeline.empty() && !PQisBusy(conn->m_conn)) {
+        PGresult* result = PQgetResult(conn->m_conn);
+        auto& front = conn->m_pipeline.front();
+
+        if (front.m_sync) {
+            // Syncs produce a single result with no trailing nullptr.
+            if (result) {
+                FUS_ASSERTD(PQresultStatus(result) == PGRES_PIPELINE_SYNC);
+                conn->m_pipeline.pop_front();
+                PQclear(result);
+            }
+            continue;
+        }
+
+        // Each query's results are terminated by a nullptr.
+        if (!result) {
+            std::function<void(PGresult*)> cb = std::move(front.m_cb);
+            bool answered = front.m_answered;
+            conn->m_pipeline.pop_front();
+            conn->m_inflight--;
+            if (!answered && cb)
+                cb(nullptr);
+            continue;
+        }
+
+        if (!front.m_answered) {
+            // The callback may submit more work or even take down the connection, so don't
+            // leave it in the pipeline while it runs.
+            std::function<void(PGresult*)> cb = std::move(front.m_cb);
+            front.m_answered = true;
+            fus::trace_span(front.m_traceId, "pgsql execute", front.m_sent, uv_hrtime());
+            if (cb)
+                cb(result);
+        }
+        PQclear(result);
+    }
+}
+
+// =================================================================================
+
+static void conn_established(fus::pgsql::pg_conn_t* conn)
+{
+    using namespace fus::pgsql;
+
+    PQsetnonblocking(conn->m_conn, 1);
+    if (PQenterPipelineMode(conn->m_conn) == 0) {
+        conn_failed(conn);
+        return;
+    }
+
+    // Statements are prepared in the pipeline ahead of any queries, so there's no need to wait.
+    for (const stmt_def_t& def : s_stmtDefs) {
+        size_t idx = conn->m_idx;
+        const char* name = def.m_name;
+        auto cb = [idx, name](PGresult* result) {
+            if (result && PQresultStatus(result) != PGRES_COMMAND_OK)
+                s_dbDaemon->m_log.write_error("PostgreSQL Connection {} Prepare '{}' Failed: {}",
+                                              idx, name, PQresultErrorMessage(result));
+        };
+        if (PQsendPrepare(conn->m_conn, def.m_name, def.m_sql, def.m_numParams, nullptr) == 0 ||
+            PQpipelineSync(conn->m_conn) == 0) {
+            conn_failed(conn);
+            return;
+        }
+        conn->m_pipeline.push_back({ cb, false, false, 0, 0 });
+        conn->m_pipeline.push_back({ nullptr, true, false, 0, 0 });
+    }
+
+    conn->m_flags &= ~pg_conn_t::e_connecting;
+    conn->m_flags |= pg_conn_t::e_ready;
+    s_dbDaemon->m_log.write_info("PostgreSQL Connection {} Ready: {}@{}/{}", conn->m_idx,
+                                 PQuser(conn->m_conn), PQhost(conn->m_conn), PQdb(conn->m_conn));
+
+    conn_flush(conn);
+    if (conn->m_flags & pg_conn_t::e_ready)
+        conn_drain_backlog(conn);
+}
+
+static void conn_poll(uv_poll_t* poll, int status, int events)
+{
+    using namespace fus::pgsql;
+    pg_conn_t* conn = (pg_conn_t*)uv_handle_get_data((uv_handle_t*)poll);
+    fus::loop_timer_t timer("pgsql connection poll");
+
+    if (status < 0) {
+        s_dbDaemon->m_log.write_error("PostgreSQL Connection {} Poll Error: {}", conn->m_idx, uv_strerror(status));
+        conn_close(conn);
+        return;
+    }
+
+    if (conn->m_flags & pg_conn_t::e_connecting) {
+        switch (PQconnectPoll(conn->m_conn)) {
+        case PGRES_POLLING_READING:
+            conn_watch(conn, UV_READABLE);
+            break;
+        case PGRES_POLLING_WRITING:
+            conn_watch(conn, UV_WRITABLE);
+            break;
+        case PGRES_POLLING_OK:
+            conn_established(conn);
+            break;
+        default:
+            conn_failed(conn);
+            break;
+        }
+        return;
+    }
+
+    if (events & UV_READABLE) {
+        if (PQconsumeInput(conn->m_conn) == 0) {
+            conn_failed(conn);
+            return;
+        }
+        conn_read_results(conn);
+    }
+    if (!(conn->m_flags & pg_conn_t::e_ready))
+        return;
+
+    if (conn->m_flags & pg_conn_t::e_flushing)
+        conn_flush(conn);
+    if (conn->m_flags & pg_conn_t::e_ready)
+        conn_drain_backlog(conn);
+}
+
+static void conn_connect(fus::pgsql::pg_conn_t* conn)
+{
+    using namespace fus::pgsql;
+
+    const char* conninfo = fus::server::get()->config().get<const char*>("postgres", "conninfo");
+    conn->m_conn = PQconnectStart(conninfo);
+    if (!conn->m_conn || PQstatus(conn->m_conn) == CONNECTION_BAD) {
+        s_dbDaemon->m_log.write_error("PostgreSQL Connection {} Failed: {}", conn->m_idx,
+                                      conn->m_conn ? PQerrorMessage(conn->m_conn) : "out of memory");
+        PQfinish(conn->m_conn);
+        conn->m_conn = nullptr;
+        uv_timer_start(&conn->m_reconnect, conn_reconnect, s_reconnectDelay, 0);
+        return;
+    }
+
+    // libpq starts out wanting to write the startup packet.
+    conn->m_flags = pg_conn_t::e_connecting;
+    conn->m_events = 0;
+    uv_poll_init_socket(uv_default_loop(), &conn->m_poll, PQsocket(conn->m_conn));
+    uv_handle_set_data((uv_handle_t*)&conn->m_poll, conn);
+    conn_watch(conn, UV_WRITABLE);
+}
+
+// =================================================================================
+
+void fus::pgsql::pg_pool_open()
+{
+    const fus::config_parser& config = server::get()->config();
+    size_t poolSize = std::max(1U, config.get<unsigned int>("postgres", "pool_size"));
+    s_dbDaemon->m_pipelineDepth = std::max(1U, config.get<unsigned int>("postgres", "pipeline_depth"));
+
+    s_dbDaemon->m_pool.reserve(poolSize);
+    for (size_t i = 0; i < poolSize; ++i) {
+        pg_conn_t* conn = new pg_conn_t();
+        conn->m_conn = nullptr;
+        conn->m_idx = i;
+        conn->m_flags = 0;
+        conn->m_events = 0;
+        conn->m_inflight = 0;
+        uv_timer_init(uv_default_loop(), &conn->m_reconnect);
+        uv_handle_set_data((uv_handle_t*)&conn->m_reconnect, conn);
+        s_dbDaemon->m_pool.push_back(conn);
+        conn_connect(conn);
+    }
+}
+
+void fus::pgsql::pg_pool_close()
+{
+    for (pg_conn_t* conn : s_dbDaemon->m_pool) {
+        if (conn->m_conn)
+            conn_close(conn);
+        uv_timer_stop(&conn->m_reconnect);
+        if (!uv_is_closing((uv_handle_t*)&conn->m_reconnect))
+            uv_close((uv_handle_t*)&conn->m_reconnect, nullptr);
+    }
+
+    std::deque<pg_query_t> backlog;
+    backlog.swap(s_dbDaemon->m_backlog);
+    for (pg_query_t& query : backlog) {
+        if (query.m_cb)
+            query.m_cb(nullptr);
+    }
+}
+
+void fus::pgsql::pg_submit(pg_query_t&& query)
+{
+    if (query.m_traceId)
+        query.m_queued = uv_hrtime();
+
+    // Spread the load by picking the connection with the shortest pipeline.
+    pg_conn_t* best = nullptr;
+    for (pg_conn_t* conn : s_dbDaemon->m_pool) {
+        if (conn_available(conn) && (!best || conn->m_inflight < best->m_inflight))
+            best = conn;
+    }
+
+    if (!best || !s_dbDaemon->m_backlog.empty()) {
+        // Everything is saturated (or down), so wait our turn.
+        s_dbDaemon->m_backlog.push_back(std::move(query));
+        if (best)
+            conn_drain_backlog(best);
+        return;
+    }
+
+    if (conn_send(best, query)) {
+        conn_flush(best);
+    } else {
+        s_dbDaemon->m_backlog.push_back(std::move(query));
+        conn_failed(best);
+    }
+}
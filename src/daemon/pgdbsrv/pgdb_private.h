@@ -0,0 +1,152 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FUS_PGDB_DAEMON_PRIVATE_H
+#define __FUS_PGDB_DAEMON_PRIVATE_H
+
+#include "daemon/daemon_base.h"
+#include <deque>
+#include <functional>
+#include "io/hash.h"
+#include <libpq-fe.h>
+#include "pgdb.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fus
+{
+    namespace pgsql
+    {
+        /** Prepared statements known to every pooled connection. */
+        enum class stmt_id
+        {
+            e_createAcct,
+            e_authAcct,
+            e_acctExists,
+
+            e_numStmts
+        };
+
+        /**
+         * \brief A single query waiting to be sent to (or answered by) the server.
+         * Parameters are stored in their wire format so that the query may sit in the backlog
+         * after the request that created it has gone away. The callback receives the first
+         * result of the query, or nullptr if the connection was lost before it was answered.
+         */
+        struct pg_query_t
+        {
+            stmt_id m_stmt;
+            std::vector<std::string> m_params;
+            std::vector<int> m_formats;
+            std::function<void(PGresult*)> m_cb;
+
+            // Set by the submitter if the request is being traced
+            uint32_t m_traceId;
+            uint64_t m_queued;
+
+            pg_query_t(stmt_id stmt) : m_stmt(stmt), m_traceId(), m_queued() { }
+
+            void add_text(const std::string_view& value)
+            {
+                m_params.emplace_back(value);
+                m_formats.push_back(0);
+            }
+
+            void add_binary(const void* buf, size_t bufsz)
+            {
+                m_params.emplace_back((const char*)buf, bufsz);
+                m_formats.push_back(1);
+            }
+
+            void add_int(uint32_t value);
+        };
+
+        struct pg_conn_t
+        {
+            enum
+            {
+                e_connecting = (1<<0),
+                e_ready = (1<<1),
+                e_flushing = (1<<2),
+                e_closing = (1<<3),
+            };
+
+            /** An entry in the pipeline. Syncs delimit each query so one failure can't abort its neighbors. */
+            struct pending_t
+            {
+                std::function<void(PGresult*)> m_cb;
+                bool m_sync;
+                bool m_answered;
+                uint32_t m_traceId;
+                uint64_t m_sent;
+            };
+
+            uv_poll_t m_poll;
+            uv_timer_t m_reconnect;
+            PGconn* m_conn;
+            size_t m_idx;
+            uint32_t m_flags;
+            int m_events;
+            std::deque<pending_t> m_pipeline;
+            size_t m_inflight;
+        };
+
+        struct db_daemon_t : public secure_daemon_t
+        {
+            FUS_LIST_DECL(db_server_t, m_link) m_clients;
+            fus::hash m_hash;
+
+            std::vector<pg_conn_t*> m_pool;
+            std::deque<pg_query_t> m_backlog;
+            size_t m_pipelineDepth;
+        };
+
+        extern db_daemon_t* s_dbDaemon;
+
+        /** Creates the tables and indices if this is a brand new database. */
+        bool pg_init_schema();
+
+        /** Starts connecting the pool. Connections come online as the event loop runs. */
+        void pg_pool_open();
+
+        /** Fails everything still in flight and closes the pool. */
+        void pg_pool_close();
+
+        /** Sends a query on the least busy connection, or holds it until one is available. */
+        void pg_submit(pg_query_t&& query);
+
+        /** Fetches the SQLSTATE of a failed result, eg "23505" for a unique violation. */
+        inline std::string_view pg_sqlstate(const PGresult* result)
+        {
+            const char* state = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+            return state ? std::string_view(state) : std::string_view();
+        }
+    };
+};
+
+// =================================================================================
+
+template<typename _Msg>
+using _db_cb = void(fus::pgsql::db_server_t*, ssize_t, _Msg*);
+
+template<typename _Msg, typename _Cb=_db_cb<_Msg>>
+static inline void db_read(fus::pgsql::db_server_t* client, _Cb cb)
+{
+    fus::tcp_stream_read_msg<_Msg>(client, (fus::tcp_read_cb)cb);
+}
+
+#endif
@@ -0,0 +1,410 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pgdb_private.h"
+#include <algorithm>
+#include "core/errors.h"
+#include "core/metrics.h"
+#include "core/uuid.h"
+#include "daemon/daemon_base.h"
+#include "io/net_error.h"
+#include <memory>
+#include <new>
+#include "protocol/acct_batch.h"
+#include "protocol/db.h"
+
+// =================================================================================
+
+void fus::pgsql::db_server_init(db_server_t* client)
+{
+    tcp_stream_free_cb(client, (tcp_free_cb)db_server_free);
+    crypt_stream_init(client);
+    crypt_stream_must_encrypt(client);
+    new(&client->m_link) FUS_LIST_LINK(db_server_t);
+}
+
+void fus::pgsql::db_server_free(db_server_t* client)
+{
+    client->m_link.~list_link();
+}
+
+// =================================================================================
+
+static inline fus::pgsql::db_daemon_t* db_daemon()
+{
+    return fus::pgsql::s_dbDaemon;
+}
+
+static inline bool db_check_read(fus::pgsql::db_server_t* client, ssize_t nread)
+{
+    if (nread < 0) {
+        FUS_LOG_DEBUG(db_daemon()->m_log, "[{}]: Read failed: {}",
+                                          client,
+                                          uv_strerror(nread));
+        fus::tcp_stream_shutdown(client);
+        return false;
+    }
+    return true;
+}
+
+static inline void db_client_ref(fus::pgsql::db_server_t* client)
+{
+    // Keeps the client's memory alive until its query has been answered.
+    fus::tcp_stream_ref(client);
+}
+
+template<typename _Msg>
+static void db_client_reply(fus::pgsql::db_server_t* client, const _Msg& reply)
+{
+    // The client may have dropped while its query was in the pipeline.
+    if (fus::tcp_stream_connected(client) && !fus::tcp_stream_closing(client))
+        fus::tcp_stream_write_msg(client, reply);
+    fus::tcp_stream_free(client);
+}
+
+static inline uint32_t db_get_uint32(const PGresult* result, int row, int col)
+{
+    const uint8_t* buf = (const uint8_t*)PQgetvalue(result, row, col);
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+static void db_pingpong(fus::pgsql::db_server_t* client, ssize_t nread, fus::protocol::db_pingRequest* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    // Message reply is a bitwise copy, so we'll just throw the request back.
+    fus::tcp_stream_write(client, msg, nread);
+
+    // Continue reading
+    fus::pgsql::db_server_read(client);
+}
+
+// =================================================================================
+
+static void db_acctInvalidate(const std::string_view& name)
+{
+    // Any daemon caching account data needs to toss whatever it knows about this account.
+    fus::protocol::db_acctInvalidateBCast bcast;
+    bcast.set_type(bcast.id());
+    bcast.set_name(name);
+
+    auto it = db_daemon()->m_clients.front();
+    while (it) {
+        fus::tcp_stream_write_msg(it, bcast);
+        it = db_daemon()->m_clients.next(it);
+    }
+}
+
+// =================================================================================
+
+static void db_acctCreate(fus::pgsql::db_server_t* client, ssize_t nread, fus::protocol::db_acctCreateRequest* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    size_t hashBufsz = db_daemon()->m_hash.digestsz();
+    void* hashBuf = alloca(hashBufsz);
+    db_daemon()->m_hash.hash_account(ST::string::from_std_string(msg->get_name()),
+                                     ST::string::from_std_string(msg->get_pass()),
+                                     hashBuf, hashBufsz);
+
+    fus::uuid uuid = fus::uuid::generate();
+    fus::pgsql::pg_query_t query(fus::pgsql::stmt_id::e_createAcct);
+    query.add_text(msg->get_name());
+    query.add_binary(hashBuf, hashBufsz);
+    query.add_binary(uuid.data(), sizeof(fus::uuid));
+    query.add_int(msg->get_flags());
+
+    fus::protocol::db_acctCreateReply reply;
+    reply.set_type(reply.id());
+    reply.set_transId(msg->get_transId());
+    *reply.get_uuid() = uuid;
+
+    std::string name(msg->get_name());
+    db_client_ref(client);
+    query.m_cb = [client, reply, name](PGresult* result) mutable {
+        fus::net_error error;
+        if (!result) {
+            error = fus::net_error::e_internalError;
+        } else if (PQresultStatus(result) == PGRES_COMMAND_OK) {
+            error = fus::net_error::e_success;
+        } else if (fus::pgsql::pg_sqlstate(result) == "23505") {
+            // unique_violation -- account names are case insensitive unique :)
+            error = fus::net_error::e_accountAlreadyExists;
+        } else {
+            db_daemon()->m_log.write_error("PostgreSQL Create Account Error: {}", PQresultErrorMessage(result));
+            error = fus::net_error::e_internalError;
+        }
+
+        reply.set_result((uint32_t)error);
+        db_client_reply(client, reply);
+        if (error == fus::net_error::e_success)
+            db_acctInvalidate(name);
+    };
+    query.m_traceId = msg->get_traceId();
+    fus::pgsql::pg_submit(std::move(query));
+
+    // Continue reading -- the pipeline can hold many more queries.
+    fus::pgsql::db_server_read(client);
+}
+
+// =================================================================================
+
+struct db_acct_batch_t
+{
+    fus::pgsql::db_server_t* m_client;
+    uint32_t m_transId;
+    size_t m_pending;
+    std::vector<uint8_t> m_results;
+};
+
+static void db_acctBatchCreate(fus::pgsql::db_server_t* client, ssize_t nread,
+                               fus::protocol::db_acctCreateBatchRequest* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    std::vector<fus::protocol::acct_batch_record_t> records;
+    if (!fus::protocol::acct_batch_read(msg->get_records(), msg->get_recordssz(), msg->get_count(), records)) {
+        FUS_LOG_ERROR(db_daemon()->m_log, "[{}] Sent a malformed batch of {} accounts",
+                                          client, msg->get_count());
+        fus::protocol::db_acctCreateBatchReply reply;
+        reply.set_type(reply.id());
+        reply.set_transId(msg->get_transId());
+        reply.set_result((uint32_t)fus::net_error::e_invalidParameter);
+        reply.set_count(0);
+        reply.set_resultssz(0);
+        fus::tcp_stream_write_msg(client, reply);
+        fus::pgsql::db_server_read(client);
+        return;
+    }
+
+    // A unique violation aborts the entire transaction in PostgreSQL, so each account gets its
+    // own implicit one instead. They're all in the pipeline together, so this still costs about
+    // one round trip per connection rather than one per account.
+    constexpr size_t k_resultsz = sizeof(uint32_t) + sizeof(fus::uuid);
+    auto batch = std::make_shared<db_acct_batch_t>();
+    batch->m_client = client;
+    batch->m_transId = msg->get_transId();
+    batch->m_pending = records.size();
+    batch->m_results.resize(records.size() * k_resultsz);
+    db_client_ref(client);
+
+    size_t hashBufsz = db_daemon()->m_hash.digestsz();
+    void* hashBuf = alloca(hashBufsz);
+    for (size_t i = 0; i < records.size(); ++i) {
+        const fus::protocol::acct_batch_record_t& record = records[i];
+        db_daemon()->m_hash.hash_account(ST::string::from_std_string(record.m_name),
+                                         ST::string::from_std_string(record.m_pass),
+                                         hashBuf, hashBufsz);
+
+        fus::uuid uuid = fus::uuid::generate();
+        fus::pgsql::pg_query_t query(fus::pgsql::stmt_id::e_createAcct);
+        query.add_text(record.m_name);
+        query.add_binary(hashBuf, hashBufsz);
+        query.add_binary(uuid.data(), sizeof(fus::uuid));
+        query.add_int(record.m_flags);
+
+        query.m_cb = [batch, i, uuid, name = record.m_name](PGresult* result) {
+            fus::net_error error;
+            if (!result) {
+                error = fus::net_error::e_internalError;
+            } else if (PQresultStatus(result) == PGRES_COMMAND_OK) {
+                error = fus::net_error::e_success;
+                db_acctInvalidate(name);
+            } else if (fus::pgsql::pg_sqlstate(result) == "23505") {
+                error = fus::net_error::e_accountAlreadyExists;
+            } else {
+                db_daemon()->m_log.write_error("PostgreSQL Create Account Error: {}", PQresultErrorMessage(result));
+                error = fus::net_error::e_internalError;
+            }
+
+            // Results are fixed size, so each one can be written straight into its slot.
+            std::vector<uint8_t> slot;
+            fus::protocol::acct_batch_write_result(slot, error, uuid);
+            std::copy(slot.begin(), slot.end(), batch->m_results.begin() + (i * k_resultsz));
+            if (--batch->m_pending != 0)
+                return;
+
+            fus::pgsql::db_server_t* client = batch->m_client;
+            if (fus::tcp_stream_connected(client) && !fus::tcp_stream_closing(client)) {
+                fus::protocol::db_acctCreateBatchReply reply;
+                reply.set_type(reply.id());
+                reply.set_transId(batch->m_transId);
+                reply.set_result((uint32_t)fus::net_error::e_success);
+                reply.set_count((uint32_t)(batch->m_results.size() / k_resultsz));
+                reply.set_resultssz((uint32_t)batch->m_results.size());
+                fus::tcp_stream_write_msg(client, reply, batch->m_results.data(), batch->m_results.size());
+            }
+            fus::tcp_stream_free(client);
+        };
+        query.m_traceId = msg->get_traceId();
+        fus::pgsql::pg_submit(std::move(query));
+    }
+
+    // Continue reading
+    fus::pgsql::db_server_read(client);
+}
+
+// =================================================================================
+
+static void db_acctAuth(fus::pgsql::db_server_t* client, ssize_t nread, fus::protocol::db_acctAuthRequest* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    fus::protocol::db_acctAuthReply reply;
+    reply.set_type(reply.id());
+    reply.set_transId(msg->get_transId());
+    reply.set_name(msg->get_name());
+    *reply.get_uuid() = fus::uuid::null;
+    reply.set_flags(0);
+    reply.set_hashlen(0);
+
+    size_t hashbufsz = db_daemon()->m_hash.digestsz();
+    if (hashbufsz != msg->get_hashsz()) {
+        db_daemon()->m_log.write_error("ERROR: Account '{}' sent an unexpected digest length [sent: {}] [expected: {}]",
+                                       msg->get_name(), msg->get_hashsz(), hashbufsz);
+        reply.set_result((uint32_t)fus::net_error::e_invalidParameter);
+        fus::tcp_stream_write_msg(client, reply);
+        fus::pgsql::db_server_read(client);
+        return;
+    }
+
+    // The request has a variable length hash, so it can't be copied wholesale.
+    std::vector<uint8_t> hash((const uint8_t*)msg->get_hash(), (const uint8_t*)msg->get_hash() + hashbufsz);
+    uint32_t cliChallenge = msg->get_cliChallenge();
+    uint32_t srvChallenge = msg->get_srvChallenge();
+
+    fus::pgsql::pg_query_t query(fus::pgsql::stmt_id::e_authAcct);
+    query.add_text(msg->get_name());
+
+    db_client_ref(client);
+    query.m_cb = [client, reply, hash, cliChallenge, srvChallenge](PGresult* result) mutable {
+        fus::net_error error;
+        if (!result) {
+            error = fus::net_error::e_internalError;
+        } else if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            db_daemon()->m_log.write_error("PostgreSQL Account Authenticate Error: {}", PQresultErrorMessage(result));
+            error = fus::net_error::e_internalError;
+        } else if (PQntuples(result) == 0) {
+            error = fus::net_error::e_accountNotFound;
+        } else {
+            const void* acctHash = PQgetvalue(result, 0, 0);
+            size_t acctHashsz = (size_t)PQgetlength(result, 0, 0);
+            void* hashbuf = alloca(hash.size());
+            db_daemon()->m_hash.hash_login(acctHash, acctHashsz, cliChallenge, srvChallenge,
+                                           hashbuf, hash.size());
+
+            if (memcmp(hashbuf, hash.data(), hash.size()) == 0) {
+                error = fus::net_error::e_success;
+                if (PQgetlength(result, 0, 1) == sizeof(fus::uuid))
+                    *reply.get_uuid() = fus::uuid(PQgetvalue(result, 0, 1));
+                reply.set_flags(db_get_uint32(result, 0, 2));
+
+                // The requesting daemon may cache the account hash to verify future logins itself.
+                size_t replyHashsz = std::min((size_t)reply.get_hashsz(), acctHashsz);
+                reply.set_hashlen(replyHashsz);
+                memcpy(reply.get_hash(), acctHash, replyHashsz);
+            } else {
+                error = fus::net_error::e_authenticationFailed;
+            }
+        }
+
+        reply.set_result((uint32_t)error);
+        db_client_reply(client, reply);
+    };
+    query.m_traceId = msg->get_traceId();
+    fus::pgsql::pg_submit(std::move(query));
+
+    // Continue reading
+    fus::pgsql::db_server_read(client);
+}
+
+// =================================================================================
+
+static void db_acctExists(fus::pgsql::db_server_t* client, ssize_t nread, fus::protocol::db_acctExistsRequest* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    fus::protocol::db_acctExistsReply reply;
+    reply.set_type(reply.id());
+    reply.set_transId(msg->get_transId());
+    reply.set_exists(0);
+
+    fus::pgsql::pg_query_t query(fus::pgsql::stmt_id::e_acctExists);
+    query.add_text(msg->get_name());
+
+    db_client_ref(client);
+    query.m_cb = [client, reply](PGresult* result) mutable {
+        fus::net_error error = fus::net_error::e_success;
+        if (!result) {
+            error = fus::net_error::e_internalError;
+        } else if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            db_daemon()->m_log.write_error("PostgreSQL Account Exists Error: {}", PQresultErrorMessage(result));
+            error = fus::net_error::e_internalError;
+        } else {
+            reply.set_exists(PQntuples(result) != 0 ? 1 : 0);
+        }
+
+        reply.set_result((uint32_t)error);
+        db_client_reply(client, reply);
+    };
+    query.m_traceId = msg->get_traceId();
+    fus::pgsql::pg_submit(std::move(query));
+
+    // Continue reading
+    fus::pgsql::db_server_read(client);
+}
+
+// =================================================================================
+
+static fus::metric_counter_set s_dbMessages("fus_db_messages_total", "Messages received by the db daemon", "type", 64);
+
+static void db_msg_pump(fus::pgsql::db_server_t* client, ssize_t nread, fus::protocol::common_msg_std_header* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    s_dbMessages.add(msg->get_type());
+    switch (msg->get_type()) {
+    case fus::protocol::db_pingRequest::id():
+        db_read<fus::protocol::db_pingRequest>(client, db_pingpong);
+        break;
+    case fus::protocol::db_acctCreateRequest::id():
+        db_read<fus::protocol::db_acctCreateRequest>(client, db_acctCreate);
+        break;
+    case fus::protocol::db_acctAuthRequest::id():
+        db_read<fus::protocol::db_acctAuthRequest>(client, db_acctAuth);
+        break;
+    case fus::protocol::db_acctExistsRequest::id():
+        db_read<fus::protocol::db_acctExistsRequest>(client, db_acctExists);
+        break;
+    case fus::protocol::db_acctCreateBatchRequest::id():
+        db_read<fus::protocol::db_acctCreateBatchRequest>(client, db_acctBatchCreate);
+        break;
+    default:
+        fus::pgsql::s_dbDaemon->m_log.write_error("Received unimplemented message type 0x{04X} -- kicking client", msg->get_type());
+        fus::tcp_stream_shutdown(client);
+    }
+}
+
+void fus::pgsql::db_server_read(db_server_t* client)
+{
+    tcp_stream_peek_msg<protocol::common_msg_std_header>(client, (tcp_read_cb)db_msg_pump);
+}
@@ -14,23 +14,30 @@
  *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <iostream>
 
 #include "adminsrv/admin.h"
 #include "authsrv/auth.h"
 #include "client/admin_client.h"
 #include "core/errors.h"
+#include "core/flight_recorder.h"
 #include "daemon_config.h"
 #include <gflags/gflags.h>
 #include "io/console.h"
 #include "io/io.h"
+#include "io/loop_monitor.h"
 #include "io/net_struct.h"
 #include "io/tcp_stream.h"
+#include "metrics_http.h"
 #include "protocol/common.h"
 #include "server.h"
 #ifdef FUS_HAVE_SQLITE
 #   include "sqlite3dbsrv/sqlite3db.h"
 #endif
+#ifdef FUS_HAVE_POSTGRES
+#   include "pgdbsrv/pgdb.h"
+#endif
 
 // =================================================================================
 
@@ -57,6 +64,19 @@ namespace fus
 };
 #endif
 
+#ifndef FUS_HAVE_POSTGRES
+namespace fus
+{
+    namespace pgsql
+    {
+        struct db_server_t
+        {
+
+        };
+    };
+};
+#endif
+
 // =================================================================================
 
 template<typename... _Args>
@@ -72,7 +92,7 @@ struct max_sizeof<_Arg0, _Args...>
 };
 
 constexpr size_t k_clientMemsz = max_sizeof<fus::admin_server_t, fus::auth_server_t,
-                                            fus::sqlite3::db_server_t>::value;
+                                            fus::sqlite3::db_server_t, fus::pgsql::db_server_t>::value;
 
 // =================================================================================
 
@@ -83,20 +103,25 @@ fus::server::server(const std::filesystem::path& config_path)
     m_config.read(config_path);
 
     log_file::set_directory(m_config.get<const ST::string&>("log", "directory"));
+    log_file::set_buffer_size((size_t)m_config.get<unsigned int>("log", "buffer_size") * 1024);
+    log_file::set_rotation((uint64_t)m_config.get<unsigned int>("log", "rotate_size") * 1024 * 1024,
+                           m_config.get<unsigned int>("log", "rotate_interval") * 60 * 60,
+                           m_config.get<unsigned int>("log", "rotate_keep"));
+    log_file::set_binary(m_config.get<bool>("log", "binary"));
     m_log.set_level(m_config.get<const ST::string&>("log", "level"));
 
-#define ADD_DAEMON(prefix, suffix) \
+#define ADD_DAEMON(prefix, suffix, ...) \
     { \
     auto pair = m_daemonCtl.emplace(std::piecewise_construct, std::forward_as_tuple(ST_LITERAL(#prefix "::" #suffix)), \
                                     std::forward_as_tuple(prefix::suffix##_daemon_init, prefix::suffix##_daemon_shutdown, \
                                                           prefix::suffix##_daemon_free, prefix::suffix##_daemon_running, \
-                                                          prefix::suffix##_daemon_shutting_down, FLAGS_run_##suffix)); \
+                                                          prefix::suffix##_daemon_shutting_down, FLAGS_run_##suffix, \
+                                                          ST_LITERAL(#suffix), std::vector<ST::string>{ __VA_ARGS__ })); \
     m_daemonIts.push_back(pair.first); \
     }
 
-    // All daemons must be entered into the map in the order that they should be inited
-    // Hint: if another server connects to it, init it first... May GAWD help you if you're trying
-    //       something crazy, like circular connections.
+    // Each daemon lists the daemons it connects to, and init_daemons() will sort out the order.
+    // May GAWD help you if you're trying something crazy, like circular connections.
     const ST::string db = m_config.get<const ST::string&>("db", "engine").to_lower();
 #ifdef FUS_HAVE_SQLITE
     if (db == ST_LITERAL("sqlite") || db == ST_LITERAL("sqlite3")) {
@@ -104,9 +129,15 @@ fus::server::server(const std::filesystem::path& config_path)
         ADD_DAEMON(fus::sqlite3, db);
     }
 #endif
+#ifdef FUS_HAVE_POSTGRES
+    if (db == ST_LITERAL("postgres") || db == ST_LITERAL("postgresql") || db == ST_LITERAL("pgsql")) {
+        m_flags |= e_dbPostgres;
+        ADD_DAEMON(fus::pgsql, db);
+    }
+#endif
 
-    ADD_DAEMON(fus, admin);
-    ADD_DAEMON(fus, auth);
+    ADD_DAEMON(fus, admin, ST_LITERAL("db"));
+    ADD_DAEMON(fus, auth, ST_LITERAL("db"));
 
 #undef ADD_DAEMON
 }
@@ -117,6 +148,7 @@ fus::server::~server()
     free_daemons();
     console::get().end(); // idempotent
     m_log.close();
+    flight_recorder_close();
 }
 
 // =================================================================================
@@ -125,7 +157,7 @@ static void _on_header_read(fus::tcp_stream_t* client, ssize_t error, void* msg)
 {
     fus::log_file& log = fus::server::get()->log();
     if (error < 0) {
-        log.write_debug("[{}] Connection Header read error: {}", fus::tcp_stream_peeraddr(client), uv_strerror(error));
+        FUS_LOG_DEBUG(log, "[{}] Connection Header read error: {}", client, uv_strerror(error));
         fus::tcp_stream_shutdown(client);
         return;
     }
@@ -133,23 +165,28 @@ static void _on_header_read(fus::tcp_stream_t* client, ssize_t error, void* msg)
     fus::protocol::common_connection_header* header = (fus::protocol::common_connection_header*)msg;
     switch (header->get_connType()) {
     case fus::protocol::e_protocolCli2Admin:
-        log.write_debug("[{}] Incoming admin connection", fus::tcp_stream_peeraddr(client));
+        FUS_LOG_DEBUG(log, "[{}] Incoming admin connection", client);
         fus::admin_daemon_accept((fus::admin_server_t*)client, msg);
         break;
     case fus::protocol::e_protocolCli2Auth:
-        log.write_debug("[{}] Incoming auth connection", fus::tcp_stream_peeraddr(client));
+        FUS_LOG_DEBUG(log, "[{}] Incoming auth connection", client);
         fus::auth_daemon_accept((fus::auth_server_t*)client, msg);
         break;
     case fus::protocol::e_protocolSrv2Database:
-        log.write_debug("[{}] Incoming db connection", fus::tcp_stream_peeraddr(client));
+        FUS_LOG_DEBUG(log, "[{}] Incoming db connection", client);
 #ifdef FUS_HAVE_SQLITE
         if (fus::server::get()->use_sqlite()) {
             fus::sqlite3::db_daemon_accept((fus::sqlite3::db_server_t*)client, msg);
         }
+#endif
+#ifdef FUS_HAVE_POSTGRES
+        if (fus::server::get()->use_postgres()) {
+            fus::pgsql::db_daemon_accept((fus::pgsql::db_server_t*)client, msg);
+        }
 #endif
         break;
     default:
-        log.write_error("[{}] Invalid connection type '{2X}'", fus::tcp_stream_peeraddr(client), header->get_connType());
+        FUS_LOG_ERROR(log, "[{}] Invalid connection type '{2X}'", client, header->get_connType());
         fus::tcp_stream_shutdown(client);
         break;
     }
@@ -175,6 +212,26 @@ static void _on_client_connect(fus::tcp_stream_t* lobby, int status)
     }
 }
 
+int fus::server::connect_loopback(fus::tcp_stream_t* client)
+{
+    fus::tcp_stream_t* peer = (fus::tcp_stream_t*)malloc(k_clientMemsz);
+    fus::tcp_stream_init(peer, uv_default_loop());
+    fus::tcp_stream_free_on_close(peer, true);
+    int result = fus::tcp_stream_pair(client, peer);
+    if (result == 0) {
+        fus::tcp_stream_read_msg<fus::protocol::common_connection_header>(peer, _on_header_read);
+    } else {
+        uv_close((uv_handle_t*)peer, (uv_close_cb)fus::tcp_stream_free);
+    }
+    return result;
+}
+
+static void _on_budget_exceeded(fus::tcp_stream_t* client, const char* reason)
+{
+    fus::log_file& log = fus::server::get()->log();
+    FUS_LOG_ERROR(log, "[{}] Kicking connection for exceeding its budget of {}", client, reason);
+}
+
 bool fus::server::start_lobby()
 {
     FUS_ASSERTD(!(m_flags & e_lobbyReady));
@@ -182,6 +239,27 @@ bool fus::server::start_lobby()
 
     uv_loop_t* loop = uv_default_loop();
     m_log.open(loop, ST_LITERAL("lobby"));
+    loop_monitor_init(loop, &m_log, m_config.get<unsigned int>("loop", "slow_callback_ms"));
+
+    unsigned int flightEvents = m_config.get<unsigned int>("flight", "events");
+    if (flightEvents != 0) {
+        // Kept next to the logs, so it's wherever they are when no directory is configured.
+        std::filesystem::path flightPath = log_file::get_directory();
+        std::error_code error;
+        std::filesystem::create_directories(flightPath, error);
+        flightPath /= "fus.flight";
+        if (!flight_recorder_open(flightPath, flightEvents))
+            m_log.write_error("Failed to open the flight recorder at '{}'", flightPath.u8string().c_str());
+    }
+
+    tcp_budget_t budget;
+    budget.m_window = (uint64_t)m_config.get<unsigned int>("budget", "window") * 1000;
+    budget.m_cpuTime = (uint64_t)m_config.get<unsigned int>("budget", "cpu_ms") * 1000000;
+    budget.m_bytesIn = (uint64_t)m_config.get<unsigned int>("budget", "recv_kib") * 1024;
+    budget.m_messages = m_config.get<unsigned int>("budget", "messages");
+    if (budget.m_cpuTime == 0 && budget.m_bytesIn == 0 && budget.m_messages == 0)
+        budget.m_window = 0;
+    tcp_stream_set_budget(budget, _on_budget_exceeded);
 
     const char* bindaddr = m_config.get<const char*>("lobby", "bindaddr");
     int port = m_config.get<int>("lobby", "port");
@@ -200,6 +278,18 @@ bool fus::server::start_lobby()
     }
     m_flags |= e_lobbyReady;
 
+    unsigned int metricsPort = m_config.get<unsigned int>("metrics", "port");
+    if (metricsPort != 0) {
+        const char* metricsAddr = m_config.get<const char*>("metrics", "bindaddr");
+        sockaddr_storage metricsSockaddr;
+        if (str2addr(metricsAddr, (uint16_t)metricsPort, &metricsSockaddr) &&
+            metrics_http_init(loop, (sockaddr*)&metricsSockaddr)) {
+            m_log.write_info("Serving metrics on '{}/{}'", metricsAddr, metricsPort);
+        } else {
+            m_log.write_error("Failed to serve metrics on '{}/{}'", metricsAddr, metricsPort);
+        }
+    }
+
     if (!init_daemons()) {
         shutdown();
         return false;
@@ -229,13 +319,95 @@ void fus::server::run_once()
 
 // =================================================================================
 
+fus::daemon_ctl_map_t::iterator fus::server::find_daemon(const ST::string& name)
+{
+    auto it = m_daemonCtl.find(name);
+    if (it != m_daemonCtl.end())
+        return it;
+
+    // Allow the short name to be used, eg "db" for whichever database daemon is in use.
+    return std::find_if(m_daemonCtl.begin(), m_daemonCtl.end(),
+                        [&name](const auto& ctl) { return ctl.second.m_name.compare_i(name) == 0; });
+}
+
+bool fus::server::sort_daemons()
+{
+    // Plain old topological sort. Daemons with nothing left to wait on are taken in the order they
+    // were added, so the result is the same from run to run.
+    std::vector<daemon_ctl_map_t::iterator> pending = m_daemonIts;
+    std::vector<daemon_ctl_map_t::iterator> sorted;
+    sorted.reserve(pending.size());
+
+    while (!pending.empty()) {
+        auto ready = std::find_if(pending.begin(), pending.end(), [&](daemon_ctl_map_t::iterator daemon) {
+            return std::all_of(daemon->second.m_deps.begin(), daemon->second.m_deps.end(),
+                               [&](const ST::string& dep) {
+                auto depIt = find_daemon(dep);
+                return depIt == m_daemonCtl.end() ||
+                       std::find(sorted.begin(), sorted.end(), depIt) != sorted.end();
+            });
+        });
+        if (ready == pending.end()) {
+            m_log.write_error("Circular dependency detected between the daemons -- cannot start up");
+            return false;
+        }
+        sorted.push_back(*ready);
+        pending.erase(ready);
+    }
+
+    m_daemonIts = std::move(sorted);
+    return true;
+}
+
 bool fus::server::init_daemons()
 {
+    uint64_t startTime = uv_hrtime();
+    if (!sort_daemons())
+        return false;
+
+    // Generating keys is by far the slowest part of starting a fresh server, so do all of them at
+    // once rather than letting each daemon stumble upon its missing keys in turn. Only daemons that
+    // run in this process get keys -- a dependency that lives elsewhere has keys of its own, which
+    // must be copied from its server's config rather than made up here.
+    std::vector<ST::string> missingKeys;
+    for (auto it : m_daemonIts) {
+        const daemon_ctl_t& ctl = it->second;
+        if (!ctl.m_enabled)
+            continue;
+        std::vector<ST::string> srvs = ctl.m_deps;
+        srvs.push_back(ctl.m_name);
+        for (const ST::string& srv : srvs) {
+            if (std::find(missingKeys.begin(), missingKeys.end(), srv) != missingKeys.end())
+                continue;
+            auto dep = find_daemon(srv);
+            if (dep == m_daemonCtl.end() || !dep->second.m_enabled)
+                continue;
+            if (m_config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_k", srv)).empty() ||
+                m_config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_n", srv)).empty())
+                missingKeys.push_back(srv);
+        }
+    }
+    if (!missingKeys.empty())
+        generate_daemon_keys(missingKeys);
+
+    // Daemons create their libuv handles in init, which must happen on the loop's thread, so
+    // they're started one at a time in dependency order.
+    size_t numStarted = 0;
     for (auto it = m_daemonIts.begin(); it != m_daemonIts.end(); ++it) {
-        if ((*it)->second.m_enabled)
-            if (!daemon_ctl_result("Starting", (*it)->first, (*it)->second.init, "[  OK  ]", "[FAILED]"))
-                return false;
+        if (!(*it)->second.m_enabled)
+            continue;
+
+        uint64_t daemonStartTime = uv_hrtime();
+        if (!daemon_ctl_result("Starting", (*it)->first, (*it)->second.init, "[  OK  ]", "[FAILED]"))
+            return false;
+        m_log.write_debug("Started {} in {} ms", (*it)->first, (uv_hrtime() - daemonStartTime) / 1000000);
+        numStarted++;
     }
+
+    uint64_t elapsed = (uv_hrtime() - startTime) / 1000000;
+    m_log.write_info("Started {} daemon(s) in {} ms", numStarted, elapsed);
+    console::get() << console::weight_bold << console::foreground_green << "Started " << numStarted
+                   << " daemon(s) in " << elapsed << " ms" << console::endl;
     return true;
 }
 
@@ -264,6 +436,9 @@ void fus::server::shutdown()
             daemon_ctl_noresult("Shutting down", (*it)->first, (*it)->second.shutdown, "[  OK  ]");
     }
     uv_close((uv_handle_t*)&m_lobby, nullptr);
+    trace_shutdown();
+    metrics_http_shutdown();
+    loop_monitor_shutdown();
 
     // The "nice" shutdown may take a few loop iterations, so we'll wait nicely for a bit.
     console::get() << console::weight_bold << console::foreground_yellow
@@ -299,7 +474,10 @@ static inline void output_result(bool result, const ST::string& success, const S
     unsigned int column = std::min(70U, std::get<0>(c.size()) - resultsz);
 
     // And you thought the ansi was limited to console.cpp? For shame...
-    c << "\x1B[" << column << "G" << fus::console::weight_bold;
+    if (c.headless())
+        c << " " << fus::console::weight_bold;
+    else
+        c << "\x1B[" << column << "G" << fus::console::weight_bold;
     if (result)
         c << fus::console::foreground_green << success << fus::console::endl;
     else
@@ -21,6 +21,7 @@
 #include <string_theory/string>
 #include <unordered_map>
 #include <uv.h>
+#include <vector>
 
 #include "core/config_parser.h"
 #include "io/log_file.h"
@@ -28,6 +29,7 @@
 namespace fus
 {
     class console;
+    struct tcp_stream_t;
 
     typedef void (*daemon_ctl_noresult_f)();
     typedef bool (*daemon_ctl_result_f)();
@@ -40,9 +42,17 @@ namespace fus
         daemon_ctl_result_f shutting_down;
         bool m_enabled;
 
+        /** Short name of the daemon, eg "db". This is also the prefix of its encryption keys. */
+        ST::string m_name;
+
+        /** Short names of the daemons this daemon connects to, which must be started first. */
+        std::vector<ST::string> m_deps;
+
         daemon_ctl_t(daemon_ctl_result_f i, daemon_ctl_noresult_f sdi, daemon_ctl_noresult_f f,
-                     daemon_ctl_result_f r, daemon_ctl_result_f sdq, bool e)
-            : init(i), shutdown(sdi), free(f), running(r), shutting_down(sdq), m_enabled(e)
+                     daemon_ctl_result_f r, daemon_ctl_result_f sdq, bool e,
+                     ST::string name, std::vector<ST::string> deps)
+            : init(i), shutdown(sdi), free(f), running(r), shutting_down(sdq), m_enabled(e),
+              m_name(std::move(name)), m_deps(std::move(deps))
         { }
     };
     typedef std::unordered_map<ST::string, daemon_ctl_t, ST::hash_i, ST::equal_i> daemon_ctl_map_t;
@@ -58,6 +68,7 @@ namespace fus
             e_shuttingDown = (1<<2),
             e_hasShutdownTimer = (1<<3),
             e_dbSqlite = (1<<4),
+            e_dbPostgres = (1<<5),
         };
 
         uv_tcp_t m_lobby;
@@ -75,14 +86,24 @@ namespace fus
         void admin_init();
         bool admin_check(console&) const;
         bool admin_acctCreate(console&, const ST::string&);
+        bool admin_acctCreateBatch(console&, const ST::string&);
         bool admin_ping(console&, const ST::string&);
+        bool admin_stats(console&, const ST::string&);
         bool admin_wall(console&, const ST::string&);
 
     protected:
+        bool alloc_profile(console&, const ST::string&);
+        bool auth_cache(console&, const ST::string&);
+        bool capture(console&, const ST::string&);
+        bool db_backup(console&, const ST::string&);
         bool daemon_ctl(console&, const ST::string&);
         bool generate_keys(console&, const ST::string&);
         bool quit(console&, const ST::string&);
         bool save_config(console&, const ST::string&);
+        bool sql_profile(console&, const ST::string&);
+        bool top(console&, const ST::string&);
+        bool trace(console&, const ST::string&);
+        void trace_shutdown();
 
     public:
         static server* get() { return m_instance; }
@@ -98,6 +119,8 @@ namespace fus
         void run_once();
 
     protected:
+        daemon_ctl_map_t::iterator find_daemon(const ST::string&);
+        bool sort_daemons();
         bool init_daemons();
         void free_daemons();
         void shutdown();
@@ -128,6 +151,13 @@ namespace fus
                                      ST::string::from_literal(fail, _FailSz-1));
         }
 
+    public:
+        /**
+         * Connects a client stream straight to the lobby with tcp_stream_pair(), so the whole
+         * server can be driven from inside the process. The lobby need not be listening.
+         */
+        int connect_loopback(tcp_stream_t*);
+
     public:
         bool config2addr(const ST::string&, sockaddr_storage*);
         void fill_common_connection_header(void* packet);
@@ -137,11 +167,13 @@ namespace fus
         log_file& log() { return m_log; }
 
         bool use_sqlite() const { return m_flags & e_dbSqlite; }
+        bool use_postgres() const { return m_flags & e_dbPostgres; }
 
     public:
         void generate_client_ini(const std::filesystem::path& path) const;
         void generate_daemon_keys(bool quiet=false);
         void generate_daemon_keys(const ST::string&, bool quiet=false);
+        void generate_daemon_keys(const std::vector<ST::string>&, bool quiet=false);
     };
 };
 
@@ -14,14 +14,30 @@
  *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include "authsrv/auth.h"
 #include "client/admin_client.h"
+#include "core/alloc_profile.h"
+#include <filesystem>
 #include <fstream>
+#include "fus_config.h"
+#include "io/capture.h"
 #include "io/console.h"
 #include "io/io.h"
+#include "io/tcp_stream.h"
+#include "io/trace.h"
+#include <openssl/opensslv.h>
+#include "protocol/acct_batch.h"
 #include "protocol/admin.h"
 #include "server.h"
+#ifdef FUS_HAVE_SQLITE
+#   include "sqlite3dbsrv/sqlite3db.h"
+#endif
 #include <string_theory/iostream>
 #include <string_theory/st_format.h>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 // =================================================================================
@@ -123,6 +139,81 @@ bool fus::server::admin_acctCreate(console& console, const ST::string& line)
     return true;
 }
 
+static void admin_acctBatchCreated(void*, fus::admin_client_t*, uint32_t, fus::net_error result, ssize_t,
+                                   const fus::protocol::admin_acctCreateBatchReply* reply)
+{
+    fus::console& c = fus::console::get();
+    std::vector<fus::protocol::acct_batch_result_t> results;
+    if (result != fus::net_error::e_success || !reply ||
+        !fus::protocol::acct_batch_read_results(reply->get_results(), reply->get_resultssz(),
+                                                reply->get_count(), results)) {
+        c << fus::console::foreground_red << fus::console::weight_bold << "Error creating accounts: "
+          << fus::net_error_string(result) << fus::console::endl;
+        return;
+    }
+
+    size_t created = 0, exists = 0;
+    for (const auto& it : results) {
+        if (it.m_result == fus::net_error::e_success)
+            created++;
+        else if (it.m_result == fus::net_error::e_accountAlreadyExists)
+            exists++;
+    }
+
+    c << fus::console::foreground_green << fus::console::weight_bold << "Created " << created << " of "
+      << results.size() << " accounts" << fus::console::weight_normal;
+    if (exists)
+        c << " (" << exists << " already existed)";
+    if (created + exists != results.size())
+        c << fus::console::foreground_red << " (" << (results.size() - created - exists) << " failed)";
+    c << fus::console::endl;
+}
+
+bool fus::server::admin_acctCreateBatch(console& console, const ST::string& line)
+{
+    if (!admin_check(console))
+        return true;
+    if (line.empty())
+        return false;
+
+    std::ifstream stream(line.to_path());
+    if (!stream.is_open()) {
+        console << console::foreground_red << console::weight_bold << "Error: Unable to open '" << line << "'"
+                << console::endl;
+        return true;
+    }
+
+    // One account per line: name, password, and optionally flags, separated by whitespace.
+    std::vector<uint8_t> records;
+    uint32_t count = 0;
+    auto send = [&]() {
+        protocol::admin_acctCreateBatchRequest msg;
+        msg.set_type(msg.id());
+        client_prep_trans(m_admin, msg, this, 0, (client_trans_cb)admin_acctBatchCreated);
+        msg.set_count(count);
+        msg.set_recordssz((uint32_t)records.size());
+        tcp_stream_write_msg(m_admin, msg, records.data(), records.size());
+        records.clear();
+        count = 0;
+    };
+
+    std::string buf;
+    while (std::getline(stream, buf)) {
+        std::vector<ST::string> args = ST::string::from_std_string(buf).trim().tokenize(" \t");
+        if (args.size() < 2 || args[0].starts_with("#"))
+            continue;
+
+        uint32_t flags = args.size() > 2 ? args[2].to_uint(10) : 0;
+        protocol::acct_batch_write(records, std::string_view(args[0].c_str(), args[0].size()),
+                                   std::string_view(args[1].c_str(), args[1].size()), flags);
+        if (++count == protocol::acct_batch_max)
+            send();
+    }
+    if (count)
+        send();
+    return true;
+}
+
 
 static void admin_pong(void*, fus::admin_client_t* client, uint32_t, fus::net_error result, ssize_t nread, const fus::protocol::admin_pingReply* pong)
 {
@@ -150,6 +241,42 @@ bool fus::server::admin_ping(console& console, const ST::string&)
     return true;
 }
 
+static void admin_statsReceived(void*, fus::admin_client_t*, uint32_t, fus::net_error result, ssize_t,
+                                const fus::protocol::admin_statsReply* reply)
+{
+    fus::console& c = fus::console::get();
+    if (result != fus::net_error::e_success || !reply) {
+        c << fus::console::foreground_red << fus::console::weight_bold << "Error fetching stats: "
+          << fus::net_error_string(result) << fus::console::endl;
+        return;
+    }
+
+    ST::string stats = ST::string::from_utf8((const char*)reply->get_stats(), reply->get_statssz());
+    for (const ST::string& line : stats.split('\n')) {
+        if (line.empty())
+            continue;
+        std::vector<ST::string> parts = line.split(' ', 1);
+        c << fus::console::weight_bold << fus::console::foreground_cyan << parts[0]
+          << fus::console::weight_normal << fus::console::foreground_white;
+        if (parts.size() > 1)
+            c << " " << parts[1];
+        c << fus::console::endl;
+    }
+}
+
+bool fus::server::admin_stats(console& console, const ST::string& filter)
+{
+    if (!admin_check(console))
+        return true;
+
+    protocol::admin_statsRequest msg;
+    msg.set_type(msg.id());
+    client_prep_trans(m_admin, msg, this, 0, (client_trans_cb)admin_statsReceived);
+    msg.set_filter(filter.trim());
+    tcp_stream_write_msg(m_admin, msg);
+    return true;
+}
+
 bool fus::server::admin_wall(console& console, const ST::string& text)
 {
     if (text.empty())
@@ -166,6 +293,120 @@ bool fus::server::admin_wall(console& console, const ST::string& text)
 
 // =================================================================================
 
+bool fus::server::alloc_profile(fus::console& console, const ST::string& args)
+{
+    if (!alloc_profile_enabled()) {
+        console << console::weight_bold << console::foreground_red
+                << "Error: fus was not built with FUS_ALLOC_PROFILE" << console::endl;
+        return true;
+    }
+
+    ST::string command = args.trim().to_lower();
+    if (command == ST_LITERAL("reset")) {
+        alloc_profile_reset();
+        console << console::weight_bold << console::foreground_green << "Allocation counters reset"
+                << console::endl;
+        return true;
+    }
+    if (!command.empty())
+        return false;
+
+    std::vector<alloc_tag_stats_t> tags = alloc_profile_tags();
+    std::sort(tags.begin(), tags.end(), [](const alloc_tag_stats_t& lhs, const alloc_tag_stats_t& rhs) {
+        return lhs.m_allocs > rhs.m_allocs;
+    });
+
+    console << console::weight_bold << console::foreground_cyan
+            << ST::format("{<32} {>6} {>10} {>12} {>14} {>11} {>11}", "Tag", "Type", "Msgs", "Allocs",
+                          "Bytes", "Allocs/Msg", "Bytes/Msg")
+            << console::endl;
+    for (const alloc_tag_stats_t& tag : tags) {
+        if (tag.m_allocs == 0)
+            continue;
+        ST::string type = tag.m_type == alloc_scope_t::k_noType ? ST_LITERAL("-") : ST::format("0x{04X}", tag.m_type);
+        ST::string allocsPer = tag.m_messages ? ST::format("{.1f}", (double)tag.m_allocs / tag.m_messages) : ST_LITERAL("-");
+        ST::string bytesPer = tag.m_messages ? ST::format("{.0f}", (double)tag.m_bytes / tag.m_messages) : ST_LITERAL("-");
+        console << console::weight_normal << console::foreground_white
+                << ST::format("{<32} {>6} {>10} {>12} {>14} {>11} {>11}", tag.m_tag, type, tag.m_messages,
+                              tag.m_allocs, tag.m_bytes, allocsPer, bytesPer)
+                << console::endl;
+    }
+
+    console << console::endl << console::weight_bold << console::foreground_cyan
+            << ST::format("{<32} {>6} {>12} {>14}  {}", "Tag", "Type", "Allocs", "Bytes", "Call Site")
+            << console::endl;
+    for (const alloc_site_stats_t& site : alloc_profile_sites(20)) {
+        if (site.m_allocs == 0)
+            break;
+        ST::string type = site.m_type == alloc_scope_t::k_noType ? ST_LITERAL("-") : ST::format("0x{04X}", site.m_type);
+        console << console::weight_normal << console::foreground_white
+                << ST::format("{<32} {>6} {>12} {>14}  {}", site.m_tag, type, site.m_allocs, site.m_bytes,
+                              site.m_site)
+                << console::endl;
+    }
+    return true;
+}
+
+bool fus::server::auth_cache(fus::console& console, const ST::string&)
+{
+    auth_acct_cache_stats_t stats;
+    if (!auth_daemon_acct_cache_stats(&stats)) {
+        console << console::weight_bold << console::foreground_red << "Error: fus::auth not running"
+                << console::endl;
+        return true;
+    }
+
+    uint64_t lookups = stats.m_hits + stats.m_misses;
+    double hitRate = lookups ? (double)stats.m_hits / (double)lookups * 100.0 : 0.0;
+    console << console::weight_bold << console::foreground_cyan << "Account Cache: "
+            << console::weight_normal << console::foreground_white << stats.m_entries << "/"
+            << stats.m_capacity << " entries" << console::endl;
+    console << "    Hits: " << stats.m_hits << " Misses: " << stats.m_misses << " Evictions: "
+            << stats.m_evictions << console::endl;
+    console << "    Hit Rate: " << ST::format("{.2f}%", hitRate) << console::endl;
+    return true;
+}
+
+#ifdef FUS_HAVE_SQLITE
+static void db_backup_progress(fus::server* server, const fus::sqlite3::db_backup_progress_t& progress)
+{
+    fus::console& c = fus::console::get();
+    if (!progress.m_done) {
+        size_t pct = progress.m_total ? ((progress.m_total - progress.m_remaining) * 100) / progress.m_total : 0;
+        c << fus::console::foreground_cyan << "Database Backup: " << pct << "% ("
+          << (progress.m_total - progress.m_remaining) << "/" << progress.m_total << " pages)"
+          << fus::console::endl;
+    } else if (progress.m_success) {
+        c << fus::console::weight_bold << fus::console::foreground_green << "Database Backup: Complete in "
+          << progress.m_elapsed << "ms" << fus::console::endl;
+    } else {
+        c << fus::console::weight_bold << fus::console::foreground_red << "Database Backup: Failed (see db log)"
+          << fus::console::endl;
+    }
+}
+#endif
+
+bool fus::server::db_backup(fus::console& console, const ST::string& args)
+{
+#ifdef FUS_HAVE_SQLITE
+    ST::string path = args.trim();
+    if (path.empty())
+        path = m_config.get<const ST::string&>("sqlite", "backup_path");
+
+    if (!sqlite3::db_daemon_backup(path, (sqlite3::db_backup_cb)db_backup_progress, this)) {
+        console << console::weight_bold << console::foreground_red
+                << "Error: Unable to start database backup (see db log)" << console::endl;
+    } else {
+        console << console::weight_bold << console::foreground_cyan << "Backing up database to '"
+                << path << "'..." << console::endl;
+    }
+#else
+    console << console::weight_bold << console::foreground_red << "Error: SQLite3 support not available"
+            << console::endl;
+#endif
+    return true;
+}
+
 bool fus::server::daemon_ctl(fus::console& console, const ST::string& line)
 {
     std::vector args = line.split(' ');
@@ -198,13 +439,10 @@ bool fus::server::daemon_ctl(fus::console& console, const ST::string& line)
 
 bool fus::server::generate_keys(fus::console& console, const ST::string& args)
 {
-    if (args.empty()) {
+    if (args.empty())
         generate_daemon_keys();
-    } else {
-        std::vector<ST::string> srvs = args.split(' ');
-        for (const ST::string& srv : srvs)
-            generate_daemon_keys(srv);
-    }
+    else
+        generate_daemon_keys(args.split(' '));
     return true;
 }
 
@@ -240,6 +478,233 @@ bool fus::server::save_config(fus::console& console, const ST::string& args)
     return true;
 }
 
+bool fus::server::sql_profile(fus::console& console, const ST::string&)
+{
+#ifdef FUS_HAVE_SQLITE
+    std::vector<sqlite3::db_stmt_profile_t> profiles;
+    if (!sqlite3::db_daemon_stmt_profile(profiles)) {
+        console << console::weight_bold << console::foreground_red << "Error: fus::db (SQLite3) not running"
+                << console::endl;
+        return true;
+    }
+
+    for (const auto& profile : profiles) {
+        if (profile.m_execs == 0)
+            continue;
+        console << console::weight_bold << console::foreground_cyan << profile.m_name << ": "
+                << console::weight_normal << console::foreground_white << profile.m_execs << " execs, "
+                << profile.m_rows << " rows, " << profile.m_busy << " busy, " << profile.m_errors
+                << " errors" << console::endl;
+        console << "    avg " << (profile.m_time / profile.m_execs) << " us, p50 <= " << profile.m_p50
+                << " us, p99 <= " << profile.m_p99 << " us, max " << profile.m_maxTime << " us"
+                << console::endl;
+    }
+#else
+    console << console::weight_bold << console::foreground_red << "Error: SQLite3 support not available"
+            << console::endl;
+#endif
+    return true;
+}
+
+// =================================================================================
+
+bool fus::server::top(fus::console& console, const ST::string& args)
+{
+    std::vector<ST::string> params = args.trim().split(' ');
+    ST::string sortBy = params[0].empty() ? ST_LITERAL("cpu") : params[0].to_lower();
+    size_t count = params.size() > 1 ? params[1].to_uint(10) : 10;
+    if (sortBy != ST_LITERAL("cpu") && sortBy != ST_LITERAL("bytes") && sortBy != ST_LITERAL("msgs"))
+        return false;
+
+    struct row_t
+    {
+        const tcp_stream_t* m_stream;
+        double m_age;
+        double m_msgRate;
+        uint32_t m_topType;
+    };
+
+    uint64_t now = uv_now(uv_default_loop());
+    std::vector<row_t> rows;
+    for (const tcp_stream_t* stream : tcp_stream_connections()) {
+        const tcp_stats_t& stats = tcp_stream_stats(stream);
+        row_t& row = rows.emplace_back();
+        row.m_stream = stream;
+        row.m_age = std::max(1.0, (double)(now - stats.m_connectedAt) / 1000.0);
+        row.m_msgRate = (double)stats.m_messages / row.m_age;
+        row.m_topType = (uint32_t)(std::max_element(std::begin(stats.m_msgTypes), std::end(stats.m_msgTypes)) -
+                                   std::begin(stats.m_msgTypes));
+    }
+
+    std::sort(rows.begin(), rows.end(), [&sortBy](const row_t& lhs, const row_t& rhs) {
+        const tcp_stats_t& l = tcp_stream_stats(lhs.m_stream);
+        const tcp_stats_t& r = tcp_stream_stats(rhs.m_stream);
+        if (sortBy == ST_LITERAL("bytes"))
+            return (l.m_bytesIn + l.m_bytesOut) > (r.m_bytesIn + r.m_bytesOut);
+        if (sortBy == ST_LITERAL("msgs"))
+            return lhs.m_msgRate > rhs.m_msgRate;
+        return l.m_cpuTime > r.m_cpuTime;
+    });
+
+    console << console::weight_bold << console::foreground_cyan
+            << ST::format("{>8} {<24} {>8} {>9} {>10} {>9} {>9} {>8} {>8} {>6}", "ID", "Peer", "Age (s)",
+                          "CPU (ms)", "Crypt (ms)", "In (KiB)", "Out (KiB)", "Msgs", "Msg/s", "Type")
+            << console::endl;
+    for (size_t i = 0; i < rows.size() && i < count; ++i) {
+        const row_t& row = rows[i];
+        const tcp_stats_t& stats = tcp_stream_stats(row.m_stream);
+        ST::string topType = stats.m_messages ? ST::format("0x{04X}", row.m_topType) : ST_LITERAL("-");
+        console << console::weight_normal << console::foreground_white
+                << ST::format("{>8} {<24} {>8.0f} {>9.1f} {>10.1f} {>9} {>9} {>8} {>8.1f} {>6}",
+                              tcp_stream_connid(row.m_stream), tcp_stream_peeraddr(row.m_stream), row.m_age,
+                              (double)stats.m_cpuTime / 1000000.0, (double)stats.m_cryptTime / 1000000.0,
+                              stats.m_bytesIn / 1024, stats.m_bytesOut / 1024, stats.m_messages,
+                              row.m_msgRate, topType)
+                << console::endl;
+    }
+    console << console::weight_normal << rows.size() << " connection(s)" << console::endl;
+    return true;
+}
+
+// =================================================================================
+
+struct capture_window_t
+{
+    uv_timer_t m_timer;
+    std::filesystem::path m_path;
+};
+
+static void capture_window_closed(capture_window_t* window)
+{
+    delete window;
+}
+
+static void capture_window_end(uv_timer_t* timer)
+{
+    auto window = (capture_window_t*)uv_handle_get_data((uv_handle_t*)timer);
+    size_t sessions, bytes;
+    bool result = fus::capture_stop(window->m_path, sessions, bytes);
+
+    fus::console& c = fus::console::get();
+    if (result) {
+        c << fus::console::weight_bold << fus::console::foreground_green << "Capture: Wrote " << sessions
+          << " connections (" << (bytes / 1024) << " KiB) to '" << window->m_path.u8string() << "'"
+          << fus::console::endl;
+    } else {
+        c << fus::console::weight_bold << fus::console::foreground_red << "Capture: Unable to write '"
+          << window->m_path.u8string() << "'" << fus::console::endl;
+    }
+    uv_close((uv_handle_t*)timer, (uv_close_cb)capture_window_closed);
+}
+
+bool fus::server::capture(fus::console& console, const ST::string& args)
+{
+    std::vector<ST::string> params = args.trim().split(' ', 1);
+    unsigned int seconds = params[0].to_uint(10);
+    if (seconds == 0)
+        return false;
+
+    std::filesystem::path path;
+    if (params.size() > 1) {
+        path = params[1].trim().to_path();
+    } else {
+        path = m_config.get<const ST::string&>("log", "directory").to_path();
+        path /= ST::format("capture-{}.fcap", time(nullptr)).to_path();
+    }
+
+    if (!capture_start((size_t)m_config.get<unsigned int>("capture", "max_size") * 1024 * 1024)) {
+        console << console::weight_bold << console::foreground_red << "Error: Traffic is already being captured"
+                << console::endl;
+        return true;
+    }
+
+    capture_window_t* window = new capture_window_t;
+    window->m_path = std::move(path);
+    uv_timer_init(uv_default_loop(), &window->m_timer);
+    uv_handle_set_data((uv_handle_t*)&window->m_timer, window);
+    uv_timer_start(&window->m_timer, capture_window_end, seconds * 1000, 0);
+    uv_unref((uv_handle_t*)&window->m_timer);
+
+    console << console::weight_bold << console::foreground_cyan << "Capturing new connections for " << seconds
+            << " seconds..." << console::endl;
+    return true;
+}
+
+// =================================================================================
+
+struct trace_window_t
+{
+    uv_timer_t m_timer;
+    std::filesystem::path m_path;
+};
+
+static trace_window_t* s_traceWindow = nullptr;
+
+static void trace_window_closed(trace_window_t* window)
+{
+    delete window;
+}
+
+static void trace_window_end(uv_timer_t* timer)
+{
+    auto window = (trace_window_t*)uv_handle_get_data((uv_handle_t*)timer);
+    std::vector<fus::trace_span_t> spans = fus::trace_stop();
+
+    fus::console& c = fus::console::get();
+    if (fus::trace_write_chrome(spans, window->m_path)) {
+        c << fus::console::weight_bold << fus::console::foreground_green << "Trace: Wrote " << spans.size()
+          << " spans to '" << window->m_path.u8string() << "'" << fus::console::endl;
+    } else {
+        c << fus::console::weight_bold << fus::console::foreground_red << "Trace: Unable to write '"
+          << window->m_path.u8string() << "'" << fus::console::endl;
+    }
+    s_traceWindow = nullptr;
+    uv_timer_stop(timer);
+    uv_close((uv_handle_t*)timer, (uv_close_cb)trace_window_closed);
+}
+
+bool fus::server::trace(fus::console& console, const ST::string& args)
+{
+    std::vector<ST::string> params = args.trim().split(' ', 1);
+    unsigned int seconds = params[0].to_uint(10);
+    if (seconds == 0)
+        return false;
+
+    std::filesystem::path path;
+    if (params.size() > 1) {
+        path = params[1].trim().to_path();
+    } else {
+        path = m_config.get<const ST::string&>("log", "directory").to_path();
+        path /= ST::format("trace-{}.json", time(nullptr)).to_path();
+    }
+
+    if (!trace_start()) {
+        console << console::weight_bold << console::foreground_red << "Error: A trace is already being recorded"
+                << console::endl;
+        return true;
+    }
+
+    // Don't let an unfinished trace hold up shutdown -- it's only diagnostics.
+    trace_window_t* window = new trace_window_t;
+    window->m_path = std::move(path);
+    uv_timer_init(uv_default_loop(), &window->m_timer);
+    uv_handle_set_data((uv_handle_t*)&window->m_timer, window);
+    uv_timer_start(&window->m_timer, trace_window_end, seconds * 1000, 0);
+    uv_unref((uv_handle_t*)&window->m_timer);
+    s_traceWindow = window;
+
+    console << console::weight_bold << console::foreground_cyan << "Tracing db transactions for " << seconds
+            << " seconds..." << console::endl;
+    return true;
+}
+
+void fus::server::trace_shutdown()
+{
+    // The window's timer doesn't keep the loop alive, so end it early and keep what we've got.
+    if (s_traceWindow)
+        trace_window_end(&s_traceWindow->m_timer);
+}
+
 // =================================================================================
 
 void fus::server::start_console()
@@ -253,6 +718,16 @@ void fus::server::start_console()
     // Add all console commands.
     console.add_command("addacct", "addacct [name] [password] [flags]", "Creates a new account for logging into the game",
                         std::bind(&fus::server::admin_acctCreate, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("addaccts", "addaccts [file]", "Creates every account listed in a file of 'name password [flags]' lines",
+                        std::bind(&fus::server::admin_acctCreateBatch, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("allocs", "allocs [reset]", "Displays allocation counts per subsystem, message type and call site",
+                        std::bind(&fus::server::alloc_profile, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("authcache", "authcache", "Displays statistics for the auth daemon's account cache",
+                        std::bind(&fus::server::auth_cache, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("backup", "backup [path]", "Makes an online backup of the SQLite3 database",
+                        std::bind(&fus::server::db_backup, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("capture", "capture [seconds] [path]", "Records the decrypted traffic of new connections for replay with fus_replay",
+                        std::bind(&fus::server::capture, this, std::placeholders::_1, std::placeholders::_2));
     console.add_command("config", "config [server|client] [output]", "Generates fus or plClient configuration",
                         std::bind(&fus::server::save_config, this, std::placeholders::_1, std::placeholders::_2));
     console.add_command("daemonctl", "daemonctl [start|status] [server]", "Observe or manipulate the status of fus daemons",
@@ -263,6 +738,14 @@ void fus::server::start_console()
                         std::bind(&fus::server::admin_ping, this, std::placeholders::_1, std::placeholders::_2));
     console.add_command("quit", "quit", "Shuts down the local fus daemon",
                         std::bind(&fus::server::quit, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("sqlprofile", "sqlprofile", "Displays execution statistics for SQL statements run by the db daemon",
+                        std::bind(&fus::server::sql_profile, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("stats", "stats [filter]", "Displays runtime statistics from the admin daemon's process",
+                        std::bind(&fus::server::admin_stats, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("top", "top [cpu|bytes|msgs] [count]", "Lists the connections using the most CPU time, bandwidth or messages",
+                        std::bind(&fus::server::top, this, std::placeholders::_1, std::placeholders::_2));
+    console.add_command("trace", "trace [seconds] [path]", "Records db transaction spans for a while and saves them as a Chrome trace",
+                        std::bind(&fus::server::trace, this, std::placeholders::_1, std::placeholders::_2));
     console.add_command("wall", "wall [msg]", "Sends a message to all server consoles and players in the cavern",
                         std::bind(&fus::server::admin_wall, this, std::placeholders::_1, std::placeholders::_2));
 
@@ -277,33 +760,88 @@ void fus::server::start_console()
 
 void fus::server::generate_daemon_keys(bool quiet)
 {
+    std::vector<ST::string> srvs;
+    srvs.reserve(m_daemonCtl.size());
     for (auto& it : m_daemonCtl)
-        generate_daemon_keys(it.first, quiet);
+        srvs.push_back(it.first);
+    generate_daemon_keys(srvs, quiet);
 }
 
 void fus::server::generate_daemon_keys(const ST::string& srv, bool quiet)
+{
+    generate_daemon_keys(std::vector<ST::string>{ srv }, quiet);
+}
+
+void fus::server::generate_daemon_keys(const std::vector<ST::string>& srvs, bool quiet)
 {
     console& c = console::get();
-    auto it = m_daemonCtl.find(srv);
-    if (it == m_daemonCtl.end()) {
-        if (!quiet) {
-            c << console::weight_bold << console::foreground_red << "Error: Unknown server type '"
-              << srv << "'" << console::endl;
+    ST::string section = ST_LITERAL("crypt");
+
+    std::vector<ST::string> names;
+    std::vector<unsigned int> g_values;
+    for (const ST::string& srv : srvs) {
+        auto it = find_daemon(srv);
+        if (it == m_daemonCtl.end()) {
+            if (!quiet) {
+                c << console::weight_bold << console::foreground_red << "Error: Unknown server type '"
+                  << srv << "'" << console::endl;
+            }
+            continue;
         }
-        return;
+
+        const ST::string& name = it->second.m_name;
+        if (std::find(names.begin(), names.end(), name) != names.end())
+            continue;
+        names.push_back(name);
+        g_values.push_back(m_config.get<unsigned int>(section, ST::format("{}_g", name)));
     }
+    if (names.empty())
+        return;
 
     if (!quiet) {
-        c << console::weight_bold << console::foreground_yellow << "Generating keys for fus::"
-          << srv << console::endl;
+        c << console::weight_bold << console::foreground_yellow << "Generating keys for";
+        for (const ST::string& name : names)
+            c << " fus::" << name;
+        c << console::endl;
     }
 
-    ST::string section = ST_LITERAL("crypt");
-    unsigned int g_value = m_config.get<unsigned int>(section, ST::format("{}_g", srv));
-    auto keys = fus::io_generate_keys(g_value);
-    m_config.set<const ST::string&>(section, ST::format("{}_k", srv), std::get<0>(keys));
-    m_config.set<const ST::string&>(section, ST::format("{}_n", srv), std::get<1>(keys));
-    m_config.set<const ST::string&>(section, ST::format("{}_x", srv), std::get<2>(keys));
+    // Each set of keys is two safe prime searches, which can take several seconds apiece, so
+    // spread the daemons over as many cores as we have.
+    std::vector<std::tuple<ST::string, ST::string, ST::string>> keys(names.size());
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        for (size_t i = next++; i < names.size(); i = next++)
+            keys[i] = fus::io_generate_keys(g_values[i]);
+    };
+
+    uint64_t startTime = uv_hrtime();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    size_t numThreads = std::min(names.size(), (size_t)std::max(1U, std::thread::hardware_concurrency()));
+#else
+    // OpenSSL 1.0 isn't thread safe without locking callbacks that we don't install.
+    size_t numThreads = 1;
+#endif
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads - 1);
+    for (size_t i = 1; i < numThreads; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    // The config parser isn't thread safe, so the keys are only stored once everyone's done.
+    for (size_t i = 0; i < names.size(); ++i) {
+        m_config.set<const ST::string&>(section, ST::format("{}_k", names[i]), std::get<0>(keys[i]));
+        m_config.set<const ST::string&>(section, ST::format("{}_n", names[i]), std::get<1>(keys[i]));
+        m_config.set<const ST::string&>(section, ST::format("{}_x", names[i]), std::get<2>(keys[i]));
+    }
+
+    uint64_t elapsed = (uv_hrtime() - startTime) / 1000000;
+    m_log.write_info("Generated {} set(s) of keys on {} thread(s) in {} ms", names.size(), numThreads, elapsed);
+    if (!quiet) {
+        c << console::weight_bold << console::foreground_green << "Generated " << names.size()
+          << " set(s) of keys in " << elapsed << " ms" << console::endl;
+    }
 }
 
 // =================================================================================
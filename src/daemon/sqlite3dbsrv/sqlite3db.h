@@ -19,6 +19,8 @@
 
 #include "core/list.h"
 #include "io/crypt_stream.h"
+#include <string_view>
+#include <vector>
 
 namespace fus
 {
@@ -43,6 +45,59 @@ namespace fus
         void db_daemon_shutdown();
 
         void db_daemon_accept(db_server_t*, const void*);
+
+        struct db_stmt_profile_t
+        {
+            const char* m_name;
+            uint64_t m_execs;
+            uint64_t m_rows;
+            uint64_t m_busy;
+            uint64_t m_errors;
+            uint64_t m_time;
+            uint64_t m_maxTime;
+            uint64_t m_p50;
+            uint64_t m_p99;
+        };
+
+        struct db_backup_progress_t
+        {
+            size_t m_remaining;
+            size_t m_total;
+            uint64_t m_elapsed;
+            bool m_done;
+            bool m_success;
+        };
+
+        typedef void (*db_backup_cb)(void*, const db_backup_progress_t&);
+
+        /**
+         * Starts an online backup of the database to the specified path. The backup is copied a few
+         * pages at a time on each shard's thread between requests, so the daemon remains responsive
+         * while it runs.
+         * \returns false if the backup could not be started.
+         */
+        bool db_daemon_backup(const ST::string& path, db_backup_cb cb, void* instance);
+
+        /** SQL that creates every table and index used by the db daemon. */
+        const char* db_schema();
+
+        /** Stable FNV-1a hash used to assign records to shards. */
+        uint64_t db_shard_hash(const void* buf, size_t bufsz);
+
+        /** Stable shard index of an account name. */
+        size_t db_shard_index(const std::string_view& name, size_t numShards);
+
+        /** Gets the path to a shard's database file. */
+        ST::string db_shard_path(const ST::string& path, size_t idx, size_t numShards);
+
+        /**
+         * Moves accounts to the shard they belong in after the number of shards has been changed.
+         * This must only be done while the db daemon is not running.
+         */
+        bool db_rebalance();
+
+        /** Fetches the execution profile (times in microseconds) of every statement run by the db daemon. */
+        bool db_daemon_stmt_profile(std::vector<db_stmt_profile_t>&);
     };
 };
 
@@ -0,0 +1,295 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "core/errors.h"
+#include "daemon/server.h"
+#include <filesystem>
+#include "io/loop_monitor.h"
+#include <new>
+#include "sqlite3db_private.h"
+
+// =================================================================================
+
+struct fus::sqlite3::db_backup_t
+{
+    uv_timer_t m_timer;
+    ::sqlite3* m_dest;
+    sqlite3_backup* m_backup;
+    ST::string m_basePath;
+    ST::string m_path;
+    size_t m_shard;
+    int m_pagesPerTick;
+    uint64_t m_start;
+    int m_lastReport;
+
+    // Written by the shard's thread, read on the loop once the step's completion is posted.
+    size_t m_total;
+    size_t m_remaining;
+
+    // The loop won't queue another step while one is in flight.
+    bool m_busy;
+    bool m_aborted;
+
+    db_backup_cb m_cb;
+    void* m_instance;
+};
+
+// =================================================================================
+
+static void backup_closed(fus::sqlite3::db_backup_t* backup)
+{
+    backup->~db_backup_t();
+    free(backup);
+}
+
+/** Starts copying the current shard. Must run on the shard's thread. */
+static bool backup_open_shard(fus::sqlite3::db_backup_t* backup)
+{
+    using namespace fus::sqlite3;
+
+    // Each shard is copied to its own file, named the same way as the shards themselves.
+    db_shard_t* shard = s_dbDaemon->m_shards[backup->m_shard];
+    backup->m_path = db_shard_path(backup->m_basePath, backup->m_shard, s_dbDaemon->m_shards.size());
+
+    int result = sqlite3_open(backup->m_path.c_str(), &backup->m_dest);
+    if (result != SQLITE_OK) {
+        s_dbDaemon->m_log.write_error("SQLite3 Backup '{}' Open Failed: {}", backup->m_path, sqlite3_errstr(result));
+        sqlite3_close(backup->m_dest);
+        backup->m_dest = nullptr;
+        return false;
+    }
+
+    backup->m_backup = sqlite3_backup_init(backup->m_dest, "main", shard->m_db, "main");
+    if (!backup->m_backup) {
+        s_dbDaemon->m_log.write_error("SQLite3 Backup '{}' Init Failed: {}", backup->m_path, sqlite3_errmsg(backup->m_dest));
+        sqlite3_close(backup->m_dest);
+        backup->m_dest = nullptr;
+        return false;
+    }
+
+    backup->m_lastReport = 0;
+    return true;
+}
+
+/** Finishes copying the current shard. Must run on the shard's thread. */
+static bool backup_close_shard(fus::sqlite3::db_backup_t* backup, bool success)
+{
+    using namespace fus::sqlite3;
+
+    if (backup->m_backup) {
+        int result = sqlite3_backup_finish(backup->m_backup);
+        success = success && (result == SQLITE_OK);
+        backup->m_backup = nullptr;
+    }
+    if (!success && backup->m_dest)
+        s_dbDaemon->m_log.write_error("SQLite3 Backup '{}' Failed: {}", backup->m_path, sqlite3_errmsg(backup->m_dest));
+    sqlite3_close(backup->m_dest);
+    backup->m_dest = nullptr;
+    return success;
+}
+
+static void backup_finish(fus::sqlite3::db_backup_t* backup, bool success)
+{
+    using namespace fus::sqlite3;
+
+    uint64_t elapsed = uv_now(uv_default_loop()) - backup->m_start;
+    if (success)
+        s_dbDaemon->m_log.write_info("SQLite3 Backup '{}' Complete: {} shard(s) in {} ms", backup->m_basePath,
+                                     s_dbDaemon->m_shards.size(), elapsed);
+
+    // Don't leave a partial copy lying around where someone might mistake it for a real backup.
+    if (!success) {
+        std::error_code error;
+        for (size_t i = 0; i <= backup->m_shard && i < s_dbDaemon->m_shards.size(); ++i) {
+            ST::string path = db_shard_path(backup->m_basePath, i, s_dbDaemon->m_shards.size());
+            std::filesystem::remove(path.to_path(), error);
+        }
+    }
+
+    if (backup->m_cb) {
+        db_backup_progress_t progress{};
+        progress.m_elapsed = elapsed;
+        progress.m_done = true;
+        progress.m_success = success;
+        backup->m_cb(backup->m_instance, progress);
+    }
+
+    if (s_dbDaemon->m_backup == backup)
+        s_dbDaemon->m_backup = nullptr;
+    uv_timer_stop(&backup->m_timer);
+    uv_close((uv_handle_t*)&backup->m_timer, (uv_close_cb)backup_closed);
+}
+
+static void backup_cancel(fus::sqlite3::db_backup_t* backup)
+{
+    using namespace fus::sqlite3;
+
+    backup->m_busy = true;
+    uv_timer_stop(&backup->m_timer);
+    db_shard_submit(s_dbDaemon->m_shards[backup->m_shard], [backup]() {
+        backup_close_shard(backup, false);
+        db_daemon_post([backup]() { backup_finish(backup, false); });
+    });
+}
+
+static int backup_step(fus::sqlite3::db_backup_t* backup)
+{
+    using namespace fus::sqlite3;
+
+    if (!backup->m_backup && !backup_open_shard(backup))
+        return SQLITE_ERROR;
+
+    // Small batches keep each step short, and the source is only locked during the step itself.
+    // Changes made through the shard's own connection are applied to the backup by SQLite, so
+    // the result is a consistent snapshot as of the moment the backup completes.
+    int result = sqlite3_backup_step(backup->m_backup, backup->m_pagesPerTick);
+    backup->m_total = (size_t)sqlite3_backup_pagecount(backup->m_backup);
+    backup->m_remaining = (size_t)sqlite3_backup_remaining(backup->m_backup);
+
+    switch (result) {
+    case SQLITE_DONE:
+        return backup_close_shard(backup, true) ? SQLITE_DONE : SQLITE_ERROR;
+    case SQLITE_OK:
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+        return result;
+    default:
+        backup_close_shard(backup, false);
+        return result;
+    }
+}
+
+static void backup_stepped(fus::sqlite3::db_backup_t* backup, int result)
+{
+    using namespace fus::sqlite3;
+
+    backup->m_busy = false;
+    switch (result) {
+    case SQLITE_DONE:
+        if (++backup->m_shard >= s_dbDaemon->m_shards.size()) {
+            backup_finish(backup, true);
+            return;
+        }
+        backup->m_lastReport = 0;
+        break;
+    case SQLITE_OK:
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+        // Try again next tick.
+        break;
+    default:
+        backup_finish(backup, false);
+        return;
+    }
+
+    if (backup->m_aborted) {
+        backup_cancel(backup);
+        return;
+    }
+
+    size_t total = backup->m_total;
+    size_t remaining = backup->m_remaining;
+    int pct = total ? (int)(((total - remaining) * 100) / total) : 0;
+    if (result != SQLITE_DONE && (pct / 10) != (backup->m_lastReport / 10)) {
+        backup->m_lastReport = pct;
+        s_dbDaemon->m_log.write_debug("SQLite3 Backup '{}': {}% ({}/{} pages)", backup->m_path, pct,
+                                      total - remaining, total);
+
+        if (backup->m_cb) {
+            db_backup_progress_t progress{};
+            progress.m_remaining = remaining;
+            progress.m_total = total;
+            progress.m_elapsed = uv_now(uv_default_loop()) - backup->m_start;
+            backup->m_cb(backup->m_instance, progress);
+        }
+    }
+}
+
+static void backup_tick(uv_timer_t* timer)
+{
+    using namespace fus::sqlite3;
+
+    db_backup_t* backup = (db_backup_t*)uv_handle_get_data((uv_handle_t*)timer);
+    if (backup->m_busy)
+        return;
+
+    // The shard's connection belongs to its thread, so that's where the copying happens.
+    backup->m_busy = true;
+    db_shard_submit(s_dbDaemon->m_shards[backup->m_shard], [backup]() {
+        int result = backup_step(backup);
+        db_daemon_post([backup, result]() {
+            fus::loop_timer_t loopTimer("sqlite3 backup step");
+            backup_stepped(backup, result);
+        });
+    });
+}
+
+// =================================================================================
+
+bool fus::sqlite3::db_daemon_backup(const ST::string& path, db_backup_cb cb, void* instance)
+{
+    if (!s_dbDaemon || s_dbDaemon->m_shards.empty() || (s_dbDaemon->m_flags & daemon_t::e_shuttingDown))
+        return false;
+    if (s_dbDaemon->m_backup) {
+        s_dbDaemon->m_log.write_error("SQLite3 Backup '{}' Refused: a backup is already in progress", path);
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::path dir = path.to_path().parent_path();
+    if (!dir.empty())
+        std::filesystem::create_directories(dir, error);
+
+    const fus::config_parser& config = server::get()->config();
+    db_backup_t* backup = (db_backup_t*)malloc(sizeof(db_backup_t));
+    new(backup) db_backup_t();
+    backup->m_dest = nullptr;
+    backup->m_backup = nullptr;
+    backup->m_basePath = path;
+    backup->m_shard = 0;
+    backup->m_pagesPerTick = (int)std::max(1U, config.get<unsigned int>("sqlite", "backup_pages"));
+    backup->m_start = uv_now(uv_default_loop());
+    backup->m_lastReport = 0;
+    backup->m_total = 0;
+    backup->m_remaining = 0;
+    backup->m_busy = false;
+    backup->m_aborted = false;
+    backup->m_cb = cb;
+    backup->m_instance = instance;
+
+    unsigned int interval = config.get<unsigned int>("sqlite", "backup_interval");
+    uv_timer_init(uv_default_loop(), &backup->m_timer);
+    uv_handle_set_data((uv_handle_t*)&backup->m_timer, backup);
+    uv_timer_start(&backup->m_timer, backup_tick, 0, interval);
+    s_dbDaemon->m_backup = backup;
+
+    s_dbDaemon->m_log.write_info("SQLite3 Backup '{}' Started: {} pages every {} ms", path,
+                                 backup->m_pagesPerTick, interval);
+    return true;
+}
+
+void fus::sqlite3::db_backup_abort()
+{
+    // The shard may be in the middle of a step, so the backup is torn down once it's finished.
+    db_backup_t* backup = s_dbDaemon->m_backup;
+    if (!backup || backup->m_aborted)
+        return;
+    backup->m_aborted = true;
+    uv_timer_stop(&backup->m_timer);
+    if (!backup->m_busy)
+        backup_cancel(backup);
+}
@@ -14,7 +14,9 @@
  *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include "core/errors.h"
+#include "core/metrics.h"
 #include "daemon/daemon_base.h"
 #include "daemon/server.h"
 #include <new>
@@ -23,55 +25,59 @@
 
 // =================================================================================
 
-const char* s_schema =
-    "BEGIN TRANSACTION; "
-
-    // -- Table: Accounts
-    "CREATE TABLE IF NOT EXISTS Accounts ("
-    "idx INTEGER PRIMARY KEY AUTOINCREMENT, "
-    "Name VARCHAR NOT NULL, Hash CHAR (64) NOT NULL, "
-    "Uuid CHAR (16) NOT NULL, Flags INTEGER NOT NULL); "
-
-    "CREATE UNIQUE INDEX IF NOT EXISTS Index_AccountName ON Accounts (Name COLLATE NOCASE); "
-
-    // -- Table: VaultNodes
-    "CREATE TABLE IF NOT EXISTS VaultNodes ("
-    "idx INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, "
-    "CreateTime INTEGER, ModifyTime INTEGER, CreateAgeName VARCHAR (64), "
-    "CreateAgeUuid CHAR (16), CreatorUuid CHAR (16), CreatorIdx INTEGER, "
-    "NodeType INTEGER, Int32_1 INTEGER, Int32_2 INTEGER, Int32_3 INTEGER, "
-    "Int32_4 INTEGER, UInt32_1 INTEGER, UInt32_2 INTEGER, UInt32_3 INTEGER, "
-    "UInt32_4 INTEGER, Uuid_1 CHAR (16), Uuid_2 CHAR (16), Uuid_3 CHAR (16), "
-    "Uuid_4 CHAR (16), String64_1 VARCHAR (64), String64_2 VARCHAR (64), "
-    "String64_3 VARCHAR (64), String64_4 VARCHAR (64), String64_5 VARCHAR (64), "
-    "String64_6 VARCHAR (64), IString64_1 VARCHAR (64), IString64_2 VARCHAR (64), "
-    "Text_1 TEXT, Text_2 TEXT, Blob_1 BLOB, Blob_2 BLOB); "
-
-    "COMMIT TRANSACTION;";
-
-const ST::string s_addAcct =
-    ST_LITERAL("INSERT INTO Accounts (Name, Hash, Uuid, Flags) "
-               "VALUES (?, ?, ?, ?);");
-
-const ST::string s_authAcct =
-    ST_LITERAL("SELECT Hash, Uuid, Flags FROM Accounts "
-               "WHERE Name = ? COLLATE NOCASE;");
-
-// =================================================================================
-
 fus::sqlite3::db_daemon_t* fus::sqlite3::s_dbDaemon = nullptr;
 
+static fus::metric_gauge s_clients("fus_daemon_clients", "Clients connected to the daemon", "daemon=\"db\",engine=\"sqlite3\"",
+                                   []() { return (uint64_t)(fus::sqlite3::s_dbDaemon ? fus::sqlite3::s_dbDaemon->m_clients.count() : 0); });
+
 // =================================================================================
 
-static inline bool init_stmt(sqlite3_stmt** stmt, const char* name, const ST::string& sql)
+bool fus::sqlite3::db_acct_filter_load()
 {
-    using namespace fus::sqlite3;
+    unsigned int filterSize = server::get()->config().get<unsigned int>("sqlite", "acct_filter_size");
+    if (filterSize == 0) {
+        s_dbDaemon->m_acctFilter = counting_bloom_filter();
+        return true;
+    }
 
-    if (sqlite3_prepare_v2(s_dbDaemon->m_db, sql.c_str(), sql.size() + 1, stmt, nullptr) != SQLITE_OK) {
-        s_dbDaemon->m_log.write_error("{} Failed: {}", name, sqlite3_errmsg(s_dbDaemon->m_db));
-        return false;
+    // Only called before the shard threads start, so we can borrow their connections.
+    size_t numAccts = 0;
+    for (db_shard_t* shard : s_dbDaemon->m_shards) {
+        db_stmts_attach(shard->m_stmts);
+        query count(stmt_id::e_acctCount);
+        if (count.step() == SQLITE_ROW)
+            numAccts += (size_t)count.column<int>(0);
     }
-    return true;
+
+    // Leave plenty of headroom so that new accounts don't immediately overfill the filter.
+    s_dbDaemon->m_acctFilter.reset(std::max((size_t)filterSize, numAccts * 2));
+
+    bool result = true;
+    for (db_shard_t* shard : s_dbDaemon->m_shards) {
+        db_stmts_attach(shard->m_stmts);
+        query names(stmt_id::e_acctNames);
+        int stepResult;
+        while ((stepResult = names.step()) == SQLITE_ROW) {
+            ST::string key = db_acct_filter_key(names.column<std::string_view>(0));
+            s_dbDaemon->m_acctFilter.add(std::string_view(key.c_str(), key.size()));
+        }
+        if (stepResult != SQLITE_DONE) {
+            s_dbDaemon->m_log.write_error("SQLite3 Account Filter Load '{}' Failed: {}", shard->m_path,
+                                          sqlite3_errmsg(shard->m_db));
+
+            // A partially loaded filter would report false negatives, so don't use it at all.
+            s_dbDaemon->m_acctFilter = counting_bloom_filter();
+            result = false;
+            break;
+        }
+    }
+    db_stmts_attach(nullptr);
+
+    if (result)
+        s_dbDaemon->m_log.write_info("SQLite3 Account Filter: {} accounts, {} KiB",
+                                     s_dbDaemon->m_acctFilter.size(),
+                                     s_dbDaemon->m_acctFilter.memsz() / 1024);
+    return result;
 }
 
 // =================================================================================
@@ -84,39 +90,25 @@ bool fus::sqlite3::db_daemon_init()
     secure_daemon_init(s_dbDaemon, ST_LITERAL("db"));
     new(&s_dbDaemon->m_clients) FUS_LIST_DECL(db_server_t, m_link);
     new(&s_dbDaemon->m_hash) fus::hash(fus::hash_type::e_sha1);
+    new(&s_dbDaemon->m_acctFilter) fus::counting_bloom_filter();
+    new(&s_dbDaemon->m_shards) std::vector<db_shard_t*>();
+    new(&s_dbDaemon->m_postLock) std::mutex();
+    new(&s_dbDaemon->m_posted) std::deque<std::function<void()>>();
 
-    // If we're using a new database and its directory does not exist, bad things will happen.
-    const ST::string& db_path = server::get()->config().get<const ST::string&>("sqlite", "path");
-    std::filesystem::path db_dir = db_path.to_path().parent_path();
-    std::error_code error;
-    std::filesystem::create_directories(db_dir, error);
-    if (error) {
-        s_dbDaemon->m_log.write_error("Error creating directory '{}': {}", db_dir, error.message());
-        // intentionally continuing to sqlite3_open
-    }
-
-    int result = sqlite3_open(db_path.c_str(), &s_dbDaemon->m_db);
-    if (result != SQLITE_OK) {
-        s_dbDaemon->m_log.write_error("SQLite3 Open Failed: {}", sqlite3_errstr(result));
+    if (!db_shards_open())
         return false;
-    }
 
-    // Ensure all tables inited
-    // Musing: perhaps we should have a table chose columns are (TableName, Version) for upgrading
-    // purposes? As of right now, I don't envision this schema changing much once a feature is
-    // implemented. URU is quite stale, after all...
-    if (sqlite3_exec(s_dbDaemon->m_db, s_schema, nullptr, nullptr, nullptr) != SQLITE_OK) {
-        s_dbDaemon->m_log.write_error("SQLite3 Schema Init Failed: {}", sqlite3_errmsg(s_dbDaemon->m_db));
-        return false;
-    }
+    // Catch missing indices before they bite us under load. All shards share a schema.
+    size_t scans = s_dbDaemon->m_shards.front()->m_stmts->verify_plans();
+    s_dbDaemon->m_log.write_debug("SQLite3 Query Plans Verified: {} statement(s) scan a table", scans);
 
-    // Compile all SQL
-    if (!init_stmt(&s_dbDaemon->m_createAcctStmt, "SQLite3 CreateAccountStmt Init", s_addAcct))
-        return false;
-    if (!init_stmt(&s_dbDaemon->m_authAcctStmt, "SQLite3 AuthAccountStmt Init", s_authAcct))
-        return false;
+    // Failure here is not fatal -- the filter is merely a shortcut.
+    db_acct_filter_load();
 
-    s_dbDaemon->m_log.write_info("SQLite3 Database Initialized: {}", db_path);
+    // From here on, only the shard threads may run statements.
+    db_shards_start();
+
+    s_dbDaemon->m_log.write_info("SQLite3 Database Initialized: {} shard(s)", s_dbDaemon->m_shards.size());
     return true;
 }
 
@@ -137,10 +129,19 @@ void fus::sqlite3::db_daemon_free()
 {
     FUS_ASSERTD(s_dbDaemon);
 
-    sqlite3_finalize(s_dbDaemon->m_createAcctStmt);
-    sqlite3_finalize(s_dbDaemon->m_authAcctStmt);
-    FUS_ASSERTD(sqlite3_close(s_dbDaemon->m_db) == SQLITE_OK);
+    // The loop isn't running anymore, so it's too late to close the backup's timer.
+    FUS_ASSERTD(!s_dbDaemon->m_backup);
+    db_shards_stop();
+    for (db_shard_t* shard : s_dbDaemon->m_shards) {
+        if (shard->m_stmts)
+            shard->m_stmts->log_profile();
+    }
+    db_shards_close();
 
+    s_dbDaemon->m_posted.~deque();
+    s_dbDaemon->m_postLock.~mutex();
+    s_dbDaemon->m_shards.~vector();
+    s_dbDaemon->m_acctFilter.~counting_bloom_filter();
     s_dbDaemon->m_hash.~hash();
     s_dbDaemon->m_clients.~list_declare();
     secure_daemon_free(s_dbDaemon);
@@ -153,6 +154,12 @@ void fus::sqlite3::db_daemon_shutdown()
     FUS_ASSERTD(s_dbDaemon);
     secure_daemon_shutdown(s_dbDaemon);
 
+    // Let the shards finish whatever they're working on so that replies can go out before the
+    // clients are shut down. Stopping the shards also finishes tearing down an aborted backup, so
+    // its timer is closed while the loop can still run the close callback.
+    db_backup_abort();
+    db_shards_stop();
+
     // Clients will be removed from the list by db_server_free
     auto it = s_dbDaemon->m_clients.front();
     while (it) {
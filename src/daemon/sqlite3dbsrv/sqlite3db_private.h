@@ -17,10 +17,19 @@
 #ifndef __FUS_SQLITE3DB_DAEMON_PRIVATE_H
 #define __FUS_SQLITE3DB_DAEMON_PRIVATE_H
 
+#include <atomic>
+#include "core/bloom_filter.h"
+#include <condition_variable>
 #include "daemon/daemon_base.h"
+#include <deque>
+#include <functional>
 #include "io/hash.h"
+#include <mutex>
 #include <sqlite3.h>
 #include "sqlite3db.h"
+#include <thread>
+#include <tuple>
+#include <vector>
 
 namespace fus
 {
@@ -28,33 +37,202 @@ namespace fus
 
     namespace sqlite3
     {
+        /**
+         * \brief Compile-time identifiers for every SQL statement used by the SQLite engine.
+         * \remarks The SQL text for each identifier lives in sqlite3db_stmt.cpp and must be kept
+         *          in the same order.
+         */
+        enum class stmt_id
+        {
+            e_createAcct,
+            e_authAcct,
+            e_acctExists,
+            e_acctCount,
+            e_acctNames,
+
+            e_numStmts
+        };
+
+        /** Latency histogram buckets are powers of two in microseconds. */
+        constexpr size_t STMT_LATENCY_BUCKETS = 24;
+
+        /** Statement stats are written by the shard thread and read by the console, hence atomics. */
+        struct stmt_stats_t
+        {
+            std::atomic<uint64_t> m_execs;
+            std::atomic<uint64_t> m_time;
+            std::atomic<uint64_t> m_rows;
+            std::atomic<uint64_t> m_busy;
+            std::atomic<uint64_t> m_errors;
+            std::atomic<uint64_t> m_maxTime;
+            std::atomic<uint64_t> m_latency[STMT_LATENCY_BUCKETS];
+        };
+
+        /**
+         * \brief Lazily prepared statements for a single database connection.
+         * SQLite statements belong to the connection that prepared them, so each thread that
+         * talks to the database owns its own registry (and connection). Statements are compiled
+         * on first use and live until the registry is destroyed. The registry also hooks the
+         * connection's trace callback to profile every statement it owns.
+         */
+        class stmt_registry
+        {
+            ::sqlite3* m_db;
+            sqlite3_stmt* m_stmts[(size_t)stmt_id::e_numStmts];
+            stmt_stats_t m_stats[(size_t)stmt_id::e_numStmts];
+
+            static int trace(unsigned int, void*, void*, void*);
+
+        public:
+            stmt_registry(::sqlite3* db);
+            stmt_registry(const stmt_registry&) = delete;
+            stmt_registry(stmt_registry&&) = delete;
+            ~stmt_registry();
+
+            /** Fetches a statement, compiling it if needed. Returns nullptr if compilation failed. */
+            sqlite3_stmt* get(stmt_id id);
+
+            /** Finds the ID of a statement owned by this registry. */
+            stmt_id find(const sqlite3_stmt* stmt) const;
+
+            /** Finalizes all compiled statements; the connection may be closed afterward. */
+            void finalize();
+
+            /**
+             * Runs EXPLAIN QUERY PLAN on every registered statement and logs a warning for each
+             * unexpected full table scan.
+             * \returns The number of statements that will scan a table.
+             */
+            size_t verify_plans();
+
+            /** Logs the execution profile of every statement that has been run. */
+            void log_profile() const;
+
+            ::sqlite3* db() const { return m_db; }
+            static const char* name(stmt_id id);
+            static const char* sql(stmt_id id);
+            stmt_stats_t& stats(stmt_id id) { return m_stats[(size_t)id]; }
+            const stmt_stats_t& stats(stmt_id id) const { return m_stats[(size_t)id]; }
+        };
+
+        /**
+         * Attaches a statement registry to the calling thread. Until another registry is attached,
+         * all queries made on this thread will use it.
+         */
+        void db_stmts_attach(stmt_registry*);
+
+        /** Statement registry for the calling thread. */
+        stmt_registry* db_stmts();
+
+        /**
+         * \brief A single database file and the thread that owns its connection.
+         * Accounts are distributed among shards by a stable hash of the case-folded account name,
+         * so a given account always lives in the same file. Work is queued to the shard's thread,
+         * which is the only thread that executes statements on its connection.
+         */
+        struct db_shard_t
+        {
+            size_t m_idx;
+            ST::string m_path;
+            ::sqlite3* m_db;
+            stmt_registry* m_stmts;
+            fus::hash m_hash;
+
+            std::thread m_thread;
+            std::mutex m_lock;
+            std::condition_variable m_cv;
+            std::deque<std::function<void()>> m_jobs;
+            bool m_quit;
+            bool m_stopped;
+
+            db_shard_t(size_t idx, const ST::string& path);
+            db_shard_t(const db_shard_t&) = delete;
+            db_shard_t(db_shard_t&&) = delete;
+            ~db_shard_t();
+
+            /** Opens the database connection and ensures the schema exists. */
+            bool open();
+            void start();
+            void stop();
+        };
+
+        struct db_backup_t;
+
         struct db_daemon_t : public secure_daemon_t
         {
             FUS_LIST_DECL(db_server_t, m_link) m_clients;
             fus::hash m_hash;
+            counting_bloom_filter m_acctFilter;
 
-            ::sqlite3* m_db;
-            sqlite3_stmt* m_createAcctStmt;
-            sqlite3_stmt* m_authAcctStmt;
+            std::vector<db_shard_t*> m_shards;
+            db_backup_t* m_backup;
+
+            // Work completed by the shards, to be run on the event loop.
+            uv_async_t m_async;
+            std::mutex m_postLock;
+            std::deque<std::function<void()>> m_posted;
         };
 
+        /** Cancels any backup in progress. */
+        void db_backup_abort();
+
         extern db_daemon_t* s_dbDaemon;
 
+        db_shard_t* db_shard_for_name(const std::string_view& name);
+        db_shard_t* db_shard_for_uuid(const fus::uuid& uuid);
+
+        /** Opens every configured shard. Statements may be run on the calling thread until the shards are started. */
+        bool db_shards_open();
+        void db_shards_start();
+
+        /** Stops the shard threads after they finish their queued work, then runs any pending completions. */
+        void db_shards_stop();
+        void db_shards_close();
+
+        /**
+         * Queues work to run on the shard's thread. If the shard has been stopped, the work is run
+         * immediately on the calling thread instead. If the request is being traced, the time it
+         * spends waiting in the queue and running are recorded.
+         */
+        void db_shard_submit(db_shard_t* shard, std::function<void()> work, uint32_t traceId=0);
+
+        /** Queues work to run on the event loop. May be called from any thread. */
+        void db_daemon_post(std::function<void()> work);
+
+        /** Writes an error to the db log from any thread. */
+        void db_log_error(const ST::string& msg);
+
+        /** Rebuilds the account name filter from the Accounts table. */
+        bool db_acct_filter_load();
+
+        /** Account names are case insensitive, so the filter must be as well. */
+        inline ST::string db_acct_filter_key(const std::string_view& name)
+        {
+            return ST::string::from_utf8(name.data(), name.size()).to_lower();
+        }
+
+        inline bool db_acct_maybe_exists(const std::string_view& name)
+        {
+            ST::string key = db_acct_filter_key(name);
+            return s_dbDaemon->m_acctFilter.maybe_contains(std::string_view(key.c_str(), key.size()));
+        }
+
+        /**
+         * \brief Executes a registered statement.
+         * The statement is reset and its bindings cleared when the query goes out of scope. Timing
+         * and row counts are collected by the registry's trace hook.
+         */
         class query
         {
+            stmt_registry* m_registry;
+            stmt_id m_id;
             sqlite3_stmt* m_stmt;
 
         public:
-            query(sqlite3_stmt* stmt)
-                : m_stmt(stmt)
-            {
-            }
-
-            ~query()
-            {
-                sqlite3_clear_bindings(m_stmt);
-                sqlite3_reset(m_stmt);
-            }
+            query(stmt_id id);
+            query(const query&) = delete;
+            query(query&&) = delete;
+            ~query();
 
             void bind(int idx, const ST::string& value);
             void bind(int idx, const std::string_view& value);
@@ -66,7 +244,7 @@ namespace fus
             template<typename T>
             T column(int idx) const;
 
-            int step() { return sqlite3_step(m_stmt); }
+            int step();
         };
     };
 };
@@ -22,18 +22,24 @@
 
 void fus::sqlite3::query::bind(int idx, const ST::string& value)
 {
+    if (!m_stmt)
+        return;
     FUS_ASSERTD(idx > 0);
     FUS_ASSERTD(sqlite3_bind_text(m_stmt, idx, value.c_str(), value.size(), nullptr) == SQLITE_OK);
 }
 
 void fus::sqlite3::query::bind(int idx, const std::string_view& value)
 {
+    if (!m_stmt)
+        return;
     FUS_ASSERTD(idx > 0);
     FUS_ASSERTD(sqlite3_bind_text(m_stmt, idx, value.data(), value.size(), nullptr) == SQLITE_OK);
 }
 
 void fus::sqlite3::query::bind(int idx, const std::u16string_view& value)
 {
+    if (!m_stmt)
+        return;
     FUS_ASSERTD(idx > 0);
     FUS_ASSERTD(sqlite3_bind_text16(m_stmt, idx, value.data(), value.size() * sizeof(char16_t),
                                     nullptr) == SQLITE_OK);
@@ -41,18 +47,24 @@ void fus::sqlite3::query::bind(int idx, const std::u16string_view& value)
 
 void fus::sqlite3::query::bind(int idx, int value)
 {
+    if (!m_stmt)
+        return;
     FUS_ASSERTD(idx > 0);
     FUS_ASSERTD(sqlite3_bind_int(m_stmt, idx, value) == SQLITE_OK);
 }
 
 void fus::sqlite3::query::bind(int idx, const void* buf, size_t bufsz)
 {
+    if (!m_stmt)
+        return;
     FUS_ASSERTD(idx > 0);
     FUS_ASSERTD(sqlite3_bind_blob(m_stmt, idx, buf, bufsz, nullptr) == SQLITE_OK);
 }
 
 void fus::sqlite3::query::bind(int idx, const fus::uuid& uuid)
 {
+    if (!m_stmt)
+        return;
     FUS_ASSERTD(idx > 0);
     FUS_ASSERTD(sqlite3_bind_blob(m_stmt, idx, uuid.data(), sizeof(fus::uuid), nullptr) == SQLITE_OK);
 }
@@ -0,0 +1,89 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <filesystem>
+#include "sqlite3db.h"
+#include <string_theory/st_format.h>
+
+// =================================================================================
+
+static const char* s_schema =
+    "BEGIN TRANSACTION; "
+
+    // -- Table: Accounts
+    "CREATE TABLE IF NOT EXISTS Accounts ("
+    "idx INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "Name VARCHAR NOT NULL, Hash CHAR (64) NOT NULL, "
+    "Uuid CHAR (16) NOT NULL, Flags INTEGER NOT NULL); "
+
+    "CREATE UNIQUE INDEX IF NOT EXISTS Index_AccountName ON Accounts (Name COLLATE NOCASE); "
+
+    // -- Table: VaultNodes
+    "CREATE TABLE IF NOT EXISTS VaultNodes ("
+    "idx INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, "
+    "CreateTime INTEGER, ModifyTime INTEGER, CreateAgeName VARCHAR (64), "
+    "CreateAgeUuid CHAR (16), CreatorUuid CHAR (16), CreatorIdx INTEGER, "
+    "NodeType INTEGER, Int32_1 INTEGER, Int32_2 INTEGER, Int32_3 INTEGER, "
+    "Int32_4 INTEGER, UInt32_1 INTEGER, UInt32_2 INTEGER, UInt32_3 INTEGER, "
+    "UInt32_4 INTEGER, Uuid_1 CHAR (16), Uuid_2 CHAR (16), Uuid_3 CHAR (16), "
+    "Uuid_4 CHAR (16), String64_1 VARCHAR (64), String64_2 VARCHAR (64), "
+    "String64_3 VARCHAR (64), String64_4 VARCHAR (64), String64_5 VARCHAR (64), "
+    "String64_6 VARCHAR (64), IString64_1 VARCHAR (64), IString64_2 VARCHAR (64), "
+    "Text_1 TEXT, Text_2 TEXT, Blob_1 BLOB, Blob_2 BLOB); "
+
+    "COMMIT TRANSACTION;";
+
+// =================================================================================
+
+const char* fus::sqlite3::db_schema()
+{
+    return s_schema;
+}
+
+uint64_t fus::sqlite3::db_shard_hash(const void* buf, size_t bufsz)
+{
+    // FNV-1a -- this must never change, or accounts will be looked for in the wrong shard.
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < bufsz; ++i) {
+        hash ^= ((const uint8_t*)buf)[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+size_t fus::sqlite3::db_shard_index(const std::string_view& name, size_t numShards)
+{
+    if (numShards <= 1)
+        return 0;
+
+    // Account names are case insensitive, so the shard must be as well.
+    ST::string key = ST::string::from_utf8(name.data(), name.size()).to_lower();
+    return (size_t)(db_shard_hash(key.c_str(), key.size()) % numShards);
+}
+
+ST::string fus::sqlite3::db_shard_path(const ST::string& path, size_t idx, size_t numShards)
+{
+    // A single shard is just the plain old database.
+    if (numShards <= 1)
+        return path;
+
+    std::filesystem::path p = path.to_path();
+    std::filesystem::path file = p.stem();
+    file += ST::format(".shard{}", idx).c_str();
+    file += p.extension();
+    return ST::string::from_utf8((p.parent_path() / file).u8string().c_str());
+}
@@ -16,10 +16,16 @@
 
 #include "sqlite3db_private.h"
 #include "core/errors.h"
+#include "core/metrics.h"
 #include "daemon/daemon_base.h"
 #include "io/net_error.h"
+#include "io/trace.h"
+#include <memory>
 #include <new>
+#include "protocol/acct_batch.h"
 #include "protocol/db.h"
+#include <string_theory/st_format.h>
+#include <unordered_map>
 
 // =================================================================================
 
@@ -46,9 +52,9 @@ static inline fus::sqlite3::db_daemon_t* db_daemon()
 static inline bool db_check_read(fus::sqlite3::db_server_t* client, ssize_t nread)
 {
     if (nread < 0) {
-        db_daemon()->m_log.write_debug("[{}]: Read failed: {}",
-                                       fus::tcp_stream_peeraddr(client),
-                                       uv_strerror(nread));
+        FUS_LOG_DEBUG(db_daemon()->m_log, "[{}]: Read failed: {}",
+                                          client,
+                                          uv_strerror(nread));
         fus::tcp_stream_shutdown(client);
         return false;
     }
@@ -69,46 +75,232 @@ static void db_pingpong(fus::sqlite3::db_server_t* client, ssize_t nread, fus::p
 
 // =================================================================================
 
+/**
+ * Hands a reply produced on a shard thread back to the event loop to be written. The client must
+ * have been ref'd by db_client_ref before its request was submitted to the shard.
+ */
+template<typename _Msg>
+static void db_client_reply(fus::sqlite3::db_server_t* client, const _Msg& reply, uint32_t traceId=0)
+{
+    uint64_t posted = traceId ? uv_hrtime() : 0;
+    fus::sqlite3::db_daemon_post([client, reply, traceId, posted]() {
+        // The client may have dropped while the shard was busy with its request.
+        if (fus::tcp_stream_connected(client) && !fus::tcp_stream_closing(client))
+            fus::tcp_stream_write_msg(client, reply);
+        fus::tcp_stream_free(client);
+        fus::trace_span(traceId, "sqlite3 reply", posted, uv_hrtime());
+    });
+}
+
+static inline void db_client_ref(fus::sqlite3::db_server_t* client)
+{
+    // Keeps the client's memory alive until the shard's reply has been dealt with.
+    fus::tcp_stream_ref(client);
+}
+
+// =================================================================================
+
+static void db_acctInvalidate(const std::string_view& name)
+{
+    // Any daemon caching account data needs to toss whatever it knows about this account.
+    fus::protocol::db_acctInvalidateBCast bcast;
+    bcast.set_type(bcast.id());
+    bcast.set_name(name);
+
+    auto it = db_daemon()->m_clients.front();
+    while (it) {
+        fus::tcp_stream_write_msg(it, bcast);
+        it = db_daemon()->m_clients.next(it);
+    }
+}
+
+static void db_acctCreated(const ST::string& name)
+{
+    ST::string key = fus::sqlite3::db_acct_filter_key(std::string_view(name.c_str(), name.size()));
+    auto& filter = db_daemon()->m_acctFilter;
+    if (filter.memsz() != 0) {
+        // Rebuilding would mean scanning every shard, so just complain once and keep going. The
+        // filter merely gets less effective as it overfills -- it never reports false negatives.
+        if (filter.size() == filter.capacity())
+            db_daemon()->m_log.write_error("WARNING: The account filter is full ({} accounts); "
+                                           "consider increasing [sqlite] acct_filter_size",
+                                           filter.size());
+        filter.add(std::string_view(key.c_str(), key.size()));
+    }
+    db_acctInvalidate(std::string_view(name.c_str(), name.size()));
+}
+
+// =================================================================================
+
+/** Inserts a single account into the shard. This must be called on the shard's own thread. */
+static fus::net_error db_acctInsert(fus::sqlite3::db_shard_t* shard, const std::string_view& name,
+                                    const std::string_view& pass, uint32_t flags, const fus::uuid& uuid)
+{
+    size_t hashBufsz = shard->m_hash.digestsz();
+    void* hashBuf = alloca(hashBufsz);
+    shard->m_hash.hash_account(ST::string::from_utf8(name.data(), name.size()),
+                               ST::string::from_utf8(pass.data(), pass.size()),
+                               hashBuf, hashBufsz);
+
+    fus::sqlite3::query query(fus::sqlite3::stmt_id::e_createAcct);
+    query.bind(1, name);
+    query.bind(2, hashBuf, hashBufsz);
+    query.bind(3, uuid);
+    query.bind(4, flags);
+    switch (query.step()) {
+    case SQLITE_DONE:
+        return fus::net_error::e_success;
+    case SQLITE_CONSTRAINT:
+        // Account name is a case insensitive unique index :)
+        return fus::net_error::e_accountAlreadyExists;
+    default:
+        fus::sqlite3::db_log_error(ST::format("SQLite3 Create Account Error: {}",
+                                              sqlite3_errmsg(shard->m_db)));
+        return fus::net_error::e_internalError;
+    }
+}
+
 static void db_acctCreate(fus::sqlite3::db_server_t* client, ssize_t nread, fus::protocol::db_acctCreateRequest* msg)
 {
     if (!db_check_read(client, nread))
         return;
 
-    fus::uuid uuid = fus::uuid::generate();
-    fus::net_error result = fus::net_error::e_pending;
-    {
-        size_t hashBufsz = db_daemon()->m_hash.digestsz();
-        void* hashBuf = alloca(hashBufsz);
-        db_daemon()->m_hash.hash_account(ST::string::from_std_string(msg->get_name()),
-                                         ST::string::from_std_string(msg->get_pass()),
-                                         hashBuf, hashBufsz);
-
-        fus::sqlite3::query query(db_daemon()->m_createAcctStmt);
-        query.bind(1, msg->get_name());
-        query.bind(2, hashBuf, hashBufsz);
-        query.bind(3, uuid);
-        query.bind(4, msg->get_flags());
-        switch (query.step()) {
-        case SQLITE_DONE:
-            result = fus::net_error::e_success;
-            break;
-        case SQLITE_CONSTRAINT:
-            // Account name is a case insensitive unique index :)
-            result = fus::net_error::e_accountAlreadyExists;
-            break;
-        default:
-            db_daemon()->m_log.write_error("SQLite3 Create Account Error: {}", sqlite3_errmsg(db_daemon()->m_db));
-            result = fus::net_error::e_internalError;
-            break;
+    fus::protocol::db_acctCreateRequest request = *msg;
+    fus::sqlite3::db_shard_t* shard = fus::sqlite3::db_shard_for_name(msg->get_name());
+    db_client_ref(client);
+    fus::sqlite3::db_shard_submit(shard, [client, shard, request]() {
+        fus::uuid uuid = fus::uuid::generate();
+        fus::net_error result = db_acctInsert(shard, request.get_name(), request.get_pass(),
+                                              request.get_flags(), uuid);
+
+        fus::protocol::db_acctCreateReply reply;
+        reply.set_type(reply.id());
+        reply.set_transId(request.get_transId());
+        reply.set_result((uint32_t)result);
+        *reply.get_uuid() = uuid;
+        db_client_reply(client, reply, request.get_traceId());
+
+        if (result == fus::net_error::e_success) {
+            ST::string name = ST::string::from_std_string(request.get_name());
+            fus::sqlite3::db_daemon_post([name]() { db_acctCreated(name); });
         }
-    }
+    }, request.get_traceId());
+
+    // Continue reading -- the reply will be sent when the shard gets around to it.
+    fus::sqlite3::db_server_read(client);
+}
+
+// =================================================================================
+
+struct db_acct_batch_t
+{
+    fus::sqlite3::db_server_t* m_client;
+    uint32_t m_transId;
+    size_t m_pending;
+    std::vector<fus::protocol::acct_batch_record_t> m_records;
+    std::vector<fus::protocol::acct_batch_result_t> m_results;
+};
 
-    fus::protocol::db_acctCreateReply reply;
+static void db_acctBatchReply(fus::sqlite3::db_server_t* client, uint32_t transId, fus::net_error result,
+                              const std::vector<uint8_t>& results = {}, uint32_t count = 0)
+{
+    fus::protocol::db_acctCreateBatchReply reply;
     reply.set_type(reply.id());
-    reply.set_transId(msg->get_transId());
+    reply.set_transId(transId);
     reply.set_result((uint32_t)result);
-    *reply.get_uuid() = uuid;
-    fus::tcp_stream_write_msg(client, reply);
+    reply.set_count(count);
+    reply.set_resultssz((uint32_t)results.size());
+    fus::tcp_stream_write_msg(client, reply, results.data(), results.size());
+}
+
+static void db_acctBatchInsert(fus::sqlite3::db_shard_t* shard, db_acct_batch_t* batch,
+                               const std::vector<size_t>& indices)
+{
+    // One transaction for the whole lot means one journal sync instead of one per account, which
+    // is the entire point of this exercise. A duplicate name only fails its own INSERT, not the
+    // transaction, so the rest of the batch still goes in.
+    // Every result goes back to the client, so none may be left holding garbage if we bail out.
+    for (size_t i : indices)
+        batch->m_results[i] = { fus::net_error::e_internalError, fus::uuid() };
+    if (sqlite3_exec(shard->m_db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        fus::sqlite3::db_log_error(ST::format("SQLite3 Create Account Batch Error: {}",
+                                              sqlite3_errmsg(shard->m_db)));
+        return;
+    }
+
+    for (size_t i : indices) {
+        const fus::protocol::acct_batch_record_t& record = batch->m_records[i];
+        fus::protocol::acct_batch_result_t& result = batch->m_results[i];
+        result.m_uuid = fus::uuid::generate();
+        result.m_result = db_acctInsert(shard, record.m_name, record.m_pass, record.m_flags, result.m_uuid);
+    }
+
+    if (sqlite3_exec(shard->m_db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        fus::sqlite3::db_log_error(ST::format("SQLite3 Create Account Batch Commit Error: {}",
+                                              sqlite3_errmsg(shard->m_db)));
+        sqlite3_exec(shard->m_db, "ROLLBACK", nullptr, nullptr, nullptr);
+        for (size_t i : indices) {
+            if (batch->m_results[i].m_result == fus::net_error::e_success)
+                batch->m_results[i] = { fus::net_error::e_internalError, fus::uuid() };
+        }
+    }
+}
+
+static void db_acctBatchInserted(std::shared_ptr<db_acct_batch_t> batch)
+{
+    if (--batch->m_pending != 0)
+        return;
+
+    std::vector<uint8_t> results;
+    results.reserve(batch->m_results.size() * (sizeof(uint32_t) + sizeof(fus::uuid)));
+    for (size_t i = 0; i < batch->m_results.size(); ++i) {
+        const fus::protocol::acct_batch_result_t& result = batch->m_results[i];
+        if (result.m_result == fus::net_error::e_success)
+            db_acctCreated(ST::string::from_std_string(batch->m_records[i].m_name));
+        fus::protocol::acct_batch_write_result(results, result.m_result, result.m_uuid);
+    }
+
+    fus::sqlite3::db_server_t* client = batch->m_client;
+    if (fus::tcp_stream_connected(client) && !fus::tcp_stream_closing(client))
+        db_acctBatchReply(client, batch->m_transId, fus::net_error::e_success, results,
+                          (uint32_t)batch->m_results.size());
+    fus::tcp_stream_free(client);
+}
+
+static void db_acctBatchCreate(fus::sqlite3::db_server_t* client, ssize_t nread,
+                               fus::protocol::db_acctCreateBatchRequest* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    auto batch = std::make_shared<db_acct_batch_t>();
+    if (!fus::protocol::acct_batch_read(msg->get_records(), msg->get_recordssz(), msg->get_count(),
+                                        batch->m_records)) {
+        FUS_LOG_ERROR(db_daemon()->m_log, "[{}] Sent a malformed batch of {} accounts",
+                                          client, msg->get_count());
+        db_acctBatchReply(client, msg->get_transId(), fus::net_error::e_invalidParameter);
+        fus::sqlite3::db_server_read(client);
+        return;
+    }
+
+    // Each shard gets its own transaction, and they all run concurrently.
+    std::unordered_map<fus::sqlite3::db_shard_t*, std::vector<size_t>> shardRecords;
+    for (size_t i = 0; i < batch->m_records.size(); ++i)
+        shardRecords[fus::sqlite3::db_shard_for_name(batch->m_records[i].m_name)].push_back(i);
+
+    batch->m_client = client;
+    batch->m_transId = msg->get_transId();
+    batch->m_pending = shardRecords.size();
+    batch->m_results.resize(batch->m_records.size());
+    db_client_ref(client);
+    for (auto& it : shardRecords) {
+        fus::sqlite3::db_shard_t* shard = it.first;
+        fus::sqlite3::db_shard_submit(shard, [shard, batch, indices = std::move(it.second)]() {
+            // Shards only ever touch their own records' results, so no locking is needed.
+            db_acctBatchInsert(shard, batch.get(), indices);
+            fus::sqlite3::db_daemon_post([batch]() { db_acctBatchInserted(batch); });
+        }, msg->get_traceId());
+    }
 
     // Continue reading
     fus::sqlite3::db_server_read(client);
@@ -121,55 +313,118 @@ static void db_acctAuth(fus::sqlite3::db_server_t* client, ssize_t nread, fus::p
     if (!db_check_read(client, nread))
         return;
 
-    fus::net_error result = fus::net_error::e_pending;
-    fus::uuid acctUuid = fus::uuid::null;
-    uint32_t acctFlags = 0;
+    fus::protocol::db_acctAuthReply reply;
+    reply.set_type(reply.id());
+    reply.set_transId(msg->get_transId());
+    reply.set_name(msg->get_name());
+    *reply.get_uuid() = fus::uuid::null;
+    reply.set_flags(0);
+    reply.set_hashlen(0);
+
     size_t hashbufsz = db_daemon()->m_hash.digestsz();
     if (hashbufsz != msg->get_hashsz()) {
         db_daemon()->m_log.write_error("ERROR: Account '{}' sent an unexpected digest length [sent: {}] [expected: {}]",
                                        msg->get_name(), msg->get_hashsz(), hashbufsz);
-        result = fus::net_error::e_invalidParameter;
+        reply.set_result((uint32_t)fus::net_error::e_invalidParameter);
+        fus::tcp_stream_write_msg(client, reply);
+    } else if (!fus::sqlite3::db_acct_maybe_exists(msg->get_name())) {
+        // Definitely not an account, no need to bother SQLite.
+        reply.set_result((uint32_t)fus::net_error::e_accountNotFound);
+        fus::tcp_stream_write_msg(client, reply);
     } else {
-        fus::sqlite3::query query(db_daemon()->m_authAcctStmt);
-        query.bind(1, msg->get_name());
-        switch (query.step()) {
-        case SQLITE_DONE:
-            result = fus::net_error::e_accountNotFound;
+        // The request has a variable length hash, so it can't be copied wholesale.
+        std::vector<uint8_t> hash((const uint8_t*)msg->get_hash(), (const uint8_t*)msg->get_hash() + hashbufsz);
+        uint32_t cliChallenge = msg->get_cliChallenge();
+        uint32_t srvChallenge = msg->get_srvChallenge();
+        uint32_t traceId = msg->get_traceId();
+
+        fus::sqlite3::db_shard_t* shard = fus::sqlite3::db_shard_for_name(msg->get_name());
+        db_client_ref(client);
+        fus::sqlite3::db_shard_submit(shard, [client, shard, reply, hash, cliChallenge, srvChallenge, traceId]() mutable {
+            fus::net_error result = fus::net_error::e_pending;
+            fus::sqlite3::query query(fus::sqlite3::stmt_id::e_authAcct);
+            query.bind(1, reply.get_name());
+            switch (query.step()) {
+            case SQLITE_DONE:
+                result = fus::net_error::e_accountNotFound;
+                break;
+
+            case SQLITE_ROW:
+            {
+                auto dbAcctHash = query.column<std::tuple<const void*, size_t>>(0);
+                void* hashbuf = alloca(hash.size());
+                shard->m_hash.hash_login(std::get<0>(dbAcctHash), std::get<1>(dbAcctHash),
+                                         cliChallenge, srvChallenge, hashbuf, hash.size());
+
+                if (memcmp(hashbuf, hash.data(), hash.size()) == 0) {
+                    result = fus::net_error::e_success;
+                    *reply.get_uuid() = query.column<fus::uuid>(1);
+                    reply.set_flags(query.column<int>(2));
+
+                    // The requesting daemon may cache the account hash to verify future logins itself.
+                    size_t acctHashsz = std::min((size_t)reply.get_hashsz(), std::get<1>(dbAcctHash));
+                    reply.set_hashlen(acctHashsz);
+                    memcpy(reply.get_hash(), std::get<0>(dbAcctHash), acctHashsz);
+                } else {
+                    result = fus::net_error::e_authenticationFailed;
+                }
+            }
             break;
 
-        case SQLITE_ROW:
-        {
-            auto dbAcctHash = query.column<std::tuple<const void*, size_t>>(0);
-            void* hashbuf = alloca(hashbufsz);
-            db_daemon()->m_hash.hash_login(std::get<0>(dbAcctHash), std::get<1>(dbAcctHash),
-                                           msg->get_cliChallenge(), msg->get_srvChallenge(),
-                                           hashbuf, hashbufsz);
-
-            if (memcmp(hashbuf, std::get<0>(dbAcctHash), hashbufsz) == 0) {
-                result = fus::net_error::e_success;
-                acctUuid = query.column<fus::uuid>(1);
-                acctFlags = query.column<int>(2);
-            } else {
-                result = fus::net_error::e_authenticationFailed;
+            default:
+                fus::sqlite3::db_log_error(ST::format("SQLite3 Account Authenticate Error: {}",
+                                                      sqlite3_errmsg(shard->m_db)));
+                result = fus::net_error::e_internalError;
+                break;
             }
-        }
-        break;
 
-        default:
-            db_daemon()->m_log.write_error("SQLite3 Account Authenticate Error: {}", sqlite3_errmsg(db_daemon()->m_db));
-            result = fus::net_error::e_internalError;
-            break;
-        }
+            reply.set_result((uint32_t)result);
+            db_client_reply(client, reply, traceId);
+        }, traceId);
     }
 
-    fus::protocol::db_acctAuthReply reply;
+    // Continue reading
+    fus::sqlite3::db_server_read(client);
+}
+
+// =================================================================================
+
+static void db_acctExists(fus::sqlite3::db_server_t* client, ssize_t nread, fus::protocol::db_acctExistsRequest* msg)
+{
+    if (!db_check_read(client, nread))
+        return;
+
+    fus::protocol::db_acctExistsReply reply;
     reply.set_type(reply.id());
     reply.set_transId(msg->get_transId());
-    reply.set_result((uint32_t)result);
-    reply.set_name(msg->get_name());
-    *reply.get_uuid() = acctUuid;
-    reply.set_flags(acctFlags);
-    fus::tcp_stream_write_msg(client, reply);
+    reply.set_result((uint32_t)fus::net_error::e_success);
+    reply.set_exists(0);
+
+    if (!fus::sqlite3::db_acct_maybe_exists(msg->get_name())) {
+        fus::tcp_stream_write_msg(client, reply);
+    } else {
+        std::string name(msg->get_name());
+        uint32_t traceId = msg->get_traceId();
+        fus::sqlite3::db_shard_t* shard = fus::sqlite3::db_shard_for_name(name);
+        db_client_ref(client);
+        fus::sqlite3::db_shard_submit(shard, [client, shard, reply, name, traceId]() mutable {
+            fus::sqlite3::query query(fus::sqlite3::stmt_id::e_acctExists);
+            query.bind(1, std::string_view(name));
+            switch (query.step()) {
+            case SQLITE_ROW:
+                reply.set_exists(1);
+                break;
+            case SQLITE_DONE:
+                break;
+            default:
+                fus::sqlite3::db_log_error(ST::format("SQLite3 Account Exists Error: {}",
+                                                      sqlite3_errmsg(shard->m_db)));
+                reply.set_result((uint32_t)fus::net_error::e_internalError);
+                break;
+            }
+            db_client_reply(client, reply, traceId);
+        }, traceId);
+    }
 
     // Continue reading
     fus::sqlite3::db_server_read(client);
@@ -177,11 +432,14 @@ static void db_acctAuth(fus::sqlite3::db_server_t* client, ssize_t nread, fus::p
 
 // =================================================================================
 
+static fus::metric_counter_set s_dbMessages("fus_db_messages_total", "Messages received by the db daemon", "type", 64);
+
 static void db_msg_pump(fus::sqlite3::db_server_t* client, ssize_t nread, fus::protocol::common_msg_std_header* msg)
 {
     if (!db_check_read(client, nread))
         return;
 
+    s_dbMessages.add(msg->get_type());
     switch (msg->get_type()) {
     case fus::protocol::db_pingRequest::id():
         db_read<fus::protocol::db_pingRequest>(client, db_pingpong);
@@ -192,6 +450,12 @@ static void db_msg_pump(fus::sqlite3::db_server_t* client, ssize_t nread, fus::p
     case fus::protocol::db_acctAuthRequest::id():
         db_read<fus::protocol::db_acctAuthRequest>(client, db_acctAuth);
         break;
+    case fus::protocol::db_acctExistsRequest::id():
+        db_read<fus::protocol::db_acctExistsRequest>(client, db_acctExists);
+        break;
+    case fus::protocol::db_acctCreateBatchRequest::id():
+        db_read<fus::protocol::db_acctCreateBatchRequest>(client, db_acctBatchCreate);
+        break;
     default:
         fus::sqlite3::s_dbDaemon->m_log.write_error("Received unimplemented message type 0x{04X} -- kicking client", msg->get_type());
         fus::tcp_stream_shutdown(client);
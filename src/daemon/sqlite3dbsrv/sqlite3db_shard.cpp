@@ -0,0 +1,432 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core/alloc_profile.h"
+#include "core/errors.h"
+#include "core/uuid.h"
+#include "daemon/server.h"
+#include <filesystem>
+#include "io/console.h"
+#include "io/loop_monitor.h"
+#include "io/trace.h"
+#include "sqlite3db_private.h"
+#include <string_theory/st_format.h>
+
+// =================================================================================
+
+static inline ST::string path_string(const std::filesystem::path& path)
+{
+    return ST::string::from_utf8(path.u8string().c_str());
+}
+
+fus::sqlite3::db_shard_t* fus::sqlite3::db_shard_for_name(const std::string_view& name)
+{
+    return s_dbDaemon->m_shards[db_shard_index(name, s_dbDaemon->m_shards.size())];
+}
+
+fus::sqlite3::db_shard_t* fus::sqlite3::db_shard_for_uuid(const fus::uuid& uuid)
+{
+    size_t idx = (size_t)(db_shard_hash(uuid.data(), sizeof(fus::uuid)) % s_dbDaemon->m_shards.size());
+    return s_dbDaemon->m_shards[idx];
+}
+
+// =================================================================================
+
+fus::sqlite3::db_shard_t::db_shard_t(size_t idx, const ST::string& path)
+    : m_idx(idx), m_path(path), m_db(), m_stmts(), m_hash(hash_type::e_sha1), m_quit(), m_stopped()
+{
+}
+
+fus::sqlite3::db_shard_t::~db_shard_t()
+{
+    stop();
+    delete m_stmts;
+    if (m_db)
+        FUS_ASSERTD(sqlite3_close(m_db) == SQLITE_OK);
+}
+
+bool fus::sqlite3::db_shard_t::open()
+{
+    // If we're using a new database and its directory does not exist, bad things will happen.
+    std::filesystem::path db_dir = m_path.to_path().parent_path();
+    std::error_code error;
+    if (!db_dir.empty())
+        std::filesystem::create_directories(db_dir, error);
+    if (error) {
+        s_dbDaemon->m_log.write_error("Error creating directory '{}': {}", db_dir, error.message());
+        // intentionally continuing to sqlite3_open
+    }
+
+    // Only one thread ever uses the connection at a time (even the backup is stepped on the
+    // shard's thread), so SQLite's connection mutex would be pure overhead.
+    int result = sqlite3_open_v2(m_path.c_str(), &m_db,
+                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                                 nullptr);
+    if (result != SQLITE_OK) {
+        s_dbDaemon->m_log.write_error("SQLite3 Open '{}' Failed: {}", m_path, sqlite3_errstr(result));
+        return false;
+    }
+
+    // Ensure all tables inited
+    // Musing: perhaps we should have a table chose columns are (TableName, Version) for upgrading
+    // purposes? As of right now, I don't envision this schema changing much once a feature is
+    // implemented. URU is quite stale, after all...
+    if (sqlite3_exec(m_db, db_schema(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+        s_dbDaemon->m_log.write_error("SQLite3 Schema Init '{}' Failed: {}", m_path, sqlite3_errmsg(m_db));
+        return false;
+    }
+
+    m_stmts = new stmt_registry(m_db);
+    return true;
+}
+
+// =================================================================================
+
+static void shard_proc(fus::sqlite3::db_shard_t* shard)
+{
+    fus::alloc_scope_t allocScope("sqlite3 shard");
+    fus::sqlite3::db_stmts_attach(shard->m_stmts);
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(shard->m_lock);
+            shard->m_cv.wait(lock, [shard]() { return shard->m_quit || !shard->m_jobs.empty(); });
+
+            // Drain everything before quitting so no client is left waiting on a reply.
+            if (shard->m_jobs.empty())
+                break;
+            job = std::move(shard->m_jobs.front());
+            shard->m_jobs.pop_front();
+        }
+        job();
+    }
+    fus::sqlite3::db_stmts_attach(nullptr);
+}
+
+void fus::sqlite3::db_shard_t::start()
+{
+    FUS_ASSERTD(!m_thread.joinable());
+    m_quit = false;
+    m_stopped = false;
+    m_thread = std::thread(shard_proc, this);
+}
+
+void fus::sqlite3::db_shard_t::stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_quit = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+
+    // The thread drained its queue before quitting. Anything submitted from now on is run
+    // by the submitter, so late requests still get their replies and release their clients.
+    std::lock_guard<std::mutex> lock(m_lock);
+    FUS_ASSERTD(m_jobs.empty());
+    m_stopped = true;
+}
+
+void fus::sqlite3::db_shard_submit(db_shard_t* shard, std::function<void()> work, uint32_t traceId)
+{
+    if (traceId && trace_active()) {
+        work = [work = std::move(work), traceId, queued = uv_hrtime()]() {
+            uint64_t start = uv_hrtime();
+            work();
+            trace_span(traceId, "sqlite3 queue", queued, start);
+            trace_span(traceId, "sqlite3 execute", start, uv_hrtime());
+        };
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shard->m_lock);
+        if (!shard->m_stopped) {
+            shard->m_jobs.push_back(std::move(work));
+            shard->m_cv.notify_one();
+            return;
+        }
+    }
+
+    // The shard's thread is gone, so its connection is ours now.
+    stmt_registry* stmts = db_stmts();
+    db_stmts_attach(shard->m_stmts);
+    work();
+    db_stmts_attach(stmts);
+}
+
+// =================================================================================
+
+static void db_run_posted(uv_async_t*)
+{
+    using namespace fus::sqlite3;
+
+    std::deque<std::function<void()>> posted;
+    {
+        std::lock_guard<std::mutex> lock(s_dbDaemon->m_postLock);
+        posted.swap(s_dbDaemon->m_posted);
+    }
+    for (auto& work : posted) {
+        fus::loop_timer_t timer("sqlite3 posted completion");
+        work();
+    }
+}
+
+void fus::sqlite3::db_daemon_post(std::function<void()> work)
+{
+    // Once the shards have stopped, completions can only come from the loop itself.
+    if (uv_is_closing((uv_handle_t*)&s_dbDaemon->m_async)) {
+        work();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(s_dbDaemon->m_postLock);
+        s_dbDaemon->m_posted.push_back(std::move(work));
+    }
+    uv_async_send(&s_dbDaemon->m_async);
+}
+
+void fus::sqlite3::db_log_error(const ST::string& msg)
+{
+    // Each thread logs into its own buffer, so there's no need to bounce this to the loop.
+    s_dbDaemon->m_log.write_error("{}", msg);
+}
+
+// =================================================================================
+
+bool fus::sqlite3::db_shards_open()
+{
+    const fus::config_parser& config = server::get()->config();
+    const ST::string& path = config.get<const ST::string&>("sqlite", "path");
+    size_t numShards = std::max(1U, config.get<unsigned int>("sqlite", "shards"));
+
+    s_dbDaemon->m_shards.reserve(numShards);
+    for (size_t i = 0; i < numShards; ++i) {
+        db_shard_t* shard = new db_shard_t(i, db_shard_path(path, i, numShards));
+        s_dbDaemon->m_shards.push_back(shard);
+        if (!shard->open())
+            return false;
+        s_dbDaemon->m_log.write_info("SQLite3 Shard {} Opened: {}", i, shard->m_path);
+    }
+
+    uv_async_init(uv_default_loop(), &s_dbDaemon->m_async, db_run_posted);
+    return true;
+}
+
+void fus::sqlite3::db_shards_start()
+{
+    for (db_shard_t* shard : s_dbDaemon->m_shards)
+        shard->start();
+}
+
+void fus::sqlite3::db_shards_stop()
+{
+    for (db_shard_t* shard : s_dbDaemon->m_shards)
+        shard->stop();
+
+    // Flush out any replies the shards finished before they quit. Completions may submit more
+    // work, which now runs inline and may post yet more completions.
+    if (uv_handle_get_loop((uv_handle_t*)&s_dbDaemon->m_async)) {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(s_dbDaemon->m_postLock);
+                if (s_dbDaemon->m_posted.empty())
+                    break;
+            }
+            db_run_posted(&s_dbDaemon->m_async);
+        }
+        if (!uv_is_closing((uv_handle_t*)&s_dbDaemon->m_async))
+            uv_close((uv_handle_t*)&s_dbDaemon->m_async, nullptr);
+    }
+}
+
+void fus::sqlite3::db_shards_close()
+{
+    db_shards_stop();
+    for (db_shard_t* shard : s_dbDaemon->m_shards)
+        delete shard;
+    s_dbDaemon->m_shards.clear();
+}
+
+// =================================================================================
+
+static void rebalance_shard_func(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    size_t numShards = (size_t)(uintptr_t)sqlite3_user_data(ctx);
+    std::string_view name((const char*)sqlite3_value_text(argv[0]), sqlite3_value_bytes(argv[0]));
+    sqlite3_result_int64(ctx, (sqlite3_int64)fus::sqlite3::db_shard_index(name, numShards));
+}
+
+static bool rebalance_exec(::sqlite3* db, const ST::string& sql)
+{
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+        fus::console::get() << fus::console::weight_bold << fus::console::foreground_red
+                            << "SQLite3 Error: " << sqlite3_errmsg(db) << fus::console::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool rebalance_conflicts(::sqlite3* db, size_t shard, const ST::string& shardPath)
+{
+    // Whatever is left behind has a different account of the same name in the destination.
+    // Someone has to decide which one wins, so leave both where they are and say so.
+    fus::console& c = fus::console::get();
+    ST::string sql = ST::format("SELECT Name FROM main.Accounts WHERE fus_shard(Name) = {};", shard);
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        c << fus::console::weight_bold << fus::console::foreground_red << "SQLite3 Error: "
+          << sqlite3_errmsg(db) << fus::console::endl;
+        return false;
+    }
+
+    size_t conflicts = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        c << fus::console::weight_bold << fus::console::foreground_red << "    Conflict: '"
+          << (const char*)sqlite3_column_text(stmt, 0) << "' already exists in " << shardPath
+          << fus::console::endl;
+        conflicts++;
+    }
+    sqlite3_finalize(stmt);
+
+    // The accounts that did move are fine, so they stay put, but the rebalance as a whole failed.
+    return conflicts == 0;
+}
+
+static bool rebalance_file(const ST::string& srcPath, const std::vector<ST::string>& shardPaths)
+{
+    fus::console& c = fus::console::get();
+
+    ::sqlite3* db;
+    if (sqlite3_open_v2(srcPath.c_str(), &db, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK) {
+        c << fus::console::weight_bold << fus::console::foreground_red << "Unable to open '" << srcPath
+          << "': " << sqlite3_errmsg(db) << fus::console::endl;
+        sqlite3_close(db);
+        return false;
+    }
+    sqlite3_create_function(db, "fus_shard", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                            (void*)(uintptr_t)shardPaths.size(), rebalance_shard_func, nullptr, nullptr);
+
+    bool result = true;
+    for (size_t i = 0; i < shardPaths.size() && result; ++i) {
+        if (std::filesystem::equivalent(srcPath.to_path(), shardPaths[i].to_path()))
+            continue;
+
+        // Move every account that belongs elsewhere in a single transaction per destination so
+        // that an account is never in two places at once (or none at all). An account that is
+        // already in the destination (say, from a run that failed partway) is only removed from
+        // the source if the copy is identical, so an interrupted rebalance can simply be re-run.
+        ST::string attach = ST::format("ATTACH DATABASE '{}' AS dest;", shardPaths[i].replace("'", "''"));
+        if (!rebalance_exec(db, attach)) {
+            result = false;
+            break;
+        }
+
+        result = rebalance_exec(db, "BEGIN TRANSACTION;");
+        if (result) {
+            ST::string move = ST::format(
+                "INSERT OR IGNORE INTO dest.Accounts (Name, Hash, Uuid, Flags) "
+                "SELECT Name, Hash, Uuid, Flags FROM main.Accounts WHERE fus_shard(Name) = {}; "
+                "DELETE FROM main.Accounts WHERE fus_shard(Name) = {} AND EXISTS ("
+                "SELECT 1 FROM dest.Accounts AS d WHERE d.Name = main.Accounts.Name COLLATE NOCASE "
+                "AND d.Hash = main.Accounts.Hash AND d.Uuid = main.Accounts.Uuid "
+                "AND d.Flags = main.Accounts.Flags);", i, i);
+            result = rebalance_exec(db, move);
+            int moved = sqlite3_changes(db);
+            if (result && rebalance_exec(db, "COMMIT TRANSACTION;")) {
+                c << "    " << srcPath << " -> " << shardPaths[i] << ": " << moved << " account(s)"
+                  << fus::console::endl;
+                result = rebalance_conflicts(db, i, shardPaths[i]);
+            } else {
+                rebalance_exec(db, "ROLLBACK TRANSACTION;");
+                result = false;
+            }
+        }
+        rebalance_exec(db, "DETACH DATABASE dest;");
+    }
+
+    sqlite3_close(db);
+    return result;
+}
+
+bool fus::sqlite3::db_rebalance()
+{
+    fus::console& c = fus::console::get();
+    const fus::config_parser& config = server::get()->config();
+    const ST::string& path = config.get<const ST::string&>("sqlite", "path");
+    size_t numShards = std::max(1U, config.get<unsigned int>("sqlite", "shards"));
+
+    std::vector<ST::string> shardPaths;
+    for (size_t i = 0; i < numShards; ++i)
+        shardPaths.push_back(db_shard_path(path, i, numShards));
+
+    // Create any new shards so they have the schema before we go stuffing accounts in them.
+    for (const ST::string& shardPath : shardPaths) {
+        std::error_code error;
+        std::filesystem::path dir = shardPath.to_path().parent_path();
+        if (!dir.empty())
+            std::filesystem::create_directories(dir, error);
+
+        ::sqlite3* db;
+        if (sqlite3_open(shardPath.c_str(), &db) != SQLITE_OK || !rebalance_exec(db, db_schema())) {
+            c << fus::console::weight_bold << fus::console::foreground_red << "Unable to initialize shard '"
+              << shardPath << "'" << fus::console::endl;
+            sqlite3_close(db);
+            return false;
+        }
+        sqlite3_close(db);
+    }
+
+    // Data may be in the unsharded database or in shards from any previous shard count.
+    std::vector<ST::string> sources;
+    std::filesystem::path base = path.to_path();
+    std::filesystem::path dir = base.parent_path().empty() ? std::filesystem::current_path() : base.parent_path();
+    ST::string prefix = ST::format("{}.shard", base.stem());
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+        std::filesystem::path file = entry.path();
+        if (file.extension() != base.extension())
+            continue;
+        ST::string stem = path_string(file.stem());
+        if (file.filename() == base.filename() || stem.starts_with(prefix.c_str()))
+            sources.push_back(path_string(file));
+    }
+
+    c << fus::console::weight_bold << fus::console::foreground_cyan << "Rebalancing accounts among "
+      << numShards << " shard(s)..." << fus::console::endl;
+    for (const ST::string& src : sources) {
+        if (!rebalance_file(src, shardPaths))
+            return false;
+
+        // Retire anything that is no longer a shard so the daemon doesn't get confused later.
+        bool isShard = std::any_of(shardPaths.begin(), shardPaths.end(), [&src](const ST::string& shardPath) {
+            return std::filesystem::equivalent(src.to_path(), shardPath.to_path());
+        });
+        if (!isShard) {
+            std::filesystem::path retired = src.to_path();
+            retired += ".old";
+            std::filesystem::rename(src.to_path(), retired, error);
+            c << "    Retired " << src << fus::console::endl;
+        }
+    }
+
+    c << fus::console::weight_bold << fus::console::foreground_green << "Rebalance complete"
+      << fus::console::endl;
+    return true;
+}
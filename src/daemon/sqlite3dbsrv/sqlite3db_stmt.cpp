@@ -0,0 +1,340 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "core/errors.h"
+#include <cstring>
+#include <iterator>
+#include "sqlite3db_private.h"
+#include <string_theory/st_format.h>
+#include <uv.h>
+
+// =================================================================================
+
+struct stmt_def_t
+{
+    const char* m_name;
+    const char* m_sql;
+
+    /** Statements that are expected to walk an entire table, so don't warn about them. */
+    bool m_fullScan;
+};
+
+static const stmt_def_t s_stmtDefs[] = {
+    { "createAcct",
+      "INSERT INTO Accounts (Name, Hash, Uuid, Flags) "
+      "VALUES (?, ?, ?, ?);",
+      false },
+
+    { "authAcct",
+      "SELECT Hash, Uuid, Flags FROM Accounts "
+      "WHERE Name = ? COLLATE NOCASE;",
+      false },
+
+    { "acctExists",
+      "SELECT 1 FROM Accounts WHERE Name = ? COLLATE NOCASE;",
+      false },
+
+    { "acctCount",
+      "SELECT COUNT(*) FROM Accounts;",
+      true },
+
+    { "acctNames",
+      "SELECT Name FROM Accounts;",
+      true },
+};
+
+static_assert(std::size(s_stmtDefs) == (size_t)fus::sqlite3::stmt_id::e_numStmts,
+              "A definition must be provided for each statement ID");
+
+static thread_local fus::sqlite3::stmt_registry* s_threadStmts = nullptr;
+
+// =================================================================================
+
+fus::sqlite3::stmt_registry::stmt_registry(::sqlite3* db)
+    : m_db(db)
+{
+    memset(m_stmts, 0, sizeof(m_stmts));
+    for (stmt_stats_t& stats : m_stats) {
+        stats.m_execs = 0;
+        stats.m_time = 0;
+        stats.m_rows = 0;
+        stats.m_busy = 0;
+        stats.m_errors = 0;
+        stats.m_maxTime = 0;
+        for (auto& bucket : stats.m_latency)
+            bucket = 0;
+    }
+
+    if (m_db)
+        sqlite3_trace_v2(m_db, SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW, trace, this);
+}
+
+fus::sqlite3::stmt_registry::~stmt_registry()
+{
+    finalize();
+    if (m_db)
+        sqlite3_trace_v2(m_db, 0, nullptr, nullptr);
+}
+
+// =================================================================================
+
+int fus::sqlite3::stmt_registry::trace(unsigned int type, void* ctx, void* p, void* x)
+{
+    stmt_registry* registry = (stmt_registry*)ctx;
+    stmt_id id = registry->find((const sqlite3_stmt*)p);
+    if (id == stmt_id::e_numStmts)
+        return 0;
+
+    stmt_stats_t& stats = registry->stats(id);
+    if (type == SQLITE_TRACE_ROW) {
+        stats.m_rows++;
+    } else if (type == SQLITE_TRACE_PROFILE) {
+        uint64_t us = (uint64_t)(*(sqlite3_int64*)x) / 1000;
+        size_t bucket = 0;
+        while ((us >> bucket) != 0 && bucket < (STMT_LATENCY_BUCKETS - 1))
+            bucket++;
+        stats.m_latency[bucket]++;
+        stats.m_time += us;
+
+        uint64_t maxTime = stats.m_maxTime.load(std::memory_order_relaxed);
+        while (us > maxTime && !stats.m_maxTime.compare_exchange_weak(maxTime, us, std::memory_order_relaxed))
+            ;
+    }
+    return 0;
+}
+
+// =================================================================================
+
+sqlite3_stmt* fus::sqlite3::stmt_registry::get(stmt_id id)
+{
+    FUS_ASSERTD(id < stmt_id::e_numStmts);
+
+    sqlite3_stmt*& stmt = m_stmts[(size_t)id];
+    if (stmt == nullptr && m_db) {
+        // These statements are reused for the life of the connection, so let SQLite know that.
+        const char* sql = s_stmtDefs[(size_t)id].m_sql;
+        if (sqlite3_prepare_v3(m_db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+            db_log_error(ST::format("SQLite3 Prepare Failed: {} [SQL: {}]", sqlite3_errmsg(m_db), sql));
+            stmt = nullptr;
+        }
+    }
+    return stmt;
+}
+
+fus::sqlite3::stmt_id fus::sqlite3::stmt_registry::find(const sqlite3_stmt* stmt) const
+{
+    for (size_t i = 0; i < std::size(m_stmts); ++i) {
+        if (m_stmts[i] == stmt)
+            return (stmt_id)i;
+    }
+    return stmt_id::e_numStmts;
+}
+
+void fus::sqlite3::stmt_registry::finalize()
+{
+    for (sqlite3_stmt*& stmt : m_stmts) {
+        sqlite3_finalize(stmt);
+        stmt = nullptr;
+    }
+}
+
+const char* fus::sqlite3::stmt_registry::name(stmt_id id)
+{
+    FUS_ASSERTD(id < stmt_id::e_numStmts);
+    return s_stmtDefs[(size_t)id].m_name;
+}
+
+const char* fus::sqlite3::stmt_registry::sql(stmt_id id)
+{
+    FUS_ASSERTD(id < stmt_id::e_numStmts);
+    return s_stmtDefs[(size_t)id].m_sql;
+}
+
+// =================================================================================
+
+size_t fus::sqlite3::stmt_registry::verify_plans()
+{
+    if (!m_db)
+        return 0;
+
+    size_t scans = 0;
+    for (size_t i = 0; i < std::size(s_stmtDefs); ++i) {
+        const stmt_def_t& def = s_stmtDefs[i];
+        ST::string sql = ST::format("EXPLAIN QUERY PLAN {}", def.m_sql);
+
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr) != SQLITE_OK) {
+            s_dbDaemon->m_log.write_error("SQLite3 Query Plan '{}' Failed: {}", def.m_name, sqlite3_errmsg(m_db));
+            continue;
+        }
+
+        // The plan detail is always the last column, eg "SCAN Accounts" or "SEARCH Accounts USING INDEX"
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int col = sqlite3_column_count(stmt) - 1;
+            ST::string detail = ST::string::from_utf8((const char*)sqlite3_column_text(stmt, col),
+                                                      sqlite3_column_bytes(stmt, col));
+            if (!detail.starts_with("SCAN") || detail.find("COVERING INDEX") >= 0)
+                continue;
+
+            scans++;
+            if (!def.m_fullScan)
+                s_dbDaemon->m_log.write_error("WARNING: Statement '{}' performs a full table scan: {}",
+                                              def.m_name, detail);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return scans;
+}
+
+// =================================================================================
+
+/** Plain copy of a statement's stats, possibly summed over several shards. */
+struct stmt_snapshot_t
+{
+    uint64_t m_execs;
+    uint64_t m_time;
+    uint64_t m_rows;
+    uint64_t m_busy;
+    uint64_t m_errors;
+    uint64_t m_maxTime;
+    uint64_t m_latency[fus::sqlite3::STMT_LATENCY_BUCKETS];
+};
+
+static void stmt_accumulate(const fus::sqlite3::stmt_stats_t& stats, stmt_snapshot_t& snapshot)
+{
+    snapshot.m_execs += stats.m_execs;
+    snapshot.m_time += stats.m_time;
+    snapshot.m_rows += stats.m_rows;
+    snapshot.m_busy += stats.m_busy;
+    snapshot.m_errors += stats.m_errors;
+    snapshot.m_maxTime = std::max(snapshot.m_maxTime, stats.m_maxTime.load());
+    for (size_t i = 0; i < std::size(snapshot.m_latency); ++i)
+        snapshot.m_latency[i] += stats.m_latency[i];
+}
+
+static uint64_t stmt_percentile(const stmt_snapshot_t& stats, double pct)
+{
+    uint64_t total = 0;
+    for (uint64_t count : stats.m_latency)
+        total += count;
+    if (total == 0)
+        return 0;
+
+    // Report the upper bound of the bucket the percentile falls into.
+    uint64_t threshold = (uint64_t)((double)total * pct);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < std::size(stats.m_latency); ++i) {
+        seen += stats.m_latency[i];
+        if (seen > threshold)
+            return (1ULL << i);
+    }
+    return stats.m_maxTime;
+}
+
+static void stmt_profile(const stmt_snapshot_t& stats, fus::sqlite3::stmt_id id,
+                         fus::sqlite3::db_stmt_profile_t& profile)
+{
+    profile.m_name = fus::sqlite3::stmt_registry::name(id);
+    profile.m_execs = stats.m_execs;
+    profile.m_rows = stats.m_rows;
+    profile.m_busy = stats.m_busy;
+    profile.m_errors = stats.m_errors;
+    profile.m_time = stats.m_time;
+    profile.m_maxTime = stats.m_maxTime;
+    profile.m_p50 = stmt_percentile(stats, 0.50);
+    profile.m_p99 = stmt_percentile(stats, 0.99);
+}
+
+void fus::sqlite3::stmt_registry::log_profile() const
+{
+    for (size_t i = 0; i < (size_t)stmt_id::e_numStmts; ++i) {
+        if (m_stats[i].m_execs == 0)
+            continue;
+
+        stmt_snapshot_t snapshot{};
+        stmt_accumulate(m_stats[i], snapshot);
+
+        db_stmt_profile_t profile;
+        stmt_profile(snapshot, (stmt_id)i, profile);
+        s_dbDaemon->m_log.write_info("SQLite3 Profile '{}': {} execs, {} rows, {} busy, {} errors, "
+                                     "{} us total, p50 <= {} us, p99 <= {} us, max {} us",
+                                     profile.m_name, profile.m_execs, profile.m_rows, profile.m_busy,
+                                     profile.m_errors, profile.m_time, profile.m_p50, profile.m_p99,
+                                     profile.m_maxTime);
+    }
+}
+
+bool fus::sqlite3::db_daemon_stmt_profile(std::vector<db_stmt_profile_t>& profiles)
+{
+    if (!s_dbDaemon || s_dbDaemon->m_shards.empty())
+        return false;
+
+    // Each shard has its own registry, but the console only cares about the big picture.
+    profiles.resize((size_t)stmt_id::e_numStmts);
+    for (size_t i = 0; i < profiles.size(); ++i) {
+        stmt_snapshot_t snapshot{};
+        for (const db_shard_t* shard : s_dbDaemon->m_shards) {
+            if (shard->m_stmts)
+                stmt_accumulate(shard->m_stmts->stats((stmt_id)i), snapshot);
+        }
+        stmt_profile(snapshot, (stmt_id)i, profiles[i]);
+    }
+    return true;
+}
+
+// =================================================================================
+
+void fus::sqlite3::db_stmts_attach(stmt_registry* stmts)
+{
+    s_threadStmts = stmts;
+}
+
+fus::sqlite3::stmt_registry* fus::sqlite3::db_stmts()
+{
+    return s_threadStmts;
+}
+
+// =================================================================================
+
+fus::sqlite3::query::query(stmt_id id)
+    : m_registry(db_stmts()), m_id(id)
+{
+    FUS_ASSERTD(m_registry);
+    m_stmt = m_registry->get(id);
+}
+
+fus::sqlite3::query::~query()
+{
+    if (m_stmt) {
+        sqlite3_clear_bindings(m_stmt);
+        sqlite3_reset(m_stmt);
+        m_registry->stats(m_id).m_execs++;
+    }
+}
+
+int fus::sqlite3::query::step()
+{
+    if (!m_stmt)
+        return SQLITE_ERROR;
+
+    int result = sqlite3_step(m_stmt);
+    if (result == SQLITE_BUSY)
+        m_registry->stats(m_id).m_busy++;
+    else if (result != SQLITE_ROW && result != SQLITE_DONE)
+        m_registry->stats(m_id).m_errors++;
+    return result;
+}
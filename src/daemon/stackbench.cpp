@@ -0,0 +1,642 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include "client/admin_client.h"
+#include "client/auth_client.h"
+#include "core/build_info.h"
+#include <filesystem>
+#include "fus_config.h"
+#include <fstream>
+#include <gflags/gflags.h>
+#include "io/console.h"
+#include "io/hash.h"
+#include "io/io.h"
+#include "protocol/acct_batch.h"
+#include "protocol/admin.h"
+#include "protocol/auth.h"
+#include "protocol/common.h"
+#include "server.h"
+#include <string_theory/st_format.h>
+#include <vector>
+
+#if !defined(FUS_HAVE_SQLITE) && !defined(FUS_HAVE_POSTGRES)
+#   error fus_stackbench requires a db daemon
+#endif
+
+// =================================================================================
+
+DEFINE_uint32(accounts, 1000, "Number of accounts to create, then log in to");
+DEFINE_uint32(concurrency, 16, "Number of scripted clients talking to the server at once");
+DEFINE_uint32(batch, 0, "Create accounts in batches of this many instead of one at a time");
+DEFINE_string(temp_dir, "", "Empty directory for the database, logs and configuration (default: a new directory "
+                            "in the system's temporary directory, removed after the run)");
+DEFINE_bool(keep_temp, false, "Keep the temporary directory after the run");
+DEFINE_string(log_level, "error", "Log level of the daemons under test");
+DEFINE_uint32(timeout, 300, "Seconds the whole run may take before it is abandoned");
+DEFINE_string(engine, "sqlite", "Database engine under test: sqlite or postgres");
+DEFINE_string(pg_conninfo, "dbname=fus_stackbench", "PostgreSQL connection string for --engine=postgres. The "
+                                                    "database must not hold accounts from a previous run.");
+
+// =================================================================================
+
+/** The whole point is to be able to shut down without a console. */
+class stackbench_server : public fus::server
+{
+public:
+    stackbench_server(const std::filesystem::path& path) : fus::server(path) { }
+    using fus::server::shutdown;
+};
+
+enum class stackbench_phase
+{
+    e_warmupCreate,
+    e_warmupLogin,
+    e_create,
+    e_login,
+    e_done,
+};
+
+enum
+{
+    e_opAdminConnect,
+    e_opCreate,
+    e_opAuthConnect,
+    e_opRegister,
+    e_opLogin,
+    e_opSession,
+
+    e_numOps
+};
+
+static const char* s_opNames[] = {
+    "admin connect",
+    "create",
+    "auth connect",
+    "register",
+    "login",
+    "session",
+};
+static_assert(std::size(s_opNames) == e_numOps);
+
+struct stackbench_stats_t
+{
+    std::vector<uint64_t> m_latencies;
+    uint64_t m_errors;
+};
+
+/** One scripted client. Its connection is thrown away and replaced as the script requires. */
+struct stackbench_slot_t
+{
+    fus::client_t* m_client;
+    uint64_t m_opStart;
+    uint64_t m_sessionStart;
+    ST::string m_name;
+    uint8_t m_acctHash[20];
+    uint32_t m_batchCount;
+    bool m_succeeded;
+};
+
+static stackbench_server* s_server;
+static stackbench_phase s_phase;
+static std::vector<stackbench_slot_t> s_slots;
+static uint32_t s_nextAccount;
+static size_t s_live;
+static stackbench_stats_t s_stats[e_numOps];
+static uint64_t s_phaseStart;
+static uint64_t s_createTime;
+static uint64_t s_loginTime;
+static bool s_timedOut;
+static uv_timer_t s_retryTimer;
+static uv_timer_t s_timeoutTimer;
+
+static fus::hash s_hash(fus::hash_type::e_sha1);
+static sockaddr_storage s_addr;
+static std::vector<uint8_t> s_header;
+static uint32_t s_buildId;
+static ST::string s_password = ST_LITERAL("stackbench");
+
+static const ST::string k_warmupAccount = ST_LITERAL("stackbench_warmup");
+
+// =================================================================================
+
+static void print(const ST::string& str)
+{
+    fputs(str.c_str(), stdout);
+    fflush(stdout);
+}
+
+static inline stackbench_slot_t* stackbench_slot(fus::client_t* client)
+{
+    return (stackbench_slot_t*)uv_handle_get_data((uv_handle_t*)client);
+}
+
+static inline bool stackbench_warmup()
+{
+    return s_phase == stackbench_phase::e_warmupCreate || s_phase == stackbench_phase::e_warmupLogin;
+}
+
+static inline void stackbench_record(size_t op, uint64_t start, bool success)
+{
+    // The warmup only exists to wait out the daemons connecting to each other.
+    if (stackbench_warmup())
+        return;
+    if (success)
+        s_stats[op].m_latencies.push_back((uv_hrtime() - start) / 1000);
+    else
+        s_stats[op].m_errors++;
+}
+
+static void stackbench_hangup(stackbench_slot_t* slot)
+{
+    if (fus::tcp_stream_connected(slot->m_client) && !fus::tcp_stream_closing(slot->m_client))
+        fus::tcp_stream_shutdown(slot->m_client);
+}
+
+// =================================================================================
+
+static void stackbench_open(stackbench_slot_t* slot);
+static void stackbench_next_phase();
+
+static void stackbench_retry(uv_timer_t*)
+{
+    stackbench_open(&s_slots.front());
+}
+
+static void stackbench_closed(uv_handle_t* handle)
+{
+    auto slot = (stackbench_slot_t*)uv_handle_get_data(handle);
+    slot->m_client = nullptr;
+    s_live--;
+
+    switch (s_phase) {
+    case stackbench_phase::e_warmupCreate:
+    case stackbench_phase::e_warmupLogin:
+        if (slot->m_succeeded)
+            stackbench_next_phase();
+        else
+            uv_timer_start(&s_retryTimer, stackbench_retry, 100, 0);
+        break;
+    case stackbench_phase::e_create:
+    case stackbench_phase::e_login:
+        // Each login is a whole session, and the create connections only hang up once they run
+        // out of accounts or something goes wrong.
+        if (s_nextAccount < FLAGS_accounts)
+            stackbench_open(slot);
+        else if (s_live == 0)
+            stackbench_next_phase();
+        break;
+    default:
+        break;
+    }
+}
+
+static void stackbench_connect_failed(uv_handle_t* handle)
+{
+    // The stream never connected, so nothing else is going to free it.
+    auto stream = (fus::tcp_stream_t*)handle;
+    stackbench_closed(handle);
+    if (stream->m_freecb)
+        stream->m_freecb(stream);
+    fus::tcp_stream_free(stream);
+}
+
+static void stackbench_connected(fus::client_t* client, ssize_t status)
+{
+    stackbench_slot_t* slot = stackbench_slot(client);
+    bool admin = s_phase == stackbench_phase::e_warmupCreate || s_phase == stackbench_phase::e_create;
+    stackbench_record(admin ? e_opAdminConnect : e_opAuthConnect, slot->m_opStart, status >= 0);
+    if (status < 0 && !fus::tcp_stream_connected(client))
+        uv_close((uv_handle_t*)client, stackbench_connect_failed);
+}
+
+// =================================================================================
+
+static void stackbench_create(stackbench_slot_t* slot);
+
+static void stackbench_created(void* instance, fus::client_t*, uint32_t, fus::net_error result, ssize_t, const void* msg)
+{
+    auto slot = (stackbench_slot_t*)instance;
+    if (!msg)
+        return;
+
+    if (stackbench_warmup()) {
+        // A leftover warmup account from an earlier run is just as good.
+        slot->m_succeeded = result == fus::net_error::e_success ||
+                            result == fus::net_error::e_accountAlreadyExists;
+        stackbench_hangup(slot);
+        return;
+    }
+
+    stackbench_record(e_opCreate, slot->m_opStart, result == fus::net_error::e_success);
+    stackbench_create(slot);
+}
+
+static void stackbench_batch_created(void* instance, fus::client_t*, uint32_t, fus::net_error result, ssize_t,
+                                    const void* msg)
+{
+    auto slot = (stackbench_slot_t*)instance;
+    if (!msg)
+        return;
+
+    // Every account in the batch waited just as long for its result.
+    auto reply = (const fus::protocol::admin_acctCreateBatchReply*)msg;
+    std::vector<fus::protocol::acct_batch_result_t> results;
+    if (result != fus::net_error::e_success ||
+        !fus::protocol::acct_batch_read_results(reply->get_results(), reply->get_resultssz(), reply->get_count(),
+                                                results) || results.size() != slot->m_batchCount) {
+        for (uint32_t i = 0; i < slot->m_batchCount; ++i)
+            stackbench_record(e_opCreate, slot->m_opStart, false);
+    } else {
+        for (const fus::protocol::acct_batch_result_t& it : results)
+            stackbench_record(e_opCreate, slot->m_opStart, it.m_result == fus::net_error::e_success);
+    }
+    stackbench_create(slot);
+}
+
+static void stackbench_create_batch(stackbench_slot_t* slot)
+{
+    std::vector<uint8_t> records;
+    slot->m_batchCount = 0;
+    while (s_nextAccount < FLAGS_accounts && slot->m_batchCount < FLAGS_batch &&
+           slot->m_batchCount < fus::protocol::acct_batch_max) {
+        ST::string name = ST::format("stackbench{}", s_nextAccount++);
+        fus::protocol::acct_batch_write(records, std::string_view(name.c_str(), name.size()),
+                                        std::string_view(s_password.c_str(), s_password.size()), 0);
+        slot->m_batchCount++;
+    }
+
+    fus::protocol::admin_acctCreateBatchRequest msg;
+    msg.set_type(msg.id());
+    fus::client_prep_trans(slot->m_client, msg, slot, 0, stackbench_batch_created);
+    msg.set_count(slot->m_batchCount);
+    msg.set_recordssz((uint32_t)records.size());
+    slot->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(slot->m_client, msg, records.data(), records.size());
+}
+
+static void stackbench_create(stackbench_slot_t* slot)
+{
+    // The warmup account is always created by itself, so it can't be mixed up with the rest.
+    if (FLAGS_batch && !stackbench_warmup() && s_nextAccount < FLAGS_accounts) {
+        stackbench_create_batch(slot);
+        return;
+    }
+
+    ST::string name;
+    if (stackbench_warmup()) {
+        name = k_warmupAccount;
+    } else if (s_nextAccount < FLAGS_accounts) {
+        name = ST::format("stackbench{}", s_nextAccount++);
+    } else {
+        stackbench_hangup(slot);
+        return;
+    }
+
+    fus::protocol::admin_acctCreateRequest msg;
+    msg.set_type(msg.id());
+    msg.set_name(name);
+    msg.set_pass(s_password);
+    msg.set_flags(0);
+    fus::client_prep_trans(slot->m_client, msg, slot, 0, stackbench_created);
+    slot->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(slot->m_client, msg);
+}
+
+// =================================================================================
+
+static void stackbench_logged_in(void* instance, fus::client_t*, uint32_t, fus::net_error result, ssize_t, const void* msg)
+{
+    auto slot = (stackbench_slot_t*)instance;
+    if (!msg)
+        return;
+
+    bool success = result == fus::net_error::e_success;
+    slot->m_succeeded = success;
+    stackbench_record(e_opLogin, slot->m_opStart, success);
+    stackbench_record(e_opSession, slot->m_sessionStart, success);
+    stackbench_hangup(slot);
+}
+
+static void stackbench_registered(fus::auth_client_t* client, uint32_t srvChallenge)
+{
+    stackbench_slot_t* slot = stackbench_slot(client);
+    stackbench_record(e_opRegister, slot->m_opStart, true);
+
+    uint32_t cliChallenge = (uint32_t)uv_hrtime();
+    fus::protocol::auth_acctLoginRequest msg;
+    msg.set_type(msg.id());
+    msg.set_challenge(cliChallenge);
+    msg.set_name(slot->m_name);
+    s_hash.hash_login(slot->m_acctHash, sizeof(slot->m_acctHash), cliChallenge, srvChallenge,
+                      msg.get_hash(), msg.get_hashsz());
+    msg.set_token(ST::string());
+    msg.set_os(ST_LITERAL("win"));
+    fus::client_prep_trans(client, msg, slot, 0, stackbench_logged_in);
+    slot->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(client, msg);
+}
+
+static void stackbench_register(stackbench_slot_t* slot)
+{
+    fus::protocol::auth_clientRegisterRequest msg;
+    msg.set_type(msg.id());
+    msg.set_buildId(s_buildId);
+    slot->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(slot->m_client, msg);
+}
+
+// =================================================================================
+
+static void stackbench_ready(fus::client_t* client)
+{
+    stackbench_slot_t* slot = stackbench_slot(client);
+    switch (s_phase) {
+    case stackbench_phase::e_warmupCreate:
+    case stackbench_phase::e_create:
+        fus::admin_client_read((fus::admin_client_t*)client);
+        stackbench_create(slot);
+        break;
+    case stackbench_phase::e_warmupLogin:
+    case stackbench_phase::e_login:
+        fus::auth_client_read((fus::auth_client_t*)client);
+        stackbench_register(slot);
+        break;
+    default:
+        stackbench_hangup(slot);
+        break;
+    }
+}
+
+static void stackbench_open(stackbench_slot_t* slot)
+{
+    const fus::config_parser& config = s_server->config();
+    bool admin = s_phase == stackbench_phase::e_warmupCreate || s_phase == stackbench_phase::e_create;
+    const char* cryptName = admin ? "admin" : "auth";
+    uint32_t g = config.get<unsigned int>(ST_LITERAL("crypt"), ST::format("{}_g", cryptName));
+    const ST::string& n = config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_n", cryptName));
+    const ST::string& x = config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_x", cryptName));
+
+    slot->m_succeeded = false;
+    if (admin) {
+        auto client = (fus::admin_client_t*)malloc(sizeof(fus::admin_client_t));
+        fus::admin_client_init(client, uv_default_loop());
+        slot->m_client = client;
+    } else {
+        if (s_phase == stackbench_phase::e_warmupLogin)
+            slot->m_name = k_warmupAccount;
+        else
+            slot->m_name = ST::format("stackbench{}", s_nextAccount++);
+        s_hash.hash_account(slot->m_name, s_password, slot->m_acctHash, sizeof(slot->m_acctHash));
+
+        auto client = (fus::auth_client_t*)malloc(sizeof(fus::auth_client_t));
+        fus::auth_client_init(client, uv_default_loop());
+        fus::auth_client_register_handler(client, stackbench_registered);
+        slot->m_client = client;
+    }
+    uv_handle_set_data((uv_handle_t*)slot->m_client, slot);
+    slot->m_client->m_proc = stackbench_ready;
+    fus::tcp_stream_close_cb(slot->m_client, stackbench_closed);
+    fus::tcp_stream_free_on_close(slot->m_client, true);
+    s_live++;
+
+    // Each connection gets its own copy of the header, just like a real client would send.
+    std::vector<uint8_t> header = s_header;
+    slot->m_opStart = uv_hrtime();
+    slot->m_sessionStart = slot->m_opStart;
+    if (admin)
+        fus::admin_client_connect((fus::admin_client_t*)slot->m_client, (const sockaddr*)&s_addr,
+                                  header.data(), header.size(), g, n, x, stackbench_connected);
+    else
+        fus::auth_client_connect((fus::auth_client_t*)slot->m_client, (const sockaddr*)&s_addr,
+                                 header.data(), header.size(), g, n, x, stackbench_connected);
+}
+
+// =================================================================================
+
+static void stackbench_finish()
+{
+    s_phase = stackbench_phase::e_done;
+    uv_close((uv_handle_t*)&s_retryTimer, nullptr);
+    uv_close((uv_handle_t*)&s_timeoutTimer, nullptr);
+    s_server->shutdown();
+}
+
+static void stackbench_next_phase()
+{
+    uint64_t now = uv_hrtime();
+    switch (s_phase) {
+    case stackbench_phase::e_warmupCreate:
+        s_phase = stackbench_phase::e_warmupLogin;
+        break;
+    case stackbench_phase::e_warmupLogin:
+        print(ST::format("Stack is up; creating {} accounts with {} clients...\n", FLAGS_accounts, s_slots.size()));
+        s_phase = stackbench_phase::e_create;
+        break;
+    case stackbench_phase::e_create:
+        s_createTime = now - s_phaseStart;
+        print(ST::format("Logging in to {} accounts with {} clients...\n", FLAGS_accounts, s_slots.size()));
+        s_phase = stackbench_phase::e_login;
+        break;
+    case stackbench_phase::e_login:
+        s_loginTime = now - s_phaseStart;
+        stackbench_finish();
+        return;
+    default:
+        return;
+    }
+    s_phaseStart = now;
+
+    switch (s_phase) {
+    case stackbench_phase::e_warmupLogin:
+        stackbench_open(&s_slots.front());
+        break;
+    case stackbench_phase::e_create:
+    case stackbench_phase::e_login:
+        s_nextAccount = 0;
+        for (stackbench_slot_t& slot : s_slots)
+            stackbench_open(&slot);
+        break;
+    default:
+        break;
+    }
+}
+
+static void stackbench_timeout(uv_timer_t*)
+{
+    print(ST::format("Gave up after {} s\n", FLAGS_timeout));
+    s_timedOut = true;
+    for (stackbench_slot_t& slot : s_slots) {
+        if (slot.m_client) {
+            fus::tcp_stream_close_cb(slot.m_client, nullptr);
+            stackbench_hangup(&slot);
+        }
+    }
+    stackbench_finish();
+}
+
+static int stackbench_connector(fus::client_t* client, const sockaddr*)
+{
+    // Everything, including the daemons' own connections to the db daemon, lands in the lobby.
+    return fus::server::get()->connect_loopback(client);
+}
+
+// =================================================================================
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double pct)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(pct * (double)sorted.size()));
+    return sorted[idx];
+}
+
+static bool write_config(const std::filesystem::path& dir, const std::filesystem::path& path)
+{
+    std::ofstream stream(path);
+    if (!stream)
+        return false;
+
+    // Nobody connects to the lobby over the network, but it still binds, so let the OS pick a port.
+    // Every loopback stream has the same (lack of) address, so throttling by address is right out.
+    stream << "[lobby]\nbindaddr = 127.0.0.1\nport = 0\n\n";
+    stream << "[log]\ndirectory = " << (dir / "log").u8string() << "\n";
+    stream << "level = " << FLAGS_log_level << "\n\n";
+    stream << "[flight]\nevents = 0\n\n";
+    stream << "[auth]\nlogin_fail_addr_limit = 0\n\n";
+    stream << "[db]\nengine = " << FLAGS_engine << "\n\n";
+    stream << "[sqlite]\npath = " << (dir / "fus.db").u8string() << "\n";
+    stream << "backup_path = " << (dir / "backup" / "fus.db").u8string() << "\n\n";
+    stream << "[postgres]\nconninfo = " << FLAGS_pg_conninfo << "\n";
+    return stream.good();
+}
+
+int main(int argc, char* argv[])
+{
+    gflags::SetVersionString(fus::build_version());
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc != 1) {
+        print("Usage: fus_stackbench [options]\n"
+              "Runs the lobby, admin, auth and db daemons in-process against a scratch database and times\n"
+              "scripted account creation and login through all of them, without any real networking.\n"
+              "Run with --help for a list of options.\n");
+        return 1;
+    }
+
+    // Compare engines by running once with each; the results are printed the same way.
+#ifdef FUS_HAVE_SQLITE
+    bool engineOk = FLAGS_engine == "sqlite";
+#else
+    bool engineOk = false;
+#endif
+#ifdef FUS_HAVE_POSTGRES
+    engineOk = engineOk || FLAGS_engine == "postgres";
+#endif
+    if (!engineOk) {
+        print(ST::format("The '{}' db engine is not available in this build\n", FLAGS_engine));
+        return 1;
+    }
+
+    std::filesystem::path dir;
+    bool ownsDir = FLAGS_temp_dir.empty();
+    if (ownsDir)
+        dir = std::filesystem::temp_directory_path() / ST::format("fus_stackbench_{}", uv_os_getpid()).c_str();
+    else
+        dir = FLAGS_temp_dir;
+    std::error_code error;
+    std::filesystem::create_directories(dir / "log", error);
+    std::filesystem::create_directories(dir / "backup", error);
+    std::filesystem::path configPath = dir / "fus.ini";
+    if (!write_config(dir, configPath)) {
+        print(ST::format("Unable to write '{}'\n", configPath.u8string()));
+        return 1;
+    }
+
+    // There's no terminal to speak of in CI, so the console just prints.
+    fus::console::init(uv_default_loop(), true);
+    fus::io_init();
+    fus::client_set_connector(stackbench_connector);
+
+    uint64_t errors = 0;
+    {
+        stackbench_server server(configPath);
+        s_server = &server;
+        server.generate_daemon_keys(true);
+
+        const fus::config_parser& config = server.config();
+        s_buildId = config.get<unsigned int>("client", "buildId");
+        s_header.resize(std::max(fus::admin_client_header_size(), fus::auth_client_header_size()));
+        auto header = (fus::protocol::common_connection_header*)s_header.data();
+        header->set_msgsz(sizeof(fus::protocol::common_connection_header) - 4); // does not include the buf field
+        header->set_buildId(s_buildId);
+        header->set_buildType(config.get<unsigned int>("client", "buildType"));
+        header->set_branchId(config.get<unsigned int>("client", "branchId"));
+        header->get_product()->from_string(config.get<const char*>("client", "product"));
+        header->set_bufsz(0);
+        fus::str2addr("127.0.0.1", 0, &s_addr);
+
+        if (server.start_lobby()) {
+            s_slots.resize(std::max(1U, std::min(FLAGS_concurrency, FLAGS_accounts)));
+            for (stackbench_slot_t& slot : s_slots)
+                slot.m_client = nullptr;
+            for (stackbench_stats_t& stats : s_stats)
+                stats.m_errors = 0;
+
+            uv_timer_init(uv_default_loop(), &s_retryTimer);
+            uv_timer_init(uv_default_loop(), &s_timeoutTimer);
+            uv_timer_start(&s_timeoutTimer, stackbench_timeout, (uint64_t)FLAGS_timeout * 1000, 0);
+            s_phase = stackbench_phase::e_warmupCreate;
+            s_phaseStart = uv_hrtime();
+            stackbench_open(&s_slots.front());
+        } else {
+            print("Failed to start the server--check the logs for details\n");
+            errors++;
+        }
+        server.run_forever();
+        s_server = nullptr;
+    }
+    fus::client_set_connector(nullptr);
+    fus::io_close();
+
+    if (s_timedOut)
+        errors++;
+    for (size_t op = 0; op < e_numOps; ++op) {
+        std::vector<uint64_t>& latencies = s_stats[op].m_latencies;
+        errors += s_stats[op].m_errors;
+        if (latencies.empty() && s_stats[op].m_errors == 0)
+            continue;
+        std::sort(latencies.begin(), latencies.end());
+        print(ST::format("{<14} {} ok, {} failed; p50 {} us, p90 {} us, p99 {} us, p99.9 {} us, max {} us\n",
+                         ST::format("{}:", s_opNames[op]), latencies.size(), s_stats[op].m_errors,
+                         percentile(latencies, 0.50), percentile(latencies, 0.90),
+                         percentile(latencies, 0.99), percentile(latencies, 0.999),
+                         latencies.empty() ? 0 : latencies.back()));
+    }
+    print(ST::format("Engine: {}\n", FLAGS_engine));
+    if (s_createTime)
+        print(ST::format("Created {} accounts in {.1f} ms ({.1f}/s)\n", FLAGS_accounts, (double)s_createTime / 1000000.0,
+                         (double)FLAGS_accounts / ((double)s_createTime / 1000000000.0)));
+    if (s_loginTime)
+        print(ST::format("Logged in {} times in {.1f} ms ({.1f}/s)\n", FLAGS_accounts, (double)s_loginTime / 1000000.0,
+                         (double)FLAGS_accounts / ((double)s_loginTime / 1000000000.0)));
+
+    if (ownsDir && !FLAGS_keep_temp)
+        std::filesystem::remove_all(dir, error);
+    else
+        print(ST::format("Left the database and logs in '{}'\n", dir.u8string()));
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,250 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+#include <uv.h>
+
+#include "capture.h"
+#include "tcp_stream.h"
+
+// =================================================================================
+
+namespace
+{
+    struct capture_conn_t
+    {
+        std::vector<uint8_t> m_pending;
+        bool m_handshake;
+    };
+};
+
+static bool s_active = false;
+static bool s_full = false;
+static size_t s_maxBytes = 0;
+static uint64_t s_start = 0;
+static uint64_t s_startTime = 0;
+static std::vector<uint8_t> s_buffer;
+static std::unordered_map<uint64_t, capture_conn_t> s_conns;
+static size_t s_sessions = 0;
+
+// =================================================================================
+
+static void append_record(uint64_t connId, fus::capture_record_type type, const void* buf, size_t bufsz)
+{
+    // Once one record doesn't fit, nothing else is recorded either. Keeping smaller records
+    // that come later would leave holes in the middle of sessions that a replay can't cope with.
+    if (s_full)
+        return;
+    if (s_buffer.size() + sizeof(fus::capture_record_t) + bufsz > s_maxBytes) {
+        s_full = true;
+        return;
+    }
+
+    fus::capture_record_t record{};
+    record.m_time = (uv_hrtime() - s_start) / 1000;
+    record.m_connId = connId;
+    record.m_size = (uint32_t)bufsz;
+    record.m_type = (uint8_t)type;
+
+    const uint8_t* ptr = (const uint8_t*)&record;
+    s_buffer.insert(s_buffer.end(), ptr, ptr + sizeof(record));
+    if (bufsz)
+        s_buffer.insert(s_buffer.end(), (const uint8_t*)buf, (const uint8_t*)buf + bufsz);
+}
+
+static capture_conn_t* find_conn(fus::tcp_stream_t* stream)
+{
+    if (!(stream->m_flags & fus::tcp_stream_t::e_capture))
+        return nullptr;
+
+    // A stream from a capture that has since been stopped (or filled up).
+    auto it = (s_active && !s_full) ? s_conns.find(stream->m_connId) : s_conns.end();
+    if (it == s_conns.end()) {
+        stream->m_flags &= ~fus::tcp_stream_t::e_capture;
+        return nullptr;
+    }
+    return &it->second;
+}
+
+// =================================================================================
+
+bool fus::capture_start(size_t maxBytes)
+{
+    if (s_active)
+        return false;
+
+    s_active = true;
+    s_full = false;
+    s_maxBytes = maxBytes;
+    s_start = uv_hrtime();
+    s_startTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    s_buffer.clear();
+    s_conns.clear();
+    s_sessions = 0;
+    return true;
+}
+
+bool fus::capture_active()
+{
+    return s_active;
+}
+
+bool fus::capture_stop(const std::filesystem::path& path, size_t& sessions, size_t& bytes)
+{
+    s_active = false;
+    s_conns.clear();
+    sessions = s_sessions;
+    bytes = s_buffer.size();
+
+    capture_file_t header{};
+    memcpy(header.m_magic, capture_magic, sizeof(header.m_magic));
+    header.m_version = capture_version;
+    header.m_startTime = s_startTime;
+
+    std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (stream.is_open()) {
+        stream.write((const char*)&header, sizeof(header));
+        stream.write((const char*)s_buffer.data(), s_buffer.size());
+    }
+    std::vector<uint8_t>().swap(s_buffer);
+    return stream.is_open() && stream.good();
+}
+
+// =================================================================================
+
+void fus::capture_open(fus::tcp_stream_t* stream)
+{
+    if (!s_active || s_full || !(stream->m_flags & tcp_stream_t::e_accepted))
+        return;
+
+    stream->m_flags |= tcp_stream_t::e_capture;
+    s_conns[stream->m_connId] = { {}, false };
+    s_sessions++;
+    const char* peer = tcp_stream_peeraddr(stream);
+    append_record(stream->m_connId, capture_record_type::e_open, peer, strlen(peer));
+}
+
+void fus::capture_handshake(fus::tcp_stream_t* stream)
+{
+    if (capture_conn_t* conn = find_conn(stream))
+        conn->m_handshake = true;
+}
+
+void fus::capture_read(fus::tcp_stream_t* stream, const void* buf, size_t bufsz)
+{
+    if (capture_conn_t* conn = find_conn(stream))
+        conn->m_pending.insert(conn->m_pending.end(), (const uint8_t*)buf, (const uint8_t*)buf + bufsz);
+}
+
+void fus::capture_dispatch(fus::tcp_stream_t* stream)
+{
+    capture_conn_t* conn = find_conn(stream);
+    if (!conn || conn->m_pending.empty())
+        return;
+
+    // Whatever the client sent in the key exchange is useless without our private key, and a
+    // replay will do its own anyway.
+    if (stream->m_flags & tcp_stream_t::e_encrypted) {
+        append_record(stream->m_connId, capture_record_type::e_inbound, conn->m_pending.data(),
+                      conn->m_pending.size());
+    } else if (!conn->m_handshake) {
+        append_record(stream->m_connId, capture_record_type::e_header, conn->m_pending.data(),
+                      conn->m_pending.size());
+    }
+    conn->m_pending.clear();
+}
+
+void fus::capture_write(fus::tcp_stream_t* stream, const void* buf, size_t bufsz)
+{
+    capture_conn_t* conn = find_conn(stream);
+    if (conn && (stream->m_flags & tcp_stream_t::e_encrypted))
+        append_record(stream->m_connId, capture_record_type::e_outbound, buf, bufsz);
+}
+
+void fus::capture_close(fus::tcp_stream_t* stream)
+{
+    if (find_conn(stream)) {
+        append_record(stream->m_connId, capture_record_type::e_close, nullptr, 0);
+        s_conns.erase(stream->m_connId);
+    }
+    stream->m_flags &= ~tcp_stream_t::e_capture;
+}
+
+// =================================================================================
+
+bool fus::capture_load(const std::filesystem::path& path, std::vector<capture_session_t>& sessions)
+{
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    if (!stream.is_open())
+        return false;
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+    capture_file_t header;
+    if (buf.size() < sizeof(header))
+        return false;
+    memcpy(&header, buf.data(), sizeof(header));
+    if (memcmp(header.m_magic, capture_magic, sizeof(capture_magic)) != 0 || header.m_version != capture_version)
+        return false;
+
+    std::unordered_map<uint64_t, size_t> indices;
+    const uint8_t* ptr = buf.data() + sizeof(header);
+    const uint8_t* end = buf.data() + buf.size();
+    while ((size_t)(end - ptr) >= sizeof(capture_record_t)) {
+        capture_record_t record;
+        memcpy(&record, ptr, sizeof(record));
+        ptr += sizeof(record);
+        if ((size_t)(end - ptr) < record.m_size)
+            break;
+        const uint8_t* data = ptr;
+        ptr += record.m_size;
+
+        if ((capture_record_type)record.m_type == capture_record_type::e_open) {
+            indices[record.m_connId] = sessions.size();
+            capture_session_t& session = sessions.emplace_back();
+            session.m_connId = record.m_connId;
+            session.m_start = record.m_time;
+            continue;
+        }
+
+        auto it = indices.find(record.m_connId);
+        if (it == indices.end())
+            continue;
+        capture_session_t& session = sessions[it->second];
+        switch ((capture_record_type)record.m_type) {
+        case capture_record_type::e_header:
+            session.m_header.insert(session.m_header.end(), data, data + record.m_size);
+            break;
+        case capture_record_type::e_inbound:
+        case capture_record_type::e_outbound:
+            session.m_messages.push_back({ record.m_time,
+                                           (capture_record_type)record.m_type == capture_record_type::e_inbound,
+                                           std::vector<uint8_t>(data, data + record.m_size) });
+            break;
+        case capture_record_type::e_close:
+            indices.erase(it);
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
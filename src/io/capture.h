@@ -0,0 +1,112 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_CAPTURE_H
+#define __FUS_CAPTURE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace fus
+{
+    struct tcp_stream_t;
+
+    enum class capture_record_type : uint8_t
+    {
+        e_open,
+        e_header,
+        e_inbound,
+        e_outbound,
+        e_close,
+    };
+
+    /**
+     * Capture files are a capture_file_t followed by records, each of which is one of these
+     * followed by its payload, in host byte order.
+     */
+    struct capture_record_t
+    {
+        /** Microseconds since the capture started */
+        uint64_t m_time;
+        uint64_t m_connId;
+        uint32_t m_size;
+        uint8_t m_type;
+        uint8_t m_reserved[3];
+    };
+    static_assert(sizeof(capture_record_t) == 24);
+
+    struct capture_file_t
+    {
+        char m_magic[8];
+        uint32_t m_version;
+        uint32_t m_reserved;
+        /** Microseconds since the Unix epoch */
+        uint64_t m_startTime;
+    };
+    static_assert(sizeof(capture_file_t) == 24);
+
+    constexpr char capture_magic[8] = { 'F', 'U', 'S', 'C', 'A', 'P', 'T', 'R' };
+    constexpr uint32_t capture_version = 1;
+
+    /**
+     * Begins recording the decrypted traffic of every connection accepted from now on. Recording
+     * stops as soon as a record would take the capture past \a maxBytes, so every session
+     * in the file is complete up to that point. Returns false if already capturing.
+     * \remarks Capturing is done entirely on the loop thread.
+     */
+    bool capture_start(size_t maxBytes);
+    bool capture_active();
+
+    /**
+     * Stops capturing and saves everything recorded so far.
+     * \param sessions Receives the number of connections captured.
+     */
+    bool capture_stop(const std::filesystem::path& path, size_t& sessions, size_t& bytes);
+
+    // Hooks for the streams. These do nothing for streams that aren't being captured.
+    void capture_open(tcp_stream_t*);
+    void capture_handshake(tcp_stream_t*);
+    void capture_read(tcp_stream_t*, const void*, size_t);
+    void capture_dispatch(tcp_stream_t*);
+    void capture_write(tcp_stream_t*, const void*, size_t);
+    void capture_close(tcp_stream_t*);
+
+    struct capture_message_t
+    {
+        uint64_t m_time;
+        bool m_inbound;
+        std::vector<uint8_t> m_data;
+    };
+
+    /**
+     * One captured connection. The header is everything the client sent before the encryption
+     * handshake, and the messages are everything either side sent after it, decrypted.
+     */
+    struct capture_session_t
+    {
+        uint64_t m_connId;
+        uint64_t m_start;
+        std::vector<uint8_t> m_header;
+        std::vector<capture_message_t> m_messages;
+    };
+
+    /** Reads a capture file back, returning the sessions in the order they connected. */
+    bool capture_load(const std::filesystem::path& path, std::vector<capture_session_t>& sessions);
+};
+
+#endif
@@ -18,6 +18,7 @@
 #include "console.h"
 #include "core/build_info.h"
 #include "core/errors.h"
+#include <cstdio>
 #include <cstring>
 #include <vector>
 
@@ -27,18 +28,22 @@ fus::console* fus::console::m_instance = nullptr;
 
 // =================================================================================
 
-fus::console::console(uv_loop_t* loop)
+fus::console::console(uv_loop_t* loop, bool headless)
     : m_charBuf(), m_flags(),  m_lastBell(), m_cursorPos(), m_historyIt(m_history.cend()), m_inputCharacters(),
       m_outForeColor(color::e_default), m_outBackColor(color::e_default), m_outWeight(weight::e_normal)
 {
     FUS_ASSERTD(!m_instance);
     m_instance = this;
 
-    uv_tty_init(loop, &m_stdin, 0, 1);
-    uv_tty_init(loop, &m_stdout, 1, 0);
+    if (headless) {
+        m_flags |= e_headless;
+    } else {
+        uv_tty_init(loop, &m_stdin, 0, 1);
+        uv_tty_init(loop, &m_stdout, 1, 0);
 
-    uv_handle_set_data((uv_handle_t*)&m_stdin, this);
-    uv_handle_set_data((uv_handle_t*)&m_stdout, this);
+        uv_handle_set_data((uv_handle_t*)&m_stdin, this);
+        uv_handle_set_data((uv_handle_t*)&m_stdout, this);
+    }
 
     // Make a nice prompt... If we have a tag it's probably something like "v1.00" -- so, let's
     // chop off the leading alpha character if the second one is numeric.
@@ -61,9 +66,11 @@ fus::console::console(uv_loop_t* loop)
 
 fus::console::~console()
 {
-    uv_close((uv_handle_t*)&m_stdin, nullptr);
-    uv_close((uv_handle_t*)&m_stdout, nullptr);
-    uv_tty_reset_mode();
+    if (!(m_flags & e_headless)) {
+        uv_close((uv_handle_t*)&m_stdin, nullptr);
+        uv_close((uv_handle_t*)&m_stdout, nullptr);
+        uv_tty_reset_mode();
+    }
     m_instance = nullptr;
 }
 
@@ -444,6 +451,12 @@ static void write_complete(console_write_t* req, int status)
 
 void fus::console::write(const char* buf, size_t bufsz)
 {
+    if (m_flags & e_headless) {
+        fwrite(buf, 1, bufsz, stdout);
+        fflush(stdout);
+        return;
+    }
+
     // The console will (hopefully) immediately accept everything.
     uv_buf_t writebuf = uv_buf_init((char*)buf, bufsz);
     int writesz = uv_try_write((uv_stream_t*)&m_stdout, &writebuf, 1);
@@ -467,6 +480,9 @@ void fus::console::write(const char* buf, size_t bufsz)
 
 void fus::console::output_ansi()
 {
+    if (m_flags & e_headless)
+        return;
+
     m_outputBuf.append("\x1B[", 2);
     if (m_outWeight == weight::e_bold)
         m_outputBuf.append_char('1');
@@ -532,11 +548,13 @@ void fus::console::output_ansi()
 fus::console& fus::console::flush(fus::console& c)
 {
     // First, we clear the working line that the doofus is typing.
-    c.write("\r\x1B[K", 4);
+    if (!(c.m_flags & e_headless))
+        c.write("\r\x1B[K", 4);
 
     // If the ANSI text mode was changed, we need to reset to something sensible.
     if (c.m_flags & e_outputAnsiChanged) {
-        c.m_outputBuf << "\x1B[0m";
+        if (!(c.m_flags & e_headless))
+            c.m_outputBuf << "\x1B[0m";
         c.m_flags &= ~e_outputAnsiChanged;
     }
     c.m_flags &= ~e_outputAnsiDirty;
@@ -559,6 +577,7 @@ fus::console& fus::console::flush(fus::console& c)
 void fus::console::begin()
 {
     FUS_ASSERTD(!(m_flags & e_processing));
+    FUS_ASSERTD(!(m_flags & e_headless));
 
     m_flags |= e_processing;
     uv_tty_set_mode(&m_stdin, UV_TTY_MODE_RAW);
@@ -586,7 +605,8 @@ void fus::console::set_prompt(const ST::string& value)
 
 std::tuple<int, int> fus::console::size()
 {
-    int width, height;
-    uv_tty_get_winsize(&m_stdout, &width, &height);
+    int width = 80, height = 24;
+    if (!(m_flags & e_headless))
+        uv_tty_get_winsize(&m_stdout, &width, &height);
     return std::make_tuple(width, height);
 }
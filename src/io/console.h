@@ -54,6 +54,7 @@ namespace fus
             e_outputAnsiDirty = (1<<1),
             e_outputAnsiChanged = (1<<2),
             e_execCommand = (1<<3),
+            e_headless = (1<<4),
         };
 
         static console* m_instance;
@@ -112,15 +113,19 @@ namespace fus
         void write(const char* buf, size_t bufsz);
 
     public:
-        console(uv_loop_t*);
+        /**
+         * A headless console never touches the terminal. Output goes straight to stdout without
+         * any escape codes, so stdin and stdout may be files, pipes or nothing at all.
+         */
+        console(uv_loop_t*, bool headless=false);
         console(const console&) = delete;
         console(console&&) = delete;
         ~console();
 
         static console& get() { return *m_instance; }
-        static console& init(uv_loop_t* loop)
+        static console& init(uv_loop_t* loop, bool headless=false)
         {
-            console* c = new console(loop);
+            console* c = new console(loop, headless);
             return *c;
         }
 
@@ -146,6 +151,8 @@ namespace fus
         void begin();
         void end();
 
+        bool headless() const { return m_flags & e_headless; }
+
         void set_prompt(const ST::string&);
         std::tuple<int, int> size();
 
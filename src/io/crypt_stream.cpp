@@ -21,6 +21,9 @@
 #include <string_theory/st_codecs.h>
 
 #include "core/errors.h"
+#include "core/flight_recorder.h"
+#include "core/metrics.h"
+#include "capture.h"
 #include "crypt_stream.h"
 #include "fus_config.h"
 #include "io.h"
@@ -28,12 +31,32 @@
 
 // =================================================================================
 
+static fus::metric_counter s_handshakes("fus_crypt_handshakes_total", "Connection handshakes completed");
+static fus::metric_counter s_handshakeFailures("fus_crypt_handshake_failures_total", "Connection handshakes that failed");
+static fus::metric_histogram s_handshakeLatency("fus_crypt_handshake_latency_us", "Time taken to establish encryption (us)");
+
+static void _handshake_done(fus::crypt_stream_t* stream)
+{
+    uint64_t latency = (uv_hrtime() / 1000) - stream->m_handshakeStart;
+    s_handshakes.add();
+    s_handshakeLatency.record(latency);
+    fus::flight_record(fus::flight_event::e_handshake, fus::tcp_stream_connid(stream), 0, (uint32_t)latency);
+}
+
+static void _handshake_failed(fus::crypt_stream_t* stream)
+{
+    s_handshakeFailures.add();
+    fus::flight_record(fus::flight_event::e_handshakeFailed, fus::tcp_stream_connid(stream));
+}
+
+// =================================================================================
+
 // Reduces the allocations
 namespace fus
 {
-    extern io_crypt_bn_t io_crypt_bn;
-    extern size_t io_crypt_bufsz;
-    extern void* io_crypt_buf;
+    extern thread_local io_crypt_bn_t io_crypt_bn;
+    extern thread_local size_t io_crypt_bufsz;
+    extern thread_local void* io_crypt_buf;
 };
 
 // Manually defining this message allows us to avoid a circular link with fus_protocol
@@ -64,11 +87,20 @@ static inline void* _realloc_buffer(size_t bufsz)
     return fus::io_crypt_buf;
 }
 
+static inline BN_CTX* _bn_ctx()
+{
+    // io_init() only sets this up for the main thread; other loop threads get theirs on demand.
+    if (!fus::io_crypt_bn.ctx)
+        fus::io_crypt_bn.ctx = BN_CTX_new();
+    return fus::io_crypt_bn.ctx;
+}
+
 // =================================================================================
 
 void fus::crypt_stream_init(fus::crypt_stream_t* stream)
 {
     stream->m_encryptcb = nullptr;
+    stream->m_handshakeStart = 0;
 #ifndef FUS_ALLOW_DECRYPTED_CLIENTS
     stream->m_flags |= tcp_stream_t::e_mustEncrypt;
 #endif
@@ -207,6 +239,7 @@ static void _init_encryption(fus::crypt_stream_t* stream, const uint8_t* seed, c
     stream->m_crypt.encrypt = _init_evp(key, keylen, 1);
     stream->m_crypt.decrypt = _init_evp(key, keylen, 0);
     stream->m_flags |= fus::tcp_stream_t::e_encrypted;
+    _handshake_done(stream);
     if (stream->m_encryptcb)
         stream->m_encryptcb(stream, 0);
 }
@@ -214,22 +247,14 @@ static void _init_encryption(fus::crypt_stream_t* stream, const uint8_t* seed, c
 static void _handshake_ydata_read(fus::crypt_stream_t* stream, ssize_t nread, uint8_t* buf)
 {
     if (nread < 0) {
+        _handshake_failed(stream);
         fus::tcp_stream_shutdown((fus::tcp_stream_t*)stream);
         return;
     }
 
-    // Hey, nice, OpenSSL has considered that we'll want temporary bignums...
-    BN_CTX_start(fus::io_crypt_bn.ctx);
-    BIGNUM* y = BN_CTX_get(fus::io_crypt_bn.ctx);
-    BIGNUM* seed = BN_CTX_get(fus::io_crypt_bn.ctx);
-
-    BN_lebin2bn((unsigned char*)buf, (int)nread, y);
-    BN_mod_exp(seed, y, stream->m_crypt.k, stream->m_crypt.n, fus::io_crypt_bn.ctx);
-
     uint8_t cli_seed[64];
     uint8_t srv_seed[7];
-    BN_bn2lebinpad(seed, cli_seed, sizeof(cli_seed));
-    BN_CTX_end(fus::io_crypt_bn.ctx);
+    fus::crypt_handshake_server(stream->m_crypt.k, stream->m_crypt.n, buf, nread, cli_seed, sizeof(cli_seed));
     fus::crypt_stream_free_keys(stream);
 
     RAND_bytes(srv_seed, sizeof(srv_seed));
@@ -242,6 +267,7 @@ static void _handshake_ydata_read(fus::crypt_stream_t* stream, ssize_t nread, ui
 static void _handshake_header_read_srv(fus::crypt_stream_t* stream, ssize_t nread, uint8_t* msg)
 {
     if (nread < 0) {
+        _handshake_failed(stream);
         fus::tcp_stream_shutdown(stream);
         return;
     }
@@ -252,10 +278,12 @@ static void _handshake_header_read_srv(fus::crypt_stream_t* stream, ssize_t nrea
     // A client will send no Y data if encryption is not desired.
     uint8_t ybufsz = msgsz - 2;
     if (ybufsz == 0) {
-        if (stream->m_flags & fus::tcp_stream_t::e_mustEncrypt)
+        if (stream->m_flags & fus::tcp_stream_t::e_mustEncrypt) {
+            _handshake_failed(stream);
             fus::tcp_stream_shutdown(stream);
-        else
+        } else {
             _init_encryption(stream, nullptr, nullptr, 0);
+        }
     } else {
         // Read in the Y-Data from the client
         fus::tcp_stream_read(stream, ybufsz, (fus::tcp_read_cb)_handshake_ydata_read);
@@ -266,6 +294,9 @@ void fus::crypt_stream_establish_server(fus::crypt_stream_t* stream, crypt_estab
 {
     FUS_ASSERTD(stream->m_flags & tcp_stream_t::e_hasSrvKeys);
     stream->m_encryptcb = cb;
+    stream->m_handshakeStart = uv_hrtime() / 1000;
+    if (stream->m_flags & tcp_stream_t::e_capture)
+        capture_handshake(stream);
     tcp_stream_read_struct(stream, &s_cryptHandshakeStruct, (tcp_read_cb)_handshake_header_read_srv);
 }
 
@@ -274,6 +305,7 @@ void fus::crypt_stream_establish_server(fus::crypt_stream_t* stream, crypt_estab
 static void _srvseed_read(fus::crypt_stream_t* stream, ssize_t nread, uint8_t* srv_seed)
 {
     if (nread < 0) {
+        _handshake_failed(stream);
         if (stream->m_encryptcb)
             stream->m_encryptcb(stream, nread);
         fus::tcp_stream_shutdown(stream);
@@ -291,6 +323,7 @@ static void _srvseed_read(fus::crypt_stream_t* stream, ssize_t nread, uint8_t* s
     stream->m_crypt.encrypt = _init_evp(key, nread, 1);
     stream->m_crypt.decrypt = _init_evp(key, nread, 0);
     stream->m_flags |= fus::tcp_stream_t::e_encrypted;
+    _handshake_done(stream);
 
     if (stream->m_encryptcb)
         stream->m_encryptcb(stream, 0);
@@ -299,6 +332,7 @@ static void _srvseed_read(fus::crypt_stream_t* stream, ssize_t nread, uint8_t* s
 static void _handshake_header_read_cli(fus::crypt_stream_t* stream, ssize_t nread, uint8_t* msg)
 {
     if (nread < 0 || msg[0] != e_encrypt || msg[1] < 9 || msg[1] > 4096) {
+        _handshake_failed(stream);
         if (stream->m_encryptcb)
             stream->m_encryptcb(stream, nread < 0 ? nread : UV_EMSGSIZE);
         fus::tcp_stream_shutdown(stream);
@@ -313,37 +347,59 @@ void fus::crypt_stream_establish_client(fus::crypt_stream_t* stream, crypt_estab
 {
     FUS_ASSERTD(stream->m_flags & tcp_stream_t::e_hasCliKeys);
     stream->m_encryptcb = cb;
+    stream->m_handshakeStart = uv_hrtime() / 1000;
 
     // What a turd. We're going to need to keep this bignum for a bit.
     stream->m_crypt.seed = BN_new();
     stream->m_flags |= tcp_stream_t::e_ownSeed;
 
-    BN_CTX_start(fus::io_crypt_bn.ctx);
-    BIGNUM* b = BN_CTX_get(fus::io_crypt_bn.ctx);
-    BIGNUM* y = BN_CTX_get(fus::io_crypt_bn.ctx);
-    BIGNUM* g = BN_CTX_get(fus::io_crypt_bn.ctx);
+    // Send the Y-data to the server and await its crypt response.
+    uint8_t connect[66];
+    connect[0] = e_connect;
+    connect[1] = sizeof(connect);
+    crypt_handshake_client(stream->m_crypt.g, stream->m_crypt.n, stream->m_crypt.x, stream->m_crypt.seed,
+                           connect + 2, sizeof(connect) - 2);
+    tcp_stream_write(stream, connect, sizeof(connect));
+    tcp_stream_read_struct(stream, &s_cryptHandshakeStruct, (tcp_read_cb)_handshake_header_read_cli);
+}
+
+// =================================================================================
+
+void fus::crypt_handshake_client(uint32_t gval, const BIGNUM* n, const BIGNUM* x, BIGNUM* seed,
+                                 void* ydata, size_t ydatasz)
+{
+    BN_CTX* ctx = _bn_ctx();
+    BN_CTX_start(ctx);
+    BIGNUM* b = BN_CTX_get(ctx);
+    BIGNUM* y = BN_CTX_get(ctx);
+    BIGNUM* g = BN_CTX_get(ctx);
 
     // Values taken from CWE's plBigNum::Rand(), used by NetMsgCryptClientStart()
     BN_rand(b, 512, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ANY);
-    BN_set_word(g, stream->m_crypt.g);
+    BN_set_word(g, gval);
 
     // This is easier to follow in the old timey pyfus. Maybe one day, its code will be resurrected...
-    BN_mod_exp(stream->m_crypt.seed, stream->m_crypt.x, b, stream->m_crypt.n, fus::io_crypt_bn.ctx);
-    BN_mod_exp(y, g, b, stream->m_crypt.n, fus::io_crypt_bn.ctx);
-
-    // Send the Y-data to the server and await its crypt response.
-    uint8_t connect[66];
-    {
-        uint8_t* ptr = connect;
-        *ptr++ = e_connect;
-        *ptr++ = sizeof(connect);
-        BN_bn2lebinpad(y, ptr, sizeof(connect) - 2);
-    }
-    tcp_stream_write(stream, connect, sizeof(connect));
-    tcp_stream_read_struct(stream, &s_cryptHandshakeStruct, (tcp_read_cb)_handshake_header_read_cli);
+    BN_mod_exp(seed, x, b, n, ctx);
+    BN_mod_exp(y, g, b, n, ctx);
+    BN_bn2lebinpad(y, (unsigned char*)ydata, (int)ydatasz);
 
     // Nukes the temp bignums
-    BN_CTX_end(fus::io_crypt_bn.ctx);
+    BN_CTX_end(ctx);
+}
+
+void fus::crypt_handshake_server(const BIGNUM* k, const BIGNUM* n, const void* ydata, size_t ydatasz,
+                                 void* seed, size_t seedsz)
+{
+    // Hey, nice, OpenSSL has considered that we'll want temporary bignums...
+    BN_CTX* ctx = _bn_ctx();
+    BN_CTX_start(ctx);
+    BIGNUM* y = BN_CTX_get(ctx);
+    BIGNUM* result = BN_CTX_get(ctx);
+
+    BN_lebin2bn((const unsigned char*)ydata, (int)ydatasz, y);
+    BN_mod_exp(result, y, k, n, ctx);
+    BN_bn2lebinpad(result, (unsigned char*)seed, (int)seedsz);
+    BN_CTX_end(ctx);
 }
 
 // =================================================================================
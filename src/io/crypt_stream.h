@@ -30,6 +30,7 @@ namespace fus
     {
         tcp_read_cb m_readcb;
         crypt_established_cb m_encryptcb;
+        uint64_t m_handshakeStart;
         union
         {
             struct
@@ -61,6 +62,16 @@ namespace fus
     void crypt_stream_establish_server(crypt_stream_t*, crypt_established_cb cb=nullptr);
     void crypt_stream_establish_client(crypt_stream_t*, crypt_established_cb cb=nullptr);
 
+    /**
+     * The Diffie-Hellman math behind each side of the handshake. The client picks a secret, stores
+     * the shared seed, and produces the Y-data to send; the server turns that Y-data into the same
+     * seed. These are used by the handshake itself and exposed for benchmarking.
+     */
+    void crypt_handshake_client(uint32_t g, const BIGNUM* n, const BIGNUM* x, BIGNUM* seed,
+                                void* ydata, size_t ydatasz);
+    void crypt_handshake_server(const BIGNUM* k, const BIGNUM* n, const void* ydata, size_t ydatasz,
+                                void* seed, size_t seedsz);
+
     void crypt_stream_decipher(crypt_stream_t*, void*, size_t);
     void crypt_stream_encipher(crypt_stream_t*, const void*, void*, size_t);
     void* crypt_stream_encipher(crypt_stream_t*, const void*, size_t);
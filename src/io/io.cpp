@@ -24,11 +24,18 @@
 
 namespace fus
 {
-    io_crypt_bn_t io_crypt_bn{ nullptr };
-    size_t io_crypt_bufsz = 0;
-    void* io_crypt_buf = nullptr;
+    // Handshake and cipher scratch space. Each loop thread gets its own so that several loops
+    // can run side by side in one process.
+    thread_local io_crypt_bn_t io_crypt_bn{ nullptr };
+    thread_local size_t io_crypt_bufsz = 0;
+    thread_local void* io_crypt_buf = nullptr;
 };
 
+fus::io_crypt_bn_t::~io_crypt_bn_t()
+{
+    BN_CTX_free(ctx);
+}
+
 // ============================================================================
 
 void fus::io_init()
@@ -45,6 +52,7 @@ void fus::io_init()
 void fus::io_close()
 {
     BN_CTX_free(io_crypt_bn.ctx);
+    io_crypt_bn.ctx = nullptr;
 
     // OpenSSL 1.0 compatibility
     EVP_cleanup();
@@ -95,12 +103,14 @@ void fus::io_generate_keys(uint32_t g_value, uint8_t (&k_key)[_KSz], uint8_t (&n
     constexpr int key_bits = _KSz * 8;
     static_assert(key_bits == 512);
 
-    // According to OpenSSL's documentation, this works well for tight loops
-    BN_CTX_start(io_crypt_bn.ctx);
-    BIGNUM* g = BN_CTX_get(io_crypt_bn.ctx);
-    BIGNUM* k = BN_CTX_get(io_crypt_bn.ctx);
-    BIGNUM* n = BN_CTX_get(io_crypt_bn.ctx);
-    BIGNUM* x = BN_CTX_get(io_crypt_bn.ctx);
+    // Key generation is slow enough that it's done on worker threads, so we can't borrow the
+    // shared context like everyone else does.
+    BN_CTX* ctx = BN_CTX_new();
+    BN_CTX_start(ctx);
+    BIGNUM* g = BN_CTX_get(ctx);
+    BIGNUM* k = BN_CTX_get(ctx);
+    BIGNUM* n = BN_CTX_get(ctx);
+    BIGNUM* x = BN_CTX_get(ctx);
 
     // Generate primes for public (N) and private (K/A) keys
     BN_generate_prime_ex(k, key_bits, 1, nullptr, nullptr, nullptr);
@@ -109,7 +119,7 @@ void fus::io_generate_keys(uint32_t g_value, uint8_t (&k_key)[_KSz], uint8_t (&n
     // Compute the client key (N/KA)
     // X = g**K%N
     BN_set_word(g, g_value);
-    BN_mod_exp(x, g, k, n, io_crypt_bn.ctx);
+    BN_mod_exp(x, g, k, n, ctx);
 
     // Store the keys
     BN_bn2bin(k, k_key);
@@ -117,7 +127,8 @@ void fus::io_generate_keys(uint32_t g_value, uint8_t (&k_key)[_KSz], uint8_t (&n
     BN_bn2bin(x, x_key);
 
     // Releases the temporary bignums
-    BN_CTX_end(io_crypt_bn.ctx);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
 }
 
 std::tuple<ST::string, ST::string, ST::string> fus::io_generate_keys(uint32_t g_value)
@@ -27,6 +27,8 @@ namespace fus
     struct io_crypt_bn_t
     {
         BN_CTX* ctx;
+
+        ~io_crypt_bn_t();
     };
 
     void io_init();
@@ -35,6 +37,10 @@ namespace fus
     bool str2addr(const char*, uint16_t, sockaddr_storage*);
     ST::string addr2str(const sockaddr*);
 
+    /**
+     * Generates a new set of base64 encoded K, N, and X keys.
+     * This is very slow, but it is safe to call from any thread.
+     */
     std::tuple<ST::string, ST::string, ST::string> io_generate_keys(uint32_t g_value);
 
     template <size_t _KSz, size_t _NSz, size_t _XSz>
@@ -14,11 +14,26 @@
  *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include "core/alloc_profile.h"
 #include "core/build_info.h"
 #include "core/errors.h"
+#include "core/metrics.h"
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <initializer_list>
 #include "log_file.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // =================================================================================
 
@@ -37,40 +52,647 @@ void fus::log_file::set_directory(const ST::string& dir)
     s_logdir = dir.c_str();
 }
 
+std::filesystem::path fus::log_file::get_directory()
+{
+    return log_directory();
+}
+
+// =================================================================================
+
+struct fus::log_sink_t
+{
+    std::filesystem::path m_path;
+    uv_file m_file;
+    uint64_t m_size;
+    time_t m_opened;
+    std::atomic<uint64_t> m_dropped;
+    bool m_closing;
+    bool m_binary;
+
+    /** Formats already introduced in this (binary) file. Only touched by the writer thread. */
+    std::unordered_map<const fus::log_format_t*, uint32_t> m_formats;
+};
+
+namespace
+{
+    /**
+     * Header preceding each message in a ring. Records are kept 8-byte aligned, but a header is
+     * bigger than that, so headers can wrap around the end of the buffer just like payloads.
+     * Text records carry a formatted line; deferred records carry their format's raw arguments.
+     */
+    struct alignas(8) log_record_t
+    {
+        fus::log_sink_t* m_sink;
+        const fus::log_format_t* m_format;
+        int64_t m_time;
+        uint32_t m_size;
+    };
+
+    struct log_part_t
+    {
+        const void* m_data;
+        size_t m_size;
+    };
+
+    constexpr size_t log_align(size_t value) { return (value + 7) & ~(size_t)7; }
+
+    /** Single producer, single consumer ring of log records. */
+    struct log_ring_t
+    {
+        std::unique_ptr<char[]> m_buf;
+        size_t m_capacity;
+        std::atomic<size_t> m_head;
+        std::atomic<size_t> m_tail;
+        std::atomic<bool> m_orphaned;
+
+        log_ring_t(size_t capacity)
+            : m_buf(new char[capacity]), m_capacity(capacity), m_head(0), m_tail(0), m_orphaned(false)
+        { }
+
+        size_t mask() const { return m_capacity - 1; }
+    };
+
+    class log_backend
+    {
+        std::mutex m_lock;
+        std::condition_variable m_wake;
+        std::condition_variable m_flushed;
+        std::vector<std::unique_ptr<log_ring_t>> m_rings;
+        std::vector<fus::log_sink_t*> m_sinks;
+        std::vector<fus::log_sink_t*> m_retired;
+        std::thread m_thread;
+        uint64_t m_flushRequested;
+        uint64_t m_flushCompleted;
+        bool m_quit;
+
+        // Only touched by the writer thread.
+        std::unordered_map<fus::log_sink_t*, std::vector<uv_buf_t>> m_batches;
+        std::deque<std::string> m_arena;
+        std::vector<uint8_t> m_scratch;
+        time_t m_second;
+        char m_timestr[32];
+        size_t m_timesz;
+
+    public:
+        std::atomic<size_t> m_ringsz;
+        std::atomic<uint64_t> m_rotateSize;
+        std::atomic<uint32_t> m_rotateAge;
+        std::atomic<unsigned int> m_rotateKeep;
+        std::atomic<bool> m_binary;
+
+    protected:
+        void run();
+        bool drain(const std::vector<log_ring_t*>& rings, const std::vector<size_t>& heads,
+                   const std::vector<fus::log_sink_t*>& sinks);
+        void write(fus::log_sink_t* sink, const std::vector<uv_buf_t>& bufs);
+        void rotate(fus::log_sink_t* sink);
+
+        void push_arena(std::vector<uv_buf_t>& bufs, std::string&& data);
+        void push_ring(std::vector<uv_buf_t>& bufs, log_ring_t* ring, size_t pos, size_t size);
+        const uint8_t* ring_data(log_ring_t* ring, size_t pos, size_t size);
+        void push_text(fus::log_sink_t* sink, std::vector<uv_buf_t>& bufs, std::string&& text);
+        void push_record(fus::log_sink_t* sink, std::vector<uv_buf_t>& bufs, log_ring_t* ring,
+                         size_t pos, const log_record_t& record);
+
+    public:
+        log_backend()
+            : m_flushRequested(), m_flushCompleted(), m_quit(), m_second(-1), m_timesz(),
+              m_ringsz(1024 * 1024), m_rotateSize(), m_rotateAge(), m_rotateKeep(), m_binary()
+        { }
+        log_backend(const log_backend&) = delete;
+        log_backend(log_backend&&) = delete;
+        ~log_backend();
+
+        log_ring_t* add_ring();
+        void add_sink(fus::log_sink_t* sink);
+        void close_sink(fus::log_sink_t* sink);
+        void flush();
+        void rotate_files(const std::filesystem::path& path);
+        uv_file open_file(fus::log_sink_t* sink);
+        size_t backlog();
+    };
+
+    struct log_thread_t
+    {
+        log_ring_t* m_ring;
+        time_t m_second;
+        size_t m_timesz;
+        char m_timestr[32];
+
+        log_thread_t() : m_ring(), m_second(-1), m_timesz() { }
+        ~log_thread_t()
+        {
+            // The writer thread will free the ring once it has been drained.
+            if (m_ring)
+                m_ring->m_orphaned.store(true, std::memory_order_release);
+        }
+    };
+};
+
+static log_backend& backend()
+{
+    static log_backend s_backend;
+    return s_backend;
+}
+
+static thread_local log_thread_t s_logThread;
+
+static fus::metric_counter s_logDropped("fus_log_dropped_total", "Log messages dropped because the log buffer was full");
+static fus::metric_gauge s_logBacklog("fus_log_backlog_bytes", "Bytes of log messages waiting to be written", nullptr,
+                                      []() { return (uint64_t)backend().backlog(); });
+
+// =================================================================================
+
+static inline void log_gmtime(time_t timest, tm* result)
+{
+#ifdef _WIN32
+    gmtime_s(result, &timest);
+#else
+    gmtime_r(&timest, result);
+#endif
+}
+
+static inline size_t log_format_time(time_t timest, char* buf, size_t bufsz)
+{
+    tm time;
+    log_gmtime(timest, &time);
+    return strftime(buf, bufsz, "[%Y-%m-%d %H:%M:%S] ", &time);
+}
+
+static inline void log_ring_copy(log_ring_t* ring, size_t pos, const void* src, size_t srcsz)
+{
+    size_t offset = pos & ring->mask();
+    size_t first = std::min(srcsz, ring->m_capacity - offset);
+    memcpy(ring->m_buf.get() + offset, src, first);
+    if (first < srcsz)
+        memcpy(ring->m_buf.get(), (const char*)src + first, srcsz - first);
+}
+
+static inline void log_ring_read(const log_ring_t* ring, size_t pos, void* dst, size_t dstsz)
+{
+    size_t offset = pos & ring->mask();
+    size_t first = std::min(dstsz, ring->m_capacity - offset);
+    memcpy(dst, ring->m_buf.get() + offset, first);
+    if (first < dstsz)
+        memcpy((char*)dst + first, ring->m_buf.get(), dstsz - first);
+}
+
+static bool log_ring_push(log_ring_t* ring, log_record_t record, std::initializer_list<log_part_t> parts)
+{
+    size_t payloadsz = 0;
+    for (const log_part_t& part : parts)
+        payloadsz += part.m_size;
+
+    size_t recordsz = sizeof(log_record_t) + log_align(payloadsz);
+    size_t head = ring->m_head.load(std::memory_order_relaxed);
+    size_t tail = ring->m_tail.load(std::memory_order_acquire);
+    if (recordsz > ring->m_capacity - (head - tail))
+        return false;
+
+    record.m_size = (uint32_t)payloadsz;
+    log_ring_copy(ring, head, &record, sizeof(record));
+
+    size_t pos = head + sizeof(log_record_t);
+    for (const log_part_t& part : parts) {
+        log_ring_copy(ring, pos, part.m_data, part.m_size);
+        pos += part.m_size;
+    }
+
+    ring->m_head.store(head + recordsz, std::memory_order_release);
+    return true;
+}
+
+template<typename _Value>
+static inline void log_append(std::string& buf, const _Value& value)
+{
+    buf.append((const char*)&value, sizeof(value));
+}
+
+static inline std::string log_entry(fus::log_entry_type type, uint8_t level, size_t bodysz)
+{
+    fus::log_entry_t entry{ (uint8_t)type, level, 0, (uint32_t)bodysz };
+    std::string result;
+    log_append(result, entry);
+    return result;
+}
+
 // =================================================================================
 
-int fus::log_file::open(uv_loop_t* loop, const ST::string& name)
+log_backend::~log_backend()
 {
-    m_loop = loop;
-    m_offset = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    for (fus::log_sink_t* sink : m_sinks) {
+        uv_fs_t req;
+        uv_fs_close(nullptr, &req, sink->m_file, nullptr);
+        uv_fs_req_cleanup(&req);
+        delete sink;
+    }
+    for (fus::log_sink_t* sink : m_retired)
+        delete sink;
+}
+
+log_ring_t* log_backend::add_ring()
+{
+    // Rings must be a power of two so positions can simply be masked.
+    size_t capacity = 64 * 1024;
+    while (capacity < m_ringsz.load(std::memory_order_relaxed))
+        capacity <<= 1;
 
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_rings.emplace_back(std::make_unique<log_ring_t>(capacity));
+    return m_rings.back().get();
+}
+
+void log_backend::add_sink(fus::log_sink_t* sink)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_sinks.push_back(sink);
+    if (!m_thread.joinable())
+        m_thread = std::thread(&log_backend::run, this);
+}
+
+void log_backend::close_sink(fus::log_sink_t* sink)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        sink->m_closing = true;
+    }
+
+    // The writer thread closes the file once everything destined for it has been written.
+    flush();
+}
+
+size_t log_backend::backlog()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    size_t result = 0;
+    for (const auto& ring : m_rings)
+        result += ring->m_head.load(std::memory_order_relaxed) - ring->m_tail.load(std::memory_order_relaxed);
+    return result;
+}
+
+void log_backend::flush()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (!m_thread.joinable())
+        return;
+    uint64_t target = ++m_flushRequested;
+    m_wake.notify_all();
+    m_flushed.wait(lock, [this, target]() { return m_flushCompleted >= target || m_quit; });
+}
+
+void log_backend::run()
+{
+    fus::alloc_scope_t allocScope("log writer");
+    std::vector<log_ring_t*> rings;
+    std::vector<size_t> heads;
+    std::vector<fus::log_sink_t*> sinks;
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (true) {
+        // Producers don't poke us -- that would take a lock -- so we poll often enough that the
+        // default ring size can absorb a burst in between.
+        m_wake.wait_for(lock, std::chrono::milliseconds(25), [this]() {
+            return m_quit || m_flushRequested != m_flushCompleted;
+        });
+
+        uint64_t flushTarget = m_flushRequested;
+        bool quit = m_quit;
+        rings.clear();
+        heads.clear();
+        for (const auto& ring : m_rings) {
+            rings.push_back(ring.get());
+            heads.push_back(ring->m_head.load(std::memory_order_acquire));
+        }
+
+        // A sink is added under the lock before anyone can log to it, so every record up to
+        // the heads we just read belongs to a sink in this list (or to one that was retired).
+        // Records logged after this point wait for the next pass.
+        sinks = m_sinks;
+
+        lock.unlock();
+        bool orphans = drain(rings, heads, sinks);
+        lock.lock();
+
+        // Retire what is no longer needed. Closing sinks were marked before the flush that was
+        // requested by their close, so everything they're owed has been drained by now.
+        if (orphans) {
+            m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(), [](const auto& ring) {
+                return ring->m_orphaned.load(std::memory_order_acquire) &&
+                       ring->m_head.load(std::memory_order_acquire) == ring->m_tail.load(std::memory_order_relaxed);
+            }), m_rings.end());
+        }
+        for (auto it = m_sinks.begin(); it != m_sinks.end();) {
+            fus::log_sink_t* sink = *it;
+            if (sink->m_closing && std::find(sinks.begin(), sinks.end(), sink) != sinks.end()) {
+                uv_fs_t req;
+                uv_fs_close(nullptr, &req, sink->m_file, nullptr);
+                uv_fs_req_cleanup(&req);
+                m_batches.erase(sink);
+
+                // A thread that read the sink just before it was closed may still count a drop
+                // against it, so it stays allocated until we go away.
+                m_retired.push_back(sink);
+                it = m_sinks.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        m_flushCompleted = flushTarget;
+        m_flushed.notify_all();
+        if (quit)
+            break;
+    }
+}
+
+void log_backend::push_arena(std::vector<uv_buf_t>& bufs, std::string&& data)
+{
+    // Strings in a deque don't move once they're in, so it's safe to point at them.
+    std::string& str = m_arena.emplace_back(std::move(data));
+    bufs.push_back(uv_buf_init(str.data(), (unsigned int)str.size()));
+}
+
+void log_backend::push_ring(std::vector<uv_buf_t>& bufs, log_ring_t* ring, size_t pos, size_t size)
+{
+    size_t offset = pos & ring->mask();
+    size_t first = std::min(size, ring->m_capacity - offset);
+    bufs.push_back(uv_buf_init(ring->m_buf.get() + offset, (unsigned int)first));
+    if (first < size)
+        bufs.push_back(uv_buf_init(ring->m_buf.get(), (unsigned int)(size - first)));
+}
+
+const uint8_t* log_backend::ring_data(log_ring_t* ring, size_t pos, size_t size)
+{
+    size_t offset = pos & ring->mask();
+    if (offset + size <= ring->m_capacity)
+        return (const uint8_t*)ring->m_buf.get() + offset;
+
+    // Wrapped around the end, so it has to be stitched back together.
+    size_t first = ring->m_capacity - offset;
+    m_scratch.resize(size);
+    memcpy(m_scratch.data(), ring->m_buf.get() + offset, first);
+    memcpy(m_scratch.data() + first, ring->m_buf.get(), size - first);
+    return m_scratch.data();
+}
+
+void log_backend::push_text(fus::log_sink_t* sink, std::vector<uv_buf_t>& bufs, std::string&& text)
+{
+    if (sink->m_binary)
+        push_arena(bufs, log_entry(fus::log_entry_type::e_text, 0, text.size()));
+    push_arena(bufs, std::move(text));
+}
+
+void log_backend::push_record(fus::log_sink_t* sink, std::vector<uv_buf_t>& bufs, log_ring_t* ring,
+                              size_t pos, const log_record_t& record)
+{
+    if (!record.m_format) {
+        // Already formatted by whoever logged it.
+        if (sink->m_binary)
+            push_arena(bufs, log_entry(fus::log_entry_type::e_text, 0, record.m_size));
+        push_ring(bufs, ring, pos, record.m_size);
+    } else if (sink->m_binary) {
+        // The arguments go straight from the ring to the file. The decoder needs to know what
+        // the format is the first time it appears in each file, however.
+        const fus::log_format_t* format = record.m_format;
+        auto it = sink->m_formats.find(format);
+        if (it == sink->m_formats.end()) {
+            uint32_t id = (uint32_t)sink->m_formats.size();
+            it = sink->m_formats.emplace(format, id).first;
+
+            uint32_t filesz = (uint32_t)strlen(format->m_file);
+            uint32_t formatsz = (uint32_t)strlen(format->m_format);
+            std::string entry = log_entry(fus::log_entry_type::e_format, format->m_level,
+                                          (sizeof(uint32_t) * 4) + filesz + formatsz);
+            log_append(entry, id);
+            log_append(entry, format->m_line);
+            log_append(entry, filesz);
+            entry.append(format->m_file, filesz);
+            log_append(entry, formatsz);
+            entry.append(format->m_format, formatsz);
+            push_arena(bufs, std::move(entry));
+        }
+
+        std::string entry = log_entry(fus::log_entry_type::e_record, format->m_level,
+                                      sizeof(int64_t) + sizeof(uint32_t) + record.m_size);
+        log_append(entry, record.m_time);
+        log_append(entry, it->second);
+        push_arena(bufs, std::move(entry));
+        push_ring(bufs, ring, pos, record.m_size);
+    } else {
+        if (record.m_time != m_second) {
+            m_timesz = log_format_time((time_t)record.m_time, m_timestr, sizeof(m_timestr));
+            m_second = (time_t)record.m_time;
+        }
+
+        ST::string msg = fus::log_format_args(record.m_format->m_format, ring_data(ring, pos, record.m_size),
+                                              record.m_size);
+        std::string line;
+        line.reserve(m_timesz + msg.size() + 1);
+        line.append(m_timestr, m_timesz);
+        line.append(msg.c_str(), msg.size());
+        line.push_back('\n');
+        push_arena(bufs, std::move(line));
+    }
+}
+
+bool log_backend::drain(const std::vector<log_ring_t*>& rings, const std::vector<size_t>& heads,
+                        const std::vector<fus::log_sink_t*>& sinks)
+{
+    for (auto& it : m_batches)
+        it.second.clear();
+
+    // Rotate before gathering anything, since binary records refer to formats introduced
+    // earlier in the same file.
+    uint64_t maxSize = m_rotateSize.load(std::memory_order_relaxed);
+    uint32_t maxAge = m_rotateAge.load(std::memory_order_relaxed);
+    time_t now = time(nullptr);
+    for (fus::log_sink_t* sink : sinks) {
+        if ((maxSize && sink->m_size >= maxSize) || (maxAge && (now - sink->m_opened) >= (time_t)maxAge))
+            rotate(sink);
+    }
+
+    // Gather every pending message into one list of buffers per file. Where possible, the
+    // buffers point straight into the rings, so nothing is copied until the kernel does it.
+    bool orphans = false;
+    std::vector<size_t> tails(rings.size());
+    for (size_t i = 0; i < rings.size(); ++i) {
+        log_ring_t* ring = rings[i];
+        orphans |= ring->m_orphaned.load(std::memory_order_acquire);
+        size_t tail = ring->m_tail.load(std::memory_order_relaxed);
+        size_t head = heads[i];
+        while (tail != head) {
+            log_record_t record;
+            log_ring_read(ring, tail, &record, sizeof(record));
+
+            // Anything logged to a file after it was closed is simply discarded.
+            if (std::find(sinks.begin(), sinks.end(), record.m_sink) != sinks.end()) {
+                push_record(record.m_sink, m_batches[record.m_sink], ring, tail + sizeof(log_record_t), record);
+            } else {
+                FUS_ASSERTD(std::find(m_retired.begin(), m_retired.end(), record.m_sink) != m_retired.end());
+            }
+            tail += sizeof(log_record_t) + log_align(record.m_size);
+        }
+        tails[i] = tail;
+    }
+
+    for (fus::log_sink_t* sink : sinks) {
+        std::vector<uv_buf_t>& bufs = m_batches[sink];
+        uint64_t dropped = sink->m_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            char timestr[32];
+            size_t timesz = log_format_time(now, timestr, sizeof(timestr));
+            ST::string msg = ST::format("*** {} log message(s) dropped: the log buffer was full ***\n", dropped);
+            std::string line(timestr, timesz);
+            line.append(msg.c_str(), msg.size());
+            push_text(sink, bufs, std::move(line));
+        }
+        if (!bufs.empty())
+            write(sink, bufs);
+    }
+    m_arena.clear();
+
+    // Only now may the producers reuse the space.
+    for (size_t i = 0; i < rings.size(); ++i)
+        rings[i]->m_tail.store(tails[i], std::memory_order_release);
+    return orphans;
+}
+
+void log_backend::write(fus::log_sink_t* sink, const std::vector<uv_buf_t>& bufs)
+{
+    // These are synchronous requests, so libuv doesn't need the loop. Large batches are split
+    // into IOV_MAX sized chunks by libuv itself.
+    uv_fs_t req;
+    uv_fs_write(nullptr, &req, sink->m_file, bufs.data(), (unsigned int)bufs.size(), -1, nullptr);
+    uv_fs_req_cleanup(&req);
+    for (const uv_buf_t& buf : bufs)
+        sink->m_size += buf.len;
+}
+
+void log_backend::rotate_files(const std::filesystem::path& path)
+{
+    ST::string extension = ST::string::from_utf8(path.extension().u8string().c_str());
+    auto numbered = [&path, &extension](unsigned int i) {
+        std::filesystem::path result = path;
+        result.replace_extension(ST::format("{}{}", i, extension).c_str());
+        return result;
+    };
+
+    std::error_code error;
+    unsigned int keep = m_rotateKeep.load(std::memory_order_relaxed);
+    if (keep == 0) {
+        std::filesystem::remove(path, error);
+        return;
+    }
+
+    std::filesystem::remove(numbered(keep), error);
+    for (unsigned int i = keep - 1; i > 0; --i)
+        std::filesystem::rename(numbered(i), numbered(i + 1), error);
+    std::filesystem::rename(path, numbered(1), error);
+}
+
+uv_file log_backend::open_file(fus::log_sink_t* sink)
+{
+    uv_fs_t req;
+    uv_file file = uv_fs_open(nullptr, &req, sink->m_path.u8string().c_str(),
+                              O_CREAT | O_WRONLY | O_TRUNC | O_APPEND, 0644, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    sink->m_file = file;
+    sink->m_size = 0;
+    sink->m_opened = time(nullptr);
+    sink->m_formats.clear();
+    if (file >= 0 && sink->m_binary) {
+        uv_buf_t buf = uv_buf_init((char*)fus::log_binary_magic, sizeof(fus::log_binary_magic));
+        uv_fs_write(nullptr, &req, file, &buf, 1, -1, nullptr);
+        uv_fs_req_cleanup(&req);
+        sink->m_size += buf.len;
+    }
+    return file;
+}
+
+void log_backend::rotate(fus::log_sink_t* sink)
+{
+    uv_fs_t req;
+    uv_fs_close(nullptr, &req, sink->m_file, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    rotate_files(sink->m_path);
+    open_file(sink);
+}
+
+// =================================================================================
+
+void fus::log_file::set_buffer_size(size_t bufsz)
+{
+    backend().m_ringsz.store(bufsz, std::memory_order_relaxed);
+}
+
+void fus::log_file::set_rotation(uint64_t maxSize, uint32_t maxAge, unsigned int keep)
+{
+    backend().m_rotateSize.store(maxSize, std::memory_order_relaxed);
+    backend().m_rotateAge.store(maxAge, std::memory_order_relaxed);
+    backend().m_rotateKeep.store(keep, std::memory_order_relaxed);
+}
+
+void fus::log_file::set_binary(bool binary)
+{
+    backend().m_binary.store(binary, std::memory_order_relaxed);
+}
+
+void fus::log_file::flush()
+{
+    backend().flush();
+}
+
+// =================================================================================
+
+int fus::log_file::open(uv_loop_t*, const ST::string& name)
+{
+    bool binary = backend().m_binary.load(std::memory_order_relaxed);
     std::filesystem::path path = log_directory();
     std::error_code error;
     std::filesystem::create_directories(path, error);
-    int test = error.value();
     path /= name.c_str();
-    path.replace_extension(".log");
+    path.replace_extension(binary ? ".blog" : ".log");
 
-    // Perhaps we should implement log rotation at some point...
-    uv_fs_t req;
-    uv_file file = uv_fs_open(loop, &req, path.u8string().c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644, nullptr);
-    uv_fs_req_cleanup(&req);
+    // Keep the last run's log around rather than clobbering it.
+    uintmax_t oldsz = std::filesystem::file_size(path, error);
+    if (!error && oldsz != 0)
+        backend().rotate_files(path);
+
+    std::unique_ptr<log_sink_t> sink = std::make_unique<log_sink_t>();
+    sink->m_path = std::move(path);
+    sink->m_dropped = 0;
+    sink->m_closing = false;
+    sink->m_binary = binary;
+    uv_file file = backend().open_file(sink.get());
     if (file < 0) {
-        m_file = -1;
+        m_sink.store(nullptr, std::memory_order_release);
         return file;
-    } else {
-        m_file = file;
-        write(ro::dah());
-        write("... Opened \"{}.log\"", name);
-        return 0;
     }
+
+    log_sink_t* result = sink.release();
+    backend().add_sink(result);
+    m_sink.store(result, std::memory_order_release);
+
+    write(ro::dah());
+    write("... Opened \"{}\"", name + (binary ? ".blog" : ".log"));
+    return 0;
 }
 
 void fus::log_file::close()
 {
-    uv_fs_t req;
-    uv_fs_close(m_loop, &req, m_file, nullptr);
-    uv_fs_req_cleanup(&req);
+    log_sink_t* sink = m_sink.exchange(nullptr, std::memory_order_acq_rel);
+    if (sink)
+        backend().close_sink(sink);
 }
 
 // =================================================================================
@@ -93,44 +715,45 @@ void fus::log_file::set_level(const ST::string& value)
 
 // =================================================================================
 
-struct log_write_t
+void fus::log_file::write(const ST::string& msg)
 {
-    uv_fs_t m_req;
-    char m_buf[];
-};
+    log_sink_t* sink = m_sink.load(std::memory_order_acquire);
+    if (!sink)
+        return;
 
-static void _log_write_complete(log_write_t* req)
-{
-    FUS_ASSERTD(uv_fs_get_result((uv_fs_t*)req) >= 0);
-    uv_fs_req_cleanup((uv_fs_t*)req);
-    free(req);
+    // Formatting the time is surprisingly expensive, so only do it when the second rolls over.
+    log_thread_t& thread = s_logThread;
+    time_t now = time(nullptr);
+    if (now != thread.m_second) {
+        thread.m_timesz = log_format_time(now, thread.m_timestr, sizeof(thread.m_timestr));
+        thread.m_second = now;
+    }
+
+    if (!thread.m_ring)
+        thread.m_ring = backend().add_ring();
+
+    log_record_t record{ sink, nullptr, (int64_t)now, 0 };
+    if (!log_ring_push(thread.m_ring, record, { { thread.m_timestr, thread.m_timesz },
+                                                { msg.c_str(), msg.size() },
+                                                { "\n", 1 } })) {
+        sink->m_dropped.fetch_add(1, std::memory_order_relaxed);
+        s_logDropped.add();
+    }
 }
 
-void fus::log_file::write(const ST::string& msg)
+void fus::log_file::push_deferred(const log_format_t& format, const uint8_t* args, size_t argsz)
 {
-    if (m_file == -1)
+    log_sink_t* sink = m_sink.load(std::memory_order_acquire);
+    if (!sink)
         return;
 
-    // Include the time in the log message
-    /// TODO: should probably cache this every second or so
-    time_t timest;
-    time(&timest);
-    tm* time = gmtime(&timest);
-    char timestr[128];
-    size_t timesz = strftime(timestr, sizeof(timestr), "[%Y-%m-%d %H:%M:%S] ", time);
-
-    // Allocate a uv_fs_t with space for the log message and a newline character
-    size_t bufsz = timesz + msg.size() + 1;
-    size_t reqsz = sizeof(log_write_t) + bufsz;
-    log_write_t* req = (log_write_t*)malloc(reqsz);
-    uv_buf_t buf = uv_buf_init(req->m_buf, bufsz);
-
-    // Copy the string data into the request and append a newline
-    memcpy(req->m_buf, timestr, timesz);
-    memcpy(req->m_buf + timesz, msg.c_str(), msg.size());
-    *(req->m_buf + (bufsz-1)) = '\n'; // Don't look in the debugger...
-    uv_fs_write(m_loop, (uv_fs_t*)req, m_file, &buf, 1, m_offset, (uv_fs_cb)_log_write_complete);
-
-    // Because libuv insists on imitating pwritev
-    m_offset += bufsz;
+    log_thread_t& thread = s_logThread;
+    if (!thread.m_ring)
+        thread.m_ring = backend().add_ring();
+
+    log_record_t record{ sink, &format, (int64_t)time(nullptr), 0 };
+    if (!log_ring_push(thread.m_ring, record, { { args, argsz } })) {
+        sink->m_dropped.fetch_add(1, std::memory_order_relaxed);
+        s_logDropped.add();
+    }
 }
@@ -17,11 +17,23 @@
 #ifndef __FUS_LOG_FILE_H
 #define __FUS_LOG_FILE_H
 
+#include <atomic>
+#include <filesystem>
+#include <memory>
 #include <string_theory/st_format.h>
 #include <uv.h>
 
+#include "log_record.h"
+
 namespace fus
 {
+    struct log_sink_t;
+
+    /**
+     * Log files are written by a shared background thread. Each thread that logs gets its own
+     * lock-free ring buffer, so writing a message never blocks on disk I/O -- if the writer falls
+     * too far behind, messages are dropped and the number dropped is noted in the log instead.
+     */
     class log_file final
     {
     public:
@@ -33,18 +45,43 @@ namespace fus
         };
 
     private:
-        uv_file m_file;
-        uv_loop_t* m_loop;
+        /** Other threads may log while this is closed, so closed sinks live as long as the writer. */
+        std::atomic<log_sink_t*> m_sink;
         level m_level;
-        int64_t m_offset;
 
     public:
-        log_file() : m_file(-1), m_loop(), m_level(level::e_info), m_offset() { }
+        log_file() : m_sink(nullptr), m_level(level::e_info) { }
         log_file(const log_file&) = delete;
         log_file(log_file&&) = delete;
 
         static void set_directory(const ST::string&);
 
+        /** The directory log files are written to, defaulting to "log" in the working directory. */
+        static std::filesystem::path get_directory();
+
+        /**
+         * Sets the size of the ring buffer each logging thread queues messages in.
+         * This only affects threads that have not yet logged anything.
+         */
+        static void set_buffer_size(size_t);
+
+        /**
+         * Sets when log files are rotated.
+         * \param maxSize Size in bytes a log may grow to before being rotated, or 0 for no limit.
+         * \param maxAge Seconds a log may be written to before being rotated, or 0 for no limit.
+         * \param keep Number of old logs to keep around as name.1.log, name.2.log, ...
+         */
+        static void set_rotation(uint64_t maxSize, uint32_t maxAge, unsigned int keep);
+
+        /**
+         * Writes logs opened from now on as binary ".blog" files. Deferred messages are stored
+         * unformatted, which is as cheap as logging gets; use fus_logdecode to read them.
+         */
+        static void set_binary(bool);
+
+        /** Blocks until every message logged so far has been written out. */
+        static void flush();
+
         int open(uv_loop_t*, const ST::string&);
         void close();
 
@@ -52,6 +89,31 @@ namespace fus
         void set_level(const ST::string&);
         void write(const ST::string&);
 
+    protected:
+        void push_deferred(const log_format_t&, const uint8_t* args, size_t argsz);
+
+    public:
+        /** Use the FUS_LOG_* macros rather than calling this directly. */
+        template<typename... _Args>
+        void write_deferred(const log_format_t& format, const _Args&... args)
+        {
+            if (!m_sink.load(std::memory_order_acquire) || (uint8_t)m_level > format.m_level)
+                return;
+
+            uint8_t stackbuf[512];
+            std::unique_ptr<uint8_t[]> heapbuf;
+            uint8_t* buf = stackbuf;
+            size_t bufsz = (size_t(0) + ... + _log::arg_size(args));
+            if (bufsz > sizeof(stackbuf)) {
+                heapbuf.reset(new uint8_t[bufsz]);
+                buf = heapbuf.get();
+            }
+
+            uint8_t* ptr = buf;
+            ((ptr = _log::arg_write(ptr, args)), ...);
+            push_deferred(format, buf, bufsz);
+        }
+
         template<typename... _Args>
         void write(const char* fmt, _Args ...args)
         {
@@ -0,0 +1,158 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include "log_record.h"
+#include <string_theory/st_format.h>
+
+// =================================================================================
+
+fus::log_peer_t fus::log_capture_peer(const fus::tcp_stream_t* stream)
+{
+    log_peer_t peer{};
+    if (!stream)
+        return peer;
+    peer.m_connId = tcp_stream_connid(stream);
+
+    const sockaddr* addr = tcp_stream_peer(stream);
+    peer.m_family = addr->sa_family;
+    if (addr->sa_family == AF_INET) {
+        const sockaddr_in* in = (const sockaddr_in*)addr;
+        peer.m_port = ntohs(in->sin_port);
+        memcpy(peer.m_addr, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (addr->sa_family == AF_INET6) {
+        const sockaddr_in6* in6 = (const sockaddr_in6*)addr;
+        peer.m_port = ntohs(in6->sin6_port);
+        memcpy(peer.m_addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    return peer;
+}
+
+static ST::string format_peer(const fus::log_peer_t& peer)
+{
+    char addrstr[64] = { "???" };
+    if (peer.m_family == AF_INET)
+        uv_inet_ntop(AF_INET, peer.m_addr, addrstr, sizeof(addrstr));
+    else if (peer.m_family == AF_INET6)
+        uv_inet_ntop(AF_INET6, peer.m_addr, addrstr, sizeof(addrstr));
+    return ST::format("#{} {}/{}", peer.m_connId, addrstr, peer.m_port);
+}
+
+// =================================================================================
+
+namespace
+{
+    class arg_reader
+    {
+        const uint8_t* m_ptr;
+        const uint8_t* m_end;
+
+    public:
+        arg_reader(const uint8_t* args, size_t argsz) : m_ptr(args), m_end(args + argsz) { }
+
+        template<typename _Value>
+        bool read(_Value& value)
+        {
+            if ((size_t)(m_end - m_ptr) < sizeof(value))
+                return false;
+            memcpy(&value, m_ptr, sizeof(value));
+            m_ptr += sizeof(value);
+            return true;
+        }
+
+        bool read_bytes(const uint8_t*& data, uint32_t& datasz)
+        {
+            if (!read(datasz) || (size_t)(m_end - m_ptr) < datasz)
+                return false;
+            data = m_ptr;
+            m_ptr += datasz;
+            return true;
+        }
+
+        /** Formats the next argument with the given placeholder, eg "{}" or "{>8}". */
+        ST::string format(const ST::string& placeholder)
+        {
+            uint8_t type;
+            const uint8_t* data;
+            uint32_t datasz;
+            if (!read(type))
+                return ST_LITERAL("<missing>");
+
+            switch ((fus::log_arg_type)type) {
+            case fus::log_arg_type::e_int:
+                if (int64_t value; read(value))
+                    return ST::format(placeholder.c_str(), value);
+                break;
+            case fus::log_arg_type::e_uint:
+                if (uint64_t value; read(value))
+                    return ST::format(placeholder.c_str(), value);
+                break;
+            case fus::log_arg_type::e_double:
+                if (double value; read(value))
+                    return ST::format(placeholder.c_str(), value);
+                break;
+            case fus::log_arg_type::e_string:
+                if (read_bytes(data, datasz))
+                    return ST::format(placeholder.c_str(), ST::string::from_utf8((const char*)data, datasz));
+                break;
+            case fus::log_arg_type::e_string16:
+                if (read_bytes(data, datasz)) {
+                    // The data isn't necessarily aligned for char16_t.
+                    std::u16string str(datasz / sizeof(char16_t), u'\0');
+                    memcpy(str.data(), data, str.size() * sizeof(char16_t));
+                    return ST::format(placeholder.c_str(), ST::string::from_utf16(str.c_str(), str.size()));
+                }
+                break;
+            case fus::log_arg_type::e_peer:
+                if (fus::log_peer_t value; read(value))
+                    return ST::format(placeholder.c_str(), format_peer(value));
+                break;
+            default:
+                break;
+            }
+
+            // We have no idea how long an unknown argument is, so everything after it is lost.
+            m_ptr = m_end;
+            return ST_LITERAL("<corrupt>");
+        }
+    };
+};
+
+ST::string fus::log_format_args(const char* format, const uint8_t* args, size_t argsz)
+{
+    arg_reader reader(args, argsz);
+    ST::string_stream stream;
+    for (const char* ptr = format; *ptr; ++ptr) {
+        if (ptr[0] == '{' && ptr[1] == '{') {
+            stream.append_char('{');
+            ++ptr;
+        } else if (ptr[0] == '}' && ptr[1] == '}') {
+            stream.append_char('}');
+            ++ptr;
+        } else if (ptr[0] == '{') {
+            const char* end = strchr(ptr, '}');
+            if (!end) {
+                stream << ptr;
+                break;
+            }
+            stream << reader.format(ST::string::from_utf8(ptr, (end - ptr) + 1));
+            ptr = end;
+        } else {
+            stream.append_char(*ptr);
+        }
+    }
+    return stream.to_string();
+}
@@ -0,0 +1,205 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FUS_LOG_RECORD_H
+#define __FUS_LOG_RECORD_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_theory/string>
+#include <string_view>
+#include <type_traits>
+
+#include "tcp_stream.h"
+
+namespace fus
+{
+    /**
+     * Static description of a deferred log statement. One of these lives at each call site, so
+     * records only need to carry a pointer to it along with the raw argument values.
+     */
+    struct log_format_t
+    {
+        const char* m_format;
+        const char* m_file;
+        uint32_t m_line;
+        uint8_t m_level;
+    };
+
+    enum class log_arg_type : uint8_t
+    {
+        e_int,
+        e_uint,
+        e_double,
+        e_string,
+        e_string16,
+        e_peer,
+    };
+
+    /** A connection's identity, captured by value so it can be formatted after the stream is gone. */
+    struct log_peer_t
+    {
+        uint64_t m_connId;
+        uint16_t m_family;
+        uint16_t m_port;
+        uint8_t m_addr[16];
+    };
+
+    log_peer_t log_capture_peer(const tcp_stream_t*);
+
+    /** Formats the raw arguments of a deferred record according to its format string. */
+    ST::string log_format_args(const char* format, const uint8_t* args, size_t argsz);
+
+    constexpr size_t log_count_placeholders(const char* format)
+    {
+        size_t count = 0;
+        for (; *format; ++format) {
+            if (format[0] == '{') {
+                if (format[1] == '{')
+                    ++format;
+                else
+                    ++count;
+            }
+        }
+        return count;
+    }
+
+    // =================================================================================
+    // Binary log files
+
+    constexpr char log_binary_magic[8] = { 'F', 'U', 'S', 'B', 'L', 'O', 'G', '1' };
+
+    enum class log_entry_type : uint8_t
+    {
+        /** Introduces a format: uint32 id, uint32 line, uint32 + file, uint32 + format */
+        e_format = 'F',
+
+        /** A deferred record: int64 time, uint32 format id, raw arguments */
+        e_record = 'R',
+
+        /** A line that was formatted when it was logged */
+        e_text = 'T',
+    };
+
+    /**
+     * Header of each entry in a binary log. Everything is in the byte order of the machine that
+     * wrote the log.
+     */
+    struct log_entry_t
+    {
+        uint8_t m_type;
+        uint8_t m_level;
+        uint16_t m_reserved;
+        uint32_t m_size;
+    };
+
+    // =================================================================================
+
+    namespace _log
+    {
+        template<typename... _Args>
+        std::integral_constant<size_t, sizeof...(_Args)> count_args(const _Args&...);
+
+        template<typename _Arg>
+        using arg_t = std::remove_cv_t<std::decay_t<_Arg>>;
+
+        template<typename _Arg>
+        constexpr bool is_stream_v = std::is_pointer_v<_Arg> &&
+                                     std::is_base_of_v<tcp_stream_t, std::remove_cv_t<std::remove_pointer_t<_Arg>>>;
+
+        inline std::string_view to_view(const char* value) { return std::string_view(value ? value : "(null)"); }
+        inline std::string_view to_view(const std::string& value) { return value; }
+        inline std::string_view to_view(const std::string_view& value) { return value; }
+        inline std::string_view to_view(const ST::string& value) { return std::string_view(value.c_str(), value.size()); }
+
+        template<typename _Arg>
+        inline size_t arg_size(const _Arg& arg)
+        {
+            using T = arg_t<_Arg>;
+            if constexpr (is_stream_v<T>)
+                return 1 + sizeof(log_peer_t);
+            else if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>)
+                return 1 + sizeof(uint64_t);
+            else if constexpr (std::is_same_v<T, std::u16string_view> || std::is_same_v<T, std::u16string>)
+                return 1 + sizeof(uint32_t) + (arg.size() * sizeof(char16_t));
+            else
+                return 1 + sizeof(uint32_t) + to_view(arg).size();
+        }
+
+        template<typename _Value>
+        inline uint8_t* put(uint8_t* buf, log_arg_type type, const _Value& value)
+        {
+            *buf++ = (uint8_t)type;
+            memcpy(buf, &value, sizeof(value));
+            return buf + sizeof(value);
+        }
+
+        inline uint8_t* put_bytes(uint8_t* buf, log_arg_type type, const void* data, uint32_t datasz)
+        {
+            *buf++ = (uint8_t)type;
+            memcpy(buf, &datasz, sizeof(datasz));
+            memcpy(buf + sizeof(datasz), data, datasz);
+            return buf + sizeof(datasz) + datasz;
+        }
+
+        template<typename _Arg>
+        inline uint8_t* arg_write(uint8_t* buf, const _Arg& arg)
+        {
+            using T = arg_t<_Arg>;
+            if constexpr (is_stream_v<T>) {
+                return put(buf, log_arg_type::e_peer, log_capture_peer(arg));
+            } else if constexpr (std::is_enum_v<T>) {
+                return arg_write(buf, (std::underlying_type_t<T>)arg);
+            } else if constexpr (std::is_floating_point_v<T>) {
+                return put(buf, log_arg_type::e_double, (double)arg);
+            } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+                return put(buf, log_arg_type::e_int, (int64_t)arg);
+            } else if constexpr (std::is_integral_v<T>) {
+                return put(buf, log_arg_type::e_uint, (uint64_t)arg);
+            } else if constexpr (std::is_same_v<T, std::u16string_view> || std::is_same_v<T, std::u16string>) {
+                return put_bytes(buf, log_arg_type::e_string16, arg.data(),
+                                 (uint32_t)(arg.size() * sizeof(char16_t)));
+            } else {
+                std::string_view view = to_view(arg);
+                return put_bytes(buf, log_arg_type::e_string, view.data(), (uint32_t)view.size());
+            }
+        }
+    };
+};
+
+// =================================================================================
+
+/**
+ * Logs a message without formatting it. The arguments are copied into the log's buffer as-is,
+ * and the message is formatted later by the log writer thread -- or, if binary logs are in use,
+ * by fus_logdecode whenever somebody gets around to reading the log. Streams passed as arguments
+ * are logged as their connection ID and peer address.
+ */
+#define FUS_LOG_DEFERRED(log, level, format, ...) \
+    do { \
+        static_assert(fus::log_count_placeholders(format) == \
+                      decltype(fus::_log::count_args(__VA_ARGS__))::value, \
+                      "Log format placeholders do not match the number of arguments"); \
+        static const fus::log_format_t _fus_log_format{ format, __FILE__, __LINE__, (uint8_t)(level) }; \
+        (log).write_deferred(_fus_log_format, ##__VA_ARGS__); \
+    } while (0)
+
+#define FUS_LOG_DEBUG(log, format, ...) FUS_LOG_DEFERRED(log, fus::log_file::level::e_debug, format, ##__VA_ARGS__)
+#define FUS_LOG_INFO(log, format, ...) FUS_LOG_DEFERRED(log, fus::log_file::level::e_info, format, ##__VA_ARGS__)
+#define FUS_LOG_ERROR(log, format, ...) FUS_LOG_DEFERRED(log, fus::log_file::level::e_error, format, ##__VA_ARGS__)
+
+#endif
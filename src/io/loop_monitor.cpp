@@ -0,0 +1,126 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <uv.h>
+
+#include "core/flight_recorder.h"
+#include "core/metrics.h"
+#include "log_file.h"
+#include "loop_monitor.h"
+
+// =================================================================================
+
+static fus::metric_histogram s_iterationTime("fus_loop_iteration_us", "Duration of one event loop iteration (us)");
+static fus::metric_histogram s_busyTime("fus_loop_busy_us", "Time each event loop iteration spent running callbacks (us)");
+static fus::metric_histogram s_idleRatio("fus_loop_idle_permille", "Fraction of each event loop iteration spent waiting for events (1/1000)");
+static fus::metric_counter s_slowCallbacks("fus_loop_slow_callbacks_total", "Event loop callbacks that exceeded the slow callback threshold");
+
+static uv_prepare_t s_prepare;
+static bool s_running = false;
+static uint64_t s_lastPrepare = 0;
+static uint64_t s_lastIdle = 0;
+
+// Iterations busier than this are worth remembering in the flight recorder.
+constexpr uint64_t k_lagSampleUs = 1000;
+
+// Only the loop thread reads these, so they need no synchronization.
+static fus::log_file* s_log = nullptr;
+static uint64_t s_slowThreshold = 0;
+
+// =================================================================================
+
+static void loop_prepare(uv_prepare_t* prepare)
+{
+    // Prepare handles run once per iteration, right before the loop blocks for I/O, so the
+    // time between two of them is one full trip around the loop.
+    uint64_t now = uv_hrtime();
+    uint64_t iteration = now - s_lastPrepare;
+    s_lastPrepare = now;
+
+    uint64_t idleTotal = uv_metrics_idle_time(prepare->loop);
+    uint64_t idle = std::min(idleTotal - s_lastIdle, iteration);
+    s_lastIdle = idleTotal;
+
+    uint64_t busy = (iteration - idle) / 1000;
+    s_iterationTime.record(iteration / 1000);
+    s_busyTime.record(busy);
+    if (busy >= k_lagSampleUs)
+        fus::flight_record(fus::flight_event::e_loopLag, 0, 0, (uint32_t)std::min<uint64_t>(busy, UINT32_MAX));
+    if (iteration != 0)
+        s_idleRatio.record((idle * 1000) / iteration);
+}
+
+// =================================================================================
+
+void fus::loop_monitor_init(uv_loop_t* loop, log_file* log, unsigned int slowMs)
+{
+    s_log = log;
+    s_slowThreshold = (uint64_t)slowMs * 1000000;
+    if (s_running)
+        return;
+
+    uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+    s_lastIdle = uv_metrics_idle_time(loop);
+    s_lastPrepare = uv_hrtime();
+
+    uv_prepare_init(loop, &s_prepare);
+    uv_prepare_start(&s_prepare, loop_prepare);
+    uv_unref((uv_handle_t*)&s_prepare);
+    s_running = true;
+}
+
+void fus::loop_monitor_shutdown()
+{
+    if (s_running) {
+        uv_prepare_stop(&s_prepare);
+        uv_close((uv_handle_t*)&s_prepare, nullptr);
+        s_running = false;
+    }
+    s_slowThreshold = 0;
+}
+
+// =================================================================================
+
+fus::loop_timer_t::loop_timer_t(const char* name, uint32_t type)
+    : m_name(name), m_type(type), m_start(s_slowThreshold ? uv_hrtime() : 0)
+{
+}
+
+fus::loop_timer_t::~loop_timer_t()
+{
+    if (m_start) {
+        uint64_t elapsed = uv_hrtime() - m_start;
+        if (elapsed >= s_slowThreshold)
+            report(elapsed);
+    }
+}
+
+void fus::loop_timer_t::report(uint64_t elapsed) const
+{
+    s_slowCallbacks.add();
+    fus::flight_record(fus::flight_event::e_slowCallback, 0, m_type == k_noType ? 0 : (uint16_t)m_type,
+                       (uint32_t)(elapsed / 1000));
+    if (!s_log)
+        return;
+
+    if (m_type == k_noType)
+        s_log->write_error("Slow callback: {} blocked the loop for {} us", m_name, elapsed / 1000);
+    else
+        s_log->write_error("Slow callback: {} (type 0x{04X}) blocked the loop for {} us", m_name,
+                           m_type, elapsed / 1000);
+}
@@ -0,0 +1,61 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_LOOP_MONITOR_H
+#define __FUS_LOOP_MONITOR_H
+
+#include <cstdint>
+
+typedef struct uv_loop_s uv_loop_t;
+
+namespace fus
+{
+    class log_file;
+
+    /**
+     * Starts watching the health of the given loop. Every iteration's duration, busy time,
+     * and idle ratio are recorded as metrics, and callbacks timed by a loop_timer_t that run
+     * longer than the threshold are logged.
+     * \remarks This must be called before the loop first runs.
+     * \param slowMs Callback duration, in milliseconds, considered slow. 0 disables reports.
+     */
+    void loop_monitor_init(uv_loop_t*, log_file*, unsigned int slowMs);
+    void loop_monitor_shutdown();
+
+    /**
+     * Times the enclosing scope, which should be a single callback run by the loop, and reports
+     * it to the loop monitor's log if it ran longer than the slow callback threshold.
+     */
+    class loop_timer_t final
+    {
+        const char* m_name;
+        uint32_t m_type;
+        uint64_t m_start;
+
+        void report(uint64_t elapsed) const;
+
+    public:
+        static constexpr uint32_t k_noType = UINT32_MAX;
+
+        loop_timer_t(const char* name, uint32_t type=k_noType);
+        loop_timer_t(const loop_timer_t&) = delete;
+        loop_timer_t(loop_timer_t&&) = delete;
+        ~loop_timer_t();
+    };
+};
+
+#endif
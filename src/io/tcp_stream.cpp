@@ -14,21 +14,58 @@
  *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <new>
 
+#include "core/alloc_profile.h"
 #include "core/endian.h"
 #include "core/errors.h"
+#include "core/flight_recorder.h"
+#include "core/metrics.h"
+#include "capture.h"
 #include "crypt_stream.h" // https://www.youtube.com/watch?v=IvzFt8PPXvE
+#include "loop_monitor.h"
 #include "net_struct.h"
 #include "tcp_stream.h"
 
+#ifndef _WIN32
+#   include <unistd.h>
+#endif
+
 // =================================================================================
 
 constexpr size_t k_tooMuchMem = 10 * 1024 * 1024; // 10 MiB
 constexpr size_t k_normBufsz = 1 * 1024 * 1024;   //  1 MiB
 constexpr size_t k_tinyBufsz = 1 * 1024;          //  1 KiB
 
+static std::atomic<uint64_t> s_nextConnId{ 1 };
+
+static fus::metric_counter s_connections("fus_tcp_connections_total", "TCP connections established");
+static fus::metric_counter s_disconnects("fus_tcp_disconnects_total", "TCP connections closed");
+static fus::metric_counter s_acceptErrors("fus_tcp_accept_errors_total", "Failed TCP accepts");
+static fus::metric_counter s_readErrors("fus_tcp_read_errors_total", "TCP reads that failed or were refused");
+static fus::metric_counter s_bytesRead("fus_tcp_read_bytes_total", "Bytes read from TCP streams");
+static fus::metric_counter s_bytesWritten("fus_tcp_written_bytes_total", "Bytes queued for writing to TCP streams");
+static fus::metric_counter s_budgetKicks("fus_tcp_budget_kicks_total", "Connections kicked for exceeding their resource budget");
+
+// Every stream that is currently connected on this thread's loop.
+static thread_local FUS_LIST_DECL(fus::tcp_stream_t, m_liveLink) s_live;
+static fus::tcp_budget_t s_budget{};
+static fus::tcp_budget_cb s_budgetcb = nullptr;
+
+// =================================================================================
+
+static inline void _reset_peer(fus::tcp_stream_t* stream)
+{
+    stream->m_connId = 0;
+    memset(&stream->m_peer, 0, sizeof(stream->m_peer));
+    strcpy(stream->m_peerstr, "???");
+}
+
 // =================================================================================
 
 template<typename T>
@@ -72,6 +109,9 @@ int fus::tcp_stream_init(fus::tcp_stream_t* stream, uv_loop_t* loop)
     stream->m_closecb = nullptr;
     stream->m_freecb = nullptr;
     stream->m_refcount = 1;
+    _reset_peer(stream);
+    memset(&stream->m_stats, 0, sizeof(stream->m_stats));
+    new(&stream->m_liveLink) FUS_LIST_LINK(tcp_stream_t);
     return 0;
 }
 
@@ -83,6 +123,7 @@ void fus::tcp_stream_free(fus::tcp_stream_t* stream)
     // This is safe because crypt_stream_t tracks its resources using our flags field
     fus::crypt_stream_free((fus::crypt_stream_t*)stream);
 
+    stream->m_liveLink.~list_link();
     free(stream->m_readBuf);
     free(stream);
 }
@@ -95,6 +136,11 @@ void fus::tcp_stream_ref(fus::tcp_stream_t* stream, uv_handle_t* handle)
     stream->m_refcount++;
 }
 
+void fus::tcp_stream_ref(fus::tcp_stream_t* stream)
+{
+    stream->m_refcount++;
+}
+
 void fus::tcp_stream_unref(uv_handle_t* handle)
 {
     fus::tcp_stream_t* stream = (fus::tcp_stream_t*)uv_handle_get_data(handle);
@@ -106,8 +152,15 @@ void fus::tcp_stream_unref(uv_handle_t* handle)
 
 static void _tcp_close(fus::tcp_stream_t* stream)
 {
+    if (stream->m_flags & fus::tcp_stream_t::e_connected) {
+        s_disconnects.add();
+        fus::flight_record(fus::flight_event::e_close, stream->m_connId, 0, (uint32_t)stream->m_stats.m_messages);
+    }
     stream->m_flags &= ~fus::tcp_stream_t::e_connected;
     stream->m_flags &= ~fus::tcp_stream_t::e_closing;
+    stream->m_liveLink.unlink();
+    if (stream->m_flags & fus::tcp_stream_t::e_capture)
+        fus::capture_close(stream);
 
     if (stream->m_closecb)
         stream->m_closecb((uv_handle_t*)stream);
@@ -123,6 +176,7 @@ static void _tcp_close(fus::tcp_stream_t* stream)
         uv_loop_t* loop = uv_handle_get_loop((uv_handle_t*)stream);
         FUS_ASSERTD(uv_tcp_init(loop, (uv_tcp_t*)stream) == 0);
         stream->m_flags = 0;
+        _reset_peer(stream);
     }
 }
 
@@ -147,11 +201,94 @@ int fus::tcp_stream_accept(fus::tcp_stream_t* server, fus::tcp_stream_t* client)
     int result = uv_accept((uv_stream_t*)server, (uv_stream_t*)client);
     if (result == 0) {
         uv_tcp_nodelay((uv_tcp_t*)client, 1);
-        client->m_flags |= tcp_stream_t::e_connected;
+        client->m_flags |= tcp_stream_t::e_accepted;
+        tcp_stream_set_connected(client);
+        capture_open(client);
+    } else {
+        s_acceptErrors.add();
     }
     return result;
 }
 
+static inline void _close_socket(uv_os_sock_t sock)
+{
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+int fus::tcp_stream_pair(fus::tcp_stream_t* client, fus::tcp_stream_t* server)
+{
+    // This is a Unix domain socket pair on POSIX and a loopback TCP pair on Windows. Either way,
+    // libuv is none the wiser, so everything above the handle works just like a real connection.
+    uv_os_sock_t socks[2];
+    int result = uv_socketpair(SOCK_STREAM, 0, socks, 0, 0);
+    if (result < 0) {
+        s_acceptErrors.add();
+        return result;
+    }
+
+    result = uv_tcp_open((uv_tcp_t*)client, socks[0]);
+    if (result < 0) {
+        _close_socket(socks[0]);
+        _close_socket(socks[1]);
+        s_acceptErrors.add();
+        return result;
+    }
+
+    // The client handle owns its socket now, so it goes away when the caller closes the client.
+    result = uv_tcp_open((uv_tcp_t*)server, socks[1]);
+    if (result < 0) {
+        _close_socket(socks[1]);
+        s_acceptErrors.add();
+        return result;
+    }
+
+    server->m_flags |= tcp_stream_t::e_accepted;
+    tcp_stream_set_connected(server);
+    capture_open(server);
+    return 0;
+}
+
+void fus::tcp_stream_set_connected(fus::tcp_stream_t* stream)
+{
+    stream->m_flags |= tcp_stream_t::e_connected;
+    s_connections.add();
+    stream->m_connId = s_nextConnId.fetch_add(1, std::memory_order_relaxed);
+
+    memset(&stream->m_stats, 0, sizeof(stream->m_stats));
+    stream->m_stats.m_connectedAt = uv_now(uv_handle_get_loop((uv_handle_t*)stream));
+    stream->m_stats.m_windowStart = stream->m_stats.m_connectedAt;
+    s_live.push_back(stream);
+    fus::flight_record(fus::flight_event::e_accept, stream->m_connId, 0,
+                       (stream->m_flags & tcp_stream_t::e_accepted) ? 1 : 0);
+
+    // The peer can't change for the life of the connection, so there's no sense in asking the
+    // kernel every time somebody wants to log something about it.
+    int addrsz = sizeof(stream->m_peer);
+    if (uv_tcp_getpeername((const uv_tcp_t*)stream, (sockaddr*)&stream->m_peer, &addrsz) < 0) {
+        memset(&stream->m_peer, 0, sizeof(stream->m_peer));
+        strcpy(stream->m_peerstr, "???");
+        return;
+    }
+
+    char addrstr[48] = {"???"};
+    uint16_t port = 0;
+    if (stream->m_peer.ss_family == AF_INET) {
+        uv_ip4_name((sockaddr_in*)&stream->m_peer, addrstr, sizeof(addrstr));
+        port = ntohs(((sockaddr_in*)&stream->m_peer)->sin_port);
+    } else if (stream->m_peer.ss_family == AF_INET6) {
+        uv_ip6_name((sockaddr_in6*)&stream->m_peer, addrstr, sizeof(addrstr));
+        port = ntohs(((sockaddr_in6*)&stream->m_peer)->sin6_port);
+    } else {
+        // Streams from tcp_stream_pair() have no address worth mentioning.
+        strcpy(addrstr, "local");
+    }
+    snprintf(stream->m_peerstr, sizeof(stream->m_peerstr), "%s/%u", addrstr, (unsigned int)port);
+}
+
 // =================================================================================
 
 void fus::tcp_stream_close_cb(fus::tcp_stream_t* stream, uv_close_cb cb)
@@ -184,18 +321,38 @@ bool fus::tcp_stream_connected(const fus::tcp_stream_t* stream)
     return stream->m_flags & tcp_stream_t::e_connected;
 }
 
-ST::string fus::tcp_stream_peeraddr(const fus::tcp_stream_t* stream)
+const char* fus::tcp_stream_peeraddr(const fus::tcp_stream_t* stream)
 {
-    sockaddr_storage addr;
-    int addrsz = sizeof(addr);
-    uv_tcp_getpeername((const uv_tcp_t*)stream, (sockaddr*)(&addr), &addrsz);
+    return stream->m_peerstr;
+}
 
-    char addrstr[64] = {"???"};
-    if (addr.ss_family == AF_INET)
-        uv_ip4_name((sockaddr_in*)(&addr), addrstr, sizeof(addrstr));
-    else if (addr.ss_family == AF_INET6)
-        uv_ip6_name((sockaddr_in6*)(&addr), addrstr, sizeof(addrstr));
-    return ST::format("{}/{}", addrstr, ((sockaddr_in*)&addr)->sin_port);
+const sockaddr* fus::tcp_stream_peer(const fus::tcp_stream_t* stream)
+{
+    return (const sockaddr*)&stream->m_peer;
+}
+
+uint64_t fus::tcp_stream_connid(const fus::tcp_stream_t* stream)
+{
+    return stream->m_connId;
+}
+
+const fus::tcp_stats_t& fus::tcp_stream_stats(const fus::tcp_stream_t* stream)
+{
+    return stream->m_stats;
+}
+
+std::vector<const fus::tcp_stream_t*> fus::tcp_stream_connections()
+{
+    std::vector<const tcp_stream_t*> result;
+    for (tcp_stream_t* it = s_live.front(); it; it = s_live.next(it))
+        result.push_back(it);
+    return result;
+}
+
+void fus::tcp_stream_set_budget(const tcp_budget_t& budget, tcp_budget_cb cb)
+{
+    s_budget = budget;
+    s_budgetcb = cb;
 }
 
 // =================================================================================
@@ -335,7 +492,7 @@ static void _read_alloc(fus::tcp_stream_t* stream, size_t suggestion, uv_buf_t*
     }
 }
 
-static void _read_complete(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* buf)
+static void _read_dispatch(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* buf)
 {
     // Error cases:
     // 1) libuv error indicated by negative read size
@@ -344,6 +501,7 @@ static void _read_complete(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* b
     //    note this should cause `nread == UV_ENOBUFS`, but we check for it anyway...
     if (nread < 0 || (!stream->m_readStruct && nread != stream->m_readField) || stream->m_flags & fus::tcp_stream_t::e_readAllocFailed) {
         stream->m_flags &= ~fus::tcp_stream_t::e_readAllocFailed;
+        s_readErrors.add();
 
         // Don't null the callback after calling it. The callback might reset the callback!
         stream->m_flags |= fus::tcp_stream_t::e_readCallback;
@@ -364,13 +522,18 @@ static void _read_complete(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* b
     // Nonerror condition, continue reading...
     if (nread == 0)
         return;
+    s_bytesRead.add(nread);
 
     // Before we do ANYTHING else... The alloc callback assumes it can peak into the buffer and see
     // decrypted contents. So, if this stream is encrypted, we need to decipher what we just read.
     if (stream->m_flags & fus::tcp_stream_t::e_encrypted) {
         FUS_ASSERTD(nread == buf->len);
+        uint64_t start = uv_hrtime();
         fus::crypt_stream_decipher((fus::crypt_stream_t*)stream, buf->base, nread);
+        stream->m_stats.m_cryptTime += uv_hrtime() - start;
     }
+    if (stream->m_flags & fus::tcp_stream_t::e_capture)
+        fus::capture_read(stream, buf->base, nread);
 
     // Determine how many fields we read in
     size_t structsz;
@@ -424,6 +587,32 @@ static void _read_complete(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* b
         fus::net_msg_print(stream->m_readStruct, stream->m_readBuf, std::cout);
 #endif
 
+    // Slow handlers are reported by the message they were handed. Anything with a type field
+    // leads with it, so that's enough to tell apart messages sharing a header struct.
+    const char* readName = "tcp_stream_read";
+    uint32_t readType = fus::loop_timer_t::k_noType;
+    if (stream->m_readStruct) {
+        readName = stream->m_readStruct->m_name;
+        if (stream->m_readStruct->m_size && strcmp(stream->m_readStruct->m_fields[0].m_name, "type") == 0 &&
+            stream->m_readStruct->m_fields[0].m_datasz == sizeof(uint16_t)) {
+            uint16_t type;
+            memcpy(&type, stream->m_readBuf, sizeof(type));
+            readType = FUS_LE16(type);
+
+            // Messages are peeked at before they're read in full, so only count the full read.
+            if (!(stream->m_flags & fus::tcp_stream_t::e_readPeek)) {
+                stream->m_stats.m_messages++;
+                stream->m_stats.m_windowMessages++;
+                stream->m_stats.m_msgTypes[std::min<size_t>(readType, fus::tcp_stats_t::k_msgTypes - 1)]++;
+                fus::flight_record(fus::flight_event::e_dispatch, stream->m_connId, (uint16_t)readType,
+                                   (uint32_t)structsz);
+            }
+        }
+    }
+
+    if ((stream->m_flags & fus::tcp_stream_t::e_capture) && !(stream->m_flags & fus::tcp_stream_t::e_readPeek))
+        fus::capture_dispatch(stream);
+
     // Reset the read struct and read field anyway. Trying to use those might cause a buffer overrun.
     stream->m_readStruct = nullptr;
     if (!(stream->m_flags & fus::tcp_stream_t::e_readPeek))
@@ -433,7 +622,11 @@ static void _read_complete(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* b
     stream->m_flags |= fus::tcp_stream_t::e_readCallback;
     fus::tcp_read_cb cb = nullptr;
     std::swap(cb, stream->m_readcb);
-    cb(stream, structsz, stream->m_readBuf);
+    {
+        fus::loop_timer_t timer(readName, readType);
+        fus::alloc_scope_t allocScope(readName, readType);
+        cb(stream, structsz, stream->m_readBuf);
+    }
     stream->m_flags &= ~fus::tcp_stream_t::e_readCallback;
 
     // If a read was not queued by the callback, stop this read.
@@ -445,6 +638,55 @@ static void _read_complete(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* b
     }
 }
 
+static bool _over_budget(const fus::tcp_stats_t& stats, const char*& reason)
+{
+    if (s_budget.m_cpuTime && stats.m_windowCpuTime > s_budget.m_cpuTime)
+        reason = "CPU time";
+    else if (s_budget.m_bytesIn && stats.m_windowBytesIn > s_budget.m_bytesIn)
+        reason = "bytes received";
+    else if (s_budget.m_messages && stats.m_windowMessages > s_budget.m_messages)
+        reason = "messages received";
+    else
+        return false;
+    return true;
+}
+
+static void _read_complete(fus::tcp_stream_t* stream, ssize_t nread, uv_buf_t* buf)
+{
+    // Only connections from the outside world are held to a budget. Start a new window before
+    // this read is counted, so it's charged to the window it actually happened in.
+    fus::tcp_stats_t& stats = stream->m_stats;
+    bool budgeted = (stream->m_flags & fus::tcp_stream_t::e_accepted) && s_budget.m_window != 0;
+    if (budgeted) {
+        uint64_t now = uv_now(uv_handle_get_loop((uv_handle_t*)stream));
+        if (now - stats.m_windowStart >= s_budget.m_window) {
+            stats.m_windowStart = now;
+            stats.m_windowCpuTime = 0;
+            stats.m_windowBytesIn = 0;
+            stats.m_windowMessages = 0;
+        }
+    }
+
+    uint64_t start = uv_hrtime();
+    _read_dispatch(stream, nread, buf);
+    uint64_t elapsed = uv_hrtime() - start;
+
+    stats.m_cpuTime += elapsed;
+    stats.m_windowCpuTime += elapsed;
+    if (nread > 0) {
+        stats.m_bytesIn += nread;
+        stats.m_windowBytesIn += nread;
+    }
+
+    const char* reason;
+    if (budgeted && _over_budget(stats, reason) && !(stream->m_flags & fus::tcp_stream_t::e_closing)) {
+        s_budgetKicks.add();
+        if (s_budgetcb)
+            s_budgetcb(stream, reason);
+        fus::tcp_stream_shutdown(stream);
+    }
+}
+
 void fus::tcp_stream_read(fus::tcp_stream_t* stream, size_t bufsz, fus::tcp_read_cb read_cb)
 {
     FUS_ASSERTD(stream);
@@ -519,6 +761,26 @@ void fus::tcp_stream_peek_struct(fus::tcp_stream_t* stream, const fus::net_struc
     }
 }
 
+void fus::tcp_stream_feed(fus::tcp_stream_t* stream, const void* buf, size_t bufsz)
+{
+    FUS_ASSERTD(stream);
+    FUS_ASSERTD(buf);
+
+    // Do what libuv's read loop does: ask for a buffer, fill it, and hand it back for as long as
+    // somebody wants to read.
+    const char* ptr = (const char*)buf;
+    while (bufsz && (stream->m_flags & tcp_stream_t::e_reading)) {
+        uv_buf_t uvbuf;
+        _read_alloc(stream, 65536, &uvbuf);
+        size_t nread = std::min(bufsz, (size_t)uvbuf.len);
+        if (nread)
+            memcpy(uvbuf.base, ptr, nread);
+        _read_complete(stream, nread ? (ssize_t)nread : UV_ENOBUFS, &uvbuf);
+        ptr += nread;
+        bufsz -= nread;
+    }
+}
+
 // =================================================================================
 
 struct write_buf_t
@@ -540,6 +802,9 @@ void fus::tcp_stream_write(fus::tcp_stream_t* stream, const void* buf, size_t bu
     FUS_ASSERTD(bufsz);
 
     if (!(stream->m_flags & tcp_stream_t::e_closing)) {
+        if (stream->m_flags & tcp_stream_t::e_capture)
+            capture_write(stream, buf, bufsz);
+
         write_buf_t* req = (write_buf_t*)malloc(sizeof(write_buf_t) + bufsz);
         req->m_bufsz = bufsz;
         if (stream->m_flags & fus::tcp_stream_t::e_encrypted)
@@ -547,7 +812,10 @@ void fus::tcp_stream_write(fus::tcp_stream_t* stream, const void* buf, size_t bu
         else
             memcpy(req->m_buf, buf, bufsz);
         uv_buf_t uvbuf = uv_buf_init((char*)req->m_buf, req->m_bufsz);
-        uv_write((uv_write_t*)req, (uv_stream_t*)stream, &uvbuf, 1, (uv_write_cb)_write_complete);
+        s_bytesWritten.add(bufsz);
+        stream->m_stats.m_bytesOut += bufsz;
+        if (uv_write((uv_write_t*)req, (uv_stream_t*)stream, &uvbuf, 1, (uv_write_cb)_write_complete) < 0)
+            free(req);
     }
 }
 
@@ -567,6 +835,9 @@ void fus::tcp_stream_write_struct(fus::tcp_stream_t* stream, const fus::net_stru
         const char* srcPtr = (const char*)buf;
         char* dstPtr = req->m_buf;
 
+        // The fields are only contiguous once they're on the wire, so a capture has to gather them.
+        std::vector<uint8_t> captureBuf;
+
         size_t i;
         for (i = 0; i < ns->m_size; ++i) {
             sendbufs[i].base = dstPtr;
@@ -598,6 +869,8 @@ void fus::tcp_stream_write_struct(fus::tcp_stream_t* stream, const fus::net_stru
                     }
                 }
 
+                if (stream->m_flags & fus::tcp_stream_t::e_capture)
+                    captureBuf.insert(captureBuf.end(), srcPtr, srcPtr + sendbufs[i].len);
                 if (stream->m_flags & fus::tcp_stream_t::e_encrypted)
                     crypt_stream_encipher((crypt_stream_t*)stream, srcPtr, dstPtr, sendbufs[i].len);
                 else
@@ -608,6 +881,12 @@ void fus::tcp_stream_write_struct(fus::tcp_stream_t* stream, const fus::net_stru
             srcPtr += ns->m_fields[i].m_datasz;
         }
 
-        uv_write((uv_write_t*)req, (uv_stream_t*)stream, sendbufs, i, (uv_write_cb)_write_complete);
+        if (!captureBuf.empty())
+            capture_write(stream, captureBuf.data(), captureBuf.size());
+
+        s_bytesWritten.add(req->m_bufsz);
+        stream->m_stats.m_bytesOut += req->m_bufsz;
+        if (uv_write((uv_write_t*)req, (uv_stream_t*)stream, sendbufs, i, (uv_write_cb)_write_complete) < 0)
+            free(req);
     }
 }
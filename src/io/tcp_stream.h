@@ -17,8 +17,10 @@
 #ifndef __FUS_TCP_STREAM_H
 #define __FUS_TCP_STREAM_H
 
+#include "core/list.h"
 #include <string_theory/string>
 #include <uv.h>
+#include <vector>
 
 namespace fus
 {
@@ -26,6 +28,41 @@ namespace fus
     typedef void (*tcp_free_cb)(tcp_stream_t*);
     typedef void (*tcp_read_cb)(tcp_stream_t*, ssize_t, void*);
 
+    /** Resources used by a single connection, for working out who is hogging the server. */
+    struct tcp_stats_t
+    {
+        /** Messages are counted by type up to this; anything beyond shares the last slot. */
+        static constexpr size_t k_msgTypes = 64;
+
+        uint64_t m_connectedAt;
+        uint64_t m_cpuTime;
+        uint64_t m_cryptTime;
+        uint64_t m_bytesIn;
+        uint64_t m_bytesOut;
+        uint64_t m_messages;
+        uint32_t m_msgTypes[k_msgTypes];
+
+        // Usage in the current budget window
+        uint64_t m_windowStart;
+        uint64_t m_windowCpuTime;
+        uint64_t m_windowBytesIn;
+        uint64_t m_windowMessages;
+    };
+
+    /**
+     * Limits on what a single accepted connection may use per window before it is kicked.
+     * Zero disables a limit. CPU time is that spent in read, decrypt and handler callbacks.
+     */
+    struct tcp_budget_t
+    {
+        uint64_t m_window;
+        uint64_t m_cpuTime;
+        uint64_t m_bytesIn;
+        uint64_t m_messages;
+    };
+
+    typedef void (*tcp_budget_cb)(tcp_stream_t*, const char* reason);
+
     struct tcp_stream_t
     {
         enum
@@ -39,6 +76,8 @@ namespace fus
             e_freeOnClose = (1<<5),
             e_connected = (1<<6),
             e_readPeek = (1<<7),
+            e_accepted = (1<<14),
+            e_capture = (1<<15),
 
             // Crypt Stream Flags
             e_encrypted = (1<<8),
@@ -62,6 +101,14 @@ namespace fus
         uv_close_cb m_closecb;
         tcp_free_cb m_freecb;
         size_t m_refcount;
+
+        // Captured once when the connection is established
+        uint64_t m_connId;
+        sockaddr_storage m_peer;
+        char m_peerstr[64];
+
+        tcp_stats_t m_stats;
+        FUS_LIST_LINK(tcp_stream_t) m_liveLink;
     };
 
     int tcp_stream_init(tcp_stream_t*, uv_loop_t*);
@@ -69,17 +116,56 @@ namespace fus
     void tcp_stream_shutdown(tcp_stream_t*);
 
     void tcp_stream_ref(tcp_stream_t*, uv_handle_t*);
+
+    /** Keeps the stream's memory alive until a matching tcp_stream_free. */
+    void tcp_stream_ref(tcp_stream_t*);
     void tcp_stream_unref(uv_handle_t*);
 
     int tcp_stream_accept(fus::tcp_stream_t* server, fus::tcp_stream_t* client);
 
+    /**
+     * Connects two initialized streams to each other in-process, without going through the
+     * network stack. The server end is treated as though it had been accepted. As with any other
+     * outgoing connection, the client end must be marked with tcp_stream_set_connected().
+     */
+    int tcp_stream_pair(fus::tcp_stream_t* client, fus::tcp_stream_t* server);
+
+    /**
+     * Marks the stream as connected and captures the identity of the peer. This is done for you
+     * by tcp_stream_accept(); outgoing connections must call it when the connect completes.
+     */
+    void tcp_stream_set_connected(tcp_stream_t*);
+
     void tcp_stream_close_cb(tcp_stream_t*, uv_close_cb);
     void tcp_stream_free_cb(tcp_stream_t*, tcp_free_cb);
     void tcp_stream_free_on_close(tcp_stream_t*, bool);
 
     bool tcp_stream_closing(const tcp_stream_t*);
     bool tcp_stream_connected(const tcp_stream_t*);
-    ST::string tcp_stream_peeraddr(const tcp_stream_t*);
+
+    /** Address of the peer, formatted as "addr/port". This is cached, so it is cheap to call. */
+    const char* tcp_stream_peeraddr(const tcp_stream_t*);
+
+    /** Address of the peer, as captured when the connection was established. */
+    const sockaddr* tcp_stream_peer(const tcp_stream_t*);
+
+    /**
+     * Process-unique ID of the current connection, suitable for correlating log messages.
+     * A new ID is assigned each time the stream connects.
+     */
+    uint64_t tcp_stream_connid(const tcp_stream_t*);
+
+    /** Times are in nanoseconds; the connection time is in loop milliseconds (uv_now). */
+    const tcp_stats_t& tcp_stream_stats(const tcp_stream_t*);
+
+    /** Every connected stream on the calling thread's loop. */
+    std::vector<const tcp_stream_t*> tcp_stream_connections();
+
+    /**
+     * Sets the limits on accepted connections. The callback is run just before an offending
+     * connection is shut down, so the reason can be logged.
+     */
+    void tcp_stream_set_budget(const tcp_budget_t&, tcp_budget_cb);
 
     void tcp_stream_read(tcp_stream_t*, size_t msgsz, tcp_read_cb read_cb);
     void tcp_stream_read_struct(tcp_stream_t*, const struct net_struct_t*, tcp_read_cb read_cb);
@@ -98,6 +184,12 @@ namespace fus
         tcp_stream_peek_struct(s, T::net_struct, read_cb);
     }
 
+    /**
+     * Runs bytes through the read path as though they had just arrived from the peer. The stream
+     * does not need to be connected, which lets message parsing be exercised without a socket.
+     */
+    void tcp_stream_feed(tcp_stream_t*, const void*, size_t);
+
     void tcp_stream_write(tcp_stream_t*, const void*, size_t);
     void tcp_stream_write_struct(tcp_stream_t*, const struct net_struct_t*, const void*, size_t,
                                  const void* appendBuf=nullptr, size_t appendBufsz=0);
@@ -0,0 +1,107 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+
+#include "trace.h"
+
+// =================================================================================
+
+// Enough for a few minutes of a busy shard. Beyond this, spans are quietly dropped.
+constexpr size_t k_maxSpans = 1 << 20;
+
+std::atomic<bool> fus::trace::s_active{ false };
+
+static std::atomic<uint32_t> s_nextTraceId{ 1 };
+static std::atomic<uint32_t> s_nextThread{ 1 };
+static thread_local uint32_t t_thread = 0;
+
+static std::mutex s_lock;
+static std::vector<fus::trace_span_t> s_spans;
+
+// =================================================================================
+
+uint32_t fus::trace_next_id()
+{
+    if (!trace_active())
+        return 0;
+
+    uint32_t id = s_nextTraceId.fetch_add(1, std::memory_order_relaxed);
+    return id ? id : s_nextTraceId.fetch_add(1, std::memory_order_relaxed);
+}
+
+void fus::trace_span(uint32_t traceId, const char* name, uint64_t start, uint64_t end)
+{
+    if (traceId == 0 || !trace_active())
+        return;
+    if (t_thread == 0)
+        t_thread = s_nextThread.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(s_lock);
+    if (trace_active() && s_spans.size() < k_maxSpans)
+        s_spans.push_back({ name, traceId, t_thread, start, end });
+}
+
+bool fus::trace_start()
+{
+    std::lock_guard<std::mutex> lock(s_lock);
+    if (trace_active())
+        return false;
+    s_spans.clear();
+    trace::s_active.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+std::vector<fus::trace_span_t> fus::trace_stop()
+{
+    std::lock_guard<std::mutex> lock(s_lock);
+    trace::s_active.store(false, std::memory_order_relaxed);
+
+    std::vector<trace_span_t> result;
+    result.swap(s_spans);
+    return result;
+}
+
+// =================================================================================
+
+bool fus::trace_write_chrome(const std::vector<trace_span_t>& spans, const std::filesystem::path& path)
+{
+    FILE* fp = fopen(path.string().c_str(), "w");
+    if (!fp)
+        return false;
+
+    // Timestamps are relative to the first span so the viewer doesn't open on an empty expanse.
+    uint64_t base = UINT64_MAX;
+    for (const trace_span_t& span : spans)
+        base = std::min(base, span.m_start);
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+    for (size_t i = 0; i < spans.size(); ++i) {
+        const trace_span_t& span = spans[i];
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"fus\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"trace\":%u}}",
+                i ? "," : "", span.m_name, span.m_thread, (double)(span.m_start - base) / 1000.0,
+                (double)(std::max(span.m_end, span.m_start) - span.m_start) / 1000.0, span.m_traceId);
+    }
+    fputs("\n]}\n", fp);
+
+    bool result = ferror(fp) == 0;
+    fclose(fp);
+    return result;
+}
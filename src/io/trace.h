@@ -0,0 +1,67 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_TRACE_H
+#define __FUS_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace fus
+{
+    /**
+     * One timed step in handling a traced request. Spans sharing a trace ID belong to the same
+     * request, even when they were recorded by different daemons or threads.
+     */
+    struct trace_span_t
+    {
+        /** Name of the step. This must be a string literal, or otherwise outlive the trace. */
+        const char* m_name;
+        uint32_t m_traceId;
+        uint32_t m_thread;
+
+        // Times are from uv_hrtime() in nanoseconds
+        uint64_t m_start;
+        uint64_t m_end;
+    };
+
+    namespace trace
+    {
+        extern std::atomic<bool> s_active;
+    };
+
+    inline bool trace_active() { return trace::s_active.load(std::memory_order_relaxed); }
+
+    /** Allocates an ID for a new request, or returns 0 if no trace is being recorded. */
+    uint32_t trace_next_id();
+
+    /** Records a span. Does nothing for untraced requests or if no trace is being recorded. */
+    void trace_span(uint32_t traceId, const char* name, uint64_t start, uint64_t end);
+
+    /** Begins recording spans. Returns false if a trace is already being recorded. */
+    bool trace_start();
+
+    /** Stops recording and returns everything that was recorded. */
+    std::vector<trace_span_t> trace_stop();
+
+    /** Writes spans as a Chrome trace, viewable in chrome://tracing or Perfetto. */
+    bool trace_write_chrome(const std::vector<trace_span_t>&, const std::filesystem::path&);
+};
+
+#endif
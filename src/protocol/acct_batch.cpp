@@ -0,0 +1,127 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "acct_batch.h"
+#include <algorithm>
+#include "core/endian.h"
+#include <cstring>
+
+// =================================================================================
+
+constexpr size_t k_resultsz = sizeof(uint32_t) + sizeof(fus::uuid);
+
+static inline void write_u16(std::vector<uint8_t>& buf, uint16_t value)
+{
+    value = FUS_LE16(value);
+    const uint8_t* p = (const uint8_t*)&value;
+    buf.insert(buf.end(), p, p + sizeof(value));
+}
+
+static inline void write_u32(std::vector<uint8_t>& buf, uint32_t value)
+{
+    value = FUS_LE32(value);
+    const uint8_t* p = (const uint8_t*)&value;
+    buf.insert(buf.end(), p, p + sizeof(value));
+}
+
+static inline bool read_u16(const uint8_t*& buf, const uint8_t* end, uint16_t& value)
+{
+    if ((size_t)(end - buf) < sizeof(value))
+        return false;
+    memcpy(&value, buf, sizeof(value));
+    value = FUS_LE16(value);
+    buf += sizeof(value);
+    return true;
+}
+
+static inline bool read_u32(const uint8_t*& buf, const uint8_t* end, uint32_t& value)
+{
+    if ((size_t)(end - buf) < sizeof(value))
+        return false;
+    memcpy(&value, buf, sizeof(value));
+    value = FUS_LE32(value);
+    buf += sizeof(value);
+    return true;
+}
+
+static inline bool read_str(const uint8_t*& buf, const uint8_t* end, std::string& value)
+{
+    uint16_t sz;
+    if (!read_u16(buf, end, sz) || (size_t)(end - buf) < sz)
+        return false;
+    value.assign((const char*)buf, sz);
+    buf += sz;
+    return true;
+}
+
+// =================================================================================
+
+void fus::protocol::acct_batch_write(std::vector<uint8_t>& buf, const std::string_view& name,
+                                     const std::string_view& pass, uint32_t flags)
+{
+    // Same limits as the single account messages.
+    size_t namesz = std::min(name.size(), (size_t)64);
+    size_t passsz = std::min(pass.size(), (size_t)64);
+
+    write_u16(buf, (uint16_t)namesz);
+    buf.insert(buf.end(), name.data(), name.data() + namesz);
+    write_u16(buf, (uint16_t)passsz);
+    buf.insert(buf.end(), pass.data(), pass.data() + passsz);
+    write_u32(buf, flags);
+}
+
+bool fus::protocol::acct_batch_read(const uint8_t* buf, size_t bufsz, uint32_t count,
+                                    std::vector<acct_batch_record_t>& records)
+{
+    if (count == 0 || count > acct_batch_max)
+        return false;
+
+    const uint8_t* end = buf + bufsz;
+    records.resize(count);
+    for (auto& it : records) {
+        if (!read_str(buf, end, it.m_name) || !read_str(buf, end, it.m_pass) || !read_u32(buf, end, it.m_flags))
+            return false;
+        if (it.m_name.empty() || it.m_name.size() > 64 || it.m_pass.size() > 64)
+            return false;
+    }
+
+    // Trailing garbage means the sender and I disagree about the format.
+    return buf == end;
+}
+
+void fus::protocol::acct_batch_write_result(std::vector<uint8_t>& buf, net_error result, const uuid& uuid)
+{
+    write_u32(buf, (uint32_t)result);
+    buf.insert(buf.end(), uuid.data(), uuid.data() + sizeof(fus::uuid));
+}
+
+bool fus::protocol::acct_batch_read_results(const uint8_t* buf, size_t bufsz, uint32_t count,
+                                            std::vector<acct_batch_result_t>& results)
+{
+    if (bufsz != (size_t)count * k_resultsz)
+        return false;
+
+    const uint8_t* end = buf + bufsz;
+    results.resize(count);
+    for (auto& it : results) {
+        uint32_t result;
+        read_u32(buf, end, result);
+        it.m_result = (net_error)result;
+        memcpy(it.m_uuid.data(), buf, sizeof(fus::uuid));
+        buf += sizeof(fus::uuid);
+    }
+    return true;
+}
@@ -0,0 +1,80 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FUS_PROTOCOL_ACCT_BATCH_H
+#define __FUS_PROTOCOL_ACCT_BATCH_H
+
+#include <cstdint>
+#include "core/uuid.h"
+#include "io/net_error.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fus
+{
+    namespace protocol
+    {
+        /**
+         * Maximum number of accounts that may be provisioned by a single batch request.
+         * Anything larger should simply be split across several requests.
+         */
+        constexpr uint32_t acct_batch_max = 10000;
+
+        struct acct_batch_record_t
+        {
+            std::string m_name;
+            std::string m_pass;
+            uint32_t m_flags;
+        };
+
+        struct acct_batch_result_t
+        {
+            net_error m_result;
+            uuid m_uuid;
+        };
+
+        /**
+         * Appends an account record to a batch creation buffer.
+         * Records are packed back to back: a 16-bit length prefixed UTF-8 name, a 16-bit length
+         * prefixed UTF-8 password, and 32-bit account flags, all little endian.
+         */
+        void acct_batch_write(std::vector<uint8_t>& buf, const std::string_view& name,
+                              const std::string_view& pass, uint32_t flags);
+
+        /**
+         * Unpacks the account records from a batch creation buffer.
+         * \returns false if the buffer does not contain exactly \p count well formed records.
+         */
+        bool acct_batch_read(const uint8_t* buf, size_t bufsz, uint32_t count,
+                             std::vector<acct_batch_record_t>& records);
+
+        /**
+         * Appends a per-account result to a batch reply buffer.
+         * Results are fixed size: the 32-bit net_error followed by the 16-byte account UUID.
+         */
+        void acct_batch_write_result(std::vector<uint8_t>& buf, net_error result, const uuid& uuid);
+
+        /**
+         * Unpacks the per-account results from a batch reply buffer.
+         * \returns false if the buffer does not contain exactly \p count results.
+         */
+        bool acct_batch_read_results(const uint8_t* buf, size_t bufsz, uint32_t count,
+                                     std::vector<acct_batch_result_t>& results);
+    };
+};
+
+#endif
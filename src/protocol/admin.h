@@ -29,6 +29,8 @@ namespace fus
                 e_wallRequest,
 
                 e_acctCreateRequest,
+                e_acctCreateBatchRequest,
+                e_statsRequest,
             };
 
             enum
@@ -37,6 +39,8 @@ namespace fus
                 e_wallBCast,
 
                 e_acctCreateReply,
+                e_acctCreateBatchReply,
+                e_statsReply,
             };
         };
     };
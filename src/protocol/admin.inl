@@ -33,6 +33,19 @@ FUS_NET_STRUCT_BEGIN(admin, acctCreateRequest)
     FUS_NET_FIELD_UINT32(flags)
 FUS_NET_STRUCT_END(admin, acctCreateRequest)
 
+FUS_NET_STRUCT_BEGIN(admin, acctCreateBatchRequest)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(count)
+    FUS_NET_FIELD_BUFFER_HUGE(records)
+FUS_NET_STRUCT_END(admin, acctCreateBatchRequest)
+
+FUS_NET_STRUCT_BEGIN(admin, statsRequest)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_STRING_UTF8(filter, 64)
+FUS_NET_STRUCT_END(admin, statsRequest)
+
 // =================================================================================
 
 FUS_NET_STRUCT_BEGIN(admin, pingReply)
@@ -53,3 +66,18 @@ FUS_NET_STRUCT_BEGIN(admin, acctCreateReply)
     FUS_NET_FIELD_UINT32(result)
     FUS_NET_FIELD_UUID(uuid)
 FUS_NET_STRUCT_END(admin, acctCreateReply)
+
+FUS_NET_STRUCT_BEGIN(admin, acctCreateBatchReply)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(result)
+    FUS_NET_FIELD_UINT32(count)
+    FUS_NET_FIELD_BUFFER_HUGE(results)
+FUS_NET_STRUCT_END(admin, acctCreateBatchReply)
+
+FUS_NET_STRUCT_BEGIN(admin, statsReply)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(result)
+    FUS_NET_FIELD_BUFFER_HUGE(stats)
+FUS_NET_STRUCT_END(admin, statsReply)
@@ -36,6 +36,12 @@ FUS_NET_STRUCT_BEGIN(auth, acctLoginRequest)
     FUS_NET_FIELD_STRING_UTF16(os, 8)
 FUS_NET_STRUCT_END(auth, acctLoginRequest)
 
+FUS_NET_STRUCT_BEGIN(auth, accountExistsRequest)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_STRING_UTF16(name, 64)
+FUS_NET_STRUCT_END(auth, accountExistsRequest)
+
 // =================================================================================
 
 FUS_NET_STRUCT_BEGIN(auth, pingReply)
@@ -59,3 +65,10 @@ FUS_NET_STRUCT_BEGIN(auth, acctLoginReply)
     FUS_NET_FIELD_UINT32(billingType)
     FUS_NET_FIELD_BLOB(droidKey, sizeof(uint32_t) * 4)
 FUS_NET_STRUCT_END(auth, acctLoginReply)
+
+FUS_NET_STRUCT_BEGIN(auth, accountExistsReply)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(result)
+    FUS_NET_FIELD_UINT8(exists)
+FUS_NET_STRUCT_END(auth, accountExistsReply)
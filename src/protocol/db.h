@@ -29,6 +29,8 @@ namespace fus
 
                 e_acctCreateRequest,
                 e_acctAuthRequest,
+                e_acctExistsRequest,
+                e_acctCreateBatchRequest,
             };
 
             enum
@@ -37,6 +39,9 @@ namespace fus
 
                 e_acctCreateReply,
                 e_acctAuthReply,
+                e_acctInvalidateBCast,
+                e_acctExistsReply,
+                e_acctCreateBatchReply,
             };
         };
     };
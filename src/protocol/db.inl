@@ -23,6 +23,7 @@ FUS_NET_STRUCT_END(db, pingRequest)
 FUS_NET_STRUCT_BEGIN(db, acctCreateRequest)
     FUS_NET_FIELD_UINT16(type)
     FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(traceId)
     FUS_NET_FIELD_STRING_UTF8(name, 64)
     FUS_NET_FIELD_STRING_UTF8(pass, 64)
     FUS_NET_FIELD_UINT32(flags)
@@ -31,12 +32,28 @@ FUS_NET_STRUCT_END(db, acctCreateRequest)
 FUS_NET_STRUCT_BEGIN(db, acctAuthRequest)
     FUS_NET_FIELD_UINT16(type)
     FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(traceId)
     FUS_NET_FIELD_STRING_UTF8(name, 64)
     FUS_NET_FIELD_UINT32(cliChallenge)
     FUS_NET_FIELD_UINT32(srvChallenge)
     FUS_NET_FIELD_BUFFER_TINY(hash)
 FUS_NET_STRUCT_END(db, acctAuthRequest)
 
+FUS_NET_STRUCT_BEGIN(db, acctExistsRequest)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(traceId)
+    FUS_NET_FIELD_STRING_UTF8(name, 64)
+FUS_NET_STRUCT_END(db, acctExistsRequest)
+
+FUS_NET_STRUCT_BEGIN(db, acctCreateBatchRequest)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(traceId)
+    FUS_NET_FIELD_UINT32(count)
+    FUS_NET_FIELD_BUFFER_HUGE(records)
+FUS_NET_STRUCT_END(db, acctCreateBatchRequest)
+
 // =================================================================================
 
 FUS_NET_STRUCT_BEGIN(db, pingReply)
@@ -59,4 +76,26 @@ FUS_NET_STRUCT_BEGIN(db, acctAuthReply)
     FUS_NET_FIELD_STRING_UTF8(name, 64)
     FUS_NET_FIELD_UUID(uuid)
     FUS_NET_FIELD_UINT32(flags)
+    FUS_NET_FIELD_UINT32(hashlen)
+    FUS_NET_FIELD_BLOB(hash, 64)
 FUS_NET_STRUCT_END(db, acctAuthReply)
+
+FUS_NET_STRUCT_BEGIN(db, acctInvalidateBCast)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_STRING_UTF8(name, 64)
+FUS_NET_STRUCT_END(db, acctInvalidateBCast)
+
+FUS_NET_STRUCT_BEGIN(db, acctExistsReply)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(result)
+    FUS_NET_FIELD_UINT8(exists)
+FUS_NET_STRUCT_END(db, acctExistsReply)
+
+FUS_NET_STRUCT_BEGIN(db, acctCreateBatchReply)
+    FUS_NET_FIELD_UINT16(type)
+    FUS_NET_FIELD_UINT32(transId)
+    FUS_NET_FIELD_UINT32(result)
+    FUS_NET_FIELD_UINT32(count)
+    FUS_NET_FIELD_BUFFER_HUGE(results)
+FUS_NET_STRUCT_END(db, acctCreateBatchReply)
@@ -0,0 +1,90 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include "io/log_file.h"
+#include <string>
+#include <string_theory/st_format.h>
+
+// =================================================================================
+
+constexpr unsigned int k_messages = 20000;
+constexpr unsigned int k_flushEvery = 200;
+
+static ST::string test_padding(unsigned int i)
+{
+    // Odd lengths, so record headers land at every 8-byte offset near the end of the ring.
+    return ST::string::from_std_string(std::string(i % 97, (char)('a' + (i % 26))));
+}
+
+int main()
+{
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "fus_log_file_test";
+    std::error_code error;
+    std::filesystem::remove_all(dir, error);
+
+    // The smallest ring there is, so it wraps many times over.
+    fus::log_file::set_directory(ST::string::from_utf8(dir.u8string().c_str()));
+    fus::log_file::set_buffer_size(0);
+    fus::log_file::set_rotation(0, 0, 0);
+    fus::log_file::set_binary(false);
+
+    fus::log_file log;
+    if (log.open(nullptr, ST_LITERAL("ring")) < 0) {
+        fputs("Unable to open the log\n", stderr);
+        return 1;
+    }
+    log.set_level(fus::log_file::level::e_error);
+    for (unsigned int i = 0; i < k_messages; ++i) {
+        // Alternate between preformatted and deferred records, which share the same header.
+        if (i % 2)
+            log.write(ST::format("message {} {}", i, test_padding(i)));
+        else
+            FUS_LOG_ERROR(log, "message {} {}", i, test_padding(i));
+        if ((i % k_flushEvery) == 0)
+            fus::log_file::flush();
+    }
+    log.close();
+    fus::log_file::flush();
+
+    // Skip the banner, then every message must be there, intact and in order.
+    std::ifstream stream(dir / "ring.log");
+    std::string line;
+    unsigned int expected = 0;
+    int result = 0;
+    while (std::getline(stream, line)) {
+        size_t pos = line.find("] message ");
+        if (pos == std::string::npos)
+            continue;
+        std::string want = ST::format("message {} {}", expected, test_padding(expected)).c_str();
+        if (line.compare(pos + 2, std::string::npos, want) != 0) {
+            fprintf(stderr, "Message %u is wrong: '%s'\n", expected, line.c_str());
+            result = 1;
+            break;
+        }
+        expected++;
+    }
+    if (result == 0 && expected != k_messages) {
+        fprintf(stderr, "Only %u of %u messages were written\n", expected, k_messages);
+        result = 1;
+    }
+
+    std::filesystem::remove_all(dir, error);
+    return result;
+}
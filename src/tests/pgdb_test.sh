@@ -0,0 +1,47 @@
+#!/bin/sh
+#    This file is part of fus.
+#
+#    fus is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU Affero General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    fus is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU Affero General Public License for more details.
+#
+#    You should have received a copy of the GNU Affero General Public License
+#    along with fus.  If not, see <https://www.gnu.org/licenses/>.
+
+# Runs fus_stackbench against a throwaway PostgreSQL cluster, which covers account
+# creation (one at a time and batched) and auth logins through the pgdb engine.
+#
+# Usage: pgdb_test.sh <fus_stackbench> <initdb> <pg_ctl>
+
+set -e
+
+stackbench="$1"
+initdb="$2"
+pg_ctl="$3"
+
+tmp=$(mktemp -d)
+cleanup() {
+    "$pg_ctl" -D "$tmp/data" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+"$initdb" -D "$tmp/data" -U fus --auth=trust >"$tmp/initdb.log"
+"$pg_ctl" -D "$tmp/data" -l "$tmp/postgres.log" -w \
+    -o "-c listen_addresses='' -c unix_socket_directories='$tmp'" start >/dev/null
+
+# Each run gets its own database, so the batch run can't trip over the first run's accounts.
+for db in single batch; do
+    "$(dirname "$pg_ctl")/createdb" -h "$tmp" -U fus "stackbench_$db"
+done
+
+"$stackbench" --engine=postgres --pg_conninfo="host=$tmp user=fus dbname=stackbench_single" \
+    --accounts=200 --concurrency=8 --temp_dir="$tmp/single"
+"$stackbench" --engine=postgres --pg_conninfo="host=$tmp user=fus dbname=stackbench_batch" \
+    --accounts=200 --concurrency=4 --batch=25 --temp_dir="$tmp/batch"
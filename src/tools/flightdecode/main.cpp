@@ -0,0 +1,128 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "core/build_info.h"
+#include "core/flight_recorder.h"
+#include <ctime>
+#include <gflags/gflags.h>
+#include <string_theory/st_format.h>
+
+// =================================================================================
+
+DEFINE_uint64(conn, 0, "Only print events for this connection ID");
+DEFINE_uint64(tail, 0, "Only print this many of the most recent events");
+
+// =================================================================================
+
+static void print(const ST::string& str)
+{
+    fputs(str.c_str(), stdout);
+}
+
+static ST::string format_time(uint64_t timeUs)
+{
+    time_t time = (time_t)(timeUs / 1000000);
+    tm result;
+#ifdef _WIN32
+    gmtime_s(&result, &time);
+#else
+    gmtime_r(&time, &result);
+#endif
+    char buf[32];
+    size_t bufsz = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &result);
+    return ST::format("{}.{06}", ST::string::from_utf8(buf, bufsz), timeUs % 1000000);
+}
+
+static ST::string describe(const fus::flight_entry_t& entry)
+{
+    switch (entry.m_kind) {
+    case fus::flight_event::e_start:
+        return ST_LITERAL("recorder started");
+    case fus::flight_event::e_accept:
+        return ST::format("conn {} {}", entry.m_connId, entry.m_arg ? "accepted" : "connected");
+    case fus::flight_event::e_close:
+        return ST::format("conn {} closed after {} messages", entry.m_connId, entry.m_arg);
+    case fus::flight_event::e_dispatch:
+        return ST::format("conn {} msg 0x{04X} ({} bytes)", entry.m_connId, entry.m_type, entry.m_arg);
+    case fus::flight_event::e_transStart:
+        return ST::format("conn {} trans {} started, msg 0x{04X}", entry.m_connId, entry.m_arg, entry.m_type);
+    case fus::flight_event::e_transFinish:
+        return ST::format("conn {} trans finished, msg 0x{04X}, {} us", entry.m_connId, entry.m_type, entry.m_arg);
+    case fus::flight_event::e_handshake:
+        return ST::format("conn {} encrypted in {} us", entry.m_connId, entry.m_arg);
+    case fus::flight_event::e_handshakeFailed:
+        return ST::format("conn {} handshake failed", entry.m_connId);
+    case fus::flight_event::e_loopLag:
+        return ST::format("loop busy for {} us", entry.m_arg);
+    case fus::flight_event::e_slowCallback:
+        return ST::format("callback for msg 0x{04X} blocked the loop for {} us", entry.m_type, entry.m_arg);
+    case fus::flight_event::e_assert:
+        return ST::format("assert at line {}", entry.m_arg);
+    default:
+        return ST::format("type {} conn {} arg {}", entry.m_type, entry.m_connId, entry.m_arg);
+    }
+}
+
+// =================================================================================
+
+static bool decode_file(const char* path)
+{
+    fus::flight_dump_t dump;
+    if (!fus::flight_recorder_read(path, dump)) {
+        print(ST::format("'{}' is not a fus flight recorder file\n", path));
+        return false;
+    }
+
+    print(ST::format("{}: pid {}, started {} UTC, {} events recorded, {} kept\n", path, dump.m_pid,
+                     format_time(dump.m_startTime), dump.m_recorded, dump.m_events.size()));
+    if (!dump.m_assert.empty())
+        print(ST::format("Assertion failed: {}\n", dump.m_assert));
+
+    size_t first = 0;
+    if (FLAGS_tail && FLAGS_tail < dump.m_events.size())
+        first = dump.m_events.size() - FLAGS_tail;
+
+    for (size_t i = first; i < dump.m_events.size(); ++i) {
+        const fus::flight_entry_t& entry = dump.m_events[i];
+        if (FLAGS_conn && entry.m_connId != FLAGS_conn)
+            continue;
+        print(ST::format("[{}] {<16} {}\n", format_time(dump.m_startTime + entry.m_time / 1000),
+                         fus::flight_event_name(entry.m_kind), describe(entry)));
+    }
+    return true;
+}
+
+// =================================================================================
+
+int main(int argc, char* argv[])
+{
+    gflags::SetVersionString(fus::build_version());
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc < 2) {
+        print("Usage: fus_flightdecode [options] <fus.flight> [...]\n"
+              "Prints the events saved by a fus server's flight recorder as a timeline.\n"
+              "Run with --help for a list of options.\n");
+        return 1;
+    }
+
+    int result = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!decode_file(argv[i]))
+            result = 1;
+    }
+    return result;
+}
@@ -0,0 +1,313 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include "import_reader.h"
+#include <string_theory/st_format.h>
+
+// =================================================================================
+
+bool fus::import_reader::read_line(std::string& line)
+{
+    if (!std::getline(m_stream, line))
+        return false;
+    if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+    m_line++;
+    return true;
+}
+
+bool fus::import_reader::open(const std::filesystem::path& path, uint64_t offset)
+{
+    m_stream.open(path, std::ios::in | std::ios::binary);
+    if (!m_stream.is_open())
+        return false;
+
+    std::error_code error;
+    m_size = std::filesystem::file_size(path, error);
+    if (offset != 0)
+        m_stream.seekg((std::streamoff)offset);
+    return m_stream.good();
+}
+
+uint64_t fus::import_reader::tell()
+{
+    // tellg() refuses to answer once the final line has been read.
+    if (m_stream.eof())
+        return m_size;
+    return (uint64_t)m_stream.tellg();
+}
+
+// =================================================================================
+
+static bool parse_flags(const std::string& value, uint32_t& flags)
+{
+    if (value.empty()) {
+        flags = 0;
+        return true;
+    }
+
+    char* end;
+    flags = (uint32_t)strtoul(value.c_str(), &end, 0);
+    return *end == '\0';
+}
+
+static bool parse_hex(const std::string& value, std::vector<uint8_t>& buf)
+{
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    };
+
+    if (value.size() % 2 != 0)
+        return false;
+    buf.resize(value.size() / 2);
+    for (size_t i = 0; i < buf.size(); ++i) {
+        int hi = nibble(value[i * 2]);
+        int lo = nibble(value[i * 2 + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        buf[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return true;
+}
+
+// =================================================================================
+
+class import_csv_reader_t : public fus::import_reader
+{
+    bool m_header;
+
+    static void split(const std::string& line, std::vector<std::string>& fields)
+    {
+        fields.clear();
+        fields.emplace_back();
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            char c = line[i];
+            if (quoted) {
+                if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                    fields.back().push_back('"');
+                    i++;
+                } else if (c == '"') {
+                    quoted = false;
+                } else {
+                    fields.back().push_back(c);
+                }
+            } else if (c == '"') {
+                quoted = true;
+            } else if (c == ',') {
+                fields.emplace_back();
+            } else {
+                fields.back().push_back(c);
+            }
+        }
+    }
+
+public:
+    import_csv_reader_t(bool header) : m_header(header) { }
+
+    bool open(const std::filesystem::path& path, uint64_t offset) override
+    {
+        if (!import_reader::open(path, offset))
+            return false;
+
+        std::string line;
+        if (m_header && offset == 0)
+            read_line(line);
+        return true;
+    }
+
+    bool next(fus::import_acct_t& acct, ST::string& error) override
+    {
+        std::string line;
+        std::vector<std::string> fields;
+        while (read_line(line)) {
+            if (line.empty() || line.front() == '#')
+                continue;
+
+            split(line, fields);
+            if (fields.size() < 2 || fields[0].empty()) {
+                error = ST::format("line {}: expected at least a name and password", m_line);
+                return true;
+            }
+
+            acct.m_name = ST::string::from_utf8(fields[0].c_str(), fields[0].size());
+            acct.m_pass = ST::string::from_utf8(fields[1].c_str(), fields[1].size());
+            acct.m_hash.clear();
+            if (!parse_flags(fields.size() > 2 ? fields[2] : std::string(), acct.m_flags)) {
+                error = ST::format("line {}: invalid flags '{}'", m_line, fields[2]);
+                return true;
+            }
+            if (fields.size() > 3 && !fields[3].empty()) {
+                if (!acct.m_uuid.from_string(fields[3].c_str())) {
+                    error = ST::format("line {}: invalid uuid '{}'", m_line, fields[3]);
+                    return true;
+                }
+            } else {
+                acct.m_uuid = fus::uuid::generate();
+            }
+            error = ST::string();
+            return true;
+        }
+        return false;
+    }
+};
+
+std::unique_ptr<fus::import_reader> fus::import_csv_reader(bool header)
+{
+    return std::make_unique<import_csv_reader_t>(header);
+}
+
+// =================================================================================
+
+class import_dirtsand_reader_t : public fus::import_reader
+{
+    enum { e_login, e_passHash, e_acctUuid, e_acctFlags, e_numColumns };
+    int m_columns[e_numColumns];
+    bool m_done;
+
+    static std::string unescape(const std::string& value)
+    {
+        // COPY text format escapes
+        std::string result;
+        result.reserve(value.size());
+        for (size_t i = 0; i < value.size(); ++i) {
+            if (value[i] != '\\' || i + 1 == value.size()) {
+                result.push_back(value[i]);
+                continue;
+            }
+            switch (value[++i]) {
+            case 't': result.push_back('\t'); break;
+            case 'n': result.push_back('\n'); break;
+            case 'r': result.push_back('\r'); break;
+            default: result.push_back(value[i]); break;
+            }
+        }
+        return result;
+    }
+
+    bool find_table()
+    {
+        // eg COPY auth."Accounts" (idx, "Login", "PassHash", "AcctUuid", "AcctFlags", "BillingType") FROM stdin;
+        std::string line;
+        while (read_line(line)) {
+            if (line.compare(0, 5, "COPY ") != 0 || line.find("\"Accounts\"") == std::string::npos)
+                continue;
+
+            size_t begin = line.find('(');
+            size_t end = line.find(')', begin);
+            if (begin == std::string::npos || end == std::string::npos)
+                return false;
+
+            static const char* s_names[] = { "Login", "PassHash", "AcctUuid", "AcctFlags" };
+            std::fill(std::begin(m_columns), std::end(m_columns), -1);
+            int column = 0;
+            size_t pos = begin + 1;
+            while (pos < end) {
+                size_t comma = std::min(line.find(',', pos), end);
+                std::string name = line.substr(pos, comma - pos);
+                name.erase(0, name.find_first_not_of(" \""));
+                name.erase(name.find_last_not_of(" \"") + 1);
+                for (size_t i = 0; i < e_numColumns; ++i) {
+                    if (name == s_names[i])
+                        m_columns[i] = column;
+                }
+                column++;
+                pos = comma + 1;
+            }
+            return std::find(std::begin(m_columns), std::end(m_columns), -1) == std::end(m_columns);
+        }
+        return false;
+    }
+
+public:
+    import_dirtsand_reader_t() : m_done() { }
+
+    bool open(const std::filesystem::path& path, uint64_t offset) override
+    {
+        // The column layout comes from the COPY statement, so always find that first.
+        if (!import_reader::open(path, 0) || !find_table())
+            return false;
+        if (offset > tell())
+            m_stream.seekg((std::streamoff)offset);
+        return m_stream.good();
+    }
+
+    bool next(fus::import_acct_t& acct, ST::string& error) override
+    {
+        std::string line;
+        std::vector<std::string> fields;
+        while (!m_done && read_line(line)) {
+            if (line == "\\.") {
+                m_done = true;
+                break;
+            }
+
+            fields.clear();
+            size_t pos = 0;
+            for (;;) {
+                size_t tab = line.find('\t', pos);
+                fields.push_back(line.substr(pos, tab == std::string::npos ? std::string::npos : tab - pos));
+                if (tab == std::string::npos)
+                    break;
+                pos = tab + 1;
+            }
+
+            auto field = [&](int column) -> std::string {
+                if ((size_t)m_columns[column] >= fields.size() || fields[m_columns[column]] == "\\N")
+                    return std::string();
+                return unescape(fields[m_columns[column]]);
+            };
+
+            std::string login = field(e_login);
+            if (login.empty()) {
+                error = ST::format("line {}: missing Login", m_line);
+                return true;
+            }
+            acct.m_name = ST::string::from_utf8(login.c_str(), login.size());
+            acct.m_pass = ST::string();
+
+            // dirtsand stores the SHA-1 of the password as hex, which is what we store as binary.
+            if (!parse_hex(field(e_passHash), acct.m_hash) || acct.m_hash.empty()) {
+                error = ST::format("line {}: invalid PassHash for '{}'", m_line, acct.m_name);
+                return true;
+            }
+            if (!acct.m_uuid.from_string(field(e_acctUuid).c_str())) {
+                error = ST::format("line {}: invalid AcctUuid for '{}'", m_line, acct.m_name);
+                return true;
+            }
+            if (!parse_flags(field(e_acctFlags), acct.m_flags)) {
+                error = ST::format("line {}: invalid AcctFlags for '{}'", m_line, acct.m_name);
+                return true;
+            }
+            error = ST::string();
+            return true;
+        }
+        return false;
+    }
+};
+
+std::unique_ptr<fus::import_reader> fus::import_dirtsand_reader()
+{
+    return std::make_unique<import_dirtsand_reader_t>();
+}
@@ -0,0 +1,84 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FUS_IMPORT_READER_H
+#define __FUS_IMPORT_READER_H
+
+#include "core/uuid.h"
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string_theory/string>
+#include <vector>
+
+namespace fus
+{
+    struct import_acct_t
+    {
+        ST::string m_name;
+        ST::string m_pass;
+        std::vector<uint8_t> m_hash;
+        fus::uuid m_uuid;
+        uint32_t m_flags;
+    };
+
+    /**
+     * \brief Streams accounts out of a migration source one record at a time.
+     * Readers report their position after each record so that an interrupted import can pick up
+     * where it left off.
+     */
+    class import_reader
+    {
+    protected:
+        std::ifstream m_stream;
+        uint64_t m_size;
+        size_t m_line;
+
+        bool read_line(std::string& line);
+
+    public:
+        import_reader() : m_size(), m_line() { }
+        virtual ~import_reader() = default;
+
+        /** Opens the source and skips to \param offset, as previously reported by tell(). */
+        virtual bool open(const std::filesystem::path& path, uint64_t offset);
+
+        /**
+         * Reads the next account.
+         * \returns false at the end of the input.
+         */
+        virtual bool next(import_acct_t& acct, ST::string& error) = 0;
+
+        uint64_t tell();
+        uint64_t size() const { return m_size; }
+        size_t line() const { return m_line; }
+    };
+
+    /**
+     * Reads `name,password[,flags[,uuid]]` records. Passwords are plaintext and will be hashed by
+     * the importer. Fields may be quoted, with "" as an escaped quote.
+     */
+    std::unique_ptr<import_reader> import_csv_reader(bool header);
+
+    /**
+     * Reads the auth."Accounts" table of a dirtsand pg_dump. The dump already contains password
+     * hashes, so no hashing is needed.
+     */
+    std::unique_ptr<import_reader> import_dirtsand_reader();
+};
+
+#endif
@@ -0,0 +1,307 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include "core/build_info.h"
+#include "daemon/daemon_config.h"
+#include "daemon/sqlite3dbsrv/sqlite3db.h"
+#include <future>
+#include <gflags/gflags.h>
+#include "import_reader.h"
+#include "io/hash.h"
+#include <sqlite3.h>
+#include <string_theory/st_format.h>
+#include <thread>
+
+// =================================================================================
+
+DEFINE_string(config_path, "fus.ini", "Path to fus configuration file");
+DEFINE_string(db_path, "", "Path to the SQLite database (default: [sqlite] path from the configuration)");
+DEFINE_string(format, "csv", "Input format: csv or dirtsand");
+DEFINE_bool(csv_header, false, "The first line of the CSV file is a header");
+DEFINE_uint32(batch_size, 10000, "Number of accounts inserted per transaction");
+DEFINE_uint32(threads, 0, "Number of password hashing threads (default: one per core)");
+DEFINE_bool(resume, true, "Continue an interrupted import of the same file");
+
+// =================================================================================
+
+struct import_shard_t
+{
+    ::sqlite3* m_db;
+    sqlite3_stmt* m_insert;
+};
+
+struct import_batch_t
+{
+    std::vector<fus::import_acct_t> m_accts;
+    uint64_t m_offset;
+};
+
+static void print(const ST::string& str)
+{
+    fputs(str.c_str(), stdout);
+    fflush(stdout);
+}
+
+// =================================================================================
+
+static bool open_shards(const ST::string& path, size_t numShards, std::vector<import_shard_t>& shards)
+{
+    shards.resize(numShards);
+    for (size_t i = 0; i < numShards; ++i) {
+        ST::string shardPath = fus::sqlite3::db_shard_path(path, i, numShards);
+        std::error_code error;
+        std::filesystem::path dir = shardPath.to_path().parent_path();
+        if (!dir.empty())
+            std::filesystem::create_directories(dir, error);
+
+        import_shard_t& shard = shards[i];
+        if (sqlite3_open(shardPath.c_str(), &shard.m_db) != SQLITE_OK) {
+            print(ST::format("Unable to open '{}': {}\n", shardPath, sqlite3_errmsg(shard.m_db)));
+            return false;
+        }
+
+        // Accounts that already exist are skipped, which is what makes resuming safe.
+        sqlite3_busy_timeout(shard.m_db, 5000);
+        if (sqlite3_exec(shard.m_db, fus::sqlite3::db_schema(), nullptr, nullptr, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(shard.m_db, "INSERT OR IGNORE INTO Accounts (Name, Hash, Uuid, Flags) VALUES (?, ?, ?, ?);",
+                               -1, &shard.m_insert, nullptr) != SQLITE_OK) {
+            print(ST::format("Unable to initialize '{}': {}\n", shardPath, sqlite3_errmsg(shard.m_db)));
+            return false;
+        }
+    }
+    return true;
+}
+
+static void close_shards(std::vector<import_shard_t>& shards)
+{
+    for (import_shard_t& shard : shards) {
+        sqlite3_finalize(shard.m_insert);
+        sqlite3_close(shard.m_db);
+    }
+    shards.clear();
+}
+
+// =================================================================================
+
+static void hash_batch(import_batch_t* batch, size_t numThreads)
+{
+    // Each thread takes an interleaved slice of the batch with its own hash context.
+    auto proc = [batch, numThreads](size_t first) {
+        fus::hash hash(fus::hash_type::e_sha1);
+        for (size_t i = first; i < batch->m_accts.size(); i += numThreads) {
+            fus::import_acct_t& acct = batch->m_accts[i];
+            if (!acct.m_hash.empty())
+                continue;
+            acct.m_hash.resize(hash.digestsz());
+            hash.hash_account(acct.m_name, acct.m_pass, acct.m_hash.data(), acct.m_hash.size());
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads - 1);
+    for (size_t i = 1; i < numThreads; ++i)
+        threads.emplace_back(proc, i);
+    proc(0);
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+static bool insert_batch(std::vector<import_shard_t>& shards, const import_batch_t& batch,
+                         size_t& imported, size_t& skipped)
+{
+    for (import_shard_t& shard : shards)
+        sqlite3_exec(shard.m_db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
+
+    bool result = true;
+    for (const fus::import_acct_t& acct : batch.m_accts) {
+        import_shard_t& shard = shards[fus::sqlite3::db_shard_index(std::string_view(acct.m_name.c_str(), acct.m_name.size()),
+                                                                    shards.size())];
+        sqlite3_bind_text(shard.m_insert, 1, acct.m_name.c_str(), acct.m_name.size(), SQLITE_STATIC);
+        sqlite3_bind_blob(shard.m_insert, 2, acct.m_hash.data(), acct.m_hash.size(), SQLITE_STATIC);
+        sqlite3_bind_blob(shard.m_insert, 3, acct.m_uuid.data(), sizeof(fus::uuid), SQLITE_STATIC);
+        sqlite3_bind_int(shard.m_insert, 4, (int)acct.m_flags);
+        if (sqlite3_step(shard.m_insert) != SQLITE_DONE) {
+            print(ST::format("Insert of '{}' failed: {}\n", acct.m_name, sqlite3_errmsg(shard.m_db)));
+            result = false;
+        } else if (sqlite3_changes(shard.m_db) == 0) {
+            skipped++;
+        } else {
+            imported++;
+        }
+        sqlite3_reset(shard.m_insert);
+        if (!result)
+            break;
+    }
+
+    for (import_shard_t& shard : shards) {
+        const char* sql = result ? "COMMIT TRANSACTION;" : "ROLLBACK TRANSACTION;";
+        if (sqlite3_exec(shard.m_db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            print(ST::format("Commit failed: {}\n", sqlite3_errmsg(shard.m_db)));
+            result = false;
+        }
+    }
+    return result;
+}
+
+// =================================================================================
+
+static bool read_batch(fus::import_reader* reader, import_batch_t& batch, size_t& invalid)
+{
+    batch.m_accts.clear();
+    batch.m_accts.reserve(FLAGS_batch_size);
+
+    fus::import_acct_t acct;
+    ST::string error;
+    while (batch.m_accts.size() < FLAGS_batch_size && reader->next(acct, error)) {
+        if (!error.empty()) {
+            print(ST::format("Skipping invalid record: {}\n", error));
+            invalid++;
+            continue;
+        }
+        batch.m_accts.push_back(std::move(acct));
+    }
+    batch.m_offset = reader->tell();
+    return !batch.m_accts.empty();
+}
+
+static uint64_t load_progress(const std::filesystem::path& path)
+{
+    uint64_t offset = 0;
+    FILE* fp = fopen(path.u8string().c_str(), "r");
+    if (fp) {
+        unsigned long long value;
+        if (fscanf(fp, "%llu", &value) == 1)
+            offset = (uint64_t)value;
+        fclose(fp);
+    }
+    return offset;
+}
+
+static void save_progress(const std::filesystem::path& path, uint64_t offset)
+{
+    // Write then rename so that a crash never leaves a torn progress file behind.
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+    FILE* fp = fopen(temp.u8string().c_str(), "w");
+    if (!fp)
+        return;
+    fprintf(fp, "%llu\n", (unsigned long long)offset);
+    fclose(fp);
+
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+}
+
+// =================================================================================
+
+int main(int argc, char* argv[])
+{
+    gflags::SetVersionString(fus::build_version());
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc != 2) {
+        print("Usage: fus_import [options] <accounts file>\n"
+              "Bulk imports accounts into the SQLite database. The server must not be running.\n"
+              "Run with --help for a list of options.\n");
+        return 1;
+    }
+    std::filesystem::path input = argv[1];
+
+    fus::config_parser config(fus::daemon_config);
+    config.read(FLAGS_config_path);
+    ST::string dbPath = FLAGS_db_path.empty() ? config.get<const ST::string&>("sqlite", "path")
+                                              : ST::string::from_std_string(FLAGS_db_path);
+    size_t numShards = std::max(1U, config.get<unsigned int>("sqlite", "shards"));
+    size_t numThreads = FLAGS_threads ? FLAGS_threads : std::max(1U, std::thread::hardware_concurrency());
+    FLAGS_batch_size = std::max(1U, FLAGS_batch_size);
+
+    std::unique_ptr<fus::import_reader> reader;
+    if (FLAGS_format == "csv") {
+        reader = fus::import_csv_reader(FLAGS_csv_header);
+    } else if (FLAGS_format == "dirtsand") {
+        reader = fus::import_dirtsand_reader();
+    } else {
+        print(ST::format("Unknown input format '{}'\n", FLAGS_format));
+        return 1;
+    }
+
+    std::filesystem::path progressPath = input;
+    progressPath += ".progress";
+    uint64_t offset = FLAGS_resume ? load_progress(progressPath) : 0;
+    if (!reader->open(input, offset)) {
+        print(ST::format("Unable to read '{}'\n", input));
+        return 1;
+    }
+    if (offset != 0)
+        print(ST::format("Resuming '{}' at byte {} of {}\n", input, offset, reader->size()));
+
+    std::vector<import_shard_t> shards;
+    if (!open_shards(dbPath, numShards, shards)) {
+        close_shards(shards);
+        return 1;
+    }
+    print(ST::format("Importing '{}' into {} shard(s) with {} hashing thread(s)\n", input, numShards, numThreads));
+
+    // While one batch is being inserted, the next is read and hashed in the background.
+    size_t imported = 0, skipped = 0, invalid = 0;
+    bool success = true;
+    auto start = std::chrono::steady_clock::now();
+
+    import_batch_t current, next;
+    bool haveCurrent = read_batch(reader.get(), current, invalid);
+    if (haveCurrent)
+        hash_batch(&current, numThreads);
+
+    while (haveCurrent) {
+        std::future<bool> pending = std::async(std::launch::async, [&]() {
+            bool haveNext = read_batch(reader.get(), next, invalid);
+            if (haveNext)
+                hash_batch(&next, numThreads);
+            return haveNext;
+        });
+
+        success = insert_batch(shards, current, imported, skipped);
+        bool haveNext = pending.get();
+        if (!success)
+            break;
+        save_progress(progressPath, current.m_offset);
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        print(ST::format("\r{} imported, {} already existed, {} invalid -- {.0f} accounts/sec   ",
+                         imported, skipped, invalid, (imported + skipped) / std::max(elapsed, 0.001)));
+
+        std::swap(current, next);
+        haveCurrent = haveNext;
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    print(ST::format("\n{} in {.1f} seconds: {} imported, {} already existed, {} invalid ({.0f} accounts/sec)\n",
+                     success ? "Import complete" : "Import FAILED", elapsed, imported, skipped, invalid,
+                     (imported + skipped) / std::max(elapsed, 0.001)));
+    close_shards(shards);
+
+    if (success) {
+        std::error_code error;
+        std::filesystem::remove(progressPath, error);
+
+        // The account name filter is only built when the db daemon starts, which is also why the
+        // server has to be stopped while importing.
+        if (imported != 0)
+            print("The new accounts will be available once the server is started.\n");
+    }
+    return success ? 0 : 1;
+}
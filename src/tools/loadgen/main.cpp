@@ -0,0 +1,599 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include "client/admin_client.h"
+#include "client/auth_client.h"
+#include "core/build_info.h"
+#include "daemon/daemon_config.h"
+#include <gflags/gflags.h>
+#include "io/hash.h"
+#include "io/io.h"
+#include <memory>
+#include "protocol/admin.h"
+#include "protocol/auth.h"
+#include "protocol/common.h"
+#include <string_theory/st_format.h>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#   include <sys/resource.h>
+#endif
+
+// =================================================================================
+
+DEFINE_string(config_path, "fus.ini", "Path to the fus configuration file of the server under test");
+DEFINE_string(server, "", "Address of the server (default: [lobby] bindaddr from the configuration)");
+DEFINE_uint32(port, 0, "Port of the server (default: [lobby] port from the configuration)");
+DEFINE_string(scenario, "ping", "What each connection does: connect (handshake, then hang up), login (register "
+                                "and log in, then hang up), ping (ping as fast as possible), or create (create "
+                                "accounts over admin connections)");
+DEFINE_uint32(connections, 1000, "Number of concurrent connections");
+DEFINE_uint32(threads, 0, "Number of client loops, each on its own thread (default: one per core)");
+DEFINE_uint32(duration, 30, "Seconds to run for");
+DEFINE_uint32(ramp, 1000, "New connections opened per second while ramping up (0: all at once)");
+DEFINE_uint32(accounts, 0, "Number of accounts used by the login and create scenarios (default: one per connection)");
+DEFINE_string(account_prefix, "loadgen", "Prefix of the account names used by the login and create scenarios");
+DEFINE_string(password, "loadgen", "Password of the accounts used by the login and create scenarios");
+
+// =================================================================================
+
+enum class loadgen_scenario
+{
+    e_connect,
+    e_login,
+    e_ping,
+    e_create,
+};
+
+enum
+{
+    e_opConnect,
+    e_opRegister,
+    e_opLogin,
+    e_opPing,
+    e_opCreate,
+
+    e_numOps
+};
+
+static const char* s_opNames[] = {
+    "connect",
+    "register",
+    "login",
+    "ping",
+    "create",
+};
+static_assert(std::size(s_opNames) == e_numOps);
+
+struct loadgen_stats_t
+{
+    std::vector<uint64_t> m_latencies;
+    uint64_t m_errors;
+};
+
+struct loadgen_worker_t;
+
+/**
+ * One simulated user. The client behind it is thrown away whenever the connection closes, and
+ * a fresh one is opened in its place until the run is over.
+ */
+struct loadgen_conn_t
+{
+    loadgen_worker_t* m_worker;
+    fus::client_t* m_client;
+    uint64_t m_opStart;
+    ST::string m_name;
+    uint8_t m_acctHash[20];
+    bool m_ready;
+    bool m_finished;
+};
+
+struct loadgen_worker_t
+{
+    uv_loop_t m_loop;
+    uv_timer_t m_tickTimer;
+    uv_timer_t m_stopTimer;
+    std::thread m_thread;
+    std::vector<loadgen_conn_t> m_conns;
+    fus::hash m_hash;
+
+    uint64_t m_startTime;
+    uint32_t m_rampRate;
+    size_t m_live;
+    size_t m_ready;
+    size_t m_readyAtEnd;
+    bool m_stopping;
+
+    loadgen_stats_t m_stats[e_numOps];
+
+    loadgen_worker_t() : m_hash(fus::hash_type::e_sha1) { }
+};
+
+static loadgen_scenario s_scenario;
+static sockaddr_storage s_addr;
+static std::vector<uint8_t> s_header;
+static uint32_t s_buildId;
+static uint32_t s_cryptG;
+static ST::string s_cryptN;
+static ST::string s_cryptX;
+static ST::string s_password;
+static std::atomic<uint32_t> s_nextAccount{ 0 };
+
+// =================================================================================
+
+static void print(const ST::string& str)
+{
+    fputs(str.c_str(), stdout);
+    fflush(stdout);
+}
+
+static inline loadgen_conn_t* loadgen_conn(fus::client_t* client)
+{
+    return (loadgen_conn_t*)uv_handle_get_data((uv_handle_t*)client);
+}
+
+static inline void loadgen_record(loadgen_conn_t* conn, size_t op, bool success)
+{
+    loadgen_stats_t& stats = conn->m_worker->m_stats[op];
+    if (success)
+        stats.m_latencies.push_back((uv_hrtime() - conn->m_opStart) / 1000);
+    else
+        stats.m_errors++;
+}
+
+static void loadgen_hangup(loadgen_conn_t* conn)
+{
+    if (fus::tcp_stream_connected(conn->m_client) && !fus::tcp_stream_closing(conn->m_client))
+        fus::tcp_stream_shutdown(conn->m_client);
+}
+
+// =================================================================================
+
+static void loadgen_open(loadgen_conn_t* conn);
+
+static void loadgen_closed(uv_handle_t* handle)
+{
+    auto conn = (loadgen_conn_t*)uv_handle_get_data(handle);
+    loadgen_worker_t* worker = conn->m_worker;
+    bool wasReady = conn->m_ready;
+    conn->m_client = nullptr;
+    conn->m_ready = false;
+    worker->m_live--;
+    if (wasReady)
+        worker->m_ready--;
+
+    // Hanging up is part of the connect and login scenarios, so go right back for more. Anything
+    // else that drops is picked up again by the next tick, so a refusing server isn't hammered.
+    if (!worker->m_stopping && !conn->m_finished && wasReady &&
+        (s_scenario == loadgen_scenario::e_connect || s_scenario == loadgen_scenario::e_login))
+        loadgen_open(conn);
+
+    if (worker->m_stopping && worker->m_live == 0) {
+        uv_close((uv_handle_t*)&worker->m_tickTimer, nullptr);
+        uv_close((uv_handle_t*)&worker->m_stopTimer, nullptr);
+    }
+}
+
+static void loadgen_connect_failed(uv_handle_t* handle)
+{
+    // The stream never connected, so nothing else is going to free it.
+    auto stream = (fus::tcp_stream_t*)handle;
+    loadgen_closed(handle);
+    if (stream->m_freecb)
+        stream->m_freecb(stream);
+    fus::tcp_stream_free(stream);
+}
+
+static void loadgen_connected(fus::client_t* client, ssize_t status)
+{
+    loadgen_conn_t* conn = loadgen_conn(client);
+    loadgen_record(conn, e_opConnect, status >= 0);
+    if (status < 0 && !fus::tcp_stream_connected(client))
+        uv_close((uv_handle_t*)client, loadgen_connect_failed);
+}
+
+// =================================================================================
+
+static void loadgen_logged_in(void* instance, fus::client_t*, uint32_t, fus::net_error result, ssize_t, const void* msg)
+{
+    auto conn = (loadgen_conn_t*)instance;
+    if (!msg)
+        return;
+    loadgen_record(conn, e_opLogin, result == fus::net_error::e_success);
+    loadgen_hangup(conn);
+}
+
+static void loadgen_registered(fus::auth_client_t* client, uint32_t srvChallenge)
+{
+    loadgen_conn_t* conn = loadgen_conn(client);
+    loadgen_record(conn, e_opRegister, true);
+
+    uint32_t cliChallenge = (uint32_t)uv_hrtime();
+    fus::protocol::auth_acctLoginRequest msg;
+    msg.set_type(msg.id());
+    msg.set_challenge(cliChallenge);
+    msg.set_name(conn->m_name);
+    conn->m_worker->m_hash.hash_login(conn->m_acctHash, sizeof(conn->m_acctHash), cliChallenge, srvChallenge,
+                                      msg.get_hash(), msg.get_hashsz());
+    msg.set_token(ST::string());
+    msg.set_os(ST_LITERAL("win"));
+    fus::client_prep_trans(client, msg, conn, 0, loadgen_logged_in);
+    conn->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(client, msg);
+}
+
+static void loadgen_register(loadgen_conn_t* conn)
+{
+    fus::protocol::auth_clientRegisterRequest msg;
+    msg.set_type(msg.id());
+    msg.set_buildId(s_buildId);
+    conn->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(conn->m_client, msg);
+}
+
+// =================================================================================
+
+static void loadgen_ping(loadgen_conn_t* conn);
+
+static void loadgen_pinged(void* instance, fus::client_t*, uint32_t, fus::net_error result, ssize_t, const void* msg)
+{
+    auto conn = (loadgen_conn_t*)instance;
+    if (!msg)
+        return;
+    loadgen_record(conn, e_opPing, result == fus::net_error::e_success);
+    if (conn->m_worker->m_stopping)
+        loadgen_hangup(conn);
+    else
+        loadgen_ping(conn);
+}
+
+static void loadgen_ping(loadgen_conn_t* conn)
+{
+    fus::protocol::auth_pingRequest msg;
+    msg.set_type(msg.id());
+    msg.set_pingTime((uint32_t)uv_now(&conn->m_worker->m_loop));
+    msg.set_payloadsz(0);
+    fus::client_prep_trans(conn->m_client, msg, conn, 0, loadgen_pinged);
+    conn->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(conn->m_client, msg);
+}
+
+// =================================================================================
+
+static void loadgen_create(loadgen_conn_t* conn);
+
+static void loadgen_created(void* instance, fus::client_t*, uint32_t, fus::net_error result, ssize_t, const void* msg)
+{
+    auto conn = (loadgen_conn_t*)instance;
+    if (!msg)
+        return;
+    loadgen_record(conn, e_opCreate, result == fus::net_error::e_success);
+    if (conn->m_worker->m_stopping)
+        loadgen_hangup(conn);
+    else
+        loadgen_create(conn);
+}
+
+static void loadgen_create(loadgen_conn_t* conn)
+{
+    uint32_t account = s_nextAccount++;
+    if (account >= FLAGS_accounts) {
+        conn->m_finished = true;
+        loadgen_hangup(conn);
+        return;
+    }
+
+    fus::protocol::admin_acctCreateRequest msg;
+    msg.set_type(msg.id());
+    msg.set_name(ST::format("{}{}", FLAGS_account_prefix, account));
+    msg.set_pass(s_password);
+    msg.set_flags(0);
+    fus::client_prep_trans(conn->m_client, msg, conn, 0, loadgen_created);
+    conn->m_opStart = uv_hrtime();
+    fus::tcp_stream_write_msg(conn->m_client, msg);
+}
+
+// =================================================================================
+
+static void loadgen_ready(fus::client_t* client)
+{
+    loadgen_conn_t* conn = loadgen_conn(client);
+    conn->m_ready = true;
+    conn->m_worker->m_ready++;
+    if (conn->m_worker->m_stopping) {
+        loadgen_hangup(conn);
+        return;
+    }
+
+    switch (s_scenario) {
+    case loadgen_scenario::e_connect:
+        fus::auth_client_read((fus::auth_client_t*)client);
+        loadgen_hangup(conn);
+        break;
+    case loadgen_scenario::e_login:
+        fus::auth_client_read((fus::auth_client_t*)client);
+        loadgen_register(conn);
+        break;
+    case loadgen_scenario::e_ping:
+        fus::auth_client_read((fus::auth_client_t*)client);
+        loadgen_ping(conn);
+        break;
+    case loadgen_scenario::e_create:
+        fus::admin_client_read((fus::admin_client_t*)client);
+        loadgen_create(conn);
+        break;
+    }
+}
+
+static void loadgen_open(loadgen_conn_t* conn)
+{
+    loadgen_worker_t* worker = conn->m_worker;
+    std::vector<uint8_t> header = s_header;
+
+    if (s_scenario == loadgen_scenario::e_create) {
+        auto client = (fus::admin_client_t*)malloc(sizeof(fus::admin_client_t));
+        fus::admin_client_init(client, &worker->m_loop);
+        conn->m_client = client;
+    } else {
+        auto client = (fus::auth_client_t*)malloc(sizeof(fus::auth_client_t));
+        fus::auth_client_init(client, &worker->m_loop);
+        fus::auth_client_register_handler(client, loadgen_registered);
+        conn->m_client = client;
+    }
+    uv_handle_set_data((uv_handle_t*)conn->m_client, conn);
+    conn->m_client->m_proc = loadgen_ready;
+    fus::tcp_stream_close_cb(conn->m_client, loadgen_closed);
+    fus::tcp_stream_free_on_close(conn->m_client, true);
+    worker->m_live++;
+
+    conn->m_opStart = uv_hrtime();
+    if (s_scenario == loadgen_scenario::e_create)
+        fus::admin_client_connect((fus::admin_client_t*)conn->m_client, (const sockaddr*)&s_addr, header.data(),
+                                  header.size(), s_cryptG, s_cryptN, s_cryptX, loadgen_connected);
+    else
+        fus::auth_client_connect((fus::auth_client_t*)conn->m_client, (const sockaddr*)&s_addr, header.data(),
+                                 header.size(), s_cryptG, s_cryptN, s_cryptX, loadgen_connected);
+}
+
+// =================================================================================
+
+static void loadgen_stop(uv_timer_t* timer)
+{
+    auto worker = (loadgen_worker_t*)uv_handle_get_data((uv_handle_t*)timer);
+    if (worker->m_stopping) {
+        // Stragglers had their chance.
+        uv_stop(&worker->m_loop);
+        return;
+    }
+
+    worker->m_stopping = true;
+    worker->m_readyAtEnd = worker->m_ready;
+    for (loadgen_conn_t& conn : worker->m_conns) {
+        if (conn.m_client)
+            loadgen_hangup(&conn);
+    }
+
+    if (worker->m_live == 0) {
+        uv_close((uv_handle_t*)&worker->m_tickTimer, nullptr);
+        uv_close((uv_handle_t*)&worker->m_stopTimer, nullptr);
+    } else {
+        uv_timer_start(timer, loadgen_stop, 5000, 0);
+    }
+}
+
+static void loadgen_tick(uv_timer_t* timer)
+{
+    auto worker = (loadgen_worker_t*)uv_handle_get_data((uv_handle_t*)timer);
+    if (worker->m_stopping)
+        return;
+
+    size_t target = worker->m_conns.size();
+    if (worker->m_rampRate) {
+        uint64_t elapsed = uv_now(&worker->m_loop) - worker->m_startTime;
+        target = std::min(target, (size_t)((elapsed * worker->m_rampRate) / 1000 + 1));
+    }
+
+    bool finished = true;
+    for (size_t i = 0; i < worker->m_conns.size(); ++i) {
+        loadgen_conn_t& conn = worker->m_conns[i];
+        if (i < target && !conn.m_client && !conn.m_finished)
+            loadgen_open(&conn);
+        finished &= conn.m_finished;
+    }
+
+    // The create scenario ends early once every account has been made.
+    if (finished && worker->m_live == 0)
+        loadgen_stop(&worker->m_stopTimer);
+}
+
+static void loadgen_run(loadgen_worker_t* worker)
+{
+    uv_run(&worker->m_loop, UV_RUN_DEFAULT);
+}
+
+// =================================================================================
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double pct)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(pct * (double)sorted.size()));
+    return sorted[idx];
+}
+
+static void raise_fd_limit(size_t connections)
+{
+#ifndef _WIN32
+    // Tens of thousands of sockets need far more descriptors than the usual soft limit.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur < connections + 64)
+        print(ST::format("Warning: only {} file descriptors are available\n", (uint64_t)limit.rlim_cur));
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+    gflags::SetVersionString(fus::build_version());
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc != 1) {
+        print("Usage: fus_loadgen [options]\n"
+              "Opens many simultaneous client connections to a fus server and reports its throughput and latency.\n"
+              "Run with --help for a list of options.\n");
+        return 1;
+    }
+
+    const char* cryptName;
+    if (FLAGS_scenario == "connect") {
+        s_scenario = loadgen_scenario::e_connect;
+        cryptName = "auth";
+    } else if (FLAGS_scenario == "login") {
+        s_scenario = loadgen_scenario::e_login;
+        cryptName = "auth";
+    } else if (FLAGS_scenario == "ping") {
+        s_scenario = loadgen_scenario::e_ping;
+        cryptName = "auth";
+    } else if (FLAGS_scenario == "create") {
+        s_scenario = loadgen_scenario::e_create;
+        cryptName = "admin";
+    } else {
+        print(ST::format("Unknown scenario '{}'\n", FLAGS_scenario));
+        return 1;
+    }
+
+    fus::config_parser config(fus::daemon_config);
+    config.read(FLAGS_config_path);
+    ST::string server = FLAGS_server.empty() ? config.get<const ST::string&>("lobby", "bindaddr")
+                                             : ST::string(FLAGS_server);
+    uint16_t port = FLAGS_port ? (uint16_t)FLAGS_port : (uint16_t)config.get<unsigned int>("lobby", "port");
+    if (!fus::str2addr(server.c_str(), port, &s_addr)) {
+        print(ST::format("Invalid server address '{}'\n", server));
+        return 1;
+    }
+
+    s_cryptN = config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_n", cryptName));
+    s_cryptX = config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_x", cryptName));
+    s_cryptG = config.get<unsigned int>(ST_LITERAL("crypt"), ST::format("{}_g", cryptName));
+    if (s_cryptN.empty() || s_cryptX.empty()) {
+        print(ST::format("The {} keys are missing from '{}'\n", cryptName, FLAGS_config_path));
+        return 1;
+    }
+
+    s_password = ST::string::from_std_string(FLAGS_password);
+    s_buildId = config.get<unsigned int>("client", "buildId");
+    s_header.resize(fus::auth_client_header_size());
+    auto header = (fus::protocol::common_connection_header*)s_header.data();
+    header->set_msgsz(sizeof(fus::protocol::common_connection_header) - 4); // does not include the buf field
+    header->set_buildId(s_buildId);
+    header->set_buildType(config.get<unsigned int>("client", "buildType"));
+    header->set_branchId(config.get<unsigned int>("client", "branchId"));
+    header->get_product()->from_string(config.get<const char*>("client", "product"));
+    header->set_bufsz(0);
+
+    size_t numConns = std::max(1U, FLAGS_connections);
+    size_t numThreads = FLAGS_threads ? FLAGS_threads : std::max(1U, std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads, numConns);
+    if (FLAGS_accounts == 0)
+        FLAGS_accounts = (uint32_t)numConns;
+    raise_fd_limit(numConns);
+    fus::io_init();
+
+    // Connections are dealt out round robin, so every loop gets its share of each account range.
+    std::vector<std::unique_ptr<loadgen_worker_t>> workers;
+    for (size_t i = 0; i < numThreads; ++i) {
+        workers.emplace_back(std::make_unique<loadgen_worker_t>());
+        loadgen_worker_t* worker = workers.back().get();
+        worker->m_conns.resize(numConns / numThreads + (i < numConns % numThreads ? 1 : 0));
+        worker->m_rampRate = FLAGS_ramp ? std::max(1U, FLAGS_ramp / (uint32_t)numThreads) : 0;
+        worker->m_live = 0;
+        worker->m_ready = 0;
+        worker->m_readyAtEnd = 0;
+        worker->m_stopping = false;
+        for (loadgen_stats_t& stats : worker->m_stats)
+            stats.m_errors = 0;
+    }
+
+    for (size_t i = 0; i < numConns; ++i) {
+        loadgen_worker_t* worker = workers[i % numThreads].get();
+        loadgen_conn_t& conn = worker->m_conns[i / numThreads];
+        conn.m_worker = worker;
+        conn.m_client = nullptr;
+        conn.m_opStart = 0;
+        conn.m_ready = false;
+        conn.m_finished = false;
+        if (s_scenario == loadgen_scenario::e_login) {
+            conn.m_name = ST::format("{}{}", FLAGS_account_prefix, i % FLAGS_accounts);
+            worker->m_hash.hash_account(conn.m_name, s_password, conn.m_acctHash, sizeof(conn.m_acctHash));
+        }
+    }
+
+    print(ST::format("Running the {} scenario with {} connections on {} threads against {}/{} for {} s...\n",
+                     FLAGS_scenario, numConns, numThreads, server, port, FLAGS_duration));
+    uint64_t start = uv_hrtime();
+    for (std::unique_ptr<loadgen_worker_t>& worker : workers) {
+        uv_loop_init(&worker->m_loop);
+        worker->m_startTime = uv_now(&worker->m_loop);
+        uv_timer_init(&worker->m_loop, &worker->m_tickTimer);
+        uv_timer_init(&worker->m_loop, &worker->m_stopTimer);
+        uv_handle_set_data((uv_handle_t*)&worker->m_tickTimer, worker.get());
+        uv_handle_set_data((uv_handle_t*)&worker->m_stopTimer, worker.get());
+        uv_timer_start(&worker->m_tickTimer, loadgen_tick, 0, 10);
+        uv_timer_start(&worker->m_stopTimer, loadgen_stop, (uint64_t)FLAGS_duration * 1000, 0);
+        worker->m_thread = std::thread(loadgen_run, worker.get());
+    }
+
+    loadgen_stats_t totals[e_numOps];
+    size_t readyAtEnd = 0;
+    for (loadgen_stats_t& stats : totals)
+        stats.m_errors = 0;
+    for (std::unique_ptr<loadgen_worker_t>& worker : workers) {
+        worker->m_thread.join();
+        uv_loop_close(&worker->m_loop);
+        readyAtEnd += worker->m_readyAtEnd;
+        for (size_t op = 0; op < e_numOps; ++op) {
+            const loadgen_stats_t& stats = worker->m_stats[op];
+            totals[op].m_latencies.insert(totals[op].m_latencies.end(), stats.m_latencies.begin(),
+                                          stats.m_latencies.end());
+            totals[op].m_errors += stats.m_errors;
+        }
+    }
+    double elapsed = (double)(uv_hrtime() - start) / 1000000000.0;
+    double duration = std::min(elapsed, (double)FLAGS_duration);
+    fus::io_close();
+
+    print(ST::format("Connected: {} of {} at the end of the run\n", readyAtEnd, numConns));
+    for (size_t op = 0; op < e_numOps; ++op) {
+        std::vector<uint64_t>& latencies = totals[op].m_latencies;
+        if (latencies.empty() && totals[op].m_errors == 0)
+            continue;
+        std::sort(latencies.begin(), latencies.end());
+        print(ST::format("{<9} {} ok, {} failed, {.1f}/s; p50 {} us, p90 {} us, p99 {} us, p99.9 {} us, max {} us\n",
+                         ST::format("{}:", s_opNames[op]), latencies.size(), totals[op].m_errors,
+                         duration > 0.0 ? (double)latencies.size() / duration : 0.0,
+                         percentile(latencies, 0.50), percentile(latencies, 0.90),
+                         percentile(latencies, 0.99), percentile(latencies, 0.999),
+                         latencies.empty() ? 0 : latencies.back()));
+    }
+    return 0;
+}
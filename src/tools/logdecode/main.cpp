@@ -0,0 +1,181 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core/build_info.h"
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <gflags/gflags.h>
+#include "io/log_record.h"
+#include <iterator>
+#include <string_theory/st_format.h>
+#include <unordered_map>
+#include <vector>
+
+// =================================================================================
+
+DEFINE_bool(show_source, false, "Print the source file and line that logged each message");
+
+// =================================================================================
+
+struct decode_format_t
+{
+    ST::string m_file;
+    uint32_t m_line;
+    std::string m_format;
+};
+
+static void print(const ST::string& str)
+{
+    fputs(str.c_str(), stdout);
+}
+
+template<typename _Value>
+static bool read_value(const uint8_t*& ptr, const uint8_t* end, _Value& value)
+{
+    if ((size_t)(end - ptr) < sizeof(value))
+        return false;
+    memcpy(&value, ptr, sizeof(value));
+    ptr += sizeof(value);
+    return true;
+}
+
+static bool read_string(const uint8_t*& ptr, const uint8_t* end, std::string& value)
+{
+    uint32_t size;
+    if (!read_value(ptr, end, size) || (size_t)(end - ptr) < size)
+        return false;
+    value.assign((const char*)ptr, size);
+    ptr += size;
+    return true;
+}
+
+static ST::string format_time(int64_t timest)
+{
+    time_t time = (time_t)timest;
+    tm result;
+#ifdef _WIN32
+    gmtime_s(&result, &time);
+#else
+    gmtime_r(&time, &result);
+#endif
+    char buf[32];
+    size_t bufsz = strftime(buf, sizeof(buf), "[%Y-%m-%d %H:%M:%S] ", &result);
+    return ST::string::from_utf8(buf, bufsz);
+}
+
+// =================================================================================
+
+static bool decode_file(const char* path)
+{
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    if (!stream.is_open()) {
+        print(ST::format("Unable to open '{}'\n", path));
+        return false;
+    }
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+    const uint8_t* ptr = buf.data();
+    const uint8_t* end = buf.data() + buf.size();
+    if (buf.size() < sizeof(fus::log_binary_magic) ||
+        memcmp(ptr, fus::log_binary_magic, sizeof(fus::log_binary_magic)) != 0) {
+        print(ST::format("'{}' is not a binary fus log\n", path));
+        return false;
+    }
+    ptr += sizeof(fus::log_binary_magic);
+
+    std::unordered_map<uint32_t, decode_format_t> formats;
+    while (ptr != end) {
+        fus::log_entry_t entry;
+        if (!read_value(ptr, end, entry) || (size_t)(end - ptr) < entry.m_size) {
+            // The server was probably killed mid-write. Everything up to here is still good.
+            print(ST::format("'{}' is truncated\n", path));
+            return false;
+        }
+        const uint8_t* body = ptr;
+        const uint8_t* bodyEnd = ptr + entry.m_size;
+        ptr = bodyEnd;
+
+        switch ((fus::log_entry_type)entry.m_type) {
+        case fus::log_entry_type::e_format:
+            {
+                uint32_t id;
+                decode_format_t format;
+                std::string file;
+                if (!read_value(body, bodyEnd, id) || !read_value(body, bodyEnd, format.m_line) ||
+                    !read_string(body, bodyEnd, file) || !read_string(body, bodyEnd, format.m_format)) {
+                    print(ST::format("'{}' has a corrupt format entry\n", path));
+                    return false;
+                }
+                format.m_file = ST::string::from_std_string(file);
+                formats[id] = std::move(format);
+            }
+            break;
+        case fus::log_entry_type::e_record:
+            {
+                int64_t time;
+                uint32_t id;
+                if (!read_value(body, bodyEnd, time) || !read_value(body, bodyEnd, id)) {
+                    print(ST::format("'{}' has a corrupt record entry\n", path));
+                    return false;
+                }
+
+                auto it = formats.find(id);
+                if (it == formats.end()) {
+                    print(ST::format("{}*** unknown format {} ***\n", format_time(time), id));
+                    break;
+                }
+
+                const decode_format_t& format = it->second;
+                ST::string msg = fus::log_format_args(format.m_format.c_str(), body, bodyEnd - body);
+                if (FLAGS_show_source)
+                    print(ST::format("{}{} ({}:{})\n", format_time(time), msg, format.m_file, format.m_line));
+                else
+                    print(ST::format("{}{}\n", format_time(time), msg));
+            }
+            break;
+        case fus::log_entry_type::e_text:
+            // Already formatted, complete with timestamp and newline.
+            fwrite(body, 1, bodyEnd - body, stdout);
+            break;
+        default:
+            // Unknown entries are sized, so they can simply be skipped.
+            break;
+        }
+    }
+    return true;
+}
+
+// =================================================================================
+
+int main(int argc, char* argv[])
+{
+    gflags::SetVersionString(fus::build_version());
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc < 2) {
+        print("Usage: fus_logdecode [options] <log.blog> [...]\n"
+              "Prints binary fus logs as text.\n"
+              "Run with --help for a list of options.\n");
+        return 1;
+    }
+
+    int result = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!decode_file(argv[i]))
+            result = 1;
+    }
+    return result;
+}
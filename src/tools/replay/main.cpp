@@ -0,0 +1,373 @@
+/*   This file is part of fus.
+ *
+ *   fus is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   fus is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with fus.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include "client/client_base.h"
+#include "core/build_info.h"
+#include "daemon/daemon_config.h"
+#include <gflags/gflags.h>
+#include "io/capture.h"
+#include "io/io.h"
+#include <new>
+#include "protocol/common.h"
+#include <string_theory/st_format.h>
+#include <vector>
+
+// =================================================================================
+
+DEFINE_string(config_path, "fus.ini", "Path to the fus configuration file of the server being replayed against");
+DEFINE_string(server, "", "Address of the server (default: [lobby] bindaddr from the configuration)");
+DEFINE_uint32(port, 0, "Port of the server (default: [lobby] port from the configuration)");
+DEFINE_double(speed, 1.0, "Replay speed as a multiple of the captured pace. 0 sends each message as soon as the "
+                          "replies to the previous one have arrived");
+DEFINE_uint32(copies, 1, "Number of concurrent copies of each captured session to replay");
+DEFINE_uint32(timeout, 10, "Seconds to wait for an expected reply before giving up on a session");
+
+// =================================================================================
+
+/** A captured session split into what to send, when, and what should come back. */
+struct replay_plan_t
+{
+    const fus::capture_session_t* m_session;
+    std::vector<const fus::capture_message_t*> m_sends;
+    std::vector<uint64_t> m_sendAt;
+    std::vector<const fus::capture_message_t*> m_replies;
+
+    /** Index of the send each reply follows, or SIZE_MAX for anything sent before the first. */
+    std::vector<size_t> m_replyTo;
+
+    /** Number of replies the server sends by the time it has handled each send. */
+    std::vector<size_t> m_repliesAfter;
+    size_t m_repliesBefore;
+};
+
+struct replay_conn_t
+{
+    fus::client_t m_client;
+    uv_timer_t m_sendTimer;
+    uv_timer_t m_idleTimer;
+    const replay_plan_t* m_plan;
+    uint64_t m_started;
+    size_t m_nextSend;
+    size_t m_nextReply;
+    std::vector<uint64_t> m_sentAt;
+    bool m_done;
+};
+
+enum class replay_result
+{
+    e_complete,
+    e_stalled,
+    e_failed,
+};
+
+static size_t s_total = 0;
+static size_t s_finished = 0;
+static size_t s_results[3] = {};
+static uint64_t s_messagesSent = 0;
+static uint64_t s_bytesSent = 0;
+static uint64_t s_bytesReceived = 0;
+static std::vector<uint64_t> s_latencies;
+
+// =================================================================================
+
+static void print(const ST::string& str)
+{
+    fputs(str.c_str(), stdout);
+}
+
+static replay_plan_t make_plan(const fus::capture_session_t& session)
+{
+    replay_plan_t plan;
+    plan.m_session = &session;
+    plan.m_repliesBefore = 0;
+
+    uint64_t first = 0;
+    for (const fus::capture_message_t& msg : session.m_messages) {
+        if (msg.m_inbound) {
+            if (plan.m_sends.empty())
+                first = msg.m_time;
+            plan.m_sends.push_back(&msg);
+            plan.m_sendAt.push_back(msg.m_time - first);
+            plan.m_repliesAfter.push_back(plan.m_replies.size());
+        } else {
+            plan.m_replies.push_back(&msg);
+            plan.m_replyTo.push_back(plan.m_sends.empty() ? SIZE_MAX : plan.m_sends.size() - 1);
+            if (plan.m_sends.empty())
+                plan.m_repliesBefore++;
+            else
+                plan.m_repliesAfter.back() = plan.m_replies.size();
+        }
+    }
+    return plan;
+}
+
+static const char* crypt_name(uint8_t connType)
+{
+    switch (connType) {
+    case fus::protocol::e_protocolCli2Admin:
+        return "admin";
+    case fus::protocol::e_protocolCli2Auth:
+        return "auth";
+    case fus::protocol::e_protocolCli2Game:
+        return "game";
+    case fus::protocol::e_protocolCli2Gate:
+        return "gate";
+    case fus::protocol::e_protocolSrv2Database:
+        return "db";
+    default:
+        return nullptr;
+    }
+}
+
+// =================================================================================
+
+static void replay_send(replay_conn_t* conn);
+static void replay_read(replay_conn_t* conn);
+
+static void replay_finish(replay_conn_t* conn, replay_result result)
+{
+    if (conn->m_done)
+        return;
+    conn->m_done = true;
+    s_results[(size_t)result]++;
+
+    uv_timer_stop(&conn->m_sendTimer);
+    uv_timer_stop(&conn->m_idleTimer);
+    if (fus::tcp_stream_connected(&conn->m_client) && !fus::tcp_stream_closing(&conn->m_client))
+        fus::tcp_stream_shutdown(&conn->m_client);
+
+    if (++s_finished == s_total)
+        uv_stop(uv_default_loop());
+}
+
+static void replay_check_done(replay_conn_t* conn)
+{
+    if (conn->m_nextSend == conn->m_plan->m_sends.size() && conn->m_nextReply == conn->m_plan->m_replies.size())
+        replay_finish(conn, replay_result::e_complete);
+}
+
+static void replay_send_timer(uv_timer_t* timer)
+{
+    replay_send((replay_conn_t*)uv_handle_get_data((uv_handle_t*)timer));
+}
+
+static void replay_idle_timer(uv_timer_t* timer)
+{
+    // Players sit idle for minutes at a time, so only a missing reply counts as a stall.
+    auto conn = (replay_conn_t*)uv_handle_get_data((uv_handle_t*)timer);
+    const replay_plan_t* plan = conn->m_plan;
+    size_t expected = conn->m_nextSend ? plan->m_repliesAfter[conn->m_nextSend - 1] : plan->m_repliesBefore;
+    if (conn->m_nextReply < expected)
+        replay_finish(conn, replay_result::e_stalled);
+}
+
+static void replay_closed(uv_handle_t* handle)
+{
+    replay_finish((replay_conn_t*)handle, replay_result::e_failed);
+}
+
+static void replay_send(replay_conn_t* conn)
+{
+    const replay_plan_t* plan = conn->m_plan;
+    while (!conn->m_done && conn->m_nextSend < plan->m_sends.size()) {
+        uint64_t now = uv_hrtime();
+        if (FLAGS_speed <= 0.0) {
+            // Closed loop: wait until the server has answered the last message in full.
+            if (conn->m_nextSend > 0 && conn->m_nextReply < plan->m_repliesAfter[conn->m_nextSend - 1])
+                return;
+        } else {
+            uint64_t due = conn->m_started + (uint64_t)((double)plan->m_sendAt[conn->m_nextSend] * 1000.0 / FLAGS_speed);
+            if (due > now) {
+                uv_timer_start(&conn->m_sendTimer, replay_send_timer, (due - now + 999999) / 1000000, 0);
+                return;
+            }
+        }
+
+        const fus::capture_message_t* msg = plan->m_sends[conn->m_nextSend];
+        fus::tcp_stream_write(&conn->m_client, msg->m_data.data(), msg->m_data.size());
+        conn->m_sentAt[conn->m_nextSend++] = now;
+        uv_timer_again(&conn->m_idleTimer);
+        s_messagesSent++;
+        s_bytesSent += msg->m_data.size();
+    }
+    replay_check_done(conn);
+}
+
+static void replay_reply_read(fus::tcp_stream_t* stream, ssize_t nread, void*)
+{
+    auto conn = (replay_conn_t*)stream;
+    if (nread < 0) {
+        replay_finish(conn, replay_result::e_failed);
+        return;
+    }
+
+    // The first reply to each message marks how long the server took to get to it.
+    const replay_plan_t* plan = conn->m_plan;
+    size_t replyTo = plan->m_replyTo[conn->m_nextReply];
+    bool first = conn->m_nextReply == 0 || plan->m_replyTo[conn->m_nextReply - 1] != replyTo;
+    if (first && replyTo != SIZE_MAX && replyTo < conn->m_nextSend)
+        s_latencies.push_back((uv_hrtime() - conn->m_sentAt[replyTo]) / 1000);
+
+    s_bytesReceived += nread;
+    conn->m_nextReply++;
+    uv_timer_again(&conn->m_idleTimer);
+    replay_read(conn);
+    replay_send(conn);
+}
+
+static void replay_read(replay_conn_t* conn)
+{
+    // The server's replies may not be byte for byte what was captured, but the sizes rarely
+    // change, and reading by size keeps us in step with the captured conversation.
+    if (!conn->m_done && conn->m_nextReply < conn->m_plan->m_replies.size()) {
+        size_t size = conn->m_plan->m_replies[conn->m_nextReply]->m_data.size();
+        fus::tcp_stream_read(&conn->m_client, size, replay_reply_read);
+    }
+}
+
+static void replay_start(fus::client_t* client)
+{
+    auto conn = (replay_conn_t*)client;
+    uint64_t timeoutMs = (uint64_t)FLAGS_timeout * 1000;
+    conn->m_started = uv_hrtime();
+    uv_timer_start(&conn->m_idleTimer, replay_idle_timer, timeoutMs, timeoutMs);
+    replay_read(conn);
+    replay_send(conn);
+}
+
+static void replay_connected(fus::client_t* client, ssize_t status)
+{
+    if (status < 0) {
+        print(ST::format("Unable to connect: {}\n", uv_strerror((int)status)));
+        replay_finish((replay_conn_t*)client, replay_result::e_failed);
+    }
+}
+
+static bool replay_connect(const replay_plan_t& plan, const fus::config_parser& config, const sockaddr* addr)
+{
+    const std::vector<uint8_t>& header = plan.m_session->m_header;
+    const char* name = crypt_name(header[0]);
+    if (!name)
+        return false;
+
+    auto conn = (replay_conn_t*)malloc(sizeof(replay_conn_t));
+    fus::client_init(&conn->m_client, uv_default_loop());
+    conn->m_client.m_proc = replay_start;
+    fus::tcp_stream_close_cb(&conn->m_client, replay_closed);
+    uv_timer_init(uv_default_loop(), &conn->m_sendTimer);
+    uv_timer_init(uv_default_loop(), &conn->m_idleTimer);
+    fus::tcp_stream_ref(&conn->m_client, (uv_handle_t*)&conn->m_sendTimer);
+    fus::tcp_stream_ref(&conn->m_client, (uv_handle_t*)&conn->m_idleTimer);
+    conn->m_plan = &plan;
+    conn->m_started = 0;
+    conn->m_nextSend = 0;
+    conn->m_nextReply = 0;
+    new(&conn->m_sentAt) std::vector<uint64_t>(plan.m_sends.size());
+    conn->m_done = false;
+    s_total++;
+
+    const ST::string& n = config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_n", name));
+    const ST::string& x = config.get<const ST::string&>(ST_LITERAL("crypt"), ST::format("{}_x", name));
+    if (n.empty() || x.empty()) {
+        fus::client_connect(&conn->m_client, addr, header.data(), header.size(), replay_connected);
+    } else {
+        unsigned int g = config.get<unsigned int>(ST_LITERAL("crypt"), ST::format("{}_g", name));
+        fus::client_crypt_connect(&conn->m_client, addr, header.data(), header.size(), g, n, x, replay_connected);
+    }
+    return true;
+}
+
+// =================================================================================
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double pct)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(pct * (double)sorted.size()));
+    return sorted[idx];
+}
+
+int main(int argc, char* argv[])
+{
+    gflags::SetVersionString(fus::build_version());
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc < 2) {
+        print("Usage: fus_replay [options] <capture.fcap> [...]\n"
+              "Replays captured client sessions against a fus server and reports its latency.\n"
+              "Run with --help for a list of options.\n");
+        return 1;
+    }
+
+    fus::config_parser config(fus::daemon_config);
+    config.read(FLAGS_config_path);
+    ST::string server = FLAGS_server.empty() ? config.get<const ST::string&>("lobby", "bindaddr")
+                                             : ST::string(FLAGS_server);
+    uint16_t port = FLAGS_port ? (uint16_t)FLAGS_port : (uint16_t)config.get<unsigned int>("lobby", "port");
+    sockaddr_storage addr;
+    if (!fus::str2addr(server.c_str(), port, &addr)) {
+        print(ST::format("Invalid server address '{}'\n", server));
+        return 1;
+    }
+
+    std::vector<std::vector<fus::capture_session_t>> captures(argc - 1);
+    std::vector<replay_plan_t> plans;
+    for (int i = 1; i < argc; ++i) {
+        if (!fus::capture_load(argv[i], captures[i - 1])) {
+            print(ST::format("'{}' is not a fus capture\n", argv[i]));
+            return 1;
+        }
+        for (const fus::capture_session_t& session : captures[i - 1]) {
+            if (!session.m_header.empty())
+                plans.push_back(make_plan(session));
+        }
+    }
+
+    fus::io_init();
+    size_t skipped = 0;
+    for (const replay_plan_t& plan : plans) {
+        for (uint32_t copy = 0; copy < std::max(1U, FLAGS_copies); ++copy) {
+            if (!replay_connect(plan, config, (const sockaddr*)&addr))
+                skipped++;
+        }
+    }
+    if (s_total == 0) {
+        print("Nothing to replay\n");
+        fus::io_close();
+        return 1;
+    }
+
+    print(ST::format("Replaying {} sessions ({} captured, {} copies each) against {}/{}...\n", s_total,
+                     plans.size(), std::max(1U, FLAGS_copies), server, port));
+    uint64_t start = uv_hrtime();
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    double elapsed = (double)(uv_hrtime() - start) / 1000000000.0;
+    fus::io_close();
+
+    std::sort(s_latencies.begin(), s_latencies.end());
+    print(ST::format("Sessions:  {} complete, {} stalled, {} failed, {} skipped\n",
+                     s_results[(size_t)replay_result::e_complete], s_results[(size_t)replay_result::e_stalled],
+                     s_results[(size_t)replay_result::e_failed], skipped));
+    print(ST::format("Sent:      {} messages, {} KiB in {.2f} s ({.1f} msg/s)\n", s_messagesSent,
+                     s_bytesSent / 1024, elapsed, elapsed > 0.0 ? (double)s_messagesSent / elapsed : 0.0));
+    print(ST::format("Received:  {} KiB\n", s_bytesReceived / 1024));
+    print(ST::format("Latency:   p50 {} us, p90 {} us, p99 {} us, max {} us ({} samples)\n",
+                     percentile(s_latencies, 0.50), percentile(s_latencies, 0.90),
+                     percentile(s_latencies, 0.99), s_latencies.empty() ? 0 : s_latencies.back(),
+                     s_latencies.size()));
+    return s_results[(size_t)replay_result::e_complete] == s_total ? 0 : 1;
+}